@@ -34,6 +34,9 @@ struct if_bcast {
     int fd;
     struct sockaddr_in addr;        /* Outbound address */
     struct sockaddr_in laddr;       /* local (bind) address */
+    size_t batch;                   /* Datagrams per system call */
+    struct dgram_tx *tx;
+    struct dgram_rx *rx;
 };
 
 /* Prevention of re-reading what has been written by a bi-directional interface
@@ -90,6 +93,11 @@ void *ifdup_bcast(void *ifb)
     /* unfortunately this will need changing and the new address binding. */
     (void) memcpy(&newif->laddr, &oldif->laddr, sizeof(oldif->laddr));
 
+    /* Batch buffers are allocated by the thread using them */
+    newif->batch = oldif->batch;
+    newif->tx = NULL;
+    newif->rx = NULL;
+
     return((void *) newif);
 }
 
@@ -97,6 +105,8 @@ void cleanup_bcast(iface_t *ifa)
 {
     struct if_bcast *ifb = (struct if_bcast *) ifa->info;
 
+    dgram_tx_free(ifb->tx);
+    dgram_rx_free(ifb->rx);
     close(ifb->fd);
 
     /* We could remove outgoing interfaces from the ignore list here, but
@@ -110,9 +120,21 @@ void write_bcast(struct iface *ifa)
     int data=0;
     struct msghdr msgh;
     struct iovec iov[2];
+    struct timespec start;
+    ssize_t sent;
 
     ifb = (struct if_bcast *) ifa->info;
 
+    if (ifb->batch > 1) {
+        if ((ifb->tx=dgram_tx_init(ifb->batch))) {
+            dgram_write(ifa,ifb->tx,ifb->fd,(struct sockaddr *)&ifb->addr,
+                    sizeof(struct sockaddr_in));
+            iface_thread_exit(errno);
+        }
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+    }
+
     msgh.msg_name=(void *)&ifb->addr;
     msgh.msg_namelen=sizeof(struct sockaddr_in);
     msgh.msg_control=NULL;
@@ -135,11 +157,6 @@ void write_bcast(struct iface *ifa)
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
         if (ifa->tagflags)
             if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
@@ -153,8 +170,10 @@ void write_bcast(struct iface *ifa)
         iov[data].iov_base=sptr->data;
         iov[data].iov_len=sptr->len;
 
-        if ((sendmsg(ifb->fd,&msgh,0)) < 0)
+        stats_clock(&start);
+        if ((sent=sendmsg(ifb->fd,&msgh,0)) < 0)
             break;
+        stats_write(ifa,1,sent,&start);
 
         senblk_free(sptr,ifa->q);
     }
@@ -173,9 +192,20 @@ ssize_t read_bcast(struct iface *ifa, char *buf)
     socklen_t sz = (socklen_t) sizeof(src);
     ssize_t nread;
 
+    if (ifb->batch > 1 && !ifb->rx &&
+            (ifb->rx=dgram_rx_init(ifb->batch)) == NULL) {
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+        ifb->batch=1;
+    }
 
     do {
-        nread = recvfrom(ifb->fd,buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
+        if (ifb->rx)
+            nread = dgram_recv(ifb->rx,ifb->fd,buf,(struct sockaddr *) &src,
+                    &sz);
+        else
+            nread = recvfrom(ifb->fd,buf,BUFSIZ,0,(struct sockaddr *) &src,
+                    &sz);
         /* Probably superfluous check that we got the right size
          * structure back */
         if (sz != (socklen_t) sizeof(src)) {
@@ -216,6 +246,7 @@ struct iface *init_bcast(struct iface *ifa)
     struct ignore_addr **igpp,*newig;
     size_t qsize = DEFBCASTQSIZE;
     struct kopts *opt;
+    int batch=1;
     
     if ((ifb=malloc(sizeof(struct if_bcast))) == NULL) {
         logerr(errno,"Could not allocate memory");
@@ -253,12 +284,23 @@ struct iface *init_bcast(struct iface *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"batch")) {
+            if (((batch=atoi(opt->val)) <= 0) || batch > MAXDGRAMBATCH) {
+                logerr(0,"Invalid batch size specified: %s",opt->val);
+                return(NULL);
+            }
         } else  {
             logerr(0,"Unknown interface option %s",opt->var);
             return(NULL);
         }
     }
 
+    if (batch > 1 && !dgram_batch_supported()) {
+        logwarn("%s: batch option not supported on this platform",ifa->name);
+        batch=1;
+    }
+    ifb->batch=batch;
+
     if (!port) {
         if ((svent = getservbyname("nmea-0183","udp")) != NULL)
             /* This is in network byte order already */
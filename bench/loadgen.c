@@ -0,0 +1,434 @@
+/* loadgen.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * End to end load generator.  Starts kplex with N udp or tcp inputs and M
+ * tcp server outputs, drives sentences into each input at a fixed rate and
+ * reads them back from every output.  Each sentence carries the time it was
+ * sent so the report can give the latency through kplex alongside
+ * throughput, loss and kplex's CPU time per sentence
+ *
+ * Usage: loadgen [-k <kplex>] [-i <inputs>] [-o <outputs>] [-p udp|tcp]
+ *                [-r <rate>] [-d <seconds>] [-P <baseport>] [-x <option>]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAXIFS 64
+#define MAXOPTS 16
+/* Latency histogram: 4 buckets per power of 2 microseconds */
+#define HISTBUCKETS 128
+/* How long to wait for kplex to start listening */
+#define STARTWAIT 5
+/* How long to let kplex drain once sending stops */
+#define DRAINTIME 1
+#define ARGLEN 128
+
+struct sender {
+    pthread_t tid;
+    int n;                      /* Input number */
+    int fd;
+    unsigned long sent;
+};
+
+struct receiver {
+    pthread_t tid;
+    int fd;
+    unsigned long received;
+    unsigned long bad;
+    unsigned long max;          /* Microseconds */
+    unsigned long hist[HISTBUCKETS];
+};
+
+static int tcpin=0;
+static double rate=10000;
+static double duration=5;
+static int baseport=20500;
+static volatile int stop=0;
+static struct timespec start;
+
+/*
+ * Get the time in nanoseconds since an arbitrary point, the same for all
+ * processes on the host
+ * Args: None
+ * Returns: nanoseconds
+ */
+static unsigned long long nsnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((unsigned long long) ts.tv_sec*1000000000ULL+ts.tv_nsec);
+}
+
+/*
+ * Histogram bucket for a latency
+ * Args: latency in microseconds
+ * Returns: bucket number
+ */
+static int bucket(unsigned long us)
+{
+    int e,b;
+
+    if (us < 4)
+        return(us);
+    e=63-__builtin_clzl(us);
+    b=4*(e-1)+((us>>(e-2))&3);
+    return((b < HISTBUCKETS)?b:HISTBUCKETS-1);
+}
+
+/*
+ * Upper bound of a histogram bucket
+ * Args: bucket number
+ * Returns: bound in microseconds
+ */
+static unsigned long bucketmax(int b)
+{
+    b++;
+    return((b < 4)?(unsigned long) b:(unsigned long) (4+b%4)<<(b/4-1));
+}
+
+/*
+ * Connect to a tcp port on localhost
+ * Args: port and how many seconds to keep trying for
+ * Returns: socket or -1 on failure
+ */
+static int tcpconnect(int port, int wait)
+{
+    struct sockaddr_in sin;
+    struct timespec ts={0,100000000};
+    int fd,i,on=1;
+
+    memset(&sin,0,sizeof(sin));
+    sin.sin_family=AF_INET;
+    sin.sin_port=htons(port);
+    sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+    for (i=0;i<wait*10;i++) {
+        if ((fd=socket(AF_INET,SOCK_STREAM,0)) < 0)
+            return(-1);
+        if (connect(fd,(struct sockaddr *) &sin,sizeof(sin)) == 0) {
+            setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+            return(fd);
+        }
+        close(fd);
+        nanosleep(&ts,NULL);
+    }
+    return(-1);
+}
+
+/*
+ * Sender thread: send sentences to a kplex input at a fixed rate
+ * Args: struct sender
+ * Returns: NULL
+ */
+static void *sender(void *arg)
+{
+    struct sender *s=(struct sender *) arg;
+    struct sockaddr_in sin;
+    struct timespec ts;
+    unsigned long long t0,due,t;
+    unsigned char cksum;
+    char buf[100];
+    int len,i;
+
+    memset(&sin,0,sizeof(sin));
+    sin.sin_family=AF_INET;
+    sin.sin_port=htons(baseport+s->n);
+    sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+    t0=nsnow();
+    while (!stop) {
+        /* Pace to the requested rate, catching up after any stall */
+        if (rate > 0) {
+            due=t0+(unsigned long long) (s->sent*1e9/rate);
+            if ((t=nsnow()) < due) {
+                ts.tv_sec=(due-t)/1000000000ULL;
+                ts.tv_nsec=(due-t)%1000000000ULL;
+                nanosleep(&ts,NULL);
+            }
+        }
+        len=sprintf(buf,"$PKLGN,%d,%lu,%llu",s->n,s->sent,nsnow());
+        for (cksum=0,i=1;i<len;i++)
+            cksum^=buf[i];
+        len+=sprintf(buf+len,"*%02X\r\n",cksum);
+        if (tcpin) {
+            if (write(s->fd,buf,len) != len) {
+                perror("input write");
+                break;
+            }
+        } else if (sendto(s->fd,buf,len,0,(struct sockaddr *) &sin,
+                sizeof(sin)) != len) {
+            if (errno == ENOBUFS)
+                continue;
+            perror("input sendto");
+            break;
+        }
+        s->sent++;
+    }
+    return(NULL);
+}
+
+/*
+ * Process one sentence read back from an output
+ * Args: receiver, sentence (nul terminated, without line ending)
+ * Returns: Nothing
+ */
+static void received(struct receiver *r, char *sen)
+{
+    unsigned long long sent,t;
+    unsigned long us;
+    char *ptr;
+
+    if (strncmp(sen,"$PKLGN,",7) || (ptr=strrchr(sen,',')) == NULL) {
+        r->bad++;
+        return;
+    }
+    sent=strtoull(ptr+1,NULL,10);
+    t=nsnow();
+    us=(t > sent)?(t-sent)/1000:0;
+    r->hist[bucket(us)]++;
+    if (us > r->max)
+        r->max=us;
+    r->received++;
+}
+
+/*
+ * Receiver thread: read sentences from a kplex output
+ * Args: struct receiver
+ * Returns: NULL
+ */
+static void *receiver(void *arg)
+{
+    struct receiver *r=(struct receiver *) arg;
+    char buf[65536];
+    char *ptr,*eptr,*bptr;
+    size_t have=0;
+    ssize_t n;
+
+    while ((n=read(r->fd,buf+have,sizeof(buf)-have-1)) > 0) {
+        have+=n;
+        buf[have]='\0';
+        for (bptr=buf;(eptr=strstr(bptr,"\r\n"));bptr=eptr+2) {
+            *eptr='\0';
+            if ((ptr=strchr(bptr,'\\')) && ptr == bptr &&
+                    (ptr=strchr(bptr+1,'\\')))
+                /* Skip a tag block */
+                bptr=ptr+1;
+            received(r,bptr);
+        }
+        have-=bptr-buf;
+        memmove(buf,bptr,have);
+    }
+    return(NULL);
+}
+
+/*
+ * Report latency percentiles over all receivers
+ * Args: receivers and number of them
+ * Returns: Nothing
+ */
+static void report_latency(struct receiver *r, int n)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    unsigned long hist[HISTBUCKETS];
+    unsigned long total=0,cum,max=0;
+    size_t p;
+    int i,b;
+
+    memset(hist,0,sizeof(hist));
+    for (i=0;i<n;i++) {
+        for (b=0;b<HISTBUCKETS;b++)
+            hist[b]+=r[i].hist[b];
+        total+=r[i].received;
+        if (r[i].max > max)
+            max=r[i].max;
+    }
+    if (total == 0)
+        return;
+    printf("Latency (us):");
+    for (p=0;p<sizeof(pcts)/sizeof(pcts[0]);p++) {
+        for (cum=0,b=0;b<HISTBUCKETS-1;b++)
+            if ((cum+=hist[b]) >= total*pcts[p]/100)
+                break;
+        printf(" p%g<=%lu",pcts[p],
+                (bucketmax(b) < max)?bucketmax(b):max);
+    }
+    printf(" max=%lu\n",max);
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr,"Usage: %s [-k <kplex>] [-i <inputs>] [-o <outputs>] "
+            "[-p udp|tcp]\n       [-r <rate per input>] [-d <seconds>] "
+            "[-P <baseport>] [-x <option>]...\n",name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *kplex="./kplex";
+    char *args[2*MAXIFS+2*MAXOPTS+4];
+    char argbuf[2*MAXIFS][ARGLEN];
+    struct sender s[MAXIFS];
+    struct receiver r[MAXIFS];
+    struct rusage ru;
+    unsigned long sent=0,rcvd=0,bad=0;
+    double el,cpu;
+    int nin=1,nout=1,nargs=0,opt,i,status;
+    pid_t pid;
+
+    signal(SIGPIPE,SIG_IGN);
+    args[nargs++]="kplex";
+    /* Don't let a user or system config file add interfaces */
+    args[nargs++]="-f";
+    args[nargs++]="/dev/null";
+    while ((opt=getopt(argc,argv,"k:i:o:p:r:d:P:x:")) != -1) {
+        switch (opt) {
+        case 'k':
+            kplex=optarg;
+            break;
+        case 'i':
+            if ((nin=atoi(optarg)) < 1 || nin > MAXIFS)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if ((nout=atoi(optarg)) < 1 || nout > MAXIFS)
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (!strcasecmp(optarg,"tcp"))
+                tcpin=1;
+            else if (!strcasecmp(optarg,"udp"))
+                tcpin=0;
+            else
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((rate=atof(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((duration=atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            if ((baseport=atoi(optarg)) <= 0 || baseport > 65535-2*MAXIFS)
+                usage(argv[0]);
+            break;
+        case 'x':
+            /* Global kplex option, e.g. qtype=lockfree */
+            if (nargs >= 2*MAXOPTS+2)
+                usage(argv[0]);
+            args[nargs++]="-o";
+            args[nargs++]=optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* Inputs are on baseport.., outputs on baseport+MAXIFS.. */
+    for (i=0;i<nin;i++) {
+        snprintf(argbuf[i],ARGLEN,(tcpin)?
+                "tcp:mode=server,direction=in,port=%d":
+                "udp:direction=in,port=%d",baseport+i);
+        args[nargs++]=argbuf[i];
+    }
+    for (i=0;i<nout;i++) {
+        snprintf(argbuf[MAXIFS+i],ARGLEN,
+                "tcp:mode=server,direction=out,port=%d",baseport+MAXIFS+i);
+        args[nargs++]=argbuf[MAXIFS+i];
+    }
+    args[nargs]=NULL;
+
+    if ((pid=fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        execv(kplex,args);
+        perror(kplex);
+        _exit(1);
+    }
+
+    memset(r,0,sizeof(r));
+    for (i=0;i<nout;i++) {
+        if ((r[i].fd=tcpconnect(baseport+MAXIFS+i,STARTWAIT)) < 0) {
+            fprintf(stderr,"Could not connect to kplex output %d\n",i);
+            kill(pid,SIGTERM);
+            exit(1);
+        }
+    }
+    memset(s,0,sizeof(s));
+    for (i=0;i<nin;i++) {
+        s[i].n=i;
+        s[i].fd=(tcpin)?tcpconnect(baseport+i,STARTWAIT):
+                socket(AF_INET,SOCK_DGRAM,0);
+        if (s[i].fd < 0) {
+            fprintf(stderr,"Could not connect to kplex input %d\n",i);
+            kill(pid,SIGTERM);
+            exit(1);
+        }
+    }
+    /* Give kplex a moment to register the connections */
+    sleep(1);
+
+    for (i=0;i<nout;i++)
+        pthread_create(&r[i].tid,NULL,receiver,&r[i]);
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (i=0;i<nin;i++)
+        pthread_create(&s[i].tid,NULL,sender,&s[i]);
+
+    usleep((useconds_t) (duration*1e6));
+    stop=1;
+    for (i=0;i<nin;i++) {
+        pthread_join(s[i].tid,NULL);
+        sent+=s[i].sent;
+    }
+    el=(nsnow()-(start.tv_sec*1000000000ULL+start.tv_nsec))/1e9;
+    sleep(DRAINTIME);
+
+    kill(pid,SIGTERM);
+    waitpid(pid,&status,0);
+    for (i=0;i<nout;i++) {
+        shutdown(r[i].fd,SHUT_RDWR);
+        pthread_join(r[i].tid,NULL);
+        rcvd+=r[i].received;
+        bad+=r[i].bad;
+    }
+    for (i=0;i<nin;i++)
+        close(s[i].fd);
+
+    getrusage(RUSAGE_CHILDREN,&ru);
+    cpu=ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+
+            ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+
+    printf("Inputs: %d %s, outputs: %d tcp, %.1fs\n",nin,(tcpin)?"tcp":"udp",
+            nout,el);
+    printf("Sent: %lu sentences, %.0f/s\n",sent,sent/el);
+    printf("Received: %lu sentences, %.0f/s, %.2f%% of expected%s\n",rcvd,
+            rcvd/el,(sent)?100.0*rcvd/((double) sent*nout):0.0,
+            (bad)?" (some unrecognised)":"");
+    printf("kplex CPU: %.2fs, %.2fus per sentence in, %.2fus per sentence "
+            "out\n",cpu,(sent)?cpu*1e6/sent:0.0,(rcvd)?cpu*1e6/rcvd:0.0);
+    report_latency(r,nout);
+    exit(0);
+}
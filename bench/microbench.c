@@ -0,0 +1,554 @@
+/* microbench.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Micro-benchmarks for the per-sentence hot paths: sentence parsing,
+ * checksum verification, filtering, tag generation, queueing and duplicate
+ * suppression.  These are
+ * linked against kplex's own objects and run against a synthetic corpus of
+ * NMEA and AIS sentences or a recorded one read from a file
+ *
+ * Usage: microbench [-f <file>] [-t <seconds>] [-b <benchmark>]
+ */
+
+#include "kplex.h"
+#include <time.h>
+
+/* Not exported by kplex.h */
+sfilter_t *getfilter(char *);
+
+/* Size of the synthetic corpus in sentences */
+#define SYNTHSENS 10000
+/* Chunk size input is parsed in, as for do_read() */
+#define CHUNK BUFSIZ
+/* Size of queues benchmarked */
+#define BENCHQSIZE 128
+/* Senblks moved per batch in batch queue benchmarks */
+#define BATCH 64
+
+struct corpus {
+    char *buf;                  /* Raw input */
+    size_t len;
+    senblk_t *sens;             /* Input split into sentences */
+    size_t nsens;
+};
+
+static struct corpus corpus;
+static double mintime=1.0;
+
+static const char *synth[] = {
+    "GPGGA,%02d%02d%02d.00,5030.%04d,N,00107.%04d,W,1,08,0.9,%d.0,M,47.0,M,,",
+    "GPRMC,%02d%02d%02d.00,A,5030.%04d,N,00107.%04d,W,%d.2,054.7,191194,020.3,E",
+    "IIVTG,%03d.%d,T,%03d.%d,M,%d.1,N,0.5,K",
+    "IIHDT,%03d.%d,T",
+    "IIMWV,%03d.%d,R,%d.%d,N,A",
+    NULL
+};
+
+static const char *aispayloads[] = {
+    "13u?etPv2;0n:dDPwUM1U1Cb069D",
+    "15M67FC000G?ufbE`FepT@3n00Sa",
+    "402=ap1uimFau0`qtpKCKHW00<0f",
+    "55NOvQP1u>QIL@O??SL985`u>0EQ18E=>222221J1p`884i6N344Sll1@m80",
+    NULL
+};
+
+/*
+ * Get the time since an arbitrary point
+ * Args: None
+ * Returns: Seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(ts.tv_sec+ts.tv_nsec/1e9);
+}
+
+/*
+ * Append a sentence with checksum and line ending to a buffer
+ * Args: buffer, current length, leading character and sentence body
+ * Returns: New length
+ */
+static size_t addsen(char *buf, size_t len, char lead, const char *body)
+{
+    return(len+sprintf(buf+len,"%c%s*%02X\r\n",lead,body,
+            calcsum(body,strlen(body))));
+}
+
+/*
+ * Build a synthetic corpus: a mix of instrument and AIS sentences, some
+ * with tag blocks, much like the output of a busy boat
+ * Args: None
+ * Returns: 0 on success, -1 on failure
+ */
+static int synth_corpus(void)
+{
+    char body[SENMAX],tag[TAGMAX];
+    size_t i,len=0,n;
+    int t;
+
+    if ((corpus.buf=malloc(SYNTHSENS*(SENBUFSZ+TAGMAX))) == NULL)
+        return(-1);
+
+    for (i=0;i<SYNTHSENS;i++) {
+        t=i%8;
+        if (t == 7) {
+            /* Occasionally tagged, as from a tag-adding input */
+            snprintf(tag,TAGMAX,"s:bench,c:%010lu",1500000000UL+i);
+            len+=sprintf(corpus.buf+len,"\\%s*%02X\\",tag,
+                    calcsum(tag,strlen(tag)));
+        }
+        if (t >= 5) {
+            n=i%4;
+            snprintf(body,SENMAX,"AIVDM,1,1,,%c,%s,0",(i&1)?'A':'B',
+                    aispayloads[n]);
+            len=addsen(corpus.buf,len,'!',body);
+        } else {
+            snprintf(body,SENMAX,synth[t],(int)(i/3600)%24,(int)(i/60)%60,
+                    (int)i%60,(int)(i*7)%10000,(int)(i*13)%10000,(int)i%20);
+            len=addsen(corpus.buf,len,'$',body);
+        }
+    }
+    corpus.len=len;
+    return(0);
+}
+
+/*
+ * Read a recorded corpus from a file
+ * Args: file name
+ * Returns: 0 on success, -1 on failure
+ */
+static int load_corpus(const char *fname)
+{
+    FILE *f;
+    size_t size=0,n;
+
+    if ((f=fopen(fname,"r")) == NULL)
+        return(-1);
+    corpus.len=0;
+    do {
+        if (corpus.len == size) {
+            size=(size)?size*2:65536;
+            if ((corpus.buf=realloc(corpus.buf,size)) == NULL) {
+                fclose(f);
+                return(-1);
+            }
+        }
+        n=fread(corpus.buf+corpus.len,1,size-corpus.len,f);
+        corpus.len+=n;
+    } while (n > 0);
+    fclose(f);
+    return((corpus.len)?0:-1);
+}
+
+/*
+ * Parser sink collecting sentences into the corpus
+ * Args: senblk and unused argument
+ * Returns: Nothing
+ */
+static void collect(senblk_t *sptr, void *arg)
+{
+    static size_t size;
+
+    (void) arg;
+    if (corpus.nsens == size) {
+        size=(size)?size*2:1024;
+        if ((corpus.sens=realloc(corpus.sens,size*sizeof(senblk_t))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(&corpus.sens[corpus.nsens++],sptr,sizeof(senblk_t));
+}
+
+/*
+ * Parser sink counting sentences
+ * Args: senblk and pointer to count
+ * Returns: Nothing
+ */
+static void count(senblk_t *sptr, void *arg)
+{
+    (void) sptr;
+    (*(size_t *) arg)++;
+}
+
+/*
+ * Initialise a dummy interface for benchmarks to use
+ * Args: interface and name
+ * Returns: Nothing
+ */
+static void dummy_iface(iface_t *ifa, char *name)
+{
+    memset(ifa,0,sizeof(iface_t));
+    ifa->name=name;
+    ifa->direction=IN;
+    ifa->checksum=0;
+    ifa->strict=0;
+}
+
+/*
+ * Report a benchmark result
+ * Args: name, operations done, elapsed time and bytes processed (0 if not
+ * meaningful)
+ * Returns: Nothing
+ */
+static void report(const char *name, size_t ops, double secs, size_t bytes)
+{
+    printf("%-26s %12lu ops %9.1f ns/op %9.2f Mops/s",name,
+            (unsigned long) ops,secs*1e9/ops,ops/secs/1e6);
+    if (bytes)
+        printf(" %8.1f MB/s",bytes/secs/1e6);
+    printf("\n");
+}
+
+/*
+ * Benchmark parsing the corpus in do_read() sized chunks
+ * Args: name, whether to verify checksums
+ * Returns: Nothing
+ */
+static void bench_parse(const char *name, int checksum)
+{
+    struct nmea_parser p;
+    iface_t ifa;
+    size_t n=0,off,bytes=0;
+    double start,el;
+
+    dummy_iface(&ifa,"parse");
+    ifa.checksum=checksum;
+    parser_init(&p,&ifa,NULL,0);
+    parser_sink(&p,count,&n);
+    start=now();
+    do {
+        for (off=0;off<corpus.len;off+=CHUNK)
+            parse_nmea(&p,corpus.buf+off,
+                    (corpus.len-off < CHUNK)?corpus.len-off:CHUNK);
+        bytes+=corpus.len;
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,bytes);
+}
+
+/*
+ * Benchmark checksum verification of parsed sentences
+ * Args: name
+ * Returns: Nothing
+ */
+static void bench_cksum(const char *name)
+{
+    size_t i,n=0,bytes=0;
+    volatile int bad=0;
+    double start,el;
+
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i++) {
+            bad+=checkcksum(&corpus.sens[i]);
+            bytes+=corpus.sens[i].len;
+        }
+        n+=corpus.nsens;
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,bytes);
+}
+
+/*
+ * Benchmark applying a filter to parsed sentences
+ * Args: name, filter specification as for ifilter/ofilter options
+ * Returns: Nothing
+ */
+static void bench_filter(const char *name, const char *spec)
+{
+    sfilter_t *filter;
+    char *s;
+    size_t i,n=0;
+    volatile int rejected=0;
+    double start,el;
+
+    if ((s=strdup(spec)) == NULL || (filter=getfilter(s)) == NULL) {
+        fprintf(stderr,"%s: bad filter \"%s\"\n",name,spec);
+        free(s);
+        return;
+    }
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i++)
+            rejected+=senfilter(&corpus.sens[i],filter);
+        n+=corpus.nsens;
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,0);
+    free_filter(filter);
+    free(s);
+}
+
+/*
+ * Benchmark generation of tag blocks
+ * Args: name, tag flags, whether to re-use tag blocks already made for a
+ * sentence, as outputs sharing tag settings do
+ * Returns: Nothing
+ */
+static void bench_tag(const char *name, unsigned int flags, int shared)
+{
+    iface_t ifa;
+    char buf[TAGMAX];
+    size_t i,n=0;
+    volatile size_t len=0;
+    double start,el;
+
+    dummy_iface(&ifa,"bench");
+    ifa.tagflags=flags;
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i++) {
+            if (!shared)
+                corpus.sens[i].tagstate=TAGC_EMPTY;
+            len+=gettag(&ifa,buf,&corpus.sens[i]);
+        }
+        n+=corpus.nsens;
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,0);
+}
+
+/*
+ * Benchmark pushing to and taking from a queue in one thread
+ * Args: name, whether to use a lock-free queue, sentences per batch taken
+ * Returns: Nothing
+ */
+static void bench_queue(const char *name, int lockfree, size_t batch)
+{
+    iface_t ifa;
+    senblk_t *sptrs[BATCH];
+    size_t i,j,k,n=0;
+    double start,el;
+
+    dummy_iface(&ifa,"queue");
+    lockfreeq=lockfree;
+    if (init_q(&ifa,BENCHQSIZE) < 0) {
+        perror("init_q");
+        return;
+    }
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i+=batch) {
+            for (j=0;j<batch && i+j<corpus.nsens;j++)
+                push_senblk(&corpus.sens[i+j],ifa.q);
+            if (batch == 1)
+                senblk_free(next_senblk(ifa.q),ifa.q);
+            else
+                for (k=next_senblk_batch(ifa.q,sptrs,j);k;)
+                    senblk_free(sptrs[--k],ifa.q);
+            n+=j;
+        }
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,0);
+    free_q(ifa.q);
+}
+
+struct qthread {
+    ioqueue_t *q;
+    size_t n;
+};
+
+/*
+ * Consumer thread for threaded queue benchmarks: take senblks until the
+ * end marker
+ * Args: struct qthread
+ * Returns: NULL
+ */
+static void *consumer(void *arg)
+{
+    struct qthread *qt=(struct qthread *) arg;
+    senblk_t *sptrs[BATCH];
+    size_t i,k;
+    int done=0;
+
+    while (!done) {
+        k=next_senblk_batch(qt->q,sptrs,BATCH);
+        for (i=0;i<k;i++) {
+            if (sptrs[i]->src == (unsigned long) -1)
+                done=1;
+            else
+                qt->n++;
+            senblk_free(sptrs[i],qt->q);
+        }
+    }
+    return(NULL);
+}
+
+/*
+ * Benchmark a producer and consumer in separate threads, as an input thread
+ * and the engine would be.  Queues discard the oldest sentence when full so
+ * the proportion delivered is reported too
+ * Args: name, whether to use a lock-free queue
+ * Returns: Nothing
+ */
+static void bench_queue_mt(const char *name, int lockfree)
+{
+    iface_t ifa;
+    pthread_t tid;
+    struct qthread qt;
+    senblk_t end;
+    size_t i,n=0;
+    double start,el;
+
+    dummy_iface(&ifa,"queue");
+    lockfreeq=lockfree;
+    if (init_q(&ifa,BENCHQSIZE) < 0) {
+        perror("init_q");
+        return;
+    }
+    qt.q=ifa.q;
+    qt.n=0;
+    if (pthread_create(&tid,NULL,consumer,&qt)) {
+        perror("pthread_create");
+        free_q(ifa.q);
+        return;
+    }
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i++)
+            push_senblk(&corpus.sens[i],ifa.q);
+        n+=corpus.nsens;
+    } while (now()-start < mintime);
+    memcpy(&end,&corpus.sens[0],sizeof(senblk_t));
+    end.src=(unsigned long) -1;
+    push_senblk(&end,ifa.q);
+    pthread_join(tid,NULL);
+    el=now()-start;
+    report(name,n,el,0);
+    printf("%-26s %11.1f%% delivered\n","",100.0*qt.n/n);
+    free_q(ifa.q);
+}
+
+/*
+ * Benchmark duplicate suppression of sentences arriving from two inputs
+ * Args: name, whether the table is shared between engine threads
+ * Returns: Nothing
+ */
+static void bench_dedup(const char *name, int shared)
+{
+    struct dedup *dd;
+    size_t i,n=0;
+    volatile int dups=0;
+    double start,el;
+
+    if ((dd=dedup_init(1000,0,shared)) == NULL) {
+        perror("dedup_init");
+        return;
+    }
+    start=now();
+    do {
+        for (i=0;i<corpus.nsens;i++) {
+            corpus.sens[i].src=1;
+            dups+=dedup_check(dd,&corpus.sens[i]);
+            corpus.sens[i].src=2;
+            dups+=dedup_check(dd,&corpus.sens[i]);
+        }
+        n+=2*corpus.nsens;
+    } while ((el=now()-start) < mintime);
+    report(name,n,el,0);
+    dedup_free(dd);
+}
+
+static void b_parse(void) { bench_parse("parse",0); }
+static void b_parse_ck(void) { bench_parse("parse+checksum",1); }
+static void b_cksum(void) { bench_cksum("checkcksum"); }
+static void b_filt_short(void) { bench_filter("senfilter/short",
+        "+GPRMC:+GPGGA:+AIVDM:-all"); }
+static void b_filt_long(void) { bench_filter("senfilter/long",
+        "-GPGSV:-GPGSA:-GPGLL:-GPZDA:-GPXTE:-GPAPB:-GPBOD:-GPBWC:-GPRMB:"
+        "-IIDBT:-IIDPT:-IIMTW:-IIVHW:-IIVLW:-IIXDR:-IIMWD:-IIRSA:-IIRPM:"
+        "-**ALR:-**TXT:-**ROT:-SDDBT:-SDDPT:-WIMWV:-WIMDA:-HCHDG:-HCHDM:"
+        "-AIVDO:-AIALR:-AITXT:+GPRMC:+GPGGA:+IIVTG:+IIHDT:+IIMWV:+AIVDM:"
+        "-all"); }
+static void b_tag_src(void) { bench_tag("gettag/src",TAG_SRC,0); }
+static void b_tag_all(void) { bench_tag("gettag/src+ts",
+        TAG_SRC|TAG_TS|TAG_MS,0); }
+static void b_tag_shared(void) { bench_tag("gettag/src+ts/shared",
+        TAG_SRC|TAG_TS|TAG_MS,1); }
+static void b_q_mutex(void) { bench_queue("queue/mutex",0,1); }
+static void b_q_lf(void) { bench_queue("queue/lockfree",1,1); }
+static void b_qb_mutex(void) { bench_queue("queue/mutex/batch",0,BATCH); }
+static void b_qb_lf(void) { bench_queue("queue/lockfree/batch",1,BATCH); }
+static void b_qmt_mutex(void) { bench_queue_mt("queue/mutex/threaded",0); }
+static void b_qmt_lf(void) { bench_queue_mt("queue/lockfree/threaded",1); }
+static void b_dedup(void) { bench_dedup("dedup",0); }
+static void b_dedup_shared(void) { bench_dedup("dedup/shared",1); }
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    { "parse", b_parse },
+    { "parse", b_parse_ck },
+    { "cksum", b_cksum },
+    { "filter", b_filt_short },
+    { "filter", b_filt_long },
+    { "tag", b_tag_src },
+    { "tag", b_tag_all },
+    { "tag", b_tag_shared },
+    { "queue", b_q_mutex },
+    { "queue", b_q_lf },
+    { "queue", b_qb_mutex },
+    { "queue", b_qb_lf },
+    { "queue", b_qmt_mutex },
+    { "queue", b_qmt_lf },
+    { "dedup", b_dedup },
+    { "dedup", b_dedup_shared },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+    struct nmea_parser p;
+    iface_t ifa;
+    char *fname=NULL,*only=NULL;
+    int opt,i;
+
+    while ((opt=getopt(argc,argv,"f:t:b:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fname=optarg;
+            break;
+        case 't':
+            if ((mintime=atof(optarg)) <= 0) {
+                fprintf(stderr,"Bad time %s\n",optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            only=optarg;
+            break;
+        default:
+            fprintf(stderr,"Usage: %s [-f <file>] [-t <seconds>] "
+                    "[-b parse|cksum|filter|tag|queue|dedup]\n",argv[0]);
+            exit(1);
+        }
+    }
+
+    if (((fname)?load_corpus(fname):synth_corpus()) < 0) {
+        fprintf(stderr,"Could not load corpus%s%s\n",(fname)?" from ":"",
+                (fname)?fname:"");
+        exit(1);
+    }
+
+    scan_init();
+
+    /* Split the corpus into sentences for benchmarks which take them */
+    dummy_iface(&ifa,"corpus");
+    parser_init(&p,&ifa,NULL,0);
+    parser_sink(&p,collect,NULL);
+    parse_nmea(&p,corpus.buf,corpus.len);
+    if (corpus.nsens == 0) {
+        fprintf(stderr,"No sentences in corpus\n");
+        exit(1);
+    }
+    printf("Corpus: %s, %lu bytes, %lu sentences\n",
+            (fname)?fname:"synthetic",(unsigned long) corpus.len,
+            (unsigned long) corpus.nsens);
+
+    for (i=0;benches[i].name;i++)
+        if (only == NULL || !strcmp(only,benches[i].name))
+            (*benches[i].fn)();
+    exit(0);
+}
@@ -0,0 +1,154 @@
+/* dedup.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Suppression of duplicate sentences from redundant inputs
+ *
+ * With the global "dedup" option the engine drops a sentence if the same
+ * sentence arrived from a different input within the last "dedup" ms, so
+ * that outputs get the union of two receivers' data without repeats.  A
+ * repeat from the same input is a new sentence (e.g. an unchanged heading)
+ * and is passed.  Tag blocks are not part of senblk data so play no part.
+ *
+ * Sentences are hashed into a fixed size table of cache line sized buckets,
+ * each holding DEDUPWAYS entries of a 32 bit tag from the hash, the source
+ * and the time last seen.  Entries expire by age so the table never needs
+ * sweeping: a new sentence replaces an expired entry in its bucket or, if
+ * none, the oldest.  With more than one engine thread buckets are guarded
+ * by a spin lock held only for the few instructions of an update
+ */
+
+#include "kplex.h"
+#include <limits.h>
+
+#define DEDUPWAYS 4
+#define DEDUPDEFSIZE 16384      /* Default entries in the table */
+
+struct dd_bucket {
+    unsigned char lock;
+    unsigned int tag[DEDUPWAYS];    /* 0 for an unused entry */
+    unsigned int src[DEDUPWAYS];
+    unsigned int when[DEDUPWAYS];   /* mono_ms(), truncated */
+} __attribute__((aligned(CACHELINE)));
+
+struct dedup {
+    struct dd_bucket *buckets;
+    size_t mask;                    /* Number of buckets - 1 */
+    unsigned int window;            /* ms */
+    int shared;                     /* Used by more than one engine thread */
+};
+
+/*
+ * Create a duplicate suppression table
+ * Args: window in ms, entries wanted (0 for the default), whether more than
+ * one engine thread will use it
+ * Returns: pointer to table or NULL on failure
+ */
+struct dedup *dedup_init(long window, size_t entries, int shared)
+{
+    struct dedup *dd;
+    size_t n;
+
+    if ((dd=(struct dedup *) malloc(sizeof(struct dedup))) == NULL)
+        return(NULL);
+    if (entries == 0)
+        entries=DEDUPDEFSIZE;
+    for (n=1;n*DEDUPWAYS < entries;n<<=1);
+    if (posix_memalign((void **) &dd->buckets,CACHELINE,
+            n*sizeof(struct dd_bucket))) {
+        free(dd);
+        return(NULL);
+    }
+    memset(dd->buckets,0,n*sizeof(struct dd_bucket));
+    dd->mask=n-1;
+    dd->window=(unsigned int) window;
+    dd->shared=shared;
+    return(dd);
+}
+
+/*
+ * Free a duplicate suppression table
+ * Args: table (may be NULL)
+ * Returns: Nothing
+ */
+void dedup_free(struct dedup *dd)
+{
+    if (dd == NULL)
+        return;
+    free(dd->buckets);
+    free(dd);
+}
+
+/*
+ * Hash a sentence, a word at a time
+ * Args: sentence data and length
+ * Returns: 64 bit hash
+ */
+static unsigned long long dd_hash(const char *data, size_t len)
+{
+    unsigned long long h=0x9e3779b97f4a7c15ULL^len,w;
+
+    for (;len >= sizeof(w);data+=sizeof(w),len-=sizeof(w)) {
+        memcpy(&w,data,sizeof(w));
+        h=(h^w)*0xff51afd7ed558ccdULL;
+        h^=h>>32;
+    }
+    if (len) {
+        w=0;
+        memcpy(&w,data,len);
+        h=(h^w)*0xff51afd7ed558ccdULL;
+    }
+    h^=h>>33;
+    h*=0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+    return(h);
+}
+
+/*
+ * Check whether a sentence duplicates one recently seen from another input,
+ * recording it if not
+ * Args: table, sentence
+ * Returns: 1 if the sentence is a duplicate, 0 otherwise
+ */
+int dedup_check(struct dedup *dd, senblk_t *sptr)
+{
+    struct dd_bucket *b;
+    unsigned long long h;
+    unsigned int tag,now,age,oldest;
+    int i,victim,dup=0;
+
+    /* Leave out the line ending, which input parsing may have supplied */
+    h=dd_hash(sptr->data,(sptr->len > 2)?sptr->len-2:sptr->len);
+    b=&dd->buckets[h&dd->mask];
+    tag=(unsigned int) (h>>32)|1;
+    now=(unsigned int) mono_ms();
+
+    if (dd->shared)
+        while (__atomic_test_and_set(&b->lock,__ATOMIC_ACQUIRE));
+
+    for (i=0,victim=0,oldest=0;i<DEDUPWAYS;i++) {
+        age=(b->tag[i])?now-b->when[i]:UINT_MAX;
+        if (b->tag[i] == tag && age < dd->window) {
+            if (b->src[i] == (unsigned int) sptr->src)
+                /* Repeated by the same input: start a new window */
+                b->when[i]=now;
+            else
+                dup=1;
+            break;
+        }
+        if (age >= oldest) {
+            oldest=age;
+            victim=i;
+        }
+    }
+    if (i == DEDUPWAYS) {
+        b->tag[victim]=tag;
+        b->src[victim]=(unsigned int) sptr->src;
+        b->when[victim]=now;
+    }
+
+    if (dd->shared)
+        __atomic_clear(&b->lock,__ATOMIC_RELEASE);
+    return(dup);
+}
@@ -0,0 +1,484 @@
+/* dgram.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Batched datagram I/O for udp, broadcast and multicast interfaces using
+ * sendmmsg() and recvmmsg() where the platform provides them.  Interfaces
+ * check dgram_batch_supported() and carry on with one system call per
+ * datagram where it doesn't
+ *
+ * On a kplex built with "make IOURING=1" a receive batch can instead be
+ * fed by a multishot recvmsg on an io_uring owned by the reading thread,
+ * so that datagrams arrive in buffers provided to the kernel without a
+ * system call per batch.  See dgram_rx_uring()
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "kplex.h"
+
+#if (defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)) && \
+        defined(MSG_WAITFORONE)
+#define HAVE_MMSG
+#endif
+
+#ifdef KPLEX_IOURING
+#include "uring.h"
+#include <fcntl.h>
+#include <poll.h>
+
+#define URXENTRIES 8        /* io_uring submission queue size */
+#define URXBUFS 64          /* Receive buffers provided to the kernel */
+#define URXBGID 0
+/* A received buffer holds a struct io_uring_recvmsg_out, the source
+ * address and the datagram */
+#define URXBUFSIZ (sizeof(struct io_uring_recvmsg_out) + \
+        sizeof(struct sockaddr_storage) + BUFSIZ)
+#define URX_RECV 0
+#define URX_WAKE 1
+#endif
+
+#ifdef HAVE_MMSG
+struct dgram_tx {
+    size_t size;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char *tagbuf;
+};
+
+struct dgram_rx {
+    size_t size;
+    size_t count;
+    size_t next;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_storage *addrs;
+    char *bufs;
+#ifdef KPLEX_IOURING
+    struct uring *ur;       /* If not NULL, receive with io_uring */
+    int fd;
+    int wake[2];            /* Pipe written to wake the reader */
+    struct msghdr mh;       /* Sizes of the recvmsg address and control */
+#endif
+};
+#endif
+
+/*
+ * Check whether batched datagram I/O is available
+ * Args: None
+ * Returns: 1 if sendmmsg() and recvmmsg() can be used, 0 otherwise
+ */
+int dgram_batch_supported(void)
+{
+#ifdef HAVE_MMSG
+    return(1);
+#else
+    return(0);
+#endif
+}
+
+/*
+ * Free a datagram send batch
+ * Args: Pointer to batch structure
+ * Returns: Nothing
+ */
+void dgram_tx_free(struct dgram_tx *tx)
+{
+#ifdef HAVE_MMSG
+    if (tx == NULL)
+        return;
+    free(tx->msgs);
+    free(tx->iov);
+    free(tx->tagbuf);
+    free(tx);
+#endif
+}
+
+/*
+ * Allocate structures for sending batches of datagrams
+ * Args: Maximum number of datagrams to be sent per system call
+ * Returns: Pointer to batch structure or NULL on failure or if batching is
+ * not supported
+ */
+struct dgram_tx *dgram_tx_init(size_t size)
+{
+#ifdef HAVE_MMSG
+    struct dgram_tx *tx;
+
+    if ((tx=(struct dgram_tx *) calloc(1,sizeof(struct dgram_tx))) == NULL)
+        return(NULL);
+
+    tx->size=size;
+    if (((tx->msgs=(struct mmsghdr *) calloc(size,sizeof(struct mmsghdr)))
+            == NULL) ||
+            ((tx->iov=(struct iovec *) calloc(size*2,sizeof(struct iovec)))
+            == NULL) ||
+            ((tx->tagbuf=(char *) malloc(size*TAGMAX)) == NULL)) {
+        dgram_tx_free(tx);
+        return(NULL);
+    }
+    return(tx);
+#else
+    return(NULL);
+#endif
+}
+
+/*
+ * Send a batch of senblks, one datagram each, to a single destination
+ * Args: Interface sending, batch structure, socket, array of senblks and
+ * number of senblks in it, destination address and its length
+ * Returns: 0 on success, -1 on error
+ * Senblks should already have been filtered.  Tag blocks are added if the
+ * interface is configured for them.
+ */
+int dgram_send(iface_t *ifa, struct dgram_tx *tx, int fd, senblk_t **sptrs,
+        size_t n, struct sockaddr *addr, socklen_t alen)
+{
+#ifdef HAVE_MMSG
+    struct msghdr *mh;
+    struct iovec *iov;
+    struct timespec start;
+    size_t i,bytes=0;
+    int sent;
+
+    for (i=0;i<n;i++) {
+        mh=&tx->msgs[i].msg_hdr;
+        iov=&tx->iov[i*2];
+        mh->msg_name=(void *)addr;
+        mh->msg_namelen=alen;
+        mh->msg_control=NULL;
+        mh->msg_controllen=mh->msg_flags=0;
+        mh->msg_iov=iov;
+        mh->msg_iovlen=0;
+
+        if (ifa->tagflags) {
+            if ((iov->iov_len = gettag(ifa,tx->tagbuf+i*TAGMAX,sptrs[i]))
+                    == 0) {
+                logerr(errno,"Disabing tag output on interface id %x (%s)",
+                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                ifa->tagflags=0;
+            } else {
+                iov->iov_base=tx->tagbuf+i*TAGMAX;
+                bytes+=iov->iov_len;
+                iov++;
+                mh->msg_iovlen++;
+            }
+        }
+        iov->iov_base=sptrs[i]->data;
+        iov->iov_len=sptrs[i]->len;
+        bytes+=iov->iov_len;
+        mh->msg_iovlen++;
+    }
+
+    stats_clock(&start);
+    for (i=0;i<n;i+=sent)
+        if ((sent=sendmmsg(fd,tx->msgs+i,n-i,0)) < 0) {
+            if (errno == EINTR) {
+                sent=0;
+                continue;
+            }
+            return(-1);
+        }
+    stats_write(ifa,n,bytes,&start);
+    return(0);
+#else
+    errno=ENOSYS;
+    return(-1);
+#endif
+}
+
+/*
+ * Free a datagram receive batch
+ * Args: Pointer to batch structure
+ * Returns: Nothing
+ */
+void dgram_rx_free(struct dgram_rx *rx)
+{
+#ifdef HAVE_MMSG
+    if (rx == NULL)
+        return;
+#ifdef KPLEX_IOURING
+    if (rx->ur) {
+        uring_free(rx->ur);
+        free(rx->ur);
+        close(rx->wake[0]);
+        close(rx->wake[1]);
+    }
+#endif
+    free(rx->msgs);
+    free(rx->iov);
+    free(rx->addrs);
+    free(rx->bufs);
+    free(rx);
+#endif
+}
+
+/*
+ * Allocate structures for receiving batches of datagrams
+ * Args: Maximum number of datagrams to be received per system call
+ * Returns: Pointer to batch structure or NULL on failure or if batching is
+ * not supported
+ */
+struct dgram_rx *dgram_rx_init(size_t size)
+{
+#ifdef HAVE_MMSG
+    struct dgram_rx *rx;
+    size_t i;
+
+    if ((rx=(struct dgram_rx *) calloc(1,sizeof(struct dgram_rx))) == NULL)
+        return(NULL);
+
+    rx->size=size;
+    if (((rx->msgs=(struct mmsghdr *) calloc(size,sizeof(struct mmsghdr)))
+            == NULL) ||
+            ((rx->iov=(struct iovec *) calloc(size,sizeof(struct iovec)))
+            == NULL) ||
+            ((rx->addrs=(struct sockaddr_storage *) calloc(size,
+            sizeof(struct sockaddr_storage))) == NULL) ||
+            ((rx->bufs=(char *) malloc(size*BUFSIZ)) == NULL)) {
+        dgram_rx_free(rx);
+        return(NULL);
+    }
+
+    for (i=0;i<size;i++) {
+        rx->iov[i].iov_base=rx->bufs+i*BUFSIZ;
+        rx->iov[i].iov_len=BUFSIZ;
+        rx->msgs[i].msg_hdr.msg_iov=&rx->iov[i];
+        rx->msgs[i].msg_hdr.msg_iovlen=1;
+        rx->msgs[i].msg_hdr.msg_name=&rx->addrs[i];
+    }
+    return(rx);
+#else
+    return(NULL);
+#endif
+}
+
+#ifdef KPLEX_IOURING
+/*
+ * Start (or restart) a multishot request on a receive batch's ring
+ * Args: batch structure, which request
+ * Returns: 0 on success, -1 on failure
+ */
+static int urx_arm(struct dgram_rx *rx, int kind)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe=uring_sqe(rx->ur)) == NULL)
+        return(-1);
+    if (kind == URX_WAKE)
+        uring_prep_poll(sqe,rx->wake[0],POLLIN,1);
+    else {
+        sqe->opcode=IORING_OP_RECVMSG;
+        sqe->fd=rx->fd;
+        sqe->addr=(unsigned long) &rx->mh;
+        sqe->len=1;
+        sqe->flags=IOSQE_BUFFER_SELECT;
+        sqe->buf_group=URXBGID;
+        sqe->ioprio=IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data=kind;
+    return(0);
+}
+
+/*
+ * Set up a receive batch fed by a multishot recvmsg on io_uring.  The ring
+ * belongs to the calling thread, which must be the only one to use the batch
+ * Args: socket to receive from
+ * Returns: Pointer to batch structure or NULL on failure.  io_uring_enter()
+ * is not a cancellation point: the thread should be woken by writing to the
+ * descriptor returned by dgram_rx_wakefd() after being cancelled
+ */
+struct dgram_rx *dgram_rx_uring(int fd)
+{
+    struct dgram_rx *rx;
+    int err;
+
+    if ((rx=(struct dgram_rx *) calloc(1,sizeof(struct dgram_rx))) == NULL)
+        return(NULL);
+    if ((rx->ur=(struct uring *) malloc(sizeof(struct uring))) == NULL) {
+        free(rx);
+        return(NULL);
+    }
+    if (uring_init(rx->ur,URXENTRIES,
+            IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN) < 0) {
+        err=errno;
+        free(rx->ur);
+        free(rx);
+        errno=err;
+        return(NULL);
+    }
+    if (pipe(rx->wake) < 0 || fcntl(rx->wake[0],F_SETFL,O_NONBLOCK) < 0) {
+        err=errno;
+        uring_free(rx->ur);
+        free(rx->ur);
+        free(rx);
+        errno=err;
+        return(NULL);
+    }
+    rx->fd=fd;
+    rx->mh.msg_namelen=sizeof(struct sockaddr_storage);
+    if (uring_bufs_init(rx->ur,URXBGID,URXBUFS,URXBUFSIZ) < 0 ||
+            urx_arm(rx,URX_RECV) < 0 || urx_arm(rx,URX_WAKE) < 0 ||
+            uring_enter(rx->ur,0) < 0) {
+        err=errno;
+        dgram_rx_free(rx);
+        errno=err;
+        return(NULL);
+    }
+    return(rx);
+}
+
+/*
+ * Get the descriptor to write to to wake a thread receiving with io_uring
+ * Args: batch structure
+ * Returns: descriptor, or -1 if the batch doesn't use io_uring
+ */
+int dgram_rx_wakefd(struct dgram_rx *rx)
+{
+    return((rx && rx->ur)?rx->wake[1]:-1);
+}
+
+/*
+ * Return the next datagram received by io_uring, waiting for one if need be
+ * Args: as for dgram_recv()
+ * Returns: Size of datagram or -1 on error
+ */
+static ssize_t urx_recv(struct dgram_rx *rx, char *buf, struct sockaddr *src,
+        socklen_t *srclen)
+{
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    char dbuf[64];
+    unsigned long ud;
+    unsigned flags,bid;
+    ssize_t len;
+    int res;
+
+    for (;;) {
+        if ((cqe=uring_cqe(rx->ur)) == NULL) {
+            if (uring_enter(rx->ur,1) < 0 && errno != EINTR)
+                return(-1);
+            continue;
+        }
+        ud=cqe->user_data;
+        res=cqe->res;
+        flags=cqe->flags;
+        uring_cqe_seen(rx->ur);
+
+        if (ud == URX_WAKE) {
+            while (read(rx->wake[0],dbuf,sizeof(dbuf)) > 0);
+            pthread_testcancel();
+            if (!(flags & IORING_CQE_F_MORE) && urx_arm(rx,URX_WAKE) < 0)
+                return(-1);
+            continue;
+        }
+
+        len=0;
+        if (flags & IORING_CQE_F_BUFFER) {
+            bid=flags>>IORING_CQE_BUFFER_SHIFT;
+            out=(struct io_uring_recvmsg_out *) uring_buf(rx->ur,bid);
+            if (res >= (int) (sizeof(*out)+rx->mh.msg_namelen)) {
+                len=res-sizeof(*out)-rx->mh.msg_namelen;
+                if (len > out->payloadlen)
+                    len=out->payloadlen;
+                memcpy(buf,(char *) (out+1)+rx->mh.msg_namelen,len);
+                if (src) {
+                    if (*srclen > out->namelen)
+                        *srclen=out->namelen;
+                    memcpy(src,out+1,*srclen);
+                }
+            }
+            uring_buf_return(rx->ur,bid);
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            /* Stopped because we ran out of buffers or the kernel ended it:
+             * those used have been returned so start another */
+            if (res < 0 && res != -ENOBUFS && res != -EINTR) {
+                errno=-res;
+                return(-1);
+            }
+            if (urx_arm(rx,URX_RECV) < 0 || uring_enter(rx->ur,0) < 0)
+                return(-1);
+        }
+        /* Empty datagrams are skipped rather than looking like EOF */
+        if (len)
+            return(len);
+    }
+}
+#endif
+
+/*
+ * Return the next received datagram, receiving a new batch if none are left
+ * from the last
+ * Args: batch structure, socket, buffer of at least BUFSIZ bytes to copy
+ * datagram into, pointer to storage for source address and pointer to its
+ * size (set on return to the actual size of the address)
+ * Returns: Size of datagram or -1 on error
+ */
+ssize_t dgram_recv(struct dgram_rx *rx, int fd, char *buf,
+        struct sockaddr *src, socklen_t *srclen)
+{
+#ifdef HAVE_MMSG
+    struct msghdr *mh;
+    size_t i;
+    int n;
+
+#ifdef KPLEX_IOURING
+    if (rx->ur)
+        return(urx_recv(rx,buf,src,srclen));
+#endif
+    if (rx->next == rx->count) {
+        for (i=0;i<rx->size;i++)
+            rx->msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_storage);
+        if ((n=recvmmsg(fd,rx->msgs,rx->size,MSG_WAITFORONE,NULL)) < 0)
+            return(-1);
+        rx->count=n;
+        rx->next=0;
+        if (n == 0)
+            return(0);
+    }
+
+    mh=&rx->msgs[rx->next].msg_hdr;
+    if (src) {
+        if (*srclen > mh->msg_namelen)
+            *srclen=mh->msg_namelen;
+        memcpy(src,mh->msg_name,*srclen);
+    }
+    memcpy(buf,mh->msg_iov->iov_base,rx->msgs[rx->next].msg_len);
+    return(rx->msgs[rx->next++].msg_len);
+#else
+    errno=ENOSYS;
+    return(-1);
+#endif
+}
+
+/*
+ * Output loop for datagram interfaces sending batches of sentences
+ * Args: Interface, batch structure, socket, destination address and its
+ * length
+ * Returns: Nothing.  Returns when the interface's queue is shut down or on
+ * error
+ */
+void dgram_write(iface_t *ifa, struct dgram_tx *tx, int fd,
+        struct sockaddr *addr, socklen_t alen)
+{
+#ifdef HAVE_MMSG
+    senblk_t *sptrs[MAXDGRAMBATCH];
+    size_t i,n;
+    int err=0;
+
+    while (!err) {
+        if ((n = next_senblk_batch(ifa->q,sptrs,tx->size)) == 0)
+            break;
+
+        if (dgram_send(ifa,tx,fd,sptrs,n,addr,alen) < 0)
+            err++;
+
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+    }
+#endif
+}
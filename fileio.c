@@ -6,20 +6,118 @@
  * This file contains code for i/o from files (incl stdin/stdout)
  */
 
+#ifdef __linux__
+/* For fallocate() */
+#define _GNU_SOURCE
+#endif
 #include "kplex.h"
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <grp.h>
+#include <signal.h>
+#include <limits.h>
+#ifdef KPLEX_ZLIB
+#include <zlib.h>
+#endif
+
+/* Buffered log output.  The interface thread copies sentences into one of
+ * LOGBUFS buffers and hands full ones to a log thread which does all the
+ * writing, compression and rotation so storage latency never holds up
+ * the output queue
+ */
+#define LOGBUFS 4
+#define DEFLOGBUF 65536
+#define MINLOGBUF 4096
+#define DEFFLUSH 5
+
+struct filelog {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *buf[LOGBUFS];
+    size_t len[LOGBUFS];
+    int head;               /* Next buffer for the log thread to write */
+    int full;               /* Number of buffers waiting to be written */
+    int done;               /* Interface thread has finished */
+    int err;                /* Log thread write error */
+    int cur;                /* Buffer being filled by the interface thread */
+    size_t fill;            /* Bytes in it */
+    int fd;
+    off_t size;             /* Bytes written to the current file */
+    off_t capoff;           /* Capture stream offset of next write */
+    time_t opened;          /* Time current file was opened */
+#ifdef KPLEX_ZLIB
+    z_stream z;
+    char *zbuf;
+#endif
+};
 
 struct if_file {
     int fd;
     char *filename;
     size_t qsize;
+    int replay;                 /* Replay from a memory mapping */
+    double rate;                /* Replay speed multiplier.  0 for max */
+    size_t logbuf;              /* Log buffer size.  0 if unbuffered */
+    int flush;                  /* Max seconds before buffered data written */
+    off_t rotsize;              /* Rotate after this many bytes */
+    int rottime;                /* Rotate after this many seconds */
+    int prealloc;               /* Preallocate rotsize bytes per file */
+    int compress;               /* gzip output */
+    uid_t uid;
+    gid_t gid;
+    mode_t perm;
+    struct filelog *log;
+    int binary;                 /* Binary capture format */
+    off_t capoff;               /* Capture stream offset (see below) */
+    long long captime;          /* Time of last capture record */
+    long long capstart;         /* Capture replay start time */
+    long long capend;           /* Capture replay end time */
+    struct ifring ring;         /* io_uring reads for inputs */
 };
 
+/* Binary capture format.  A file starts with a CAPHDR byte header:
+ *   0  magic "KPLEXCAP"
+ *   8  u16 format version
+ *  10  u16 log2 of the block size
+ *  12  u32 bytes from the end of the header to the first block boundary
+ * followed by records, each with a CAPRECHDR byte header:
+ *   0  u8 record type
+ *   1  u8 reserved (0)
+ *   2  u16 payload length
+ *   4  u32 source interface id
+ *   8  u64 time in ns since the epoch.  Never decreases within a file
+ * All integers are little endian.  Sentence records hold a sentence without
+ * its trailing <CR><LF>.  No record spans a block boundary: the end of a
+ * block too short for the next record is zero filled.  Each block starts
+ * with a sync record with no payload and the time of the record after it so
+ * readers can find a time by binary search over the blocks.
+ * Block boundaries are at multiples of CAPBLOCK in the capture stream, which
+ * rotated logs continue across files.  capoff is the stream offset of the
+ * next byte to be written
+ */
+#define CAPMAGIC "KPLEXCAP"
+#define CAPVERSION 1
+#define CAPBLOCKBITS 16
+#define CAPBLOCK (1<<CAPBLOCKBITS)
+#define CAPHDR 16
+#define CAPRECHDR 16
+#define CAP_PAD 0
+#define CAP_SEN 1
+#define CAP_SYNC 2
+
+/* Padding never exceeds the size of a record */
+static char capzero[CAPRECHDR+SENBUFSZ];
+
+static int log_free(struct if_file *);
+
+/* Amount of a mapped file passed to the parser at a time when not pacing */
+#define REPLAYCHUNK 65536
+
 /*
  * Duplicate struct if_file
  * Args: if_file to be duplicated
@@ -45,20 +143,182 @@ void cleanup_file(iface_t *ifa)
 {
     struct if_file *iff = (struct if_file *) ifa->info;
 
+    ring_free(ifa,&iff->ring);
+    /* Terminated output threads leave the log to be flushed here */
+    if (iff->log)
+        (void) log_free(iff);
     if (iff->fd >= 0)
         close(iff->fd);
     if (iff->filename)
         free(iff->filename);
 }
 
+static void put16(char *p, unsigned v)
+{
+    p[0]=v&0xff;
+    p[1]=(v>>8)&0xff;
+}
+
+static void put32(char *p, unsigned long v)
+{
+    put16(p,v&0xffff);
+    put16(p+2,(v>>16)&0xffff);
+}
+
+static void put64(char *p, unsigned long long v)
+{
+    put32(p,v&0xffffffff);
+    put32(p+4,(v>>32)&0xffffffff);
+}
+
+static unsigned get16(const char *p)
+{
+    return((unsigned char) p[0]|((unsigned char) p[1]<<8));
+}
+
+static unsigned long get32(const char *p)
+{
+    return(get16(p)|((unsigned long) get16(p+2)<<16));
+}
+
+static unsigned long long get64(const char *p)
+{
+    return(get32(p)|((unsigned long long) get32(p+4)<<32));
+}
+
+/*
+ * Fill in a capture file header
+ * Args: buffer of CAPHDR bytes, capture stream offset of data following
+ * Returns: Nothing
+ */
+static void cap_header(char *buf, off_t capoff)
+{
+    memcpy(buf,CAPMAGIC,8);
+    put16(buf+8,CAPVERSION);
+    put16(buf+10,CAPBLOCKBITS);
+    put32(buf+12,(CAPBLOCK-(capoff&(CAPBLOCK-1)))&(CAPBLOCK-1));
+}
+
+/*
+ * Fill in a capture record header
+ * Args: buffer of CAPRECHDR bytes, record type, payload length, source id,
+ * time
+ * Returns: Nothing
+ */
+static void cap_rechdr(char *buf, int type, size_t len, unsigned long src,
+        long long t)
+{
+    buf[0]=type;
+    buf[1]=0;
+    put16(buf+2,len);
+    put32(buf+4,src);
+    put64(buf+8,t);
+}
+
+/*
+ * Make a regular file ready for capture output: write a header to an empty
+ * file or carry on from the header of one being appended to
+ * Args: interface, interface info
+ * Returns: 0 on success, -1 on failure
+ */
+static int cap_open(iface_t *ifa, struct if_file *ifc)
+{
+    struct stat statbuf;
+    struct iovec iov;
+    char hdr[CAPHDR];
+    ssize_t n;
+    int fd;
+
+    if (fstat(ifc->fd,&statbuf) < 0) {
+        logerr(errno,"Could not stat %s",ifc->filename);
+        return(-1);
+    }
+    if (statbuf.st_size == 0) {
+        ifc->capoff=0;
+        cap_header(hdr,0);
+        iov.iov_base=hdr;
+        iov.iov_len=CAPHDR;
+        if (writev_all(ifc->fd,&iov,1) < 0) {
+            logerr(errno,"Failed to write to %s",ifc->filename);
+            return(-1);
+        }
+        return(0);
+    }
+
+    /* Output descriptor is write only */
+    if ((fd=open(ifc->filename,O_RDONLY)) < 0) {
+        logerr(errno,"Could not open %s",ifc->filename);
+        return(-1);
+    }
+    n=pread(fd,hdr,CAPHDR,0);
+    close(fd);
+    if (n != CAPHDR || memcmp(hdr,CAPMAGIC,8) ||
+            get16(hdr+8) != CAPVERSION || get16(hdr+10) != CAPBLOCKBITS) {
+        logerr(0,"Can't append to %s: Not a compatible capture file",
+                ifc->filename);
+        return(-1);
+    }
+    ifc->capoff=statbuf.st_size-CAPHDR+
+            ((CAPBLOCK-get32(hdr+12))&(CAPBLOCK-1));
+    DEBUG(3,"%s: appending to capture file %s",ifa->name,ifc->filename);
+    return(0);
+}
+
+/*
+ * Build an iovec of capture records for an array of senblks
+ * Args: Interface info, array of senblks and number of senblks in it, iovec
+ * to fill (at least 3 entries per senblk) and buffer of 2*CAPRECHDR bytes
+ * per senblk for record headers
+ * Returns: Number of iovec entries used
+ * Side effects: Capture offset advanced assuming all are written
+ */
+static int batch_cap(struct if_file *ifc, senblk_t **sptrs, size_t n,
+        struct iovec *iov, char *hdrbuf)
+{
+    struct timespec ts;
+    long long t;
+    size_t i,len,room;
+    char *hp;
+    int cnt=0;
+
+    for (i=0;i<n;i++,hdrbuf+=2*CAPRECHDR) {
+        clock_gettime(CLOCK_REALTIME,&ts);
+        if ((t=(long long) ts.tv_sec*1000000000LL+ts.tv_nsec) < ifc->captime)
+            t=ifc->captime;
+        ifc->captime=t;
+        len=sptrs[i]->len-2;
+        room=CAPBLOCK-(ifc->capoff&(CAPBLOCK-1));
+        if (room < CAPRECHDR+len) {
+            iov[cnt].iov_base=capzero;
+            iov[cnt++].iov_len=room;
+            ifc->capoff+=room;
+            room=CAPBLOCK;
+        }
+        hp=hdrbuf;
+        if (room == CAPBLOCK) {
+            cap_rechdr(hp,CAP_SYNC,0,0,t);
+            hp+=CAPRECHDR;
+        }
+        cap_rechdr(hp,CAP_SEN,len,sptrs[i]->src,t);
+        hp+=CAPRECHDR;
+        iov[cnt].iov_base=hdrbuf;
+        iov[cnt++].iov_len=hp-hdrbuf;
+        iov[cnt].iov_base=sptrs[i]->data;
+        iov[cnt++].iov_len=len;
+        ifc->capoff+=hp-hdrbuf+len;
+    }
+    return(cnt);
+}
+
 void write_file(iface_t *ifa)
 {
     struct if_file *ifc = (struct if_file *) ifa->info;
-    senblk_t *sptr;
-    int usereturn=flag_test(ifa,F_NOCR)?0:1;
-    int data=0;
-    int cnt=1;
-    struct iovec iov[2];
+    senblk_t *sptrs[WRITEBATCH];
+    struct iovec iov[WRITEBATCH*3];
+    char *tagbuf=NULL;
+    int nocr=flag_test(ifa,F_NOCR)?1:0;
+    size_t i,n;
+    int cnt;
 
     /* ifc->fd will only be < 0 if we're opening a FIFO.
      */
@@ -74,63 +334,463 @@ void write_file(iface_t *ifa)
         DEBUG(3,"%s opened FIFO %s for writing",ifa->name,ifc->filename);
     }
 
-    if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+    if (ifc->binary) {
+        if ((tagbuf=malloc(2*CAPRECHDR*WRITEBATCH)) == NULL) {
+            logerr(errno,"%s: Could not allocate capture buffer",ifa->name);
+            iface_thread_exit(errno);
+        }
+    } else if (ifa->tagflags) {
+        if ((tagbuf=malloc(TAGMAX*WRITEBATCH)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
-
     for(;;)  {
-        if ((sptr = next_senblk(ifa->q)) == NULL) {
+        if ((n = next_senblk_batch(ifa->q,sptrs,WRITEBATCH)) == 0) {
             break;
         }
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        if ((cnt=(ifc->binary)?batch_cap(ifc,sptrs,n,iov,tagbuf):
+                batch_iov(ifa,sptrs,n,iov,tagbuf,nocr)) &&
+                (writev_batch(ifa,ifc->fd,iov,cnt,n) <0)) {
+            if (!(flag_test(ifa,F_PERSIST) && errno == EPIPE) ) {
+                logerr(errno,"%s: write failed",ifa->name);
+                cnt=-1;
+            } else if ((ifc->fd=open(ifc->filename,O_WRONLY)) < 0) {
+                logerr(errno,"%s: failed to re-open %s",ifa->name,
+                        ifc->filename);
+                cnt=-1;
+            } else {
+                STATADD(&ifa->stats,reconnects,1);
+                DEBUG(4,"%s: reconnected to FIFO %s",ifa->name,ifc->filename);
+            }
         }
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+        if (cnt < 0)
+            break;
+    }
+
+    if (tagbuf)
+        free(tagbuf);
+
+    iface_thread_exit(errno);
+}
+
+/*
+ * Write buffered data to the current log file, compressing if configured
+ * Args: interface info, log, data and its length
+ * Returns: 0 on success, -1 on error
+ */
+static int log_write(struct if_file *ifc, struct filelog *log, char *buf,
+        size_t len)
+{
+    struct iovec iov;
+    ssize_t n;
 
-        if (!usereturn) {
-            sptr->data[sptr->len-2] = '\n';
-            sptr->len--;
+#ifdef KPLEX_ZLIB
+    if (ifc->compress) {
+        /* Flush each buffer so the file is complete up to the last write */
+        log->z.next_in=(unsigned char *) buf;
+        log->z.avail_in=len;
+        do {
+            log->z.next_out=(unsigned char *) log->zbuf;
+            log->z.avail_out=ifc->logbuf;
+            (void) deflate(&log->z,(buf)?Z_SYNC_FLUSH:Z_FINISH);
+            iov.iov_base=log->zbuf;
+            iov.iov_len=ifc->logbuf-log->z.avail_out;
+            if (iov.iov_len && (n=writev_all(log->fd,&iov,1)) < 0)
+                return(-1);
+            log->size+=iov.iov_len;
+        } while (log->z.avail_out == 0);
+        return(0);
+    }
+#endif
+    if (buf == NULL)
+        return(0);
+
+    iov.iov_base=buf;
+    iov.iov_len=len;
+    if ((n=writev_all(log->fd,&iov,1)) < 0)
+        return(-1);
+    log->size+=n;
+    return(0);
+}
+
+/*
+ * Start writing to a newly opened log file
+ * Args: interface, interface info, log
+ * Returns: Nothing
+ */
+static void log_start(iface_t *ifa, struct if_file *ifc, struct filelog *log)
+{
+    struct stat statbuf;
+
+    char hdr[CAPHDR];
+
+    /* The file may have been opened for appending */
+    log->size=(fstat(log->fd,&statbuf) == 0)?statbuf.st_size:0;
+    log->opened=time(NULL);
+    if (ifc->binary && log->size == 0) {
+        cap_header(hdr,log->capoff);
+        if (log_write(ifc,log,hdr,CAPHDR) < 0)
+            logerr(errno,"%s: failed to write capture header",ifa->name);
+    }
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* Allocate space up front so the file is contiguous and the filesystem
+     * isn't updating block allocations with every write */
+    if (ifc->prealloc && log->size < ifc->rotsize &&
+            fallocate(log->fd,FALLOC_FL_KEEP_SIZE,log->size,
+            ifc->rotsize-log->size) < 0)
+        DEBUG(3,"%s: preallocation failed: %s",ifa->name,strerror(errno));
+#endif
+}
+
+/*
+ * Finish writing to a log file and close it
+ * Args: interface info, log
+ * Returns: 0 on success, -1 on error
+ */
+static int log_end(struct if_file *ifc, struct filelog *log)
+{
+    int ret=0;
+
+    if (log->fd < 0)
+        return(0);
+
+#ifdef KPLEX_ZLIB
+    if (ifc->compress) {
+        ret=log_write(ifc,log,NULL,0);
+        deflateReset(&log->z);
+    }
+#endif
+    /* Release preallocated space beyond what was written */
+    if (ifc->prealloc && ftruncate(log->fd,log->size) < 0)
+        ret=-1;
+    if (fsync(log->fd) < 0 && errno != EINVAL)
+        ret=-1;
+    close(log->fd);
+    log->fd=-1;
+    return(ret);
+}
+
+/*
+ * Close the current log file, rename it with the time it was opened and
+ * open a new one: "log.txt" becomes e.g "log-20170101120000.txt"
+ * Args: interface, interface info, log
+ * Returns: 0 on success, -1 on error
+ */
+static int log_rotate(iface_t *ifa, struct if_file *ifc, struct filelog *log)
+{
+    struct stat statbuf;
+    char *name,*ext,*base;
+    size_t stem;
+    int i;
+
+    if (log_end(ifc,log) < 0)
+        logerr(errno,"%s: error closing %s",ifa->name,ifc->filename);
+
+    if ((name=malloc(strlen(ifc->filename)+32)) == NULL)
+        return(-1);
+    base=((base=strrchr(ifc->filename,'/')))?base+1:ifc->filename;
+    if ((ext=strrchr(base,'.')) == NULL || ext == base)
+        ext=base+strlen(base);
+    stem=ext-ifc->filename;
+    memcpy(name,ifc->filename,stem);
+    stem+=strftime(name+stem,20,"-%Y%m%d%H%M%S",gmtime(&log->opened));
+    strcpy(name+stem,ext);
+    for (i=1;stat(name,&statbuf) == 0 && i < 1000;i++)
+        sprintf(name+stem,"-%d%s",i,ext);
+
+    if (rename(ifc->filename,name) < 0)
+        logerr(errno,"%s: failed to rename %s to %s",ifa->name,ifc->filename,
+                name);
+    else
+        DEBUG(3,"%s: rotated %s to %s",ifa->name,ifc->filename,name);
+    free(name);
+
+    if ((log->fd=open(ifc->filename,O_WRONLY|O_CREAT|O_TRUNC,
+            (ifc->perm)?ifc->perm:0664)) < 0) {
+        logerr(errno,"%s: failed to open %s",ifa->name,ifc->filename);
+        return(-1);
+    }
+    /* Not using umask() to apply permissions as it is process wide */
+    if (ifc->perm && fchmod(log->fd,ifc->perm) < 0)
+        logwarn("%s: failed to set permissions on %s",ifa->name,
+                ifc->filename);
+    if ((ifc->uid != -1 || ifc->gid != -1) &&
+            fchown(log->fd,ifc->uid,ifc->gid) < 0)
+        logwarn("%s: failed to set ownership of %s",ifa->name,ifc->filename);
+    log_start(ifa,ifc,log);
+    return(0);
+}
+
+/*
+ * Log thread: writes buffers handed over by the interface thread and
+ * rotates files
+ * Args: interface
+ * Returns: NULL
+ */
+static void *log_thread(void *arg)
+{
+    iface_t *ifa = (iface_t *) arg;
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct filelog *log = ifc->log;
+    struct timespec ts;
+    int slot,full,err;
+
+    pthread_mutex_lock(&log->mutex);
+    for (;;) {
+        while (log->full == 0 && !log->done) {
+            if (ifc->rottime == 0) {
+                pthread_cond_wait(&log->cond,&log->mutex);
+                continue;
+            }
+            ts.tv_sec=log->opened+ifc->rottime;
+            ts.tv_nsec=0;
+            if (pthread_cond_timedwait(&log->cond,&log->mutex,&ts)
+                    == ETIMEDOUT)
+                break;
         }
+        if (log->full == 0 && log->done)
+            break;
+        full=log->full;
+        slot=log->head;
+        err=log->err;
+        pthread_mutex_unlock(&log->mutex);
+
+        /* After an error buffers are discarded until the interface exits */
+        if (!err && full) {
+            if (log_write(ifc,log,log->buf[slot],log->len[slot]) < 0) {
+                err=errno;
+                logerr(err,"%s: write failed",ifa->name);
+            }
+            log->capoff+=log->len[slot];
+        }
+        if (!err && ((ifc->rotsize && log->size >= ifc->rotsize) ||
+                (ifc->rottime && time(NULL) >= log->opened+ifc->rottime))) {
+            if (log->size == 0)
+                log->opened=time(NULL);
+            else if (log_rotate(ifa,ifc,log) < 0)
+                err=errno;
+        }
+
+        pthread_mutex_lock(&log->mutex);
+        if (err)
+            log->err=err;
+        if (full) {
+            log->head=(slot+1)%LOGBUFS;
+            log->full--;
+            pthread_cond_signal(&log->cond);
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+    if (log_end(ifc,log) < 0)
+        logerr(errno,"%s: error closing %s",ifa->name,ifc->filename);
+    return(NULL);
+}
+
+/*
+ * Pass the buffer being filled to the log thread, waiting for a free one if
+ * need be
+ * Args: log
+ * Returns: 0 on success, -1 if the log thread has failed
+ * Side effects: log set to fill the next buffer
+ */
+static int log_handoff(struct filelog *log)
+{
+    int state,err;
+
+    /* Output threads are cancelled on shutdown and this must not happen
+     * with the mutex held: it is needed to flush the log on cleanup */
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&state);
+    pthread_mutex_lock(&log->mutex);
+    log->len[log->cur]=log->fill;
+    log->full++;
+    pthread_cond_signal(&log->cond);
+    while (log->full == LOGBUFS && !log->err)
+        pthread_cond_wait(&log->cond,&log->mutex);
+    err=log->err;
+    log->cur=(log->cur+1)%LOGBUFS;
+    log->fill=0;
+    pthread_mutex_unlock(&log->mutex);
+    (void) pthread_setcancelstate(state,NULL);
+
+    if (err) {
+        errno=err;
+        return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Write out anything buffered, stop the log thread and free the log
+ * Args: interface info
+ * Returns: errno of any log thread write failure, 0 otherwise
+ */
+static int log_free(struct if_file *ifc)
+{
+    struct filelog *log = ifc->log;
+    int i,err;
+
+    if (log->fill)
+        (void) log_handoff(log);
+    pthread_mutex_lock(&log->mutex);
+    log->done=1;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+    pthread_join(log->tid,NULL);
+    err=log->err;
+
+    for (i=0;i<LOGBUFS;i++)
+        free(log->buf[i]);
+#ifdef KPLEX_ZLIB
+    if (ifc->compress)
+        deflateEnd(&log->z);
+    free(log->zbuf);
+#endif
+    pthread_mutex_destroy(&log->mutex);
+    pthread_cond_destroy(&log->cond);
+    ifc->fd=log->fd;
+    ifc->log=NULL;
+    free(log);
+    return(err);
+}
+
+/*
+ * Set up buffers and start a log thread
+ * Args: interface
+ * Returns: 0 on success, -1 on failure
+ */
+static int log_init(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct filelog *log;
+    int i;
+
+    if ((log=(struct filelog *) calloc(1,sizeof(struct filelog))) == NULL)
+        return(-1);
+    for (i=0;i<LOGBUFS;i++)
+        if ((log->buf[i]=malloc(ifc->logbuf)) == NULL)
+            goto fail;
+#ifdef KPLEX_ZLIB
+    if (ifc->compress) {
+        if ((log->zbuf=malloc(ifc->logbuf)) == NULL)
+            goto fail;
+        /* 16 added to window bits for a gzip header */
+        if (deflateInit2(&log->z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+            errno=ENOMEM;
+            goto fail;
+        }
+    }
+#endif
+    pthread_mutex_init(&log->mutex,NULL);
+    pthread_cond_init(&log->cond,NULL);
+    log->fd=ifc->fd;
+    log->capoff=ifc->capoff;
+    ifc->fd=-1;
+    log_start(ifa,ifc,log);
+    ifc->log=log;
+    if ((errno=pthread_create(&log->tid,NULL,log_thread,(void *) ifa))) {
+        ifc->fd=log->fd;
+        ifc->log=NULL;
+        goto fail;
+    }
+    return(0);
+
+fail:
+    for (i=0;i<LOGBUFS;i++)
+        free(log->buf[i]);
+#ifdef KPLEX_ZLIB
+    free(log->zbuf);
+#endif
+    free(log);
+    return(-1);
+}
+
+/*
+ * Buffered output to a log file.  Data are handed to the log thread when
+ * a buffer fills or has held data for the flush interval
+ * Args: interface
+ * Returns: Nothing
+ */
+void write_filelog(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct filelog *log;
+    senblk_t *sptrs[WRITEBATCH];
+    struct iovec iov[WRITEBATCH*3];
+    struct timespec deadline,start;
+    char *tagbuf=NULL;
+    int nocr=flag_test(ifa,F_NOCR)?1:0;
+    size_t i,n,len,bytes;
+    int j,cnt,err=0;
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
+    if (log_init(ifa) < 0) {
+        logerr(errno,"%s: could not start log output",ifa->name);
+        iface_thread_exit(errno);
+    }
+    log=ifc->log;
+
+    if (ifc->binary) {
+        if ((tagbuf=malloc(2*CAPRECHDR)) == NULL) {
+            logerr(errno,"%s: Could not allocate capture buffer",ifa->name);
+            (void) log_free(ifc);
+            iface_thread_exit(errno);
+        }
+    } else if (ifa->tagflags) {
+        if ((tagbuf=malloc(TAGMAX*WRITEBATCH)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
+        }
+    }
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-        if (writev(ifc->fd,iov,cnt) <0) {
-            if (!(flag_test(ifa,F_PERSIST) && errno == EPIPE) ) {
-                logerr(errno,"%s: write failed",ifa->name);
+    for(;;) {
+        if ((n=next_senblk_batch_timed(ifa->q,sptrs,WRITEBATCH,
+                (log->fill)?&deadline:NULL)) == 0) {
+            if (errno != ETIMEDOUT || log_handoff(log) < 0)
                 break;
-            }
+            continue;
+        }
 
-            if ((ifc->fd=open(ifc->filename,O_WRONLY)) < 0) {
-                logerr(errno,"%s: failed to re-open %s",ifa->name,
-                        ifc->filename);
+        stats_clock(&start);
+        /* Each sentence goes in one buffer so files are only rotated
+         * between sentences */
+        for (i=0,bytes=0;i<n;i++) {
+            cnt=(ifc->binary)?batch_cap(ifc,sptrs+i,1,iov,tagbuf):
+                    batch_iov(ifa,sptrs+i,1,iov,tagbuf,nocr);
+            for (j=0,len=0;j<cnt;j++)
+                len+=iov[j].iov_len;
+            if (log->fill+len > ifc->logbuf && log_handoff(log) < 0) {
+                err=errno;
                 break;
             }
-            DEBUG(4,"%s: reconnected to FIFO %s",ifa->name,ifc->filename);
+            if (log->fill == 0) {
+                wait_abstime(&deadline,ifc->flush*1000);
+            }
+            for (j=0;j<cnt;j++) {
+                memcpy(log->buf[log->cur]+log->fill,iov[j].iov_base,
+                        iov[j].iov_len);
+                log->fill+=iov[j].iov_len;
+            }
+            bytes+=len;
         }
-        senblk_free(sptr,ifa->q);
+        stats_write(ifa,n,bytes,&start);
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+        if (err)
+            break;
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    err=log_free(ifc);
 
-    iface_thread_exit(errno);
+    if (tagbuf)
+        free(tagbuf);
+
+    iface_thread_exit(err);
 }
 
 void file_read_wrapper(iface_t *ifa)
@@ -155,7 +815,7 @@ ssize_t read_file(iface_t *ifa, char *buf)
     ssize_t nread;
 
     for(;;) {
-        if ((nread=read(ifc->fd,buf,BUFSIZ)) <=0) {
+        if ((nread=ring_read(ifa,&ifc->ring,ifc->fd,buf)) <=0) {
             if (!flag_test(ifa,F_PERSIST))
                 break;
             close(ifc->fd);
@@ -172,6 +832,314 @@ ssize_t read_file(iface_t *ifa, char *buf)
     return nread;
 }
 
+/*
+ * Extract the time from a tag block "c:" field at the start of a line.
+ * NMEA 4.10 specifies seconds since the epoch: kplex itself appends
+ * milliseconds, so values of more than 10 digits are taken to be in ms
+ * Args: start of line, end of mapped data, pointer to time in ms
+ * Returns: 1 if a time was found, 0 otherwise
+ */
+static int tag_ctime(const char *ptr, const char *end, long long *ms)
+{
+    const char *tend;
+    long long val;
+    int digits;
+
+    if (*ptr++ != '\\')
+        return(0);
+    if (end-ptr > TAGMAX)
+        end=ptr+TAGMAX;
+    for (tend=ptr;tend < end && *tend != '\\' && *tend != '*';tend++);
+
+    while (ptr < tend) {
+        if (ptr+1 < tend && *ptr == 'c' && *(ptr+1) == ':') {
+            for (ptr+=2,val=0,digits=0;ptr < tend && *ptr >= '0' &&
+                    *ptr <= '9' && digits < 16;ptr++,digits++)
+                val=val*10+*ptr-'0';
+            if (digits == 0)
+                return(0);
+            *ms=(digits > 10)?val:val*1000;
+            return(1);
+        }
+        /* Skip to the next field */
+        while (ptr < tend && *ptr++ != ',');
+    }
+    return(0);
+}
+
+/* Replay pacing state */
+struct pace {
+    int started;
+    long long first;            /* First timestamp in the data (ns) */
+    long long start;            /* Monotonic clock when it was released */
+};
+
+/*
+ * Get the monotonic clock in ns
+ * Args: None
+ * Returns: time in ns
+ */
+static long long replay_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((long long) ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
+/*
+ * Work out how long to wait before releasing data stamped with a given
+ * time: its offset from the first time seen divided by the rate multiplier
+ * after the first was released.  Time going backwards doesn't rewind
+ * Args: interface info, pacing state, data timestamp in ns
+ * Returns: ns to wait, 0 if data is due now
+ */
+static long long replay_due(struct if_file *ifc, struct pace *pc, long long t)
+{
+    long long due,now;
+
+    now=replay_clock();
+    if (!pc->started) {
+        pc->first=t;
+        pc->start=now;
+        pc->started=1;
+    }
+    if (t < pc->first)
+        t=pc->first;
+    due=pc->start+(long long) ((t-pc->first)/ifc->rate);
+    return((now < due)?due-now:0);
+}
+
+/*
+ * Sleep for a number of nanoseconds
+ * Args: time to sleep in ns
+ * Returns: Nothing
+ */
+static void replay_sleep(long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec=ns/1000000000LL;
+    ts.tv_nsec=ns%1000000000LL;
+    while (nanosleep(&ts,&ts) < 0 && errno == EINTR);
+}
+
+/*
+ * Get the time from a capture block's sync record
+ * Args: start of block, end of mapped data, pointer to returned time
+ * Returns: 1 if the block starts with a sync record, 0 otherwise
+ */
+static int cap_synctime(const char *blk, const char *end, long long *t)
+{
+    if (blk+CAPRECHDR > end || *blk != CAP_SYNC)
+        return(0);
+    *t=get64(blk+8);
+    return(1);
+}
+
+/*
+ * Replay a mapped binary capture file between the interface's start and
+ * end times.  The block to start from is found by binary search of the
+ * blocks' sync records
+ * Args: Interface, parser, mapped file and its end
+ * Returns: Nothing
+ */
+static void replay_cap(iface_t *ifa, struct nmea_parser *parser,
+        const char *map, const char *end)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct pace pc;
+    const char *ptr,*blk0,*bound;
+    size_t bsize,lo,hi,mid;
+    long long t,wait;
+    unsigned bits,len;
+
+    if (end-map < CAPHDR || memcmp(map,CAPMAGIC,8) ||
+            get16(map+8) != CAPVERSION || (bits=get16(map+10)) < 9 ||
+            bits > 24) {
+        logerr(0,"%s: %s is not a kplex capture file",ifa->name,
+                ifc->filename);
+        return;
+    }
+    bsize=1<<bits;
+    blk0=map+CAPHDR+get32(map+12);
+    ptr=map+CAPHDR;
+
+    if (ifc->capstart && cap_synctime(blk0,end,&t) && t <= ifc->capstart) {
+        /* Find the last block starting no later than the start time */
+        for (lo=0,hi=(end-blk0+bsize-1)/bsize;hi-lo > 1;) {
+            mid=lo+(hi-lo)/2;
+            if (cap_synctime(blk0+mid*bsize,end,&t) && t <= ifc->capstart)
+                lo=mid;
+            else
+                hi=mid;
+        }
+        ptr=blk0+lo*bsize;
+        DEBUG(4,"%s: starting replay at block %lu",ifa->name,
+                (unsigned long) lo);
+    }
+    bound=(ptr < blk0)?blk0:ptr+bsize;
+
+    memset(&pc,0,sizeof(pc));
+    while (ptr+CAPRECHDR <= end) {
+        if (ptr >= bound)
+            bound+=bsize;
+        len=get16(ptr+2);
+        /* Resynchronise at the next block boundary after padding or a
+         * damaged or truncated record */
+        if (*ptr == CAP_PAD || ptr+CAPRECHDR+len > bound ||
+                ptr+CAPRECHDR+len > end || (*ptr == CAP_SEN && (len == 0 ||
+                (ptr[CAPRECHDR] != '$' && ptr[CAPRECHDR] != '!')))) {
+            ptr=bound;
+            continue;
+        }
+        if (*ptr == CAP_SEN) {
+            if ((t=get64(ptr+8)) >= ifc->capend)
+                break;
+            if (t >= ifc->capstart) {
+                if (ifc->rate && (wait=replay_due(ifc,&pc,t)))
+                    replay_sleep(wait);
+                parse_nmea(parser,ptr+CAPRECHDR,len);
+                parse_nmea(parser,"\r\n",2);
+            }
+        }
+        ptr+=CAPRECHDR+len;
+    }
+}
+
+/*
+ * Replay a regular file from a memory mapping.  Data are passed to the
+ * parser straight from the mapping.  Unless rate is "max", output is paced
+ * by the times in tag block "c:" fields: each stamped line is released at
+ * the start time plus its offset from the first stamp divided by the rate
+ * multiplier.  Lines without stamps go with whatever precedes them.
+ * Binary captures are paced by their record times
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+void replay_file(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct nmea_parser *parser;
+    struct stat statbuf;
+    struct pace pc;
+    const char *map,*end,*line,*batch,*nl;
+    long long ms,wait;
+    size_t len;
+
+    if ((parser=parser_attach(ifa)) == NULL) {
+        logerr(errno,"%s: Could not allocate parser",ifa->name);
+        iface_thread_exit(errno);
+    }
+
+    if (fstat(ifc->fd,&statbuf) < 0) {
+        logerr(errno,"%s: Could not stat %s",ifa->name,ifc->filename);
+        iface_thread_exit(errno);
+    }
+    if ((len=statbuf.st_size) == 0)
+        iface_thread_exit(0);
+
+    if ((map=mmap(NULL,len,PROT_READ,MAP_PRIVATE,ifc->fd,0)) == MAP_FAILED) {
+        logerr(errno,"%s: Could not map %s",ifa->name,ifc->filename);
+        iface_thread_exit(errno);
+    }
+    (void) madvise((void *) map,len,MADV_SEQUENTIAL);
+    end=map+len;
+    DEBUG(3,"%s: replaying %s (%lu bytes)",ifa->name,ifc->filename,
+            (unsigned long) len);
+
+    if (ifc->binary) {
+        replay_cap(ifa,parser,map,end);
+    } else if (ifc->rate == 0) {
+        for (batch=map;batch < end;batch+=len) {
+            len=(end-batch > REPLAYCHUNK)?REPLAYCHUNK:end-batch;
+            parse_nmea(parser,batch,len);
+        }
+    } else {
+        memset(&pc,0,sizeof(pc));
+        for (line=batch=map;line < end;) {
+            if (tag_ctime(line,end,&ms) &&
+                    (wait=replay_due(ifc,&pc,ms*1000000LL))) {
+                if (line > batch)
+                    parse_nmea(parser,batch,line-batch);
+                batch=line;
+                replay_sleep(wait);
+            }
+            if ((nl=memchr(line,'\n',end-line)) == NULL)
+                break;
+            line=nl+1;
+        }
+        if (end > batch)
+            parse_nmea(parser,batch,end-batch);
+    }
+
+    munmap((void *) map,end-map);
+    iface_thread_exit(0);
+}
+
+/*
+ * Parse a time given as seconds since the epoch or as a UTC date and time
+ * in the form YYYY-MM-DDTHH:MM:SS
+ * Args: string, pointer to returned time in ns since the epoch
+ * Returns: 0 on success, -1 if the time is invalid
+ */
+static int parse_time(const char *str, long long *ns)
+{
+    struct tm tm;
+    char *eptr;
+    double secs;
+
+    memset(&tm,0,sizeof(tm));
+    if ((eptr=strptime(str,"%Y-%m-%dT%H:%M:%S",&tm))) {
+        if (*eptr == 'Z')
+            eptr++;
+        if (*eptr)
+            return(-1);
+        *ns=(long long) timegm(&tm)*1000000000LL;
+        return(0);
+    }
+    if ((secs=strtod(str,&eptr)) < 0 || eptr == str || *eptr)
+        return(-1);
+    *ns=(long long) (secs*1000000000.0);
+    return(0);
+}
+
+/*
+ * Parse a size with an optional k, M or G suffix
+ * Args: string, pointer to returned size
+ * Returns: 0 on success, -1 if the size is invalid
+ */
+int parse_size(const char *str, off_t *size)
+{
+    char *eptr;
+    long long val;
+
+    errno=0;
+    if ((val=strtoll(str,&eptr,0)) <= 0 || errno)
+        return(-1);
+    switch (*eptr) {
+    case 'k':
+    case 'K':
+        val<<=10;
+        eptr++;
+        break;
+    case 'm':
+    case 'M':
+        val<<=20;
+        eptr++;
+        break;
+    case 'g':
+    case 'G':
+        val<<=30;
+        eptr++;
+        break;
+    }
+    if (*eptr)
+        return(-1);
+    *size=val;
+    return(0);
+}
+
 iface_t *init_file (iface_t *ifa)
 {
     struct if_file *ifc;
@@ -185,6 +1153,8 @@ iface_t *init_file (iface_t *ifa)
     struct group *group;
     mode_t tperm,perm=0;
     char *cp;
+    off_t size;
+    int buffered=0;
 
     if ((ifc = (struct if_file *)malloc(sizeof(struct if_file))) == NULL) {
         logerr(errno,"Could not allocate memory");
@@ -195,6 +1165,7 @@ iface_t *init_file (iface_t *ifa)
 
     ifc->qsize=DEFQSIZE;
     ifc->fd=-1;
+    ifc->flush=-1;
     ifa->info = (void *) ifc;
 
     for(opt=ifa->options;opt;opt=opt->next) {
@@ -246,6 +1217,96 @@ iface_t *init_file (iface_t *ifa)
                 logerr(0,"Invalid permissions for tty device \'%s\'",opt->val);
                 return 0;
             }
+        } else if (!strcasecmp(opt->var,"rate")) {
+            ifc->replay=1;
+            if (!strcasecmp(opt->val,"max"))
+                ifc->rate=0;
+            else if (!strcasecmp(opt->val,"realtime"))
+                ifc->rate=1;
+            else if ((ifc->rate=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid replay rate \"%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"format")) {
+            if (!strcasecmp(opt->val,"binary"))
+                ifc->binary=1;
+            else if (!strcasecmp(opt->val,"nmea"))
+                ifc->binary=0;
+            else {
+                logerr(0,"Invalid option \"format=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"start")) {
+            if (parse_time(opt->val,&ifc->capstart) < 0) {
+                logerr(0,"Invalid start time %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"end")) {
+            if (parse_time(opt->val,&ifc->capend) < 0) {
+                logerr(0,"Invalid end time %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"logbuf")) {
+            if (parse_size(opt->val,&size) < 0 || size < MINLOGBUF ||
+                    size > 1<<30) {
+                logerr(0,"Invalid log buffer size %s (minimum %d)",opt->val,
+                        MINLOGBUF);
+                return(NULL);
+            }
+            ifc->logbuf=size;
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"flush")) {
+            if ((ifc->flush=strtol(opt->val,&cp,0)) < 0 || *cp ||
+                    cp == opt->val) {
+                logerr(0,"Invalid flush interval %s",opt->val);
+                return(NULL);
+            }
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"rotatesize")) {
+            if (parse_size(opt->val,&ifc->rotsize) < 0) {
+                logerr(0,"Invalid rotation size %s",opt->val);
+                return(NULL);
+            }
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"rotatetime")) {
+            if ((ifc->rottime=strtol(opt->val,&cp,0)) <= 0 || *cp) {
+                logerr(0,"Invalid rotation interval %s",opt->val);
+                return(NULL);
+            }
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"prealloc")) {
+            if (!strcasecmp(opt->val,"yes")) {
+#ifdef FALLOC_FL_KEEP_SIZE
+                ifc->prealloc=1;
+#else
+                logerr(0,"Preallocation not supported on this platform");
+                return(NULL);
+#endif
+            } else if (!strcasecmp(opt->val,"no")) {
+                ifc->prealloc=0;
+            } else {
+                logerr(0,"Invalid option \"prealloc=%s\"",opt->val);
+                return(NULL);
+            }
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"compress")) {
+            if (!strcasecmp(opt->val,"gzip")) {
+#ifdef KPLEX_ZLIB
+                ifc->compress=1;
+#else
+                logerr(0,"kplex was built without compression support");
+                return(NULL);
+#endif
+            } else if (!strcasecmp(opt->val,"no")) {
+                ifc->compress=0;
+            } else {
+                logerr(0,"Invalid option \"compress=%s\"",opt->val);
+                return(NULL);
+            }
+            buffered=1;
+        } else if (!strcasecmp(opt->var,"uring")) {
+            if (ring_opt(ifa,&ifc->ring,opt->val) < 0)
+                return(NULL);
         } else {
             logerr(0,"Unknown interface option %s\n",opt->var);
             return(NULL);
@@ -255,6 +1316,55 @@ iface_t *init_file (iface_t *ifa)
     /* We do allow use of stdin and stdout, but not if they're connected to
      * a terminal. This allows re-direction in background mode
      */
+    if (ifc->binary) {
+        if (ifa->direction == BOTH || ifc->filename == NULL) {
+            logerr(0,"Binary format is only supported for regular files");
+            return(NULL);
+        }
+        if (ifc->compress) {
+            logerr(0,"Binary captures can't be compressed");
+            return(NULL);
+        }
+        /* Binary input is always read from a mapping */
+        if (ifa->direction == IN)
+            ifc->replay=1;
+    }
+    if ((ifc->capstart || ifc->capend) && !(ifc->binary &&
+            ifa->direction == IN)) {
+        logerr(0,"Start and end times may only be specified for binary inputs");
+        return(NULL);
+    }
+    if (ifc->capend == 0)
+        ifc->capend=LLONG_MAX;
+
+    if (ifc->replay && (ifa->direction != IN || ifc->filename == NULL)) {
+        logerr(0,"Replay rate may only be specified for regular input files");
+        return(NULL);
+    }
+
+    if (ifc->ring.want && (ifa->direction == OUT || ifc->replay)) {
+        logerr(0,"uring option only valid for file inputs which aren't replayed");
+        return(NULL);
+    }
+
+    if (buffered) {
+        if (ifa->direction != OUT || ifc->filename == NULL) {
+            logerr(0,"Log options may only be specified for regular output files");
+            return(NULL);
+        }
+        if (ifc->logbuf == 0)
+            ifc->logbuf=DEFLOGBUF;
+        if (ifc->flush < 0)
+            ifc->flush=DEFFLUSH;
+        if (ifc->prealloc && ifc->rotsize == 0) {
+            logerr(0,"Preallocation requires a rotation size");
+            return(NULL);
+        }
+        ifc->uid=uid;
+        ifc->gid=gid;
+        ifc->perm=perm;
+    }
+
     if (ifc->filename == NULL) {
         if (flag_test(ifa,F_PERSIST)) {
             logerr(0,"Can't use persist mode with stdin/stdout");
@@ -290,6 +1400,16 @@ iface_t *init_file (iface_t *ifa)
                 return(NULL);
             }
         }
+        if (ifc->replay && !S_ISREG(statbuf.st_mode)) {
+            logerr(0,"Can't replay from %s: Not a regular file",ifc->filename);
+            return(NULL);
+        }
+        if ((buffered || ifc->binary) && ret == 0 &&
+                !S_ISREG(statbuf.st_mode)) {
+            logerr(0,"%s options may only be used with regular files",
+                    (buffered)?"Log":"Binary format");
+            return(NULL);
+        }
         if ((ret == 0) && S_ISFIFO(statbuf.st_mode)) {
             /* Special rules for FIFOs. Opening here would hang for a reading
              * interface with no writer. Given that we're single threaded here,
@@ -340,10 +1460,13 @@ iface_t *init_file (iface_t *ifa)
         }
     }
 
+    if (ifc->binary && ifa->direction == OUT && cap_open(ifa,ifc) < 0)
+        return(NULL);
+
     free_options(ifa->options);
 
-    ifa->write=write_file;
-    ifa->read=file_read_wrapper;
+    ifa->write=(buffered)?write_filelog:write_file;
+    ifa->read=(ifc->replay)?replay_file:file_read_wrapper;
     ifa->readbuf=read_file;
     ifa->cleanup=cleanup_file;
 
@@ -364,6 +1487,8 @@ iface_t *init_file (iface_t *ifa)
         ifa->pair->direction=IN;
         ifc = (struct if_file *) ifa->pair->info;
         ifc->fd=STDIN_FILENO;
+        /* ifdup_file() clears everything but it is this half which reads */
+        ifc->ring.want=((struct if_file *) ifa->info)->ring.want;
     }
     return(ifa);
 }
@@ -0,0 +1,200 @@
+/* filter.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Compiled sentence filters.  Walking a filter's rule list for every
+ * sentence gets expensive with long lists, so when a filter is built its
+ * rules are indexed by the 5 character address field they match.  Rules are
+ * grouped by which characters are wildcards: each group is looked up in a
+ * hash table with the wildcard positions of the address blanked out, and
+ * the earliest rule found across all groups is the first match, exactly as
+ * if the list had been walked
+ */
+
+#include "kplex.h"
+
+#define MATCHLEN 5
+/* One group for each combination of wildcard positions */
+#define MAXGROUPS (1<<MATCHLEN)
+/* Largest hash table used, in buckets */
+#define MAXHASH 4096
+
+struct sf_entry {
+    unsigned char wild;
+    char key[MATCHLEN];
+    unsigned int idx;
+    sf_rule_t *rule;
+    struct sf_entry *next;
+};
+
+struct sf_group {
+    unsigned char wild;
+    unsigned int first;
+};
+
+struct sf_index {
+    int ngroups;
+    struct sf_group groups[MAXGROUPS];
+    unsigned int hashmask;
+    struct sf_entry **hash;
+    struct sf_entry *entries;
+};
+
+/*
+ * Hash an address pattern
+ * Args: wildcard bitmap and address with wildcard positions zeroed
+ * Returns: Hash value
+ */
+static unsigned int sf_hash(unsigned char wild, const char *key)
+{
+    unsigned int h=2166136261u;
+    int i;
+
+    h=(h^wild)*16777619u;
+    for (i=0;i<MATCHLEN;i++)
+        h=(h^(unsigned char) key[i])*16777619u;
+    return(h);
+}
+
+/*
+ * Copy an address, blanking out wildcard positions
+ * Args: destination, address and wildcard bitmap
+ * Returns: Nothing
+ */
+static void sf_mask(char *key, const char *addr, unsigned char wild)
+{
+    int i;
+
+    for (i=0;i<MATCHLEN;i++)
+        key[i]=(wild & (1<<i))?0:addr[i];
+}
+
+/*
+ * Free a filter's index, if it has one
+ * Args: Filter
+ * Returns: Nothing
+ */
+void free_filter_index(sfilter_t *filter)
+{
+    struct sf_index *idx;
+
+    if ((idx=filter->index) == NULL)
+        return;
+    free(idx->hash);
+    free(idx->entries);
+    free(idx);
+    filter->index=NULL;
+}
+
+/*
+ * Build an index of a filter's rules, replacing any existing one
+ * Args: Filter
+ * Returns: 0 on success, -1 on failure
+ * If building the index fails filter lookups fall back to walking the rule
+ * list.  Rule source ids are read at lookup time so the index does not need
+ * rebuilding when interface names are translated to ids
+ */
+int compile_filter(sfilter_t *filter)
+{
+    struct sf_index *idx;
+    struct sf_entry *e,**eptr;
+    sf_rule_t *rule;
+    unsigned int n,size,i;
+    unsigned char wild;
+    int g;
+
+    free_filter_index(filter);
+
+    for (n=0,rule=filter->rules;rule;rule=rule->next)
+        n++;
+    if (n == 0)
+        return(0);
+
+    for (size=16;size < 2*n && size < MAXHASH;size<<=1);
+
+    if ((idx=(struct sf_index *) malloc(sizeof(struct sf_index))) == NULL)
+        return(-1);
+    idx->ngroups=0;
+    idx->hashmask=size-1;
+    idx->hash=(struct sf_entry **) calloc(size,sizeof(struct sf_entry *));
+    idx->entries=(struct sf_entry *) malloc(n*sizeof(struct sf_entry));
+    if (idx->hash == NULL || idx->entries == NULL) {
+        free(idx->hash);
+        free(idx->entries);
+        free(idx);
+        return(-1);
+    }
+
+    for (i=0,rule=filter->rules;rule;rule=rule->next,i++) {
+        for (wild=0,g=0;g<MATCHLEN;g++)
+            if (rule->match[g] == 0)
+                wild|=1<<g;
+
+        /* Groups are created in order of the first rule in them */
+        for (g=0;g<idx->ngroups;g++)
+            if (idx->groups[g].wild == wild)
+                break;
+        if (g == idx->ngroups) {
+            idx->groups[g].wild=wild;
+            idx->groups[g].first=i;
+            idx->ngroups++;
+        }
+
+        e=&idx->entries[i];
+        e->wild=wild;
+        sf_mask(e->key,rule->match,wild);
+        e->idx=i;
+        e->rule=rule;
+        e->next=NULL;
+        /* Append so each chain is in rule order */
+        for (eptr=&idx->hash[sf_hash(wild,e->key)&idx->hashmask];*eptr;
+                eptr=&(*eptr)->next);
+        *eptr=e;
+    }
+
+    filter->index=idx;
+    DEBUG(7,"Compiled %u filter rules into %d groups",n,idx->ngroups);
+    return(0);
+}
+
+/*
+ * Find the first rule in a filter matching a sentence
+ * Args: Filter, pointer to the sentence's 5 character address field and
+ * source id (ignored for failover filters)
+ * Returns: Pointer to first matching rule or NULL if there is none or the
+ * filter has no index
+ */
+sf_rule_t *filter_lookup(sfilter_t *filter, const char *addr,
+        unsigned int src)
+{
+    struct sf_index *idx=filter->index;
+    struct sf_entry *e;
+    sf_rule_t *found=NULL;
+    unsigned int best=(unsigned int) -1;
+    char key[MATCHLEN];
+    int g;
+
+    if (idx == NULL)
+        return(NULL);
+
+    for (g=0;g<idx->ngroups;g++) {
+        /* No rule in this or later groups can come before what we've got */
+        if (idx->groups[g].first >= best)
+            break;
+        sf_mask(key,addr,idx->groups[g].wild);
+        for (e=idx->hash[sf_hash(idx->groups[g].wild,key)&idx->hashmask];
+                e && e->idx < best;e=e->next) {
+            if (e->wild != idx->groups[g].wild ||
+                    memcmp(e->key,key,MATCHLEN))
+                continue;
+            if (filter->type == FILTER && e->rule->src.id &&
+                    e->rule->src.id != src)
+                continue;
+            best=e->idx;
+            found=e->rule;
+            break;
+        }
+    }
+    return(found);
+}
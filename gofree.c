@@ -64,15 +64,14 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
     iface_t *newifa;
     struct if_tcp *newift;
     int err;
-    sigset_t set,saved;
     char addrbuf[INET_ADDRSTRLEN];   /* for debug info */
 
-    if ((newifa = malloc(sizeof(iface_t))) == NULL)
+    if ((newifa = iface_alloc()) == NULL)
         return(NULL);
-    memset(newifa,0,sizeof(iface_t));
 
-    if ((newift = (struct if_tcp *) malloc(sizeof(struct if_tcp))) == NULL) {
-        free(newifa);
+    if ((newift = (struct if_tcp *) pool_alloc(sizeof(struct if_tcp),
+            &newifa->mem)) == NULL) {
+        pool_free(newifa);
         return(NULL);
     }
 
@@ -80,12 +79,15 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
             (connect(newift->fd,(struct sockaddr *)&mfd->addr,sizeof(struct sockaddr)) != 0)) {
         /* Save errno so it isn't set to 0 by free */
         err=errno;
-        free(newift);
-        free(newifa);
+        pool_free(newift);
+        pool_free(newifa);
         errno=err;
         return(NULL);
     }
     newift->shared=NULL;
+    newift->reactor=NULL;
+    newift->ring.want=0;
+    newift->ring.rd=NULL;
     newifa->id=ifa->id+(newift->fd&IDMINORMASK);
     newifa->direction=IN;
     newifa->type=TCP;
@@ -97,20 +99,14 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
     newifa->tagflags=ifa->tagflags;
     newifa->readbuf=read_tcp;
     newifa->lists=ifa->lists;
-    newifa->ifilter=addfilter(ifa->ifilter);
+    newifa->ifilter=filter_get(&ifa->ifilter);
     /* Copying ofilter is unnecessary as gofree is input only */
     newifa->checksum=ifa->checksum;
-    newifa->q=ifa->lists->engine->q;
-    /* disable SIGUSR1 before launching new thread to avoid it being killed
-     * while holding a mutex */
-    sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
-    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    newifa->tattr=ifa->tattr;
+    newifa->q=engine_q(ifa->lists,newifa->id);
     link_to_initialized(newifa);
-    pthread_create(tid,NULL,(void *)start_interface,(void *) newifa);
-
-    /* reset sig mask and re-enable SIGUSR1 */
-    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    (void) thread_create(tid,&newifa->tattr,(void *(*)(void *)) start_interface,
+            (void *) newifa);
     DEBUG(3,"%s: connected to MFD %s at %s port %s",ifa->name,mfd->name,
             inet_ntop(AF_INET,(const void *)&mfd->addr.sin_addr,addrbuf,
             INET_ADDRSTRLEN),ntohs(mfd->addr.sin_port));
@@ -391,7 +387,7 @@ void gofree_server (iface_t *ifa)
                     continue;
             } else {
                 /* Connected but new connection required */
-                pthread_kill(tid,SIGUSR1);
+                pthread_cancel(tid);
                 pthread_join(tid,NULL);
             }
         }
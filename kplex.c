@@ -10,9 +10,16 @@
  * defined in interface-specific files
  */
 
+#ifdef __linux__
+/* For pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
+#endif
 #include "kplex.h"
 #include "kplex_mods.h"
 #include "version.h"
+#ifdef KPLEX_IOURING
+#include "uring.h"
+#endif
 #include <signal.h>
 #include <pwd.h>
 #include <time.h>
@@ -23,26 +30,22 @@
 #include <sys/wait.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <sched.h>
 
 /* Macro to identify kplex Proprietary sentences */
 #define isprop(sptr) (sptr->len >= 7 && sptr->data[1] == 'P' && sptr->data[2] == 'K' && sptr->data[3] == 'P' && sptr->data[4] == 'X')
 
-/* Globals. Sadly. Used in signal handlers so few other simple options */
+/* Globals. Sadly. */
 pthread_key_t ifkey;    /* Key for Thread local pointer to interface struct */
-pthread_t reaper;       /* tid of thread responsible for reaping */
 int timetodie=0;        /* Set on receipt of SIGTERM or SIGINT */
 time_t graceperiod=3;   /* Grace period for unsent data before shutdown (secs)*/
 int debuglevel=0;                    /* debug off by default */
-
-/* Signal handler for SIGUSR1 used by interface threads.  Note that this is
- * highly dubious: pthread_exit() is not async safe.  No associated problems
- * reported so far and if they do occur they should occur on exit, but this
- * will be changed in the next release
- */
-void terminate(int sig)
-{
-    pthread_exit((void *)&sig);
-}
+static int graceover=0;             /* Set when the grace period expires */
+static struct ktimer gracetimer;
+static int reloadreq=0;             /* Set on receipt of SIGHUP */
+static unsigned int nifaces=0;      /* Interfaces given ids so far */
+/* Serialises replacement of filters with taking references to them */
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Sleep function not relying on SIGALRM for thread safety
  * Unnecessary on many platforms but here to minimise portability issues
@@ -58,8 +61,109 @@ int mysleep(time_t sleepytime)
     return (nanosleep(&rqtp,NULL));
 }
 
+/* As mysleep() but for delays given in milliseconds */
+int mysleep_ms(long ms)
+{
+    struct timespec rqtp;
+
+    rqtp.tv_sec = ms/1000;
+    rqtp.tv_nsec = (ms%1000)*1000000;
+
+    return (nanosleep(&rqtp,NULL));
+}
+
 /* functions */
 
+/*
+ * Build an iovec for writing a batch of senblks in one system call.
+ * Tag blocks are interleaved where the interface is configured to add them
+ * Args: Interface, array of senblks and number of senblks in it, iovec to
+ * fill (at least 3 entries per senblk), buffer of TAGMAX bytes per senblk
+ * for tag blocks (may be NULL if interface tagflags not set), and flag
+ * indicating whether sentences are to be terminated with \n rather than \r\n
+ * Returns: Number of iovec entries used
+ * Side effects: Tag output disabled on the interface if tag generation fails
+ */
+int batch_iov(iface_t *ifa, senblk_t **sptrs, size_t n, struct iovec *iov,
+        char *tagbuf, int nocr)
+{
+    senblk_t *sptr;
+    size_t i;
+    int cnt;
+
+    for (i=0,cnt=0;i<n;i++) {
+        sptr=sptrs[i];
+        if (ifa->tagflags) {
+            if ((iov[cnt].iov_len = gettag(ifa,tagbuf+i*TAGMAX,sptr)) == 0) {
+                logerr(errno,"Disabing tag output on interface id %x (%s)",
+                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                ifa->tagflags=0;
+            } else
+                iov[cnt++].iov_base=tagbuf+i*TAGMAX;
+        }
+
+        iov[cnt].iov_base=sptr->data;
+        if (nocr) {
+            /* senblk is shared with other outputs so can't be modified.
+             * Write all but the trailing \r\n then a newline */
+            iov[cnt++].iov_len=sptr->len-2;
+            iov[cnt].iov_base="\n";
+            iov[cnt].iov_len=1;
+        } else
+            iov[cnt].iov_len=sptr->len;
+        cnt++;
+    }
+    return(cnt);
+}
+
+/*
+ * writev() an entire iovec, continuing after short writes
+ * Args: file descriptor, iovec and number of entries in it
+ * Returns: number of bytes written or -1 on error
+ * Side effects: iovec contents are modified
+ */
+ssize_t writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n,total=0;
+
+    while (cnt) {
+        if ((n=writev(fd,iov,cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        total+=n;
+        for (;cnt && (size_t) n >= iov->iov_len;cnt--,iov++)
+            n-=iov->iov_len;
+        if (cnt) {
+            iov->iov_base=(char *) iov->iov_base+n;
+            iov->iov_len-=n;
+        }
+    }
+    return(total);
+}
+
+/*
+ * writev_all() a batch of sentences for an output interface, recording the
+ * write in the interface's statistics
+ * Args: interface, file descriptor, iovec and number of entries in it, and
+ * number of sentences it holds
+ * Returns: number of bytes written or -1 on error
+ * Side effects: iovec contents are modified
+ */
+ssize_t writev_batch(iface_t *ifa, int fd, struct iovec *iov, int cnt,
+        size_t nsen)
+{
+    struct timespec start;
+    ssize_t n;
+
+    stats_clock(&start);
+    if ((n=writev_all(fd,iov,cnt)) >= 0)
+        stats_write(ifa,nsen,n,&start);
+    return(n);
+}
+
+
 /*
  * Check an NMEA 0183 checksum
  * Args: pointer to struct senblk
@@ -70,10 +174,14 @@ int checkcksum (senblk_t *sptr)
 {
     int cksm=0;
     int rcvdcksum=0,i,end;
-    char *ptr;
+    char *ptr=sptr->data+1;
 
-    for(i=0,end=sptr->len-6,ptr=sptr->data+1; i < end; ptr++,i++)
-            cksm ^= *ptr;
+    /* Convert as for XORing plain chars, so that a sum with the top bit set
+     * is sign extended (and never matches) only where char is signed */
+    if ((end=sptr->len-6) > 0) {
+        cksm=(char) xorsum(ptr,end);
+        ptr+=end;
+    }
 
     if (*ptr != '*')
         return -1;
@@ -106,8 +214,7 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
     sf_rule_t *fptr;
     char *cptr;
     int i;
-    time_t tsecs;
-    struct timeval tv;
+    long long now;
 
     /* We shouldn't actually be filtering any NULL packets, but check anyway */
     if (sptr == NULL || filter == NULL || filter->rules == NULL)
@@ -118,35 +225,44 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
     if (*sptr->data == '\r')
         return(1);
 
-    for (fptr=filter->rules;fptr;fptr=fptr->next) {
-        if ((fptr->src.id) && (fptr->src.id != (sptr->src&mask)))
-            continue;
-        for (i=0,cptr=sptr->data+1;i<5 && *cptr != '\r';i++,cptr++)
-            if(fptr->match[i] && fptr->match[i] != *cptr)
-                break;
-        if (i!=5)
-            continue;
-
-        if (fptr->type == ACCEPT) {
+    if (filter->index) {
+        /* A CR within the address field can't match any rule */
+        if (memchr(sptr->data+1,'\r',5))
             return(0);
+        if ((fptr=filter_lookup(filter,sptr->data+1,sptr->src&mask)) == NULL)
+            return(0);
+    } else {
+        for (fptr=filter->rules;fptr;fptr=fptr->next) {
+            if ((fptr->src.id) && (fptr->src.id != (sptr->src&mask)))
+                continue;
+            for (i=0,cptr=sptr->data+1;i<5 && *cptr != '\r';i++,cptr++)
+                if(fptr->match[i] && fptr->match[i] != *cptr)
+                    break;
+            if (i==5)
+                break;
         }
-        if (fptr->type == DENY) {
-            return(-1);
-        }
-        /* type is limit. Hopefully. */
-        (void) gettimeofday(&tv,NULL);
-        if (tv.tv_sec < fptr->info.limit->timeout)
-            return(-1);
-        if ((tsecs=(tv.tv_sec - fptr->info.limit->timeout)) <
-                fptr->info.limit->last.tv_sec)
-            return(-1);
-        if (tsecs == fptr->info.limit->last.tv_sec &&
-                (tv.tv_usec < fptr->info.limit->last.tv_usec ))
-            return(-1);
-        /* at least timeout since last seen: Update info and pass */
-        memcpy(&fptr->info.limit->last,&tv,sizeof(struct timeval));
+        if (!fptr)
+            return(0);
+    }
+
+    if (fptr->type == ACCEPT) {
         return(0);
     }
+    if (fptr->type == DENY) {
+        return(-1);
+    }
+    /* type is limit. Hopefully.  With more than one engine thread the
+     * filter may be applied by several at once */
+    now=mono_ms();
+    pthread_mutex_lock(&filter->lock);
+    if (fptr->info.limit->last &&
+            now-fptr->info.limit->last < fptr->info.limit->timeout*1000LL) {
+        pthread_mutex_unlock(&filter->lock);
+        return(-1);
+    }
+    /* at least timeout since last seen: Update info and pass */
+    fptr->info.limit->last=now;
+    pthread_mutex_unlock(&filter->lock);
     return(0);
 }
 
@@ -193,6 +309,9 @@ void free_filter(sfilter_t *fptr)
             free(rptr);
         }
 
+    free_filter_index(fptr);
+    if (fptr->spec)
+        free(fptr->spec);
     free(fptr);
 }
 
@@ -218,7 +337,7 @@ void link_src_to_rule (struct srclist **list, struct srclist *src)
  */
 int isactive(sfilter_t *filter,senblk_t *sptr)
 {
-    time_t now=time(NULL);
+    time_t now=mono_ms()/1000;
     unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
     unsigned int src;
     char *cptr,*mptr;
@@ -232,25 +351,31 @@ int isactive(sfilter_t *filter,senblk_t *sptr)
 
     src = sptr->src & mask;
 
-    for(rule=filter->rules;rule;rule=rule->next) {
-        for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
-            if(*mptr && *cptr != *mptr)
+    if (filter->index)
+        rule=filter_lookup(filter,sptr->data+1,src);
+    else
+        for(rule=filter->rules;rule;rule=rule->next) {
+            for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
+                if(*mptr && *cptr != *mptr)
+                    break;
+            if (i == 5)
                 break;
-        if (i == 5)
-            break;
-    }
+        }
     if (!rule)
         return(1);
     for (last=0,rptr=rule->info.source;rptr;rptr=rptr->next) {
         if (rptr->src.id == src) {
-            rptr->lasttime = now;
-            if (last+rptr->failtime < now)
+            /* Engine threads may be handling different sources at once */
+            __atomic_store_n(&rptr->lasttime,now,__ATOMIC_RELAXED);
+            /* now counts from boot so may not yet exceed failtime: a last
+             * time of 0 means no preferred source has been seen */
+            if (last == 0 || last+rptr->failtime < now)
                 return(1);
             else
                 return(0);
         }
-        if (rptr->lasttime > last)
-            last = rptr->lasttime;
+        if (__atomic_load_n(&rptr->lasttime,__ATOMIC_RELAXED) > last)
+            last = __atomic_load_n(&rptr->lasttime,__ATOMIC_RELAXED);
     }
     return(0);
 }
@@ -286,7 +411,7 @@ int addfailover(sfilter_t **head,char *spec)
         free(newrule);
         return(-1);
     }
-    for (now=time(NULL),done=0;!done && *cptr;src=NULL,cptr++) {
+    for (now=mono_ms()/1000,done=0;!done && *cptr;src=NULL,cptr++) {
         if ((src=(struct srclist *)malloc(sizeof(struct srclist))) == NULL) {
             free(newrule);
             return(-1);
@@ -320,11 +445,16 @@ int addfailover(sfilter_t **head,char *spec)
                 (*head)->refcount=1;
                 pthread_mutex_init(&(*head)->lock,NULL);
                 (*head)->rules=NULL;
+                (*head)->index=NULL;
+                (*head)->spec=NULL;
+                memset((*head)->slot,0,sizeof((*head)->slot));
             }
         }
         if (*head) {
             newrule->next=(*head)->rules;
             (*head)->rules=newrule;
+            if (compile_filter(*head) < 0)
+                DEBUG(3,"Failed to index failover rules: using rule list");
             return(0);
         }
     }
@@ -345,220 +475,158 @@ int addfailover(sfilter_t **head,char *spec)
  */
 void iface_thread_exit(int ret)
 {
-    sigset_t set;
-
-    sigemptyset(&set);
-    sigaddset(&set,SIGUSR1);
-    pthread_sigmask(SIG_BLOCK,&set,NULL);
-
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
     pthread_exit((void *)&ret);
 }
 
 /*
- *  Initialise an ioqueue
- *  Args: iface_t to add queue to, size of queue (in senblk structures)
- *  Returns: 0 on success, -1 on failure
+ * Stop an interface's thread.  Threads are cancelled rather than signalled
+ * so that they exit only where they block (or otherwise reach a cancellation
+ * point) and never part way through updating shared state.  A thread which
+ * waits somewhere that isn't a cancellation point sets cancelfd so that it
+ * can be woken to notice
+ * Args: Interface
+ * Returns: Nothing
+ * io_mutex should be held
  */
-int init_q(iface_t *ifa, size_t size)
+void iface_cancel(iface_t *ifa)
 {
-    ioqueue_t *newq;
-    senblk_t *sptr;
-    int    i;
-    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
-        return(-1);
-    if ((newq->base=(senblk_t *)calloc(size,sizeof(senblk_t))) ==NULL) {
-        i=errno;
-        free(newq);
-        errno=i;
-        return(-1);
-    }
-
-    /* "base" always points to the allocated memory so that we can free() it.
-     * All senblks initially allocated to the free list
-     */
-    newq->free=newq->base;
+    int fd;
 
-    /* Initiailise senblk queue pointers */
-    for (i=0,sptr=newq->free,--size;i<size;++i,++sptr)
-        sptr->next=sptr+1;
-
-    sptr->next = NULL;
-
-    newq->qhead = newq->qtail = NULL;
-    newq->owner=ifa;
-
-    pthread_mutex_init(&newq->q_mutex,NULL);
-    pthread_cond_init(&newq->freshmeat,NULL);
-
-    newq->active=1;
-    ifa->q=newq;
-    return(0);
+    (void) pthread_cancel(ifa->tid);
+    if ((fd=__atomic_load_n(&ifa->cancelfd,__ATOMIC_ACQUIRE)) >= 0 &&
+            write(fd,"",1) < 0)
+        DEBUG(3,"%s: Failed to wake cancelled thread",ifa->name);
 }
 
 /*
- *  Copy information in a senblk structure (data and len only)
- *  Args: pointers to dest and source senblk structures
- *  Returns: pointer to dest senblk
+ * Fill in scheduling options which haven't been set from defaults
+ * Args: options to complete, defaults
+ * Returns: Nothing
  */
-senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
+void thread_inherit(struct thrattr *ta, const struct thrattr *def)
 {
-    dptr->len=sptr->len;
-    dptr->src=sptr->src;
-    dptr->next=NULL;
-    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
-            sptr->len);
+    if (ta->rtprio == 0)
+        ta->rtprio=def->rtprio;
+    if (ta->stacksize == 0)
+        ta->stacksize=def->stacksize;
+    if (!ta->hascpus) {
+        ta->hascpus=def->hascpus;
+        memcpy(ta->cpus,def->cpus,sizeof(ta->cpus));
+    }
 }
 
 /*
- * Add an senblk to an ioqueue
- * Args: Pointer to senblk and Pointer to queue it is to be added to
- * Returns: None
+ * Create a thread with scheduling options
+ * Args: pthread_t to fill in, scheduling options (NULL for defaults),
+ * function and argument as for pthread_create()
+ * Returns: 0 on success, error number otherwise
+ * If we aren't allowed real time scheduling the thread is created without it
+ * and a warning logged (once).  CPU affinity is set once the thread exists
+ * so that a CPU set the system can't honour costs only a warning
  */
-void push_senblk(senblk_t *sptr, ioqueue_t *q)
+int thread_create(pthread_t *tid, struct thrattr *ta, void *(*fn)(void *),
+        void *arg)
 {
-    senblk_t *tptr;
-
-    pthread_mutex_lock(&q->q_mutex);
+    static int warned=0;
+    pthread_attr_t attr;
+    struct sched_param sp;
+    long pagesize;
+    size_t stacksize;
+    int err;
+#ifdef __linux__
+    cpu_set_t set;
+    int cpu;
+#endif
 
-    if (sptr == NULL) {
-        /* NULL senblk pointer is magic "off" switch for a queue */
-        q->active = 0;
-    } else {
-        /* Get a senblk from the queue's free list if possible...*/
-        if (q->free) {
-            tptr=q->free;
-            q->free=q->free->next;
-        } else {
-            /* ...if not steal from the head of the queue, dropping previous
-               contents. */
-            tptr=q->qhead;
-            q->qhead=q->qhead->next;
-            if (q->drops < 0)
-                q->drops++;
-            DEBUG(4,"Dropped senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
-        }
-    
-        (void) senblk_copy(tptr,sptr);
-    
-        /* If there is anything on the queue already, set it's "next" member
-           to point to the new senblk */
-        if (q->qtail)
-            q->qtail->next=tptr;
-    
-        /* Set tail pointer to the new senblk */
-        q->qtail=tptr;
-    
-        /* queue head needs to point to new senblk if there was nothing
-           previously on the queue */
-        if (q->qhead == NULL)
-            q->qhead=tptr;
-    
+    if (ta == NULL || (ta->rtprio <= 0 && ta->stacksize == 0 && !ta->hascpus))
+        return(pthread_create(tid,NULL,fn,arg));
+
+    if ((err=pthread_attr_init(&attr)))
+        return(err);
+    if (ta->stacksize) {
+        /* Some systems insist on a whole number of pages */
+        pagesize=sysconf(_SC_PAGESIZE);
+        stacksize=ta->stacksize;
+        if (pagesize > 0 && stacksize % pagesize)
+            stacksize+=pagesize-stacksize%pagesize;
+        if ((err=pthread_attr_setstacksize(&attr,stacksize)))
+            logwarn("Could not set thread stack size %zu: %s",stacksize,
+                    strerror(err));
     }
-    pthread_cond_broadcast(&q->freshmeat);
-    pthread_mutex_unlock(&q->q_mutex);
-}
-
-/*
- *  Get the next senblk from the head of a queue
- *  Args: Queue to retrieve from
- *  Returns: Pointer to next senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
- */
-senblk_t *next_senblk(ioqueue_t *q)
-{
-    senblk_t *tptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
-        }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    if (ta->rtprio > 0) {
+        sp.sched_priority=ta->rtprio;
+        (void) pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+        (void) pthread_attr_setschedpolicy(&attr,SCHED_FIFO);
+        (void) pthread_attr_setschedparam(&attr,&sp);
     }
 
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
-}
-
-/*
- *  Get the last senblk from a queue, discarding all before it
- *  Args: Queue to retrieve from
- *  Returns: Pointer to last senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
- */
-senblk_t *last_senblk(ioqueue_t *q)
-{
-    senblk_t *tptr,*nptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-    /* Move all but last senblk on the queue to the free list */
-    if ((tptr=q->qhead) != NULL) {
-        for (nptr=tptr->next;nptr;tptr=nptr,nptr=nptr->next) {
-            tptr->next=q->free;
-            q->free=tptr;
-        }
-        q->qhead=tptr;
+    if ((err=pthread_create(tid,&attr,fn,arg)) == EPERM && ta->rtprio > 0) {
+        if (!(__atomic_fetch_or(&warned,1,__ATOMIC_RELAXED) & 1))
+            logwarn("Not permitted to use real time scheduling (rtprio): "
+                    "using normal scheduling");
+        (void) pthread_attr_setinheritsched(&attr,PTHREAD_INHERIT_SCHED);
+        err=pthread_create(tid,&attr,fn,arg);
     }
-
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
-        }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    pthread_attr_destroy(&attr);
+
+    if (err == 0 && ta->hascpus) {
+#ifdef __linux__
+        CPU_ZERO(&set);
+        for (cpu=0;cpu<MAXCPUS && cpu < CPU_SETSIZE;cpu++)
+            if (CPUISSET(cpu,ta->cpus))
+                CPU_SET(cpu,&set);
+        if ((cpu=pthread_setaffinity_np(*tid,sizeof(set),&set)) &&
+                !(__atomic_fetch_or(&warned,2,__ATOMIC_RELAXED) & 2))
+            logwarn("Could not set thread CPU affinity (cpus): %s",
+                    strerror(cpu));
+#else
+        if (!(__atomic_fetch_or(&warned,2,__ATOMIC_RELAXED) & 2))
+            logwarn("CPU affinity (cpus) is not supported on this system");
+#endif
     }
-
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
+    return(err);
 }
 
 /*
- * Flush a queue, returning anything on it to the free list
- * Args: Queue to be flushed
- * Returns: Nothing
- * Side Effect: Returns anything on the queue to the free list
+ * Create the thread which runs an interface
+ * Args: interface
+ * Returns: 0 on success, error number otherwise
  */
-void flush_queue(ioqueue_t *q)
+int iface_thread(iface_t *ifa)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    if (q->qhead != NULL) {
-        q->qtail->next = q->free;
-        q->free=q->qhead;
-        q->qhead=q->qtail=NULL;
-    }
-    pthread_mutex_unlock(&q->q_mutex);
+    pthread_t tid;
+
+    return(thread_create(&tid,&ifa->tattr,(void *(*)(void *)) start_interface,
+            (void *) ifa));
 }
 
 /*
- * Return a senblk to a queue's free list
- * Args: pointer to senblk, and pointer to the queue whose free list it is to
- * be added to
- * Returns: Nothing
+ * Work out the scheduling of an engine thread.  If there are at least as
+ * many CPUs in the engine CPU set as there are engines, each engine is pinned
+ * to its own CPU from the set, otherwise all share the set
+ * Args: engine data, engine index, options to fill in
+ * Returns: pointer to options to use
  */
-void senblk_free(senblk_t *sptr, ioqueue_t *q)
+static struct thrattr *engine_attr(struct if_engine *ifg, int idx,
+        struct thrattr *ta)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    /* Adding to head of free list is quicker than tail */
-    sptr->next = q->free;
-    q->free=sptr;
-    pthread_mutex_unlock(&q->q_mutex);
+    int cpu,n;
+
+    *ta=ifg->eattr;
+    if (!ta->hascpus || ifg->shards < 2)
+        return(ta);
+
+    for (cpu=0,n=0;cpu<MAXCPUS;cpu++)
+        if (CPUISSET(cpu,ta->cpus))
+            n++;
+    if (n < ifg->shards)
+        return(ta);
+
+    for (cpu=0;!CPUISSET(cpu,ta->cpus) || idx--;cpu++);
+    memset(ta->cpus,0,sizeof(ta->cpus));
+    CPUADD(cpu,ta->cpus);
+    return(ta);
 }
 
 iface_t *get_default_global()
@@ -566,19 +634,23 @@ iface_t *get_default_global()
     iface_t *ifp;
     struct if_engine *ifg;
 
-    if ((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL)
+    if ((ifp = iface_alloc()) == NULL)
         return(NULL);
 
-    memset((void *) ifp,0,sizeof(iface_t));
-
     ifp->type = GLOBAL;
     ifp->options = NULL;
     if ((ifg = (struct if_engine *)malloc(sizeof(struct if_engine))) == NULL) {
-        free(ifp);
+        pool_free(ifp);
         return(NULL);
     }
     ifg->flags=0;
     ifg->logto=LOG_DAEMON;
+    ifg->stats=NULL;
+    ifg->statsfmt=STATS_JSON;
+    ifg->shards=1;
+    ifg->shard=NULL;
+    ifg->dedup=NULL;
+    memset(&ifg->eattr,0,sizeof(ifg->eattr));
     ifp->strict=-1;
     ifp->checksum=0;
     ifp->info = (void *)ifg;
@@ -603,6 +675,9 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
         /* Query Sentence */
         if (sptr->data[7] == 'V') {
              sptr->len=sprintf(sptr->data,"$PKPXR,%s",VERSION);
+        } else if (sptr->data[7] == 'S') {
+            if (stats_query(sptr,eptr) < 0)
+                return -1;
         } else
             return -1;
         break;
@@ -621,67 +696,243 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
 }
 
 /*
- * This is the heart of the multiplexer.  All inputs add to the tail of the
- * Engine's queue.  The engine takes from the head of its queue and copies
- * to all outputs on its output list.
- * Args: Pointer to information structure (iface_t, cast to void)
+ * This is the heart of the multiplexer.  All inputs add to the tail of an
+ * Engine queue.  The engine takes from the head of its queue and passes
+ * a reference to the (shared, read-only) senblk to all outputs on its
+ * output list.  There may be several engine threads, each with its own
+ * queue: see engine_q().  Engines take no locks to find outputs, reading
+ * the array maintained by publish_outputs()
+ * Args: Pointer to engine shard structure (cast to void)
  * Returns: Nothing
  */
 void *run_engine(void *info)
 {
     senblk_t *sptr;
     iface_t *optr;
-    iface_t *eptr = (iface_t *)info;
+    struct eshard *shard = (struct eshard *)info;
+    iface_t *eptr = shard->engine;
+    sfilter_t *fptr;
+    struct outarray *oarr;
+    unsigned long gen,verdict;
+    struct dedup *dedup=((struct if_engine *) eptr->info)->dedup;
+    size_t i;
     int retval=0;
 
     (void) pthread_detach(pthread_self());
 
+    /* Generation 0 is never used so that new filters' slots don't match */
+    gen=0;
+
     for (;;) {
-        sptr = next_senblk(eptr->q);
+        sptr = next_senblk(shard->q);
 
         if (sptr==NULL)
             /* Queue has been marked inactive */
             break;
 
+        /* The engine holds the only reference to sptr until it is passed to
+         * outputs, so process_prop() may modify it in place */
         if (isprop(sptr)) {
             if (process_prop(sptr,eptr)) {
-                senblk_free(sptr,eptr->q);
+                senblk_free(sptr,shard->q);
                 continue;
             }
         }
 
+        /* Duplicates from redundant inputs are counted as filtered by the
+         * engine */
+        if (dedup && dedup_check(dedup,sptr)) {
+            __atomic_add_fetch(&eptr->stats.filtered,1,__ATOMIC_RELAXED);
+            senblk_free(sptr,shard->q);
+            continue;
+        }
+
         if (isactive(eptr->ofilter,sptr)) {
-            pthread_mutex_lock(&eptr->lists->io_mutex);
-            /* Traverse list of outputs and push a copy of senblk to each */
-            for (optr=eptr->lists->outputs;optr;optr=optr->next) {
+            /* Output filters are applied here rather than by outputs.  Many
+             * outputs may share a filter (e.g. connections to a tcp server)
+             * so each filter's verdict is worked out once per sentence.  The
+             * verdict is stored with the generation it applies to in this
+             * engine's own slot in the filter, so other engines using the
+             * same filter can't cause it to be worked out again (and get a
+             * different answer from a rate limit) during this fan-out */
+            gen++;
+            /* Let writers see we're using the output array before we load
+             * it.  See publish_outputs() */
+            __atomic_add_fetch(&shard->epoch,1,__ATOMIC_SEQ_CST);
+            oarr=__atomic_load_n(&eptr->lists->oarray,__ATOMIC_ACQUIRE);
+            /* Give each output a reference to senblk */
+            for (i=0;oarr && i<oarr->count;i++) {
+                if ((optr=__atomic_load_n(&oarr->ifs[i],__ATOMIC_RELAXED))
+                        == NULL)
+                    /* Removed since the array was published */
+                    continue;
                 if ((optr->q) && ((!sptr) ||
                         ((sptr->src != optr->id) || (flag_test(optr,F_LOOPBACK))))) {
-                    push_senblk(sptr,optr->q);
+                    if ((fptr=__atomic_load_n(&optr->ofilter,
+                            __ATOMIC_ACQUIRE))) {
+                        verdict=fptr->slot[shard->idx].verdict;
+                        if (verdict>>1 != gen) {
+                            verdict=gen<<1|(senfilter(sptr,fptr) != 0);
+                            fptr->slot[shard->idx].verdict=verdict;
+                        }
+                        if (verdict&1) {
+                            __atomic_add_fetch(&optr->stats.filtered,1,
+                                    __ATOMIC_RELAXED);
+                            continue;
+                        }
+                    }
+                    link_senblk(sptr,optr->q);
                 }
             }
-            pthread_mutex_unlock(&eptr->lists->io_mutex);
+            __atomic_add_fetch(&shard->epoch,1,__ATOMIC_RELEASE);
         }
-        senblk_free(sptr,eptr->q);
+        senblk_free(sptr,shard->q);
+    }
+
+    /* The last engine to stop switches off the outputs' queues so that they
+     * exit as soon as they have written what they hold rather than being
+     * cancelled when the shutdown grace period expires */
+    if (__atomic_sub_fetch(&((struct if_engine *) eptr->info)->running,1,
+            __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&eptr->lists->io_mutex);
+        for (optr=eptr->lists->outputs;optr;optr=optr->next)
+            if (optr->q)
+                push_senblk(NULL,optr->q);
+        pthread_mutex_unlock(&eptr->lists->io_mutex);
     }
     pthread_exit(&retval);
 }
 
+/*
+ * Find the engine queue an input should push to.  With more than one engine
+ * thread, inputs are spread between them by id.  All sentences from one
+ * source go through the same engine so they stay in order
+ * Args: iolists structure, id of input
+ * Returns: Pointer to engine queue
+ */
+ioqueue_t *engine_q(struct iolists *lists, unsigned long id)
+{
+    struct if_engine *ifg = (struct if_engine *) lists->engine->info;
+
+    if (ifg->shards <= 1)
+        return(lists->engine->q);
+    return(ifg->shard[(id^(id>>IDMINORBITS))%ifg->shards].q);
+}
+
+/*
+ * Shut down all the engine threads by marking their queues inactive
+ * Args: iolists structure
+ * Returns: Nothing
+ */
+void stop_engine(struct iolists *lists)
+{
+    struct if_engine *ifg = (struct if_engine *) lists->engine->info;
+    ioqueue_t *q;
+    unsigned int i;
+
+    for (i=0;i<ifg->shards;i++) {
+        q=ifg->shard[i].q;
+        pthread_mutex_lock(&q->q_mutex);
+        q->active=0;
+        pthread_cond_broadcast(&q->freshmeat);
+        pthread_mutex_unlock(&q->q_mutex);
+    }
+}
+
+/*
+ * Wait until no engine thread can still be using an output array which has
+ * been replaced or had entries removed.  Engines make their epoch odd while
+ * fanning out a sentence so only those caught doing so are waited for, and
+ * only until they finish that sentence
+ * Args: iolists structure
+ * Returns: Nothing
+ */
+static void sync_engines(struct iolists *lists)
+{
+    struct if_engine *ifg = (struct if_engine *) lists->engine->info;
+    unsigned long epoch;
+    unsigned int i;
+
+    /* Pairs with the engines' increment of their epoch before loading the
+     * array */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i=0;i<ifg->shards;i++) {
+        epoch=__atomic_load_n(&ifg->shard[i].epoch,__ATOMIC_ACQUIRE);
+        if (epoch & 1)
+            while (__atomic_load_n(&ifg->shard[i].epoch,__ATOMIC_ACQUIRE)
+                    == epoch)
+                sched_yield();
+    }
+}
+
+/*
+ * Publish a new array of outputs for engines to use from the output list.
+ * Called with io_mutex held after an output has been added to the list.
+ * Engines never block on this: the old array is only freed once no engine
+ * is using it
+ * Args: iolists structure
+ * Returns: 0 on success, -1 on failure (the current array is unchanged)
+ */
+int publish_outputs(struct iolists *lists)
+{
+    struct outarray *oarr,*old;
+    iface_t *optr;
+    size_t n;
+
+    for (n=0,optr=lists->outputs;optr;optr=optr->next,n++);
+    if ((oarr=(struct outarray *) malloc(sizeof(struct outarray)+
+            n*sizeof(iface_t *))) == NULL)
+        return(-1);
+    for (n=0,optr=lists->outputs;optr;optr=optr->next)
+        oarr->ifs[n++]=optr;
+    oarr->count=n;
+
+    old=lists->oarray;
+    __atomic_store_n(&lists->oarray,oarr,__ATOMIC_RELEASE);
+    if (old) {
+        sync_engines(lists);
+        free(old);
+    }
+    return(0);
+}
+
+/*
+ * Remove an output from the engines' output array.  Called with io_mutex
+ * held.  This needs no memory: the entry is cleared in place (engines skip
+ * cleared entries) and the array is compacted the next time one is published
+ * Args: iolists structure, output interface
+ * Returns: Nothing.  On return no engine can have a reference to the output
+ */
+static void retire_output(struct iolists *lists, iface_t *ifa)
+{
+    struct outarray *oarr=lists->oarray;
+    size_t i;
+
+    if (oarr == NULL)
+        return;
+    for (i=0;i<oarr->count;i++)
+        if (oarr->ifs[i] == ifa)
+            break;
+    if (i == oarr->count)
+        return;
+    __atomic_store_n(&oarr->ifs[i],NULL,__ATOMIC_RELAXED);
+    sync_engines(lists);
+}
+
 /*
  * Start processing an interface and add it to an iolist, input or output, 
  * depending on direction
  * Args: Pointer to interface structure (cast to void *)
  * Returns: Nothing
- * We should come into this with SIGUSR1 blocked
+ * Cancellation is deferred until the interface is fully linked in
  */
 void start_interface(void *ptr)
 {
     iface_t *ifa = (iface_t *)ptr;
     iface_t **lptr;
     iface_t **iptr;
-    sigset_t set;
 
-    sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
 
     pthread_mutex_lock(&ifa->lists->io_mutex);
     ifa->tid = pthread_self();
@@ -712,6 +963,13 @@ void start_interface(void *ptr)
     else
         ifa->next=NULL;
     (*lptr)=ifa;
+    if (ifa->direction != IN && publish_outputs(ifa->lists) < 0) {
+        logerr(errno,"Could not add %s to outputs",ifa->name);
+        if (ifa->lists->initialized == NULL)
+            pthread_cond_broadcast(&ifa->lists->init_cond);
+        pthread_mutex_unlock(&ifa->lists->io_mutex);
+        iface_thread_exit(errno);
+    }
 
     if (ifa->lists->initialized == NULL)
         pthread_cond_broadcast(&ifa->lists->init_cond);
@@ -720,7 +978,7 @@ void start_interface(void *ptr)
             pthread_cond_wait(&ifa->lists->init_cond,&ifa->lists->io_mutex);
 
     pthread_mutex_unlock(&ifa->lists->io_mutex);
-    pthread_sigmask(SIG_UNBLOCK,&set,NULL);
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
     if (ifa->direction == IN) {
         ifa->read(ifa);
     } else
@@ -756,14 +1014,24 @@ int link_to_initialized(iface_t *ifa)
  */
 void free_if_data(iface_t *ifa)
 {
-    if ((ifa->direction == OUT) && ifa->q) {
-        /* output interfaces have queues which need freeing */
-        free(ifa->q->base);
-        free(ifa->q);
+    if ((ifa->direction != IN) && ifa->q) {
+        /* output interfaces have queues which need freeing.  Reactor
+         * driven tcp servers may be bi-directional and have one */
+        free_q(ifa->q);
     }
 
     free_filter(ifa->ifilter);
     free_filter(ifa->ofilter);
+    free_filter(ifa->qprio);
+    lanes_free(&ifa->qlanes);
+
+    if (ifa->parser) {
+        parser_release(ifa->parser);
+        free(ifa->parser);
+    }
+
+    if (ifa->conf)
+        free(ifa->conf);
 
     if (ifa->info) {
         if (ifa->cleanup)
@@ -780,14 +1048,31 @@ void free_if_data(iface_t *ifa)
             pthread_mutex_unlock(&ifa->pair->q->q_mutex);
         } else {
             if (ifa->pair->tid)
-                pthread_kill(ifa->pair->tid,SIGUSR1);
+                iface_cancel(ifa->pair);
             else
                 ifa->pair->direction = NONE;
         }
-    } else
-        if (ifa->name && !(ifa->id & IDMINORMASK)) {
-            free(ifa->name);
-       }
+    }
+}
+
+/*
+ * Shut down if nothing more can be read: there are no inputs left, nor
+ * bi-directional outputs.  Called with io_mutex held
+ * Args: iolists structure
+ * Returns: Nothing
+ */
+void check_inputs(struct iolists *lists)
+{
+    iface_t *tptr;
+
+    if (lists->inputs)
+        return;
+    for(tptr=lists->outputs;tptr;tptr=tptr->next)
+        if (tptr->direction == BOTH)
+            return;
+    stop_engine(lists);
+    if (timetodie == 0)
+        timetodie++;
 }
 
 /*
@@ -815,21 +1100,13 @@ int unlink_interface(iface_t *ifa)
             for (tptr=(*lptr);tptr->next != ifa;tptr=tptr->next);
             tptr->next = ifa->next;
         }
+        /* Engines must be finished with the output before its queue can
+         * be freed */
+        if (ifa->direction != IN)
+            retire_output(ifa->lists,ifa);
     
-        if (ifa->direction != OUT)
-            if (!ifa->lists->inputs) {
-                for(tptr=ifa->lists->outputs;tptr;tptr=tptr->next)
-                    if (tptr->direction == BOTH)
-                        break;
-                if (tptr == NULL) {
-                    pthread_mutex_lock(&ifa->lists->engine->q->q_mutex);
-                    ifa->lists->engine->q->active=0;
-                    pthread_cond_broadcast(&ifa->lists->engine->q->freshmeat);
-                    pthread_mutex_unlock(&ifa->lists->engine->q->q_mutex);
-                    if (timetodie == 0)
-                        timetodie++;
-                }
-            }
+        if (ifa->direction != OUT && !ifa->lists->reloading)
+            check_inputs(ifa->lists);
     }
 
     free_if_data(ifa);
@@ -858,20 +1135,19 @@ void iface_destroy(void *ifptr)
     DEBUG(3,"Cleaning up data for exiting %s %s %s id %x",
             (ifa->direction == IN)?"input":"output",(ifa->id & IDMINORBITS)?
             "connection":"interface",ifa->name,ifa->id);
-    sigset_t set,saved;
-    sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
-    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    int state;
+
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&state);
     pthread_mutex_lock(&ifa->lists->io_mutex);
     if (ifa->tid) {
         unlink_interface(ifa);
-        /* Signal the reaper thread */
-        (void) pthread_kill(reaper,SIGUSR2);
+        /* Wake the reaper */
+        pthread_cond_signal(&ifa->lists->dead_cond);
     } else
         free_if_data(ifa);
 
     pthread_mutex_unlock(&ifa->lists->io_mutex);
-    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    (void) pthread_setcancelstate(state,NULL);
 }
 
 /*
@@ -890,6 +1166,59 @@ sfilter_t *addfilter(sfilter_t *filter)
     return(filter);
 }
 
+/*
+ * Take a reference to the filter an interface has in a slot which may be
+ * changed by a configuration reload
+ * Args: address of interface's filter pointer
+ * Returns: pointer to filter (NULL if none)
+ */
+sfilter_t *filter_get(sfilter_t **slot)
+{
+    sfilter_t *filter;
+
+    pthread_mutex_lock(&filter_mutex);
+    filter=addfilter(*slot);
+    pthread_mutex_unlock(&filter_mutex);
+    return(filter);
+}
+
+/*
+ * Replace the filter in a slot read with filter_get()
+ * Args: address of interface's filter pointer, new filter (a reference is
+ * added to it)
+ * Returns: the reference to the old filter, for the caller to free when
+ * nothing can still be using it
+ */
+sfilter_t *filter_swap(sfilter_t **slot, sfilter_t *filter)
+{
+    sfilter_t *old;
+
+    filter=addfilter(filter);
+    pthread_mutex_lock(&filter_mutex);
+    old=*slot;
+    __atomic_store_n(slot,filter,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&filter_mutex);
+    return(old);
+}
+
+/*
+ * Give a running interface a new input or output filter.  Called with
+ * io_mutex held.  Sentences are never dropped for want of a filter: the
+ * interface's parsers change to a new input filter between reads and an old
+ * output filter is only released once no engine can be applying it
+ * Args: interface, address of its filter pointer to be replaced, new filter
+ * Returns: Nothing
+ */
+void iface_refilter(iface_t *ifa, sfilter_t **slot, sfilter_t *filter)
+{
+    sfilter_t *old;
+
+    old=filter_swap(slot,filter);
+    if (old && slot == &ifa->ofilter && ifa->direction != IN)
+        sync_engines(ifa->lists);
+    free_filter(old);
+}
+
 /*
  * Duplicate an interface
  * Used when creating IN/OUT pair for bidirectional communication
@@ -900,11 +1229,11 @@ iface_t *ifdup (iface_t *ifa)
 {
     iface_t *newif;
 
-    if ((newif=(iface_t *) malloc(sizeof(iface_t))) == (iface_t *) NULL)
+    if ((newif=iface_alloc()) == (iface_t *) NULL)
         return(NULL);
     if (iftypes[ifa->type].ifdup_func) {
         if ((newif->info=(*iftypes[ifa->type].ifdup_func)(ifa->info)) == NULL) {
-            free(newif);
+            pool_free(newif);
             return(NULL);
         }
     } else
@@ -924,13 +1253,37 @@ iface_t *ifdup (iface_t *ifa)
     newif->write=ifa->write;
     newif->cleanup=ifa->cleanup;
     newif->options=NULL;
-    newif->ifilter=addfilter(ifa->ifilter);
-    newif->ofilter=addfilter(ifa->ofilter);
+    newif->parser=NULL;
+    newif->ifilter=filter_get(&ifa->ifilter);
+    newif->ofilter=filter_get(&ifa->ofilter);
+    newif->qpolicy=ifa->qpolicy;
+    newif->qmax=ifa->qmax;
+    newif->qprio=addfilter(ifa->qprio);
+    lanes_copy(&newif->qlanes,&ifa->qlanes);
+    newif->qcompact=ifa->qcompact;
     newif->checksum=ifa->checksum;
     newif->strict=ifa->strict;
+    newif->tattr=ifa->tattr;
     return(newif);
 }
 
+/*
+ * Allocate a zeroed interface structure
+ * Args: None
+ * Returns: pointer to new interface or NULL on failure
+ * Interfaces are pooled (see pool.c) and are charged with their own memory
+ */
+iface_t *iface_alloc(void)
+{
+    iface_t *ifa;
+
+    if ((ifa=(iface_t *) pool_alloc(sizeof(iface_t),NULL)) == NULL)
+        return(NULL);
+    ifa->mem=pool_size(sizeof(iface_t));
+    ifa->cancelfd=-1;
+    return(ifa);
+}
+
 /*
  * Return the path to the kplex config file
  * Args: None
@@ -1083,11 +1436,59 @@ int name2id(sfilter_t *filter)
     return(0);
 }
 
+/*
+ * Convert interface names to IDs in priority lane filters
+ * Args: Pointer to lane options
+ * Returns: -1 on failure, 0 on success
+ */
+int lanes_name2id(struct laneconf *lc)
+{
+    int i;
+
+    for (i=0;i<MAXLANES-1;i++)
+        if (name2id(lc->match[i]))
+            return(-1);
+    return(0);
+}
+
+/*
+ * Copy priority lane options, adding references to their filters
+ * Args: Pointers to destination and source lane options
+ * Returns: Nothing
+ */
+void lanes_copy(struct laneconf *dst, const struct laneconf *src)
+{
+    int i;
+
+    *dst=*src;
+    for (i=0;i<MAXLANES-1;i++)
+        dst->match[i]=addfilter(src->match[i]);
+}
+
+/*
+ * Release the filters of priority lane options
+ * Args: Pointer to lane options
+ * Returns: Nothing
+ */
+void lanes_free(struct laneconf *lc)
+{
+    int i;
+
+    for (i=0;i<MAXLANES-1;i++) {
+        free_filter(lc->match[i]);
+        lc->match[i]=NULL;
+    }
+}
+
 int proc_engine_options(iface_t *e_info,struct kopts *options)
 {
     struct kopts *optr;
-    size_t qsize=DEFQSIZE;
+    size_t qsize=DEFQSIZE,ddsize=0;
     struct if_engine *ifg = (struct if_engine *) e_info->info;
+    off_t limit;
+    long ddwin=0;
+    char *eptr;
+    int n;
 
     if (e_info->options) {
         for (optr=e_info->options;optr->next;optr=optr->next);
@@ -1145,6 +1546,73 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 fprintf(stderr,"Strict option must be either \'yes\' or \'no\'\n");
                 exit(1);
             }
+        } else if (!strcasecmp(optr->var,"qtype")) {
+            if (!strcasecmp(optr->val,"lockfree"))
+                lockfreeq=1;
+            else if (!strcasecmp(optr->val,"mutex"))
+                lockfreeq=0;
+            else {
+                fprintf(stderr,"qtype option must be either \'mutex\' or \'lockfree\'\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"stats")) {
+            if (ifg->stats)
+                free(ifg->stats);
+            if ((ifg->stats=strdup(optr->val)) == NULL) {
+                perror("failed to allocate memory");
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"statsformat")) {
+            if (!strcasecmp(optr->val,"json"))
+                ifg->statsfmt=STATS_JSON;
+            else if (!strcasecmp(optr->val,"prometheus"))
+                ifg->statsfmt=STATS_PROMETHEUS;
+            else {
+                fprintf(stderr,"statsformat option must be either \'json\' or \'prometheus\'\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"engines")) {
+            if ((n=atoi(optr->val)) <= 0 || n > MAXENGINES) {
+                fprintf(stderr,"engines must be between 1 and %d\n",
+                        MAXENGINES);
+                exit(1);
+            }
+            ifg->shards=n;
+        } else if (!strncasecmp(optr->var,"engine",6) &&
+                (n=thread_opt(&ifg->eattr,optr->var+6,optr->val)) <= 0) {
+            if (n < 0) {
+                fprintf(stderr,"Bad value for %s: %s\n",optr->var,optr->val);
+                exit(1);
+            }
+        } else if ((n=thread_opt(&e_info->tattr,optr->var,optr->val)) <= 0 ||
+                (n=lane_opt(&e_info->qlanes,optr->var,optr->val)) <= 0) {
+            /* Interface thread defaults or lanes for the engine's queues
+             * given on the command line */
+            if (n < 0) {
+                fprintf(stderr,"Bad value for %s: %s\n",optr->var,optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"dedup")) {
+            if (!strcasecmp(optr->val,"no"))
+                ddwin=0;
+            else if ((ddwin=strtol(optr->val,&eptr,10)) <= 0 || *eptr ||
+                    ddwin > MAXDEDUP) {
+                fprintf(stderr,"dedup must be \'no\' or between 1 and %d ms\n",
+                        MAXDEDUP);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"dedupsize")) {
+            if ((n=atoi(optr->val)) <= 0) {
+                fprintf(stderr,"Invalid dedupsize: %s\n",optr->val);
+                exit(1);
+            }
+            ddsize=n;
+        } else if (!strcasecmp(optr->var,"memlimit")) {
+            if (parse_size(optr->val,&limit) < 0) {
+                fprintf(stderr,"Invalid memlimit: %s\n",optr->val);
+                exit(1);
+            }
+            pool_setlimit((size_t) limit);
         } else if (!strcasecmp(optr->var,"failover")) {
             if (addfailover(&e_info->ofilter,optr->val) != 0) {
                 fprintf(stderr,"Failed to add failover %s\n",optr->val);
@@ -1155,65 +1623,173 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
             exit(0);
         }
     }
+    thread_inherit(&ifg->eattr,&e_info->tattr);
+
+    if (ddwin && (ifg->dedup=dedup_init(ddwin,ddsize,ifg->shards > 1))
+            == NULL) {
+        perror("failed to create dedup table");
+        exit(1);
+    }
 
-    if (init_q(e_info, qsize) < 0) {
-        perror("failed to initiate queue");
+    if ((ifg->shard=(struct eshard *) calloc(ifg->shards,
+            sizeof(struct eshard))) == NULL) {
+        perror("failed to allocate memory");
         exit(1);
     }
+    for (n=0;n<ifg->shards;n++) {
+        if (init_q(e_info, qsize) < 0) {
+            perror("failed to initiate queue");
+            exit(1);
+        }
+        ifg->shard[n].engine=e_info;
+        ifg->shard[n].q=e_info->q;
+        ifg->shard[n].idx=n;
+    }
+    e_info->q=ifg->shard[0].q;
     return(0);
 }
 
 int calcsum(const char *buf, size_t len)
 {
-    int c = 0;
+    return((char) xorsum(buf,len));
+}
+
+/*
+ * Format the s: field of an interface's tag blocks if the name it uses has
+ * changed
+ * Args: Interface and senblk being tagged
+ * Returns: Pointer to the name the field is made from
+ */
+static const char *tag_srcfield(iface_t *ifa, senblk_t *sptr)
+{
+    struct tagfmt *tf=&ifa->tagfmt;
+    const char *nameptr;
+    size_t len;
+
+    if (ifa->tagflags & TAG_ISRC) {
+        /* Inputs rarely change between successive sentences, so only look
+         * up the source when it does */
+        if (tf->srcname && tf->srcid == (sptr->src&~IDMINORMASK))
+            return(tf->srcname);
+        tf->srcid=sptr->src&~IDMINORMASK;
+        if (((nameptr=idlookup(sptr->src))==NULL) || (*nameptr == '_'))
+            nameptr=DEFSRCNAME;
+    } else {
+        nameptr=(*ifa->name=='_')?DEFSRCNAME:ifa->name;
+        if (nameptr == tf->srcname)
+            return(nameptr);
+        tf->srcid=(unsigned long) -1;
+    }
 
-    for (;len;len--)
-        c ^=*buf++;
+    tf->srcname=nameptr;
+    memcpy(tf->sfield,"s:",2);
+    for (len=0;nameptr[len] && len < TAGNAMEMAX; len++)
+        tf->sfield[2+len]=nameptr[len];
+    tf->slen=len+2;
+    tf->scks=calcsum(tf->sfield,tf->slen);
+    return(nameptr);
+}
+
+/*
+ * Format a tag block
+ * Args: Interface, buffer of at least TAGMAX bytes, time (seconds and
+ * microseconds) if the tag block has a c: field
+ * Returns: Length of tag block
+ */
+static size_t tag_format(iface_t *ifa, char *buf, time_t sec, long usec)
+{
+    static const char hex[]="0123456789ABCDEF";
+    struct tagfmt *tf=&ifa->tagfmt;
+    unsigned char cksum=0;
+    char *ptr=buf;
+    unsigned long v;
+    int i;
+
+    *ptr++='\\';
+    if (ifa->tagflags & TAG_SRC) {
+        memcpy(ptr,tf->sfield,tf->slen);
+        ptr+=tf->slen;
+        cksum=tf->scks;
+    }
+
+    if (ifa->tagflags & TAG_TS) {
+        if (ifa->tagflags & TAG_SRC) {
+            *ptr++=',';
+            cksum^=',';
+        }
+        /* The seconds part only changes once a second */
+        if (sec != tf->sec || tf->cfield[0] != 'c') {
+            memcpy(tf->cfield,"c:",2);
+            for (v=(unsigned) sec,i=11;i>=2;i--,v/=10)
+                tf->cfield[i]='0'+v%10;
+            tf->ccks=calcsum(tf->cfield,sizeof(tf->cfield));
+            tf->sec=sec;
+        }
+        memcpy(ptr,tf->cfield,sizeof(tf->cfield));
+        ptr+=sizeof(tf->cfield);
+        cksum^=tf->ccks;
+        if (ifa->tagflags & TAG_MS) {
+            v=(unsigned) usec/1000;
+            *ptr++='0'+v/100;
+            *ptr++='0'+(v/10)%10;
+            *ptr++='0'+v%10;
+            cksum^=ptr[-3]^ptr[-2]^ptr[-1];
+        }
+    }
 
-    return c;
+    *ptr++='*';
+    *ptr++=hex[cksum>>4];
+    *ptr++=hex[cksum&0xf];
+    *ptr++='\\';
+    return(ptr-buf);
 }
 
 /* Add tag data
- * Args: Interface pointer, buffer for tags
+ * Args: Interface pointer, buffer for tags (at least TAGMAX bytes)
  * Returns: Length of tag buffer on success
+ * Outputs with the same tag settings and name (e.g. connections to a tcp
+ * server) generate identical tag blocks for a sentence if they write it in
+ * the same second (or millisecond).  The first tag block made for a senblk
+ * is kept with it and copied by any output for which it would be identical.
+ * A senblk only has room for one so outputs with different settings make
+ * their own
  */
 size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
 {
-    char *ptr=buf;
-    char *nameptr;
-    int first=1;
+    const char *nameptr=NULL;
     struct timeval tv;
-    unsigned char cksum;
+    long long key=0;
     size_t len;
+    int state;
 
-    *ptr++='\\';
-    if (ifa->tagflags & TAG_SRC){
-        first=0;
-        memcpy(ptr,"s:",2);
-        ptr+=2;
-        if (ifa->tagflags & TAG_ISRC) {
-            if (((nameptr=idlookup(sptr->src))==NULL) || (*nameptr == '_'))
-                nameptr=DEFSRCNAME;
-        } else
-            nameptr=(*ifa->name=='_')?DEFSRCNAME:ifa->name;
+    if (ifa->tagflags & TAG_SRC)
+        nameptr=tag_srcfield(ifa,sptr);
+    if (ifa->tagflags & TAG_TS) {
+        (void) gettimeofday(&tv,NULL);
+        key=(ifa->tagflags & TAG_MS)?
+                (long long) tv.tv_sec*1000+tv.tv_usec/1000:tv.tv_sec;
+    } else
+        tv.tv_sec=tv.tv_usec=0;
 
-        for (len=0;*nameptr && len < 15; len++)
-            *ptr++=*nameptr++;
+    if ((state=__atomic_load_n(&sptr->tagstate,__ATOMIC_ACQUIRE)) ==
+            TAGC_READY && sptr->tagflags == ifa->tagflags &&
+            sptr->tagname == nameptr && sptr->tagtime == key) {
+        memcpy(buf,sptr->tag,sptr->taglen);
+        return(sptr->taglen);
     }
 
-    if (ifa->tagflags & TAG_TS) {
-        if (!first)
-            *ptr++=',';
-        memcpy(ptr,"c:",2);
-        ptr+=2;
-        (void) gettimeofday(&tv,NULL);
-        ptr+=sprintf(ptr,"%010u",(unsigned) tv.tv_sec);
-        if (ifa->tagflags & TAG_MS)
-            ptr += sprintf(ptr,"%03u",((unsigned) tv.tv_usec)/1000);
+    len=tag_format(ifa,buf,tv.tv_sec,tv.tv_usec);
+
+    /* Offer this tag block to other outputs if nobody got there first */
+    if (state == TAGC_EMPTY && __atomic_compare_exchange_n(&sptr->tagstate,
+            &state,TAGC_BUSY,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+        sptr->tagflags=ifa->tagflags;
+        sptr->tagname=nameptr;
+        sptr->tagtime=key;
+        sptr->taglen=len;
+        memcpy(sptr->tag,buf,len);
+        __atomic_store_n(&sptr->tagstate,TAGC_READY,__ATOMIC_RELEASE);
     }
-    /* Don't include initial '/' */
-    cksum=calcsum(buf+1,(len=ptr-buf)-1);
-    len+=sprintf(ptr,"*%02X\\",cksum);
     return(len);
 }
 
@@ -1223,97 +1799,87 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
  */ 
 void do_read(iface_t *ifa)
 {
-    senblk_t sblk;
+    struct nmea_parser *parser;
     char buf[BUFSIZ];
-    char tbuf[TAGMAX];
-    char *bptr,*eptr,*ptr;
-    int nread,countmax,count=0;
-    enum sstate senstate;
-    int nocr=flag_test(ifa,F_NOCR)?1:0;
-    int loose = (ifa->strict)?0:1;
-    sblk.src=ifa->id;
-    senstate=SEN_NODATA;
-
-    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
-        for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
-            switch (*bptr) {
-            case '$':
-            case '!':
-                ptr=sblk.data;
-                countmax=SENMAX-(nocr|loose);
-                count=1;
-                *ptr++=*bptr;
-                senstate=SEN_SENPROC;
-                continue;
-            case '\\':
-                if (senstate==SEN_TAGPROC) {
-                    *ptr++=*bptr;
-                    senstate=SEN_TAGSEEN;
-                } else {
-                    senstate=SEN_TAGPROC;
-                    ptr=tbuf;
-                    countmax=TAGMAX-1;
-                    *ptr++=*bptr;
-                    count=1;
-                }
-                continue;
-            case '\r':
-            case '\n':
-            case '\0':
-                if (senstate == SEN_SENPROC || senstate == SEN_TAGSEEN) {
-                    if (loose || (nocr && *bptr == '\n')) {
-                        *ptr++='\r';
-                        *ptr='\n';
-                        sblk.len = count+2;
-                    } else {
-                        if ((!nocr) && *bptr == '\r') {
-                            senstate = SEN_CR;
-                            *ptr++=*bptr;
-                            ++count;
-                        } else {
-                            senstate = SEN_NODATA;
-                        }
-                        continue;
-                    }
-                } else if (senstate == SEN_CR) {
-                    if (*bptr != '\n') {
-                        senstate = SEN_NODATA;
-                        continue;
-                    }
-                    *ptr=*bptr;
-                    sblk.len = ++count;
-                } else {
-                    senstate = SEN_NODATA;
-                    continue;
-                }
-                /* If we're not checksumming OR the checksum is correct OR
-                 * it's a zero length packet, the first clause is false which
-                 * is true when negated...*/
-                if (!(ifa->checksum && checkcksum(&sblk) && (sblk.len > 0 )) &&
-                        senfilter(&sblk,ifa->ifilter) == 0) {
-                    push_senblk(&sblk,ifa->q);
-                }
-                senstate=SEN_NODATA;
-                continue;
-            default:
-                break;
-            }
+    int nread;
 
-            if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
-                if (senstate != SEN_NODATA )
-                    senstate=SEN_NODATA;
-                continue;
-            }
+    if ((parser=parser_attach(ifa)) == NULL) {
+        logerr(errno,"%s: Could not allocate parser",ifa->name);
+        iface_thread_exit(errno);
+    }
 
-            if (count++ > countmax) {
-                senstate=SEN_NODATA;
-                continue;
-            }
+    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0)
+        parse_nmea(parser,buf,nread);
 
-            *ptr++=*bptr;
+    iface_thread_exit(errno);
+}
+
+/*
+ * Handle a "uring" option for an interface which can read with ring_read()
+ * Args: interface, its ring state and the option value
+ * Returns: 0 on success, -1 if the value is invalid
+ */
+int ring_opt(iface_t *ifa, struct ifring *ring, const char *val)
+{
+    if (!strcasecmp(val,"yes"))
+        ring->want=1;
+    else if (!strcasecmp(val,"no"))
+        ring->want=0;
+    else {
+        logerr(0,"Invalid option \"uring=%s\"",val);
+        return(-1);
+    }
+#ifndef KPLEX_IOURING
+    if (ring->want)
+        logwarn("%s: kplex was not built with io_uring support: not using it",
+                ifa->name);
+    ring->want=0;
+#endif
+    return(0);
+}
+
+/*
+ * Read an input's descriptor, through an io_uring owned by the calling
+ * thread if "uring=yes" was given.  The ring is set up on the first call
+ * and, if that fails, read() is used instead
+ * Args: interface, its ring state, descriptor and buffer of BUFSIZ bytes
+ * Returns: as for read()
+ */
+ssize_t ring_read(iface_t *ifa, struct ifring *ring, int fd, char *buf)
+{
+#ifdef KPLEX_IOURING
+    if (ring->want && ring->rd == NULL) {
+        if ((ring->rd=uring_rd_init(fd)) == NULL) {
+            logwarn("%s: Could not set up io_uring (%s): not using it",
+                    ifa->name,strerror(errno));
+            ring->want=0;
+        } else {
+            DEBUG(3,"%s: reading with io_uring",ifa->name);
+            /* io_uring_enter() isn't a cancellation point */
+            __atomic_store_n(&ifa->cancelfd,ring->rd->wake[1],
+                    __ATOMIC_RELEASE);
         }
     }
-    iface_thread_exit(errno);
+    if (ring->rd)
+        return(uring_rd_read(ring->rd,fd,buf,BUFSIZ));
+#endif
+    return(read(fd,buf,BUFSIZ));
+}
+
+/*
+ * Free an interface's io_uring read state
+ * Args: interface, its ring state
+ * Returns: Nothing
+ */
+void ring_free(iface_t *ifa, struct ifring *ring)
+{
+#ifdef KPLEX_IOURING
+    if (ring->rd) {
+        ifa->cancelfd=-1;
+        uring_rd_free(ring->rd);
+        ring->rd=NULL;
+    }
+#endif
 }
 
 /* Make an interface name based on file type and index
@@ -1353,7 +1919,145 @@ char * mkname(iface_t *ifa, unsigned int i)
     return(strdup(nambuf));
 }        
 
-    
+/*
+ * Give a newly configured interface an id, and a name if it doesn't have one
+ * Args: interface
+ * Returns: 0 on success, -1 on failure
+ */
+int iface_assign(iface_t *ifa)
+{
+    if (nifaces == MAXINTERFACES) {
+        logerr(0,"Too many interfaces");
+        return(-1);
+    }
+    ifa->id=++nifaces<<IDMINORBITS;
+    if (!ifa->name && !(ifa->name=mkname(ifa,nifaces))) {
+        logerr(errno,"Failed to make interface name");
+        return(-1);
+    }
+    if (insertname(ifa->name,ifa->id) < 0) {
+        logerr(errno,"Failed to associate interface name and id");
+        return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Initialise an interface which has been given an id and name.  Bi-directional
+ * interfaces may be initialised as an IN/OUT pair
+ * Args: interface, iolists structure
+ * Returns: the interface, linked to its pair (if any) through next, or NULL
+ * on failure
+ */
+iface_t *init_iface(iface_t *ifa, struct iolists *lists)
+{
+    iface_t *engine=lists->engine;
+    iface_t *ifptr,*next=ifa->next;
+    char *name;
+
+    /* Use the name table's copy of the name, which outlasts the interface
+     * and any connections sharing its name */
+    if ((name=idlookup(ifa->id)) && name != ifa->name) {
+        free(ifa->name);
+        ifa->name=name;
+    }
+    ifa->lists = lists;
+
+    if ((*iftypes[ifa->type].init_func)(ifa) == NULL) {
+        logerr(0,"Failed to initialize Interface %s",(ifa->name)?
+                ifa->name:"(unnamed)");
+        return(NULL);
+    }
+    for (ifptr=ifa;ifptr;ifptr = ifptr->next) {
+    /* This loop should be done once for IN or OUT interfaces twice for
+     * interfaces where the initialisation routine has expanded them to an
+     * IN/OUT pair.
+     */
+        if (ifptr->direction == IN)
+            ifptr->q=engine_q(lists,ifptr->id);
+
+        thread_inherit(&ifptr->tattr,&engine->tattr);
+        if (ifptr->checksum <0)
+            ifptr->checksum = engine->checksum;
+        if (ifptr->strict <0) {
+            if (engine->strict >= 0) {
+                ifptr->strict = engine->strict;
+            } else {
+                ifptr->strict = (ifptr->type == FILEIO)?0:1;
+            }
+        }
+        if (ifptr->next==next)
+            ifptr->next=NULL;
+    }
+    return(ifa);
+}
+
+/*
+ * Join the threads of interfaces on the dead list and free them.  Called
+ * with io_mutex held
+ * Args: iolists structure
+ * Returns: Nothing
+ */
+void reap_dead(struct iolists *lists)
+{
+    iface_t *ifptr;
+    void *ret;
+
+    for (ifptr=lists->dead;ifptr;ifptr=lists->dead) {
+        lists->dead=ifptr->next;
+        pthread_join(ifptr->tid,&ret);
+        pool_free(ifptr);
+    }
+}
+
+/*
+ * Wait for user shutdown requests (SIGTERM or SIGINT) and reload requests
+ * (SIGHUP), which are blocked in all other threads, and pass them on to the
+ * reaper
+ * Args: Pointer to iolists (cast to void *)
+ * Returns: Nothing (doesn't)
+ */
+static void *sig_thread(void *arg)
+{
+    struct iolists *lists = (struct iolists *) arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set,SIGTERM);
+    sigaddset(&set,SIGINT);
+    sigaddset(&set,SIGHUP);
+    for (;;) {
+        if (sigwait(&set,&sig))
+            continue;
+        pthread_mutex_lock(&lists->io_mutex);
+        if (sig == SIGHUP)
+            reloadreq=1;
+        /* Once we've caught a user shutdown request we don't need to be
+         * told twice */
+        else if (timetodie == 0)
+            timetodie++;
+        pthread_cond_signal(&lists->dead_cond);
+        pthread_mutex_unlock(&lists->io_mutex);
+    }
+    return(NULL);
+}
+
+/*
+ * Timer callback marking the end of the shutdown grace period
+ * Args: Pointer to iolists (cast to void *)
+ * Returns: Nothing
+ */
+static void grace_expired(void *arg)
+{
+    struct iolists *lists = (struct iolists *) arg;
+
+    pthread_mutex_lock(&lists->io_mutex);
+    graceover=1;
+    pthread_cond_signal(&lists->dead_cond);
+    pthread_mutex_unlock(&lists->io_mutex);
+}
+
 int main(int argc, char ** argv)
 {
     char *tmpbuf;
@@ -1364,11 +2068,10 @@ int main(int argc, char ** argv)
     char *pidfile=NULL;
     iface_t  *engine;
     struct if_engine *ifg;
-    iface_t *ifptr,*ifptr2,*rptr;
+    iface_t *ifptr,*ifptr2;
     iface_t **tiptr;
     unsigned int i=1;
-    int opt,err=0;
-    void *ret;
+    int opt,err=0,autoname;
     struct kopts *options=NULL;
     sigset_t set,oset;
     struct iolists lists = {
@@ -1379,13 +2082,14 @@ int main(int argc, char ** argv)
     .initialized = NULL,
     .outputs = NULL,
     .inputs = NULL,
-    .dead = NULL
+    .dead = NULL,
+    .oarray = NULL
     };
     struct rlimit lim;
     struct flock *fl;
     int gotinputs=0;
     int rcvdsig;
-    struct sigaction sa;
+    struct thrattr tattr;
 
     pthread_mutex_init(&lists.io_mutex,NULL);
 
@@ -1443,16 +2147,17 @@ int main(int argc, char ** argv)
     if ((config && (strcmp(config,"-"))) ||
             (!config && (config = get_def_config()))) {
         DEBUG(1,"Using config file %s",config);
-        if ((engine=parse_file(config)) == NULL) {
-            fprintf(stderr,"Error parsing config file: %s\n",errno?
-                    strerror(errno):"Syntax Error");
+        if ((engine=parse_file(config)) == NULL)
             exit(1);
-        }
+        /* Reloads must find the file after we've changed directory */
+        if ((tmpbuf=realpath(config,NULL)) != NULL)
+            config=tmpbuf;
     } else {
         /* global options for engine configuration are also returned in config
          * file parsing. If we didn't do that, get default options here */
         DEBUG(1,"Not using config file");
         engine = get_default_global();
+        config=NULL;
     }
 
     proc_engine_options(engine,options);
@@ -1595,25 +2300,14 @@ int main(int argc, char ** argv)
      * are initialised to one IN and one OUT which then need to be linked back
      * into the list
      */
-    for (ifptr=engine->next,tiptr=&lists.initialized,i=0;ifptr;ifptr=ifptr2) {
+    for (ifptr=engine->next,tiptr=&lists.initialized;ifptr;ifptr=ifptr2) {
         ifptr2 = ifptr->next;
+        autoname=(ifptr->name == NULL);
 
-        if (i == MAXINTERFACES)
-            logterm(0,"Too many interfaces");
-        ifptr->id=++i<<IDMINORBITS;
-        if (!ifptr->name) {
-            if (!(ifptr->name=mkname(ifptr,i)))
-                logterm(errno,"Failed to make interface name");
-        }
-
-        if (insertname(ifptr->name,ifptr->id) < 0)
-            logterm(errno,"Failed to associate interface name and id");
-
-        ifptr->lists = &lists;
+        if (iface_assign(ifptr) < 0)
+            exit(1);
 
-        if ((rptr=(*iftypes[ifptr->type].init_func)(ifptr)) == NULL) {
-            logerr(0,"Failed to initialize Interface %s",(ifptr->name)?
-                    ifptr->name:"(unnamed)");
+        if (init_iface(ifptr,&lists) == NULL) {
             if (!flag_test(ifptr,F_OPTIONAL)) {
                 timetodie++;
                 break;
@@ -1624,30 +2318,15 @@ int main(int argc, char ** argv)
              * Now we need to clean up properly but not yet implemented.  This
              * is a little memory leak with each failed init attempt
              */
-            free(ifptr);
+            pool_free(ifptr);
             continue;
         }
+        /* Remember how it was configured for reload_config() */
+        if (reload_add(ifptr,autoname) < 0)
+            logterm(errno,"Failed to record interface configuration");
         for (;ifptr;ifptr = ifptr->next) {
-        /* This loop should be done once for IN or OUT interfaces twice for
-         * interfaces where the initialisation routine has expanded them to an
-         * IN/OUT pair.
-         */
-            if (ifptr->direction == IN)
-                ifptr->q=engine->q;
-
-            if (ifptr->checksum <0)
-                ifptr->checksum = engine->checksum;
-            if (ifptr->strict <0) {
-                if (engine->strict >= 0) {
-                    ifptr->strict = engine->strict;
-                } else {
-                    ifptr->strict = (ifptr->type == FILEIO)?0:1;
-                }
-            }
             (*tiptr)=ifptr;
             tiptr=&ifptr->next;
-            if (ifptr->next==ifptr2)
-                ifptr->next=NULL;
         }
     }
 
@@ -1658,7 +2337,17 @@ int main(int argc, char ** argv)
         if (ifptr->direction != IN && ifptr->ofilter)
             if (name2id(ifptr->ofilter))
                 logterm(errno,"Name to interface translation failed");
+        if (ifptr->direction != IN && ifptr->qprio)
+            if (name2id(ifptr->qprio))
+                logterm(errno,"Name to interface translation failed");
+        if (ifptr->direction != IN && lanes_name2id(&ifptr->qlanes))
+            logterm(errno,"Name to interface translation failed");
+        if (ifptr->direction != IN && ifptr->qpolicy == Q_PRIORITY &&
+                ifptr->qprio == NULL)
+            logterm(0,"overflow=priority requires a priority filter");
     }
+    if (lanes_name2id(&engine->qlanes))
+        logterm(errno,"Name to interface translation failed");
 
     /* Create the key for thread local storage: in this case for a pointer to
      * the interface each thread is handling
@@ -1683,22 +2372,24 @@ int main(int argc, char ** argv)
         free_options(engine->options);
 
     pthread_setspecific(ifkey,(void *)&lists);
-    reaper=pthread_self();
 
+    /* User shutdown and reload requests are handled by sig_thread().  All
+     * other threads inherit this mask */
     sigemptyset(&set);
-    sigemptyset(&sa.sa_mask);
-    sa.sa_handler=terminate;
-    sa.sa_flags=0;
-    sigaction(SIGUSR1,&sa,NULL);
-    sigaddset(&set,SIGUSR1);
-    sigaddset(&set,SIGUSR2);
-    sigaddset(&set,SIGALRM);
     sigaddset(&set,SIGTERM);
     sigaddset(&set,SIGINT);
+    sigaddset(&set,SIGHUP);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
-    sigdelset(&set,SIGUSR1);
     signal(SIGPIPE,SIG_IGN);
-    pthread_create(&tid,NULL,run_engine,(void *) engine);
+    pthread_create(&tid,NULL,sig_thread,(void *) &lists);
+    scan_init();
+    if (init_stats(engine) < 0)
+        logterm(0,"Failed to start statistics server");
+    ifg->running=ifg->shards;
+    for (i=0;i<ifg->shards;i++)
+        if ((err=thread_create(&tid,engine_attr(ifg,i,&tattr),run_engine,
+                (void *) &ifg->shard[i])))
+            logterm(err,"Failed to start engine");
 
     pthread_mutex_lock(&lists.io_mutex);
     for (ifptr=lists.initialized;ifptr;ifptr=ifptr->next) {
@@ -1706,7 +2397,8 @@ int main(int argc, char ** argv)
         if ((ifptr->direction == IN ) || (ifptr->direction == BOTH))
             gotinputs=1;
         /* Create a thread to run each interface */
-        pthread_create(&tid,NULL,(void *)start_interface,(void *) ifptr);
+        if ((err=iface_thread(ifptr)))
+            logterm(err,"Failed to start interface %s",ifptr->name);
     }
 
     while (lists.initialized)
@@ -1717,10 +2409,7 @@ int main(int argc, char ** argv)
      */
     if (!gotinputs) {
         logerr(0,"No Inputs!");
-        pthread_mutex_lock(&engine->q->q_mutex);
-        engine->q->active=0;
-        pthread_cond_broadcast(&engine->q->freshmeat);
-        pthread_mutex_unlock(&engine->q->q_mutex);
+        stop_engine(&lists);
         timetodie++;
     }
 
@@ -1732,53 +2421,43 @@ int main(int argc, char ** argv)
      * inactive and shutting them down. Thus the last input exiting also shuts
      * everything down */
     while (lists.outputs || lists.inputs || lists.dead) {
-        if (lists.dead  == NULL && (timetodie <= 0)) {
-            pthread_mutex_unlock(&lists.io_mutex);
-            /* Here we're waiting for SIGTERM/SIGINT (user shutdown requests),
-             * SIGUSR2 (notifications of termination from interface threads)
-             * and (later) SIGALRM to notify of the grace period expiry
-             */
-            (void) sigwait(&set,&rcvdsig);
-            pthread_mutex_lock(&lists.io_mutex);
-        } else {
-            rcvdsig = 0;
-        }
-
-        if ((timetodie > 0) || ( lists.outputs == NULL && (timetodie == 0)) ||
-                rcvdsig == SIGTERM || rcvdsig == SIGINT) {
+        /* Here we're waiting for interface threads to exit, user shutdown
+         * and reload requests (passed on by sig_thread()) and (later) the
+         * grace period to expire */
+        if (lists.dead  == NULL && (timetodie <= 0) && graceover != 1 &&
+                !reloadreq)
+            pthread_cond_wait(&lists.dead_cond,&lists.io_mutex);
+
+        if ((timetodie > 0) || ( lists.outputs == NULL && (timetodie == 0))) {
             timetodie=-1;
-            /* Once we've caught a user shutdown address we don't need to be
-             * told twice
-             */
-            signal(SIGTERM,SIG_IGN);
-            signal(SIGINT,SIG_IGN);
-            sigdelset(&set,SIGTERM);
-            sigdelset(&set,SIGINT);
             for (ifptr=lists.inputs;ifptr;ifptr=ifptr->next) {
-                pthread_kill(ifptr->tid,SIGUSR1);
+                iface_cancel(ifptr);
             }
             for (ifptr=lists.outputs;ifptr;ifptr=ifptr->next) {
                 if (ifptr->q == NULL)
-                    pthread_kill(ifptr->tid,SIGUSR1);
+                    iface_cancel(ifptr);
             }
-            /* Set up the graceperiod alarm */
-            if (graceperiod)
-                alarm(graceperiod);
+            /* Bi-directional interfaces may still be reading but nothing
+             * more is wanted.  Once the engines have passed on what they
+             * have they will switch off the outputs' queues */
+            stop_engine(&lists);
+            /* Outputs with queues have the grace period to drain them */
+            if (graceperiod == 0 || timer_add(&gracetimer,graceperiod*1000,
+                    grace_expired,(void *) &lists) < 0)
+                graceover=1;
         }
-        if (rcvdsig == SIGALRM || graceperiod == 0) {
-            sigdelset(&set,SIGALRM);
-            /* Make sure we don't come back here with 0 graceperiod */
-            if (graceperiod == 0)
-                graceperiod=1;
+        if (graceover == 1) {
+            graceover++;
             for (ifptr=lists.outputs;ifptr;ifptr=ifptr->next) {
                 if (ifptr->q)
-                    pthread_kill(ifptr->tid,SIGUSR1);
+                    iface_cancel(ifptr);
             }
         }
-        for (ifptr=lists.dead;ifptr;ifptr=lists.dead) {
-            lists.dead=ifptr->next;
-            pthread_join(ifptr->tid,&ret);
-            free(ifptr);
+        reap_dead(&lists);
+        if (reloadreq) {
+            reloadreq=0;
+            if (timetodie == 0)
+                reload_config(&lists,config);
         }
     }
 
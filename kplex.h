@@ -10,11 +10,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <termios.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifdef __APPLE__
 #include <AvailabilityMacros.h>
@@ -33,6 +35,26 @@
 #define DEFSRCNAME "kplex"
 
 #define DEFQSIZE 16
+/* Most engine threads which may be requested with "engines=" */
+#define MAXENGINES 64
+/* Default limit (in senblk references) for queues allowed to grow */
+#define DEFQMAX 1024
+
+/* What to do when an output queue is full */
+#define Q_OLDEST 0      /* Drop the oldest entry (the default) */
+#define Q_NEWEST 1      /* Drop the entry being added */
+#define Q_PRIORITY 2    /* Drop the oldest entry not passing the priority
+                           filter */
+#define Q_GROW 3        /* Grow the queue up to a limit, then drop oldest */
+
+/* Priority lanes (see queue.c).  The last lane takes sentences matching no
+ * lane filter */
+#define MAXLANES 4
+#define LANE_STRICT 0   /* Always serve the highest priority lane first */
+#define LANE_WEIGHTED 1 /* Serve lanes in proportion to their weights */
+
+/* Longest "dedup" window (ms).  See dedup.c */
+#define MAXDEDUP 3600000
 
 #define SENMAX 80
 /* This should be +2. Will be reduced in a future release */
@@ -46,6 +68,31 @@
 
 #define BUFSIZE 1024
 
+/* Maximum number of senblks written by an output in one system call */
+#define WRITEBATCH 32
+/* Maximum number of datagrams sent or received in one system call */
+#define MAXDGRAMBATCH 256
+
+/* Write latency histogram buckets.  Bucket n counts writes taking less than
+ * 4^n microseconds, the last bucket everything slower */
+#define LATBUCKETS 12
+
+#ifdef KPLEX_LATENCY
+/* Latency histograms have 4 buckets per power of 2 microseconds, up to
+ * 2^27us (a little over 2 minutes) */
+#define LATHBUCKETS 108
+
+struct lathist {
+    unsigned long count;
+    unsigned long max;          /* Microseconds */
+    unsigned long b[LATHBUCKETS];
+};
+#endif
+
+/* Stats socket report formats */
+#define STATS_JSON 0
+#define STATS_PROMETHEUS 1
+
 /* Iinterface flags */
 #define F_PERSIST 1
 #define F_IPERSIST 2
@@ -64,6 +111,8 @@
 #define TAG_ISRC 8
 
 extern int debuglevel;
+extern int lockfreeq;
+extern int timetodie;
 #define DEBUG(level,...) if (debuglevel >= level) logdebug(0, __VA_ARGS__)
 #define DEBUG2(level,...) if (debuglevel >= level) logdebug(errno, __VA_ARGS__)
 
@@ -116,31 +165,121 @@ enum udptype {
     UDP_MULTICAST
 };
 
+/* senblks on queues are shared: each queue holds a reference and the last
+ * queue to release a senblk returns it to the pool */
 struct senblk {
     size_t len;
     unsigned long src;
     struct senblk *next;
+    unsigned int refs;
+#ifdef KPLEX_LATENCY
+    struct timespec ts;         /* When the sentence was read */
+#endif
+    /* The first tag block generated for the sentence, re-used by outputs
+     * with the same tag settings.  See gettag() */
+    int tagstate;
+    unsigned int tagflags;
+    const char *tagname;
+    long long tagtime;
+    size_t taglen;
+    char tag[TAGMAX];
     char data[SENBUFSZ];
 };
 typedef struct senblk senblk_t;
 
+/* senblk tagstate values */
+#define TAGC_EMPTY 0
+#define TAGC_BUSY 1
+#define TAGC_READY 2
+
+/* Maximum length of the name in a tag block s: field */
+#define TAGNAMEMAX 15
+
+/* Pre-formatted parts of an output's tag blocks.  Each output has its own
+ * so no locking is needed */
+struct tagfmt {
+    unsigned long srcid;        /* Source id srcname is for (TAG_ISRC) */
+    const char *srcname;        /* Name the s: field was made from */
+    size_t slen;
+    unsigned char scks;         /* Checksum of the s: field */
+    char sfield[2+TAGNAMEMAX];
+    time_t sec;                 /* Second the c: field is for */
+    unsigned char ccks;         /* Checksum of the c: field to the second */
+    char cfield[2+10];
+};
+
 typedef struct iface iface_t;
 
+/* Cell of a lock-free queue */
+struct qcell {
+    size_t seq;
+    senblk_t *sptr;
+};
+
+#define CACHELINE 64
+
+struct qlane {
+    struct sfilter *match;  /* Sentences for this lane, NULL for the last */
+    senblk_t **ring;
+    size_t size;
+    size_t head;
+    size_t count;
+    unsigned int weight;    /* LANE_WEIGHTED: entries per round */
+    unsigned int credit;    /* LANE_WEIGHTED: entries left this round */
+};
+
 struct ioqueue {
     iface_t *owner;
     pthread_mutex_t    q_mutex;
     pthread_cond_t    freshmeat;
     int active;
-    int drops;
-    senblk_t *free;
-    senblk_t *qhead;
-    senblk_t *qtail;
-    senblk_t *base;
+    unsigned long drops;    /* References dropped because the queue was full */
+    size_t hwm;             /* Most references queued at once */
+    int lockfree;
+    int policy;             /* Overflow policy: Q_OLDEST etc. */
+    struct sfilter *prio;   /* Sentences to keep with Q_PRIORITY */
+    unsigned char *isprio;  /* Q_PRIORITY: which ring entries pass prio */
+    size_t minsize;         /* Q_GROW: size to shrink back to */
+    size_t maxsize;         /* Q_GROW: size not to grow beyond */
+    unsigned int waiting;   /* Consumers waiting on freshmeat */
+    int wakefd;             /* If >= 0, written to to wake a consumer polling
+                               it instead of waiting on freshmeat */
+    size_t size;        /* Capacity in senblk references */
+    size_t head;        /* Index of oldest queued reference */
+    size_t count;       /* Number of queued references */
+    senblk_t **ring;
+    /* Queues with priority lanes keep entries in the lanes' rings rather
+     * than ring, count being the total.  See queue.c */
+    int nlanes;
+    int lanemode;
+    struct qlane *lanes;
+    /* Compact queues only.  Sentences are copied into a byte ring rather
+     * than referenced, count being the number of records.  See queue.c */
+    int compact;
+    char *bytes;
+    size_t bsize;       /* Capacity in bytes */
+    size_t bhead;       /* Offset of the oldest record */
+    size_t bused;       /* Bytes of records queued */
+    /* lock-free queues only.  Producer and consumer positions are kept on
+     * separate cache lines */
+    struct qcell *cells;
+    char pad1[CACHELINE];
+    size_t enqpos;
+    char pad2[CACHELINE-sizeof(size_t)];
+    size_t deqpos;
+    char pad3[CACHELINE-sizeof(size_t)];
 };
 typedef struct ioqueue ioqueue_t;
 
+/* Snapshot of the output list read by engines.  See publish_outputs() */
+struct outarray {
+    size_t count;
+    struct iface *ifs[];
+};
+
 struct iolists {
     pthread_mutex_t io_mutex;
+    struct outarray *oarray;    /* Outputs for engines to fan out to */
     pthread_mutex_t init_mutex;
     pthread_cond_t  dead_cond;
     pthread_cond_t  init_cond;
@@ -149,6 +288,16 @@ struct iolists {
     struct iface *inputs;
     struct iface *dead;
     struct iface *engine;
+    int reloading;              /* Interfaces are being replaced: see
+                                   reload_config() */
+};
+
+/* Priority lane options of an interface (or of the engine for its queues) */
+struct laneconf {
+    struct sfilter *match[MAXLANES-1];  /* "lane1" etc. filters */
+    int mode;                   /* LANE_STRICT or LANE_WEIGHTED */
+    int nweights;               /* Number of "laneweights" given */
+    unsigned int weight[MAXLANES];
 };
 
 struct kopts {
@@ -163,13 +312,13 @@ struct srclist {
     char *name;
     } src;
     time_t failtime;
-    time_t lasttime;
+    time_t lasttime;    /* Monotonic seconds.  See mono_ms() */
     struct srclist *next;
 };
 
 struct ratelimit {
     time_t timeout;
-    struct timeval last;
+    long long last;     /* mono_ms() when last passed, 0 if never */
 };
 
 struct sfilter_rule {
@@ -193,10 +342,74 @@ struct sfilter {
     pthread_mutex_t lock;
     unsigned int refcount;
     sf_rule_t *rules;
+    struct sf_index *index;
+    char *spec;             /* Option value the filter was made from, or
+                               NULL (failover) */
+    struct {                /* One per engine thread, in its own line */
+        unsigned long verdict;  /* Engine's generation of the last sentence
+                                   checked << 1 | whether it was rejected */
+        char pad[CACHELINE-sizeof(unsigned long)];
+    } slot[MAXENGINES];
 };
 
 typedef struct sfilter sfilter_t;
 
+/* Per-interface counters.  Most have a single writer, the thread handling
+ * the interface, so are updated without locked instructions using STATADD.
+ * filtered is the exception: engine threads count sentences rejected by
+ * output filters (and duplicates) while the interface counts those rejected
+ * by its input filter, so every writer of it uses an atomic add */
+struct ifstats {
+    unsigned long sen_in;
+    unsigned long bytes_in;
+    unsigned long sen_out;
+    unsigned long bytes_out;
+    unsigned long cksum_fail;
+    unsigned long filtered;
+    unsigned long reconnects;
+    unsigned long wlat[LATBUCKETS];
+#ifdef KPLEX_LATENCY
+    struct lathist residency;   /* Time from being read to leaving a queue */
+    struct lathist completion;  /* Time from being read to being released
+                                   after a write */
+#endif
+};
+
+#define STATADD(sp,ctr,n) __atomic_store_n(&(sp)->ctr, \
+        __atomic_load_n(&(sp)->ctr,__ATOMIC_RELAXED)+(n),__ATOMIC_RELAXED)
+#define stats_clock(tsp) clock_gettime(CLOCK_MONOTONIC,(tsp))
+
+/* Clock used for timed condition variable waits.  See timer.c */
+#ifdef __APPLE__
+#define WAITCLOCK CLOCK_REALTIME    /* No pthread_condattr_setclock() */
+#else
+#define WAITCLOCK CLOCK_MONOTONIC
+#endif
+
+/* Scheduling options for interface and engine threads.  Zero values are
+ * unset and take the global defaults.  See thread_create() */
+#define MAXCPUS 256
+#define CPUWORDS (MAXCPUS/(8*sizeof(unsigned long)))
+#define CPUBIT(c) (1UL << ((c)%(8*sizeof(unsigned long))))
+#define CPUISSET(c,set) ((set)[(c)/(8*sizeof(unsigned long))] & CPUBIT(c))
+#define CPUADD(c,set) ((set)[(c)/(8*sizeof(unsigned long))] |= CPUBIT(c))
+#define MINSTACK 65536      /* Smallest "stacksize" which may be set */
+
+struct thrattr {
+    int rtprio;             /* SCHED_FIFO priority, -1 for normal scheduling */
+    size_t stacksize;
+    int hascpus;            /* Whether cpus is set */
+    unsigned long cpus[CPUWORDS];   /* CPUs the thread may run on */
+};
+
+struct ktimer {
+    struct ktimer *next;
+    struct ktimer **prev;   /* NULL unless pending */
+    long long when;         /* Expiry time (mono_ms()) */
+    void (*fn)(void *);
+    void *arg;
+};
+
 struct iface {
     pthread_t tid;
     unsigned long id;
@@ -215,6 +428,22 @@ struct iface {
     unsigned int tagflags;
     sfilter_t *ifilter;
     sfilter_t *ofilter;
+    int qpolicy;
+    size_t qmax;
+    sfilter_t *qprio;
+    struct laneconf qlanes;
+    int qcompact;               /* Output queue is compact.  See init_q() */
+    struct nmea_parser *parser;
+    struct ifstats stats;
+    size_t mem;                 /* Bytes of pooled memory charged to the
+                                   interface.  See pool.c */
+    struct tagfmt tagfmt;
+    struct thrattr tattr;       /* Scheduling of the interface's thread */
+    char *conf;                 /* Config file options other than name and
+                                   filters, until started.  See reload.c */
+    int cancelfd;               /* If >= 0, written to after the thread is
+                                   cancelled to wake it from a wait which is
+                                   not a cancellation point */
     void (*cleanup)(struct iface *);
     void (*read)(struct iface *);
     void (*write)(struct iface *);
@@ -235,12 +464,85 @@ struct iftypedef {
 #define K_NOSTDOUT 0x4
 #define K_NOSTDERR 0x8
 
+/* An engine thread and the queue inputs assigned to it push to */
+struct eshard {
+    iface_t *engine;
+    ioqueue_t *q;
+    unsigned int idx;
+    unsigned long epoch;    /* Odd while the engine is using lists->oarray */
+    char pad[CACHELINE];
+};
+
 struct if_engine {
     unsigned flags;
     int logto;
+    char *stats;            /* Stats socket specification */
+    int statsfmt;
+    unsigned int shards;    /* Number of engine threads */
+    unsigned int running;   /* Engine threads yet to exit */
+    struct thrattr eattr;   /* Scheduling of engine threads */
+    struct eshard *shard;
+    struct dedup *dedup;    /* Duplicate suppression or NULL.  See dedup.c */
+};
+
+/* Sentence parsing state, kept between reads so that input may be parsed
+ * in whatever chunks it arrives in.  See parse.c */
+struct nmea_parser {
+    int checksum;           /* Options copied from the interface */
+    int loose;
+    int nocr;
+    sfilter_t *ifilter;     /* Reference to the filter in *fslot */
+    sfilter_t **fslot;      /* Interface's input filter, which may be
+                               replaced by a reload */
+    struct ifstats *stats;  /* Interface counters to update */
+    void (*sink)(senblk_t *, void *);   /* Where complete sentences go */
+    void *arg;
+    enum sstate senstate;
+    char *ptr;              /* Next byte in sblk.data or tbuf */
+    int count;
+    int countmax;
+    senblk_t sblk;
+    char tbuf[TAGMAX];
+};
+
+struct dgram_tx;
+struct dgram_rx;
+
+/* io_uring reads for file, serial and tcp client inputs.  See ring_read() */
+struct uring_rd;
+struct ifring {
+    int want;                   /* "uring=yes" was given */
+    struct uring_rd *rd;        /* Set up by the reading thread */
 };
 
 int mysleep(time_t);
+int mysleep_ms(long);
+long long mono_ms(void);
+struct dedup *dedup_init(long, size_t, int);
+int dedup_check(struct dedup *, senblk_t *);
+void dedup_free(struct dedup *);
+void wait_abstime(struct timespec *, long);
+int wait_cond_init(pthread_cond_t *);
+int timer_add(struct ktimer *, long, void (*)(void *), void *);
+int timer_cancel(struct ktimer *);
+int batch_iov(iface_t *, senblk_t **, size_t, struct iovec *, char *, int);
+ssize_t writev_all(int, struct iovec *, int);
+int dgram_batch_supported(void);
+struct dgram_tx *dgram_tx_init(size_t);
+void dgram_tx_free(struct dgram_tx *);
+int dgram_send(iface_t *, struct dgram_tx *, int, senblk_t **, size_t,
+        struct sockaddr *, socklen_t);
+void dgram_write(iface_t *, struct dgram_tx *, int, struct sockaddr *,
+        socklen_t);
+struct dgram_rx *dgram_rx_init(size_t);
+void dgram_rx_free(struct dgram_rx *);
+ssize_t dgram_recv(struct dgram_rx *, int, char *, struct sockaddr *,
+        socklen_t *);
+int ring_opt(iface_t *, struct ifring *, const char *);
+ssize_t ring_read(iface_t *, struct ifring *, int, char *);
+void ring_free(iface_t *, struct ifring *);
+struct dgram_rx *dgram_rx_uring(int);
+int dgram_rx_wakefd(struct dgram_rx *);
 
 iface_t *init_file( iface_t *);
 iface_t *init_serial(iface_t *);
@@ -261,19 +563,56 @@ void *ifdup_bcast(void *);
 void *ifdup_mcast(void *);
 void *ifdup_seatalk(void *);
 
+void *pool_alloc(size_t, size_t *);
+void pool_free(void *);
+void pool_account(void *, size_t *);
+size_t pool_size(size_t);
+void pool_setlimit(size_t);
+void pool_usage(size_t *, size_t *, size_t *);
+int parse_size(const char *, off_t *);
+
 int init_q(iface_t *, size_t);
+void free_q(ioqueue_t *);
 
 senblk_t *next_senblk(ioqueue_t *);
+senblk_t *next_senblk_timed(ioqueue_t *, const struct timespec *);
 senblk_t *last_senblk(ioqueue_t *);
+size_t next_senblk_batch(ioqueue_t *, senblk_t **, size_t);
+size_t next_senblk_batch_timed(ioqueue_t *, senblk_t **, size_t,
+        const struct timespec *);
+size_t try_senblk_batch(ioqueue_t *, senblk_t **, size_t);
+senblk_t *senblk_ref(senblk_t *);
 void push_senblk(senblk_t *, ioqueue_t *);
+void link_senblk(senblk_t *, ioqueue_t *);
 void senblk_free(senblk_t *, ioqueue_t *);
 void flush_queue(ioqueue_t *);
+void q_dropped(ioqueue_t *, unsigned long);
 int link_interface(iface_t *);
 int unlink_interface(iface_t *);
 int link_to_initialized(iface_t *);
 void start_interface(void *);
 iface_t *ifdup(iface_t *);
+iface_t *iface_alloc(void);
+ioqueue_t *engine_q(struct iolists *, unsigned long);
+int publish_outputs(struct iolists *);
+void stop_engine(struct iolists *);
+void check_inputs(struct iolists *);
+void reap_dead(struct iolists *);
+int iface_assign(iface_t *);
+iface_t *init_iface(iface_t *, struct iolists *);
+void iface_refilter(iface_t *, sfilter_t **, sfilter_t *);
+int reload_add(iface_t *, int);
+void reload_config(struct iolists *, char *);
 void iface_thread_exit(int);
+int thread_create(pthread_t *, struct thrattr *, void *(*)(void *), void *);
+void thread_inherit(struct thrattr *, const struct thrattr *);
+int iface_thread(iface_t *);
+int thread_opt(struct thrattr *, char *, char *);
+int lane_opt(struct laneconf *, char *, char *);
+void lanes_copy(struct laneconf *, const struct laneconf *);
+void lanes_free(struct laneconf *);
+int lanes_name2id(struct laneconf *);
+void iface_cancel(iface_t *);
 int next_config(FILE *,unsigned int *,char **,char **);
 
 int calcsum(const char *, size_t);
@@ -281,6 +620,7 @@ iface_t *parse_file(char *);
 iface_t *parse_arg(char *);
 iface_t *get_default_global(void);
 void free_options(struct kopts *);
+void free_config(iface_t *);
 void free_filter(sfilter_t *);
 void logerr(int,char *,...);
 void logterm(int,char *,...);
@@ -290,15 +630,38 @@ void logwarn(char *,...);
 void loginfo(char *,...);
 void initlog(int);
 sfilter_t *addfilter(sfilter_t *);
+sfilter_t *filter_get(sfilter_t **);
+sfilter_t *filter_swap(sfilter_t **, sfilter_t *);
 int senfilter(senblk_t *,sfilter_t *);
+int compile_filter(sfilter_t *);
+void free_filter_index(sfilter_t *);
+sf_rule_t *filter_lookup(sfilter_t *, const char *, unsigned int);
 int checkcksum(senblk_t *);
 unsigned long namelookup(char *);
+int name2id(sfilter_t *);
 char *idlookup(unsigned long);
 int insertname(char *, unsigned long);
 void freenames(void);
 int cmdlineopt(struct kopts **, char *);
 void do_read(iface_t *);
+void parser_init(struct nmea_parser *, iface_t *, ioqueue_t *, unsigned long);
+void parser_sink(struct nmea_parser *, void (*)(senblk_t *, void *), void *);
+void parser_reset(struct nmea_parser *);
+void parser_release(struct nmea_parser *);
+struct nmea_parser *parser_attach(iface_t *);
+size_t parse_nmea(struct nmea_parser *, const char *, size_t);
+void scan_init(void);
+size_t scan_delim(const char *, size_t);
+unsigned char xorsum(const char *, size_t);
 size_t gettag(iface_t *, char *, senblk_t *);
+ssize_t writev_batch(iface_t *, int, struct iovec *, int, size_t);
+void stats_write(iface_t *, size_t, size_t, const struct timespec *);
+int stats_query(senblk_t *, iface_t *);
+int init_stats(iface_t *);
+#ifdef KPLEX_LATENCY
+void lat_record(struct lathist *, const struct timespec *,
+        const struct timespec *);
+#endif
 
 extern struct iftypedef iftypes[];
 
@@ -4,6 +4,16 @@
  * For copying information see the file COPYING distributed with this software
  *
  * functions for associating names with interfaces
+ *
+ * Mappings are held in two tables of pointers to (never modified) name/id
+ * structures: one indexed directly by the major part of the id and an open
+ * addressed hash table of names.  idlookup() is used per sentence by outputs
+ * tagging sentences with their source so lookups take no locks.  Mappings
+ * are added under a mutex and a table which needs to grow is copied and the
+ * new one published with an atomic store.  Old tables are retired rather than
+ * freed as readers may still be using them.  Mappings keep their own copy of
+ * the name and are never removed: an interface stopped by a configuration
+ * reload keeps its id for any interface given its name by a later one
  */
 
 #include "kplex.h"
@@ -11,16 +21,115 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+
+/* Initial size of each table (in entries) */
+#define LOOKUPINIT 64
 
-/* Structures holding the name to id mappings in a linked list */
+/* Structures holding a name to id mapping */
 struct nameid {
     unsigned long id;
     char * name;
-    struct nameid *next;
 };
 
-/* This is used before we start multiple threads */
-static struct nameid *idlist;
+struct nametab {
+    size_t size;            /* Power of 2 for the name table */
+    struct nameid **slot;
+    struct nametab *retired;  /* Previous table, kept for current readers */
+};
+
+static struct nametab *idtab;
+static struct nametab *nametab;
+static size_t nnames;
+static pthread_mutex_t lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Hash a name, ignoring case
+ * Args: name
+ * Returns: hash value
+ */
+static unsigned long namehash(const char *name)
+{
+    unsigned long h=2166136261u;
+
+    for (;*name;name++)
+        h=(h^(unsigned char) tolower((unsigned char) *name))*16777619u;
+    return(h);
+}
+
+/*
+ * Allocate an empty table
+ * Args: number of entries
+ * Returns: pointer to new table or NULL on failure
+ */
+static struct nametab *newtab(size_t size)
+{
+    struct nametab *tab;
+
+    if ((tab=(struct nametab *) malloc(sizeof(struct nametab))) == NULL)
+        return(NULL);
+    if ((tab->slot=(struct nameid **) calloc(size,sizeof(struct nameid *)))
+            == NULL) {
+        free(tab);
+        return(NULL);
+    }
+    tab->size=size;
+    tab->retired=NULL;
+    return(tab);
+}
+
+/*
+ * Free a table and any it replaced
+ * Args: table
+ * Returns: nothing
+ */
+static void freetab(struct nametab *tab)
+{
+    struct nametab *next;
+
+    for (;tab;tab=next) {
+        next=tab->retired;
+        free(tab->slot);
+        free(tab);
+    }
+}
+
+/*
+ * Add a mapping to a name table.  Called with lookup_mutex held and the
+ * table having a free slot
+ * Args: table, mapping
+ * Returns: nothing
+ */
+static void nametab_add(struct nametab *tab, struct nameid *nptr)
+{
+    size_t i;
+
+    for (i=namehash(nptr->name)&(tab->size-1);tab->slot[i];
+            i=(i+1)&(tab->size-1));
+    __atomic_store_n(&tab->slot[i],nptr,__ATOMIC_RELEASE);
+}
+
+/*
+ * Find a mapping in the name table
+ * Args: name
+ * Returns: pointer to mapping or NULL if there is none
+ */
+static struct nameid *nametab_find(const char *name)
+{
+    struct nametab *tab;
+    struct nameid *nptr;
+    size_t i;
+
+    if ((tab=__atomic_load_n(&nametab,__ATOMIC_ACQUIRE)) == NULL)
+        return(NULL);
+
+    for (i=namehash(name)&(tab->size-1);
+            (nptr=__atomic_load_n(&tab->slot[i],__ATOMIC_ACQUIRE));
+            i=(i+1)&(tab->size-1))
+        if (!strcasecmp(name,nptr->name))
+            return(nptr);
+    return(NULL);
+}
 
 /*
  * Return an interface name given an ID
@@ -29,15 +138,17 @@ static struct nameid *idlist;
  */
 char * idlookup(unsigned long id)
 {
+    struct nametab *tab;
     struct nameid *nptr;
-    id&=~((unsigned int) IDMINORMASK);
 
-    for (nptr=idlist;nptr;nptr=nptr->next) {
-        if (nptr->id == id)
-            return(nptr->name);
-    }
+    id>>=IDMINORBITS;
 
-    return(NULL);
+    if ((tab=__atomic_load_n(&idtab,__ATOMIC_ACQUIRE)) == NULL ||
+            id >= tab->size ||
+            (nptr=__atomic_load_n(&tab->slot[id],__ATOMIC_ACQUIRE)) == NULL)
+        return(NULL);
+
+    return(nptr->name);
 }
 
 /*
@@ -47,7 +158,6 @@ char * idlookup(unsigned long id)
  */
 unsigned long namelookup(char *name)
 {
-    long ret;
     struct nameid *nptr;
 
     if (name == NULL) {
@@ -55,57 +165,104 @@ unsigned long namelookup(char *name)
         return(0);
     }
 
-    for (nptr=idlist;nptr;nptr=nptr->next) {
-        if((ret=strcasecmp(name,nptr->name))) {
-            if (ret<0)
-                return(0);
-        } else {
-            return(nptr->id);
-        }
+    return(((nptr=nametab_find(name)))?nptr->id:0);
+}
+
+/*
+ * Make sure the id table has a slot for an id and the name table is no more
+ * than half full after adding a name.  Called with lookup_mutex held
+ * Args: major part of id to be added
+ * Returns: 0 on success, -1 on failure
+ */
+static int growtabs(unsigned long major)
+{
+    struct nametab *tab,*old;
+    size_t size,i;
+
+    if ((old=idtab) == NULL || major >= old->size) {
+        for (size=(old)?old->size:LOOKUPINIT;size <= major;size<<=1);
+        if ((tab=newtab(size)) == NULL)
+            return(-1);
+        if (old)
+            memcpy(tab->slot,old->slot,old->size*sizeof(struct nameid *));
+        tab->retired=old;
+        __atomic_store_n(&idtab,tab,__ATOMIC_RELEASE);
+    }
+
+    if ((old=nametab) == NULL || 2*(nnames+1) > old->size) {
+        if ((tab=newtab((old)?old->size*2:LOOKUPINIT)) == NULL)
+            return(-1);
+        if (old)
+            for (i=0;i<old->size;i++)
+                if (old->slot[i])
+                    nametab_add(tab,old->slot[i]);
+        tab->retired=old;
+        __atomic_store_n(&nametab,tab,__ATOMIC_RELEASE);
     }
     return(0);
 }
 
 /*
- * Insert a name-ID mapping into the list
+ * Insert a name-ID mapping
  * Args: Pointer to a name, associated interface ID
  * Returns: 0 on success, -1 otherwise
- * Side Effects: structure is created and linked into the list of mappings
+ * Side Effects: structure is created and added to the lookup tables.
+ * Mappings may be added while other threads are looking names up
  */
 int insertname(char *name, unsigned long id)
 {
-    struct nameid *nptr,**nptrp;
-    long ret;
+    struct nameid *nptr;
+    unsigned long major=id>>IDMINORBITS;
 
-    for (nptrp=&idlist;(*nptrp);nptrp=&(*nptrp)->next)
-        if ((ret=strcasecmp(name,(*nptrp)->name)) == 0) {
-            logwarn("%s used as name for more than one interface",name);
-            return(-1);
-        } else if (ret < 0 )
-            break;
-    if ((nptr = (struct nameid *)malloc(sizeof(struct nameid))) < 0) {
+    pthread_mutex_lock(&lookup_mutex);
+    if (nametab_find(name)) {
+        pthread_mutex_unlock(&lookup_mutex);
+        logwarn("%s used as name for more than one interface",name);
+        return(-1);
+    }
+    if ((nptr = (struct nameid *)malloc(sizeof(struct nameid))) == NULL ||
+            (nptr->name=strdup(name)) == NULL) {
+        pthread_mutex_unlock(&lookup_mutex);
+        free(nptr);
+        logerr(errno,"Memory allocation failed");
+        return(-1);
+    }
+    if (growtabs(major) < 0) {
+        pthread_mutex_unlock(&lookup_mutex);
+        free(nptr->name);
+        free(nptr);
         logerr(errno,"Memory allocation failed");
         return(-1);
     }
-    nptr->name=name;
     nptr->id=id;
-    nptr->next=(*nptrp);
-    *nptrp=nptr;
+    nametab_add(nametab,nptr);
+    __atomic_store_n(&idtab->slot[major],nptr,__ATOMIC_RELEASE);
+    nnames++;
+    pthread_mutex_unlock(&lookup_mutex);
     return(0);
 }
 
 /*
- * Free a name/ID mapping list
+ * Free the name/ID mappings
  * Args: none
  * Returns: nothing
- * Side Effects: All name/ID mapping strings are freed
+ * Side Effects: All name/ID mapping structures and tables are freed.  No
+ * other thread may be looking names up
  */
 void freenames()
 {
-    struct nameid *nptr,*nptr2;
+    size_t i;
 
-    for (nptr=idlist;nptr;nptr=nptr2) {
-        nptr2=nptr->next;
-        free(nptr);
-    }
+    pthread_mutex_lock(&lookup_mutex);
+    if (nametab)
+        for (i=0;i<nametab->size;i++)
+            if (nametab->slot[i]) {
+                free(nametab->slot[i]->name);
+                free(nametab->slot[i]);
+            }
+    freetab(nametab);
+    freetab(idtab);
+    nametab=idtab=NULL;
+    nnames=0;
+    pthread_mutex_unlock(&lookup_mutex);
 }
@@ -22,6 +22,9 @@ struct if_mcast {
         struct ip_mreq ipmr;
         struct ipv6_mreq ip6mr;
     } mr;
+    size_t batch;               /* Datagrams per system call */
+    struct dgram_tx *tx;
+    struct dgram_rx *rx;
 };
 
 /*
@@ -40,6 +43,9 @@ void *ifdup_mcast(void *ifb)
         return(NULL);
 
     (void) memcpy(newif, oldif, sizeof(struct if_mcast));
+    /* Batch buffers are allocated by the thread using them */
+    newif->tx = NULL;
+    newif->rx = NULL;
 
     return((void *) newif);
 }
@@ -59,6 +65,9 @@ void cleanup_mcast(iface_t *ifa)
         }
     }
 
+    dgram_tx_free(ifb->tx);
+    dgram_rx_free(ifb->rx);
+
     /* iomutex should be locked in the cleanup routine */
     if (!ifa->pair)
         close(ifb->fd);
@@ -71,9 +80,21 @@ void write_mcast(struct iface *ifa)
     int data=0;
     struct msghdr msgh;
     struct iovec iov[2];
+    struct timespec start;
+    ssize_t sent;
 
     ifb = (struct if_mcast *) ifa->info;
 
+    if (ifb->batch > 1) {
+        if ((ifb->tx=dgram_tx_init(ifb->batch))) {
+            dgram_write(ifa,ifb->tx,ifb->fd,(struct sockaddr *)&ifb->maddr,
+                    ifb->asize);
+            iface_thread_exit(errno);
+        }
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+    }
+
     msgh.msg_name=(void *)&ifb->maddr;
     msgh.msg_namelen=ifb->asize;
     msgh.msg_control=NULL;
@@ -96,11 +117,6 @@ void write_mcast(struct iface *ifa)
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
         if (ifa->tagflags)
             if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
@@ -114,8 +130,10 @@ void write_mcast(struct iface *ifa)
         iov[data].iov_base=sptr->data;
         iov[data].iov_len=sptr->len;
 
-        if (sendmsg(ifb->fd,&msgh,0) < 0)
+        stats_clock(&start);
+        if ((sent=sendmsg(ifb->fd,&msgh,0)) < 0)
             break;
+        stats_write(ifa,1,sent,&start);
         senblk_free(sptr,ifa->q);
     }
 
@@ -131,6 +149,14 @@ ssize_t read_mcast(iface_t *ifa, char *buf)
     struct sockaddr_storage src;
     socklen_t sz = (socklen_t) sizeof(src);
 
+    if (ifm->batch > 1) {
+        if (ifm->rx || (ifm->rx=dgram_rx_init(ifm->batch)))
+            return dgram_recv(ifm->rx,ifm->fd,buf,NULL,NULL);
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+        ifm->batch=1;
+    }
+
     return recvfrom(ifm->fd,(void *)buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
 }
 
@@ -177,6 +203,7 @@ struct iface *init_mcast(struct iface *ifa)
     struct servent *svent;
     size_t qsize = DEFMCASTQSIZE;
     struct kopts *opt;
+    int batch=1;
     int ifindex,iffound=0;
     int linklocal=0;
     int on=1,off=0;
@@ -202,12 +229,23 @@ struct iface *init_mcast(struct iface *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"batch")) {
+            if (((batch=atoi(opt->val)) <= 0) || batch > MAXDGRAMBATCH) {
+                logerr(0,"Invalid batch size specified: %s",opt->val);
+                return(NULL);
+            }
         } else  {
             logerr(0,"Unknown interface option %s",opt->var);
             return(NULL);
         }
     }
 
+    if (batch > 1 && !dgram_batch_supported()) {
+        logwarn("%s: batch option not supported on this platform",ifa->name);
+        batch=1;
+    }
+    ifm->batch=batch;
+
     if (!host) {
         logerr(0,"Must specify multicast address for multicast interfaces");
         return(NULL);
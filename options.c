@@ -10,6 +10,7 @@
 #include "kplex.h"
 #include <syslog.h>
 #include <ctype.h>
+#include <sched.h>
 
 #define ARGDELIM ','
 #define FILTERDELIM ':'
@@ -19,10 +20,9 @@
 /* This is used before we start multiple threads */
 static char configbuf[BUFSIZE];
 
-void lineerror(unsigned int line)
+void lineerror(char *fname, unsigned int line)
 {
-    fprintf(stderr,"Error parsing config file at line %d\n",line);
-    exit(1);
+    logerr(0,"Error parsing config file %s at line %d",fname,line);
 }
 
 enum itype name2type(const char *str)
@@ -231,6 +231,7 @@ struct kopts *add_option(char *var, char *val)
 
 sfilter_t *getfilter(char *fstring)
 {
+    char *spec=fstring;
     char *sptr;
     sfilter_t *head;
     sf_rule_t *filter;
@@ -307,11 +308,20 @@ sfilter_t *getfilter(char *fstring)
             break;
     }
     if (ok) {
-        if ((head=(sfilter_t *)malloc(sizeof(sfilter_t))) != NULL) {
+        if ((head=(sfilter_t *)malloc(sizeof(sfilter_t))) != NULL &&
+                (head->spec=strdup(spec)) == NULL) {
+            free(head);
+            head=NULL;
+        }
+        if (head) {
             head->type=FILTER;
             pthread_mutex_init(&head->lock,NULL);
             head->refcount=1;
             head->rules=filter;
+            head->index=NULL;
+            memset(head->slot,0,sizeof(head->slot));
+            if (compile_filter(head) < 0)
+                DEBUG(3,"Failed to index filter rules: using rule list");
             return(head);
         }
     }
@@ -325,9 +335,106 @@ sfilter_t *getfilter(char *fstring)
     return(NULL);
 }
 
+/*
+ * Parse a thread scheduling option
+ * Args: scheduling options to update, option name and value
+ * Returns: 0 if the option was handled, 1 if it isn't a scheduling option,
+ * -2 if its value is bad
+ */
+int thread_opt(struct thrattr *ta, char *var, char *val)
+{
+    char *ptr;
+    long lo,hi;
+    off_t size;
+
+    if (!strcasecmp(var,"cpus")) {
+        /* A list of CPUs and ranges of CPUs, e.g. 0:2-3 */
+        memset(ta->cpus,0,sizeof(ta->cpus));
+        for (ptr=val;;ptr++) {
+            if (!isdigit((unsigned char) *ptr))
+                return(-2);
+            lo=hi=strtol(ptr,&ptr,10);
+            if (*ptr == '-') {
+                if (!isdigit((unsigned char) *++ptr))
+                    return(-2);
+                hi=strtol(ptr,&ptr,10);
+            }
+            if (hi < lo || hi >= MAXCPUS)
+                return(-2);
+            for (;lo <= hi;lo++)
+                CPUADD(lo,ta->cpus);
+            if (*ptr != FILTERDELIM)
+                break;
+        }
+        if (*ptr)
+            return(-2);
+        ta->hascpus=1;
+    } else if (!strcasecmp(var,"rtprio")) {
+        if (!strcasecmp(val,"no"))
+            ta->rtprio=-1;
+        else if ((ta->rtprio=atoi(val)) < sched_get_priority_min(SCHED_FIFO)
+                || ta->rtprio > sched_get_priority_max(SCHED_FIFO))
+            return(-2);
+    } else if (!strcasecmp(var,"stacksize")) {
+        if (parse_size(val,&size) < 0 || size < MINSTACK)
+            return(-2);
+        ta->stacksize=(size_t) size;
+    } else
+        return(1);
+    return(0);
+}
+
+/*
+ * Parse a priority lane option
+ * Args: lane options to update, option name and value
+ * Returns: 0 if the option was handled, 1 if it isn't a lane option,
+ * -2 if its value is bad
+ */
+int lane_opt(struct laneconf *lc, char *var, char *val)
+{
+    char *ptr;
+    long w;
+    int n;
+
+    if (!strncasecmp(var,"lane",4) && var[4] >= '1' &&
+            var[4] < '0'+MAXLANES && var[5] == '\0') {
+        n=var[4]-'1';
+        if (lc->match[n])
+            free_filter(lc->match[n]);
+        if ((lc->match[n]=getfilter(val)) == NULL)
+            return(-2);
+    } else if (!strcasecmp(var,"lanemode")) {
+        if (!strcasecmp(val,"strict"))
+            lc->mode=LANE_STRICT;
+        else if (!strcasecmp(val,"weighted"))
+            lc->mode=LANE_WEIGHTED;
+        else
+            return(-2);
+    } else if (!strcasecmp(var,"laneweights")) {
+        for (n=0,ptr=val;;ptr++) {
+            if (n == MAXLANES || !isdigit((unsigned char) *ptr) ||
+                    (w=strtol(ptr,&ptr,10)) <= 0 || w > 1000)
+                return(-2);
+            lc->weight[n++]=w;
+            if (*ptr != FILTERDELIM)
+                break;
+        }
+        if (*ptr)
+            return(-2);
+        lc->nweights=n;
+    } else
+        return(1);
+    return(0);
+}
+
 int add_common_opt(char *var, char *val,iface_t *ifp)
 {
     char *ptr;
+    int n;
+
+    if ((n=thread_opt(&ifp->tattr,var,val)) <= 0 ||
+            (n=lane_opt(&ifp->qlanes,var,val)) <= 0)
+        return(n);
 
     if (!strcasecmp(var,"direction")) {
         if (!strcasecmp(val,"in"))
@@ -347,6 +454,33 @@ int add_common_opt(char *var, char *val,iface_t *ifp)
             free_filter(ifp->ofilter);
         if ((ifp->ofilter=getfilter(val)) == NULL)
         return(-2);
+    } else if (!strcmp(var,"overflow")) {
+        if (!strcasecmp(val,"oldest"))
+            ifp->qpolicy=Q_OLDEST;
+        else if (!strcasecmp(val,"newest"))
+            ifp->qpolicy=Q_NEWEST;
+        else if (!strcasecmp(val,"priority"))
+            ifp->qpolicy=Q_PRIORITY;
+        else if (!strcasecmp(val,"grow"))
+            ifp->qpolicy=Q_GROW;
+        else
+            return(-2);
+    } else if (!strcmp(var,"priority")) {
+        if (ifp->qprio)
+            free_filter(ifp->qprio);
+        if ((ifp->qprio=getfilter(val)) == NULL)
+            return(-2);
+    } else if (!strcmp(var,"qmax")) {
+        if ((n=atoi(val)) <= 0)
+            return(-2);
+        ifp->qmax=n;
+    } else if (!strcmp(var,"qstore")) {
+        if (!strcasecmp(val,"shared"))
+            ifp->qcompact=0;
+        else if (!strcasecmp(val,"compact"))
+            ifp->qcompact=1;
+        else
+            return(-2);
     } else if (!strcmp(var,"strict")) {
         if (!strcasecmp(val,"yes")) {
             ifp->strict=1;
@@ -436,6 +570,32 @@ void free_options(struct kopts *options)
     }
 }
 
+/*
+ * Record an option in an interface's configuration text.  When the config
+ * file is reloaded this is compared with the text the running interface was
+ * started with (see reload.c)
+ * Args: interface, option name and value
+ * Returns: 0 on success, -1 on failure
+ * Names and filters are left out: they are matched or updated separately
+ */
+static int add_conf(iface_t *ifp, char *var, char *val)
+{
+    size_t len;
+    char *conf;
+
+    if (!strcasecmp(var,"name") || !strcmp(var,"ifilter") ||
+            !strcmp(var,"ofilter"))
+        return(0);
+
+    len=strlen(ifp->conf);
+    if ((conf=(char *) realloc(ifp->conf,len+strlen(var)+strlen(val)+3))
+            == NULL)
+        return(-1);
+    sprintf(conf+len,"%s=%s\n",var,val);
+    ifp->conf=conf;
+    return(0);
+}
+
 iface_t *get_config(FILE *fp, unsigned int *line, enum itype type)
 {
     char *var,*val;
@@ -443,15 +603,19 @@ iface_t *get_config(FILE *fp, unsigned int *line, enum itype type)
     iface_t *ifp;
     int ret;
 
-    if((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL) {
+    if((ifp = iface_alloc()) == NULL) {
         *line = 0;
         return(NULL);
     }
-    memset((void *) ifp,0,sizeof(iface_t));
     ifp->direction = BOTH;
     ifp->checksum=-1;
     ifp->strict=-1;
     ifp->type=type;
+    if ((ifp->conf=strdup("")) == NULL) {
+        pool_free(ifp);
+        *line = 0;
+        return(NULL);
+    }
 
     /* Set defaults */
     switch (type) {
@@ -465,6 +629,10 @@ iface_t *get_config(FILE *fp, unsigned int *line, enum itype type)
     for(opt = &ifp->options;next_config(fp,line,&var,&val) == 0;) {
         if (!var)
             return(ifp);
+        if (add_conf(ifp,var,val) < 0) {
+            *line=0;
+            break;
+        }
         if ((ret = add_common_opt(var,val,ifp)) == 0)
             continue;
         if ((ret < 0) || (((*opt) = add_option(var,val)) == NULL && (ret=-1))) {
@@ -474,11 +642,48 @@ iface_t *get_config(FILE *fp, unsigned int *line, enum itype type)
         }
         opt=&(*opt)->next;
     }
-    free_options(ifp->options);
-    free(ifp);
+    ifp->next=NULL;
+    free_config(ifp);
     return(NULL);
 }
 
+/*
+ * Free interface specifications which have not been initialised, e.g. those
+ * read from a config file which are unchanged by a reload
+ * Args: list of interfaces
+ * Returns: Nothing
+ */
+void free_config(iface_t *list)
+{
+    iface_t *ifp;
+    struct if_engine *ifg;
+
+    for (;list;list=ifp) {
+        ifp=list->next;
+        free_options(list->options);
+        free_filter(list->ifilter);
+        free_filter(list->ofilter);
+        free_filter(list->qprio);
+        lanes_free(&list->qlanes);
+        if (list->name)
+            free(list->name);
+        if (list->conf)
+            free(list->conf);
+        if (list->type == GLOBAL && (ifg=(struct if_engine *) list->info)) {
+            if (ifg->stats)
+                free(ifg->stats);
+            free(ifg);
+        }
+        pool_free(list);
+    }
+}
+
+/*
+ * Read a config file
+ * Args: path to file
+ * Returns: list of interfaces, the first being the global section, or NULL
+ * if the file could not be read or parsed (the error is logged)
+ */
 iface_t *parse_file(char *fname)
 {
     FILE *fp;
@@ -489,42 +694,55 @@ iface_t *parse_file(char *fname)
     struct if_engine *ifg;
 
     if ((fp = fopen(fname,"r")) == NULL) {
-        fprintf(stderr,"Failed to open config file %s: %s\n",fname,
-            strerror(errno));
-        exit(1);
+        logerr(errno,"Failed to open config file %s",fname);
+        return(NULL);
     }
-    
+
+    /* Don't pick up the end of any previous read */
+    *configbuf='\0';
+
     for (ifpp=&list;get_interface_section(fp,&line,&type) == 0;) {
         if (type == END) {
             if (!list || list->type != GLOBAL) {
-                ifp = get_default_global();
+                if ((ifp = get_default_global()) == NULL)
+                    break;
                 ifp->next = list;
                 list = ifp;
             }
+            fclose(fp);
             return(list);
         } else if (type == GLOBAL && list && list->type == GLOBAL) {
-            fprintf(stderr,"Error: duplicate global section in config file line %d\n",line);
-            exit(1);
+            logerr(0,"Duplicate global section in config file %s line %d",
+                    fname,line);
+            line=0;
+            break;
         }
 
         if ((ifp = get_config(fp,&line,type)) == NULL) {
-            if (line == 0) {
-                perror("Error creating interface");
-                exit(1);
-            } else {
-                lineerror(line);
-            }
+            if (line == 0)
+                logerr(errno,"Error creating interface");
+            else
+                lineerror(fname,line);
+            line=0;
+            break;
         }
 
         if ((ifp->type) == GLOBAL) {
             if ((ifg = (struct if_engine *)malloc(sizeof(struct if_engine)))
                     == NULL) {
-                free(ifp);
-                perror("Error creating interface");
-                exit(1);
+                logerr(errno,"Error creating interface");
+                ifp->next=NULL;
+                free_config(ifp);
+                break;
             }
             ifg->flags=0;
             ifg->logto=LOG_DAEMON;
+            ifg->stats=NULL;
+            ifg->statsfmt=STATS_JSON;
+            ifg->shards=1;
+            ifg->shard=NULL;
+            ifg->dedup=NULL;
+            memset(&ifg->eattr,0,sizeof(ifg->eattr));
             ifp->info = (void *)ifg;
             if (ifp->checksum <0)
                 ifp->checksum = 0;
@@ -539,9 +757,10 @@ iface_t *parse_file(char *fname)
         }
     }
     if (line)
-        lineerror(line);
-    perror("Error parsing config file");
-    exit(1);
+        lineerror(fname,line);
+    fclose(fp);
+    free_config(list);
+    return(NULL);
 }
 
 iface_t *parse_arg(char *arg)
@@ -552,18 +771,16 @@ iface_t *parse_arg(char *arg)
     int ret,done=0;
     struct kopts **opt;
 
-    if ((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL)
+    if ((ifp = iface_alloc()) == NULL)
         return(NULL);
 
-    memset((void *) ifp,0,sizeof(iface_t));
-
     ifp->direction = BOTH;
     ifp->checksum=-1;
     ifp->strict=-1;
 
     for(ptr=arg;*ptr && *ptr != ':';ptr++);
     if (!*ptr) {
-        free(ifp);
+        pool_free(ifp);
         return(NULL);
     } else
         *ptr++='\0';
@@ -595,7 +812,7 @@ iface_t *parse_arg(char *arg)
         ifp->type = GOFREE;
     else {
         fprintf(stderr,"Unrecognised interface type %s\n",arg);
-        free(ifp);
+        pool_free(ifp);
         return(NULL);
     }
 
@@ -641,7 +858,7 @@ iface_t *parse_arg(char *arg)
         return(ifp);
 
     free_options(ifp->options);
-    free(ifp);
+    pool_free(ifp);
     return(NULL);
 }
 
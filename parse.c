@@ -0,0 +1,242 @@
+/* parse.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * NMEA-0183 sentence framing.  A parser holds the state of a partly read
+ * sentence so it can be fed input in whatever chunks it arrives in: from a
+ * blocking read loop, a non-blocking event loop or a buffer already in
+ * memory.  Complete sentences which pass checksum and input filter checks
+ * are handed to the parser's sink, by default pushing them to a queue
+ */
+
+#include "kplex.h"
+
+/*
+ * Default sink: push a sentence onto a queue
+ * Args: senblk, queue (cast to void *)
+ * Returns: Nothing
+ */
+static void sink_queue(senblk_t *sptr, void *arg)
+{
+    push_senblk(sptr,(ioqueue_t *) arg);
+}
+
+/*
+ * Initialise sentence parsing state
+ * Args: Parser to initialise, interface whose options govern parsing, queue
+ * complete sentences are to be pushed to and source id to give them
+ * Returns: Nothing
+ * The interface's options are copied but the parser takes a reference to its
+ * input filter, which it checks for replacement by a configuration reload
+ * before each buffer it parses.  The interface must outlast the parser, which
+ * is to be released with parser_release()
+ */
+void parser_init(struct nmea_parser *p, iface_t *ifa, ioqueue_t *q,
+        unsigned long src)
+{
+    p->checksum=ifa->checksum;
+    p->loose=(ifa->strict)?0:1;
+    p->nocr=flag_test(ifa,F_NOCR)?1:0;
+    p->fslot=&ifa->ifilter;
+    p->ifilter=filter_get(p->fslot);
+    p->stats=&ifa->stats;
+    p->sink=sink_queue;
+    p->arg=(void *) q;
+    p->sblk.src=src;
+    p->sblk.tagstate=TAGC_EMPTY;
+    parser_reset(p);
+}
+
+/*
+ * Set the function complete sentences are passed to
+ * Args: Parser, function and argument to pass it along with each sentence
+ * Returns: Nothing
+ * The senblk passed to the sink belongs to the parser and is re-used for the
+ * next sentence: sinks must copy anything they want to keep
+ */
+void parser_sink(struct nmea_parser *p, void (*sink)(senblk_t *, void *),
+        void *arg)
+{
+    p->sink=sink;
+    p->arg=arg;
+}
+
+/*
+ * Discard any partly parsed sentence, e.g. after a connection is re-made
+ * Args: Parser
+ * Returns: Nothing
+ */
+void parser_reset(struct nmea_parser *p)
+{
+    p->senstate=SEN_NODATA;
+    p->ptr=p->sblk.data;
+    p->count=p->countmax=0;
+}
+
+/*
+ * Release the resources held by a parser
+ * Args: Parser
+ * Returns: Nothing
+ */
+void parser_release(struct nmea_parser *p)
+{
+    free_filter(p->ifilter);
+    p->ifilter=NULL;
+}
+
+/*
+ * Allocate a parser for an interface if it doesn't have one already
+ * Args: Interface
+ * Returns: Pointer to the interface's parser or NULL on failure
+ * Sentences are pushed to the interface's queue.  The parser is freed with
+ * the interface
+ */
+struct nmea_parser *parser_attach(iface_t *ifa)
+{
+    if (ifa->parser)
+        return(ifa->parser);
+
+    if ((ifa->parser=(struct nmea_parser *) malloc(sizeof(struct nmea_parser)))
+            == NULL)
+        return(NULL);
+    parser_init(ifa->parser,ifa,ifa->q,ifa->id);
+    return(ifa->parser);
+}
+
+/*
+ * Parse a buffer of input, passing complete sentences to the parser's sink.
+ * State is kept between calls so data may be supplied in arbitrary chunks
+ * Args: Parser, buffer and number of bytes in it
+ * Returns: Number of sentences passed to the sink
+ */
+size_t parse_nmea(struct nmea_parser *p, const char *buf, size_t nread)
+{
+    const char *bptr,*eptr;
+    char *ptr=p->ptr;
+    int countmax=p->countmax;
+    int count=p->count;
+    enum sstate senstate=p->senstate;
+    int nocr=p->nocr;
+    int loose=p->loose;
+    size_t emitted=0;
+    size_t span,room;
+#ifdef KPLEX_LATENCY
+    int stamped=0;
+#endif
+
+    /* Pick up an input filter replaced by a reload */
+    if (__atomic_load_n(p->fslot,__ATOMIC_RELAXED) != p->ifilter) {
+        free_filter(p->ifilter);
+        p->ifilter=filter_get(p->fslot);
+    }
+
+    for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
+        switch (*bptr) {
+        case '$':
+        case '!':
+            ptr=p->sblk.data;
+            countmax=SENMAX-(nocr|loose);
+            count=1;
+            *ptr++=*bptr;
+            senstate=SEN_SENPROC;
+            continue;
+        case '\\':
+            if (senstate==SEN_TAGPROC) {
+                *ptr++=*bptr;
+                senstate=SEN_TAGSEEN;
+            } else {
+                senstate=SEN_TAGPROC;
+                ptr=p->tbuf;
+                countmax=TAGMAX-1;
+                *ptr++=*bptr;
+                count=1;
+            }
+            continue;
+        case '\r':
+        case '\n':
+        case '\0':
+            if (senstate == SEN_SENPROC || senstate == SEN_TAGSEEN) {
+                if (loose || (nocr && *bptr == '\n')) {
+                    *ptr++='\r';
+                    *ptr='\n';
+                    p->sblk.len = count+2;
+                } else {
+                    if ((!nocr) && *bptr == '\r') {
+                        senstate = SEN_CR;
+                        *ptr++=*bptr;
+                        ++count;
+                    } else {
+                        senstate = SEN_NODATA;
+                    }
+                    continue;
+                }
+            } else if (senstate == SEN_CR) {
+                if (*bptr != '\n') {
+                    senstate = SEN_NODATA;
+                    continue;
+                }
+                *ptr=*bptr;
+                p->sblk.len = ++count;
+            } else {
+                senstate = SEN_NODATA;
+                continue;
+            }
+            /* Pass the sentence on if we're not checksumming OR the
+             * checksum is correct OR it's a zero length packet, and the
+             * input filter allows it */
+            if (p->checksum && checkcksum(&p->sblk) && (p->sblk.len > 0 ))
+                STATADD(p->stats,cksum_fail,1);
+            else if (senfilter(&p->sblk,p->ifilter))
+                /* Shared with the engine: see struct ifstats */
+                __atomic_add_fetch(&p->stats->filtered,1,__ATOMIC_RELAXED);
+            else {
+                STATADD(p->stats,sen_in,1);
+                STATADD(p->stats,bytes_in,p->sblk.len);
+#ifdef KPLEX_LATENCY
+                /* Input is parsed as soon as it's read, so the time the
+                 * first sentence from a read completes is the read time */
+                if (!stamped++)
+                    stats_clock(&p->sblk.ts);
+#endif
+                (*p->sink)(&p->sblk,p->arg);
+                emitted++;
+            }
+            senstate=SEN_NODATA;
+            continue;
+        default:
+            break;
+        }
+
+        /* Handle the whole run of non-delimiters starting here at once */
+        span=scan_delim(bptr,eptr-bptr);
+
+        if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
+            if (senstate != SEN_NODATA )
+                senstate=SEN_NODATA;
+            bptr+=span-1;
+            continue;
+        }
+
+        /* Bytes which fit before count exceeds countmax are kept.  The
+         * first which doesn't fit discards the sentence */
+        room=(count <= countmax)?countmax-count+1:0;
+        if (span > room) {
+            memcpy(ptr,bptr,room);
+            ptr+=room;
+            count+=room+1;
+            senstate=SEN_NODATA;
+        } else {
+            memcpy(ptr,bptr,span);
+            ptr+=span;
+            count+=span;
+        }
+        bptr+=span-1;
+    }
+
+    p->ptr=ptr;
+    p->count=count;
+    p->countmax=countmax;
+    p->senstate=senstate;
+    return(emitted);
+}
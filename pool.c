@@ -0,0 +1,245 @@
+/* pool.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Slab allocation of interface, queue and connection structures
+ *
+ * Objects are carved from slabs in a fixed set of size classes and returned
+ * to their class's free list when released.  Slabs are never given back, so
+ * the structures created and destroyed as tcp clients come and go re-use
+ * the same memory rather than fragmenting the heap.  Requests larger than
+ * the biggest class (e.g. rings of very long queues) go to malloc().
+ *
+ * Every object has a small header recording the bytes it is charged with
+ * and, optionally, a counter (normally an interface's "mem") they are also
+ * charged to, so that the per-interface memory use reported by stats is
+ * maintained without callers having to remember sizes.  The total charged
+ * may be capped with the global "memlimit" option, in which case
+ * allocations which would exceed it fail with ENOMEM
+ */
+
+#include "kplex.h"
+
+/* Bytes to allocate at a time for a size class (at least 2 objects) */
+#define SLABSIZE 16384
+
+struct pool_hdr {
+    size_t *acct;       /* Counter also charged with the object, or NULL */
+    size_t size;        /* Bytes charged, header included */
+};
+
+/* Object sizes (header included) at each power of 2 and half way between */
+static const size_t classsize[] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096, 6144, 8192, 12288, 16384
+};
+#define NCLASSES (sizeof(classsize)/sizeof(classsize[0]))
+
+static struct pool_class {
+    pthread_mutex_t mutex;
+    void *free;         /* Free objects, linked through their first word */
+} classes[NCLASSES];
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static size_t pool_used=0;      /* Bytes charged to live objects */
+static size_t pool_held=0;      /* Bytes of slabs and large allocations */
+static size_t pool_limit=0;     /* Cap on pool_used, 0 for none */
+
+static void pool_init(void)
+{
+    size_t c;
+
+    for (c=0;c<NCLASSES;c++) {
+        pthread_mutex_init(&classes[c].mutex,NULL);
+        classes[c].free=NULL;
+    }
+}
+
+/*
+ * Find the size class for a request
+ * Args: bytes needed, header included
+ * Returns: class index or NCLASSES if too big for any
+ */
+static size_t class_of(size_t need)
+{
+    size_t c;
+
+    for (c=0;c<NCLASSES && classsize[c] < need;c++);
+    return(c);
+}
+
+/*
+ * Charge bytes to the global total, enforcing any limit
+ * Args: bytes
+ * Returns: 0 on success, -1 if the limit would be exceeded
+ */
+static int pool_charge(size_t n)
+{
+    size_t used,limit;
+
+    limit=__atomic_load_n(&pool_limit,__ATOMIC_RELAXED);
+    used=__atomic_load_n(&pool_used,__ATOMIC_RELAXED);
+    do {
+        if (limit && used+n > limit)
+            return(-1);
+    } while (!__atomic_compare_exchange_n(&pool_used,&used,used+n,1,
+            __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+    return(0);
+}
+
+/*
+ * Take an object from a size class, adding a slab if it has none free
+ * Args: class index
+ * Returns: pointer to object or NULL if memory is exhausted
+ */
+static void *class_get(size_t c)
+{
+    struct pool_class *pc=&classes[c];
+    char *slab;
+    void *obj;
+    size_t n,i;
+
+    pthread_mutex_lock(&pc->mutex);
+    if (pc->free == NULL) {
+        if ((n=SLABSIZE/classsize[c]) < 2)
+            n=2;
+        if ((slab=(char *) malloc(n*classsize[c])) == NULL) {
+            pthread_mutex_unlock(&pc->mutex);
+            return(NULL);
+        }
+        __atomic_add_fetch(&pool_held,n*classsize[c],__ATOMIC_RELAXED);
+        for (i=0;i<n-1;i++)
+            *(void **) (slab+i*classsize[c])=slab+(i+1)*classsize[c];
+        *(void **) (slab+i*classsize[c])=NULL;
+        pc->free=slab;
+    }
+    obj=pc->free;
+    pc->free=*(void **) obj;
+    pthread_mutex_unlock(&pc->mutex);
+    return(obj);
+}
+
+/*
+ * Allocate zeroed memory from the pools
+ * Args: size required, counter to charge the memory to (or NULL)
+ * Returns: pointer to memory or NULL with errno set on failure.  ENOMEM
+ * means either the system or the "memlimit" budget is exhausted
+ */
+void *pool_alloc(size_t size, size_t *acct)
+{
+    struct pool_hdr *hdr;
+    size_t need,c;
+
+    (void) pthread_once(&pool_once,pool_init);
+
+    need=size+sizeof(struct pool_hdr);
+    if ((c=class_of(need)) < NCLASSES)
+        need=classsize[c];
+    if (pool_charge(need) < 0) {
+        errno=ENOMEM;
+        return(NULL);
+    }
+
+    if (c < NCLASSES)
+        hdr=(struct pool_hdr *) class_get(c);
+    else if ((hdr=(struct pool_hdr *) malloc(need)))
+        __atomic_add_fetch(&pool_held,need,__ATOMIC_RELAXED);
+
+    if (hdr == NULL) {
+        __atomic_sub_fetch(&pool_used,need,__ATOMIC_RELAXED);
+        errno=ENOMEM;
+        return(NULL);
+    }
+
+    memset(hdr,0,need);
+    hdr->acct=acct;
+    hdr->size=need;
+    if (acct)
+        __atomic_add_fetch(acct,need,__ATOMIC_RELAXED);
+    return((void *) (hdr+1));
+}
+
+/*
+ * Return memory to the pools
+ * Args: pointer returned by pool_alloc() (may be NULL)
+ * Returns: Nothing
+ * The counter the memory was charged to must still exist
+ */
+void pool_free(void *ptr)
+{
+    struct pool_hdr *hdr;
+    struct pool_class *pc;
+    size_t c;
+
+    if (ptr == NULL)
+        return;
+
+    hdr=((struct pool_hdr *) ptr)-1;
+    if (hdr->acct)
+        __atomic_sub_fetch(hdr->acct,hdr->size,__ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pool_used,hdr->size,__ATOMIC_RELAXED);
+
+    if ((c=class_of(hdr->size)) == NCLASSES) {
+        __atomic_sub_fetch(&pool_held,hdr->size,__ATOMIC_RELAXED);
+        free(hdr);
+        return;
+    }
+    pc=&classes[c];
+    pthread_mutex_lock(&pc->mutex);
+    *(void **) hdr=pc->free;
+    pc->free=hdr;
+    pthread_mutex_unlock(&pc->mutex);
+}
+
+/*
+ * Charge a pooled object to a different counter, e.g. one belonging to an
+ * interface which didn't exist when the object was allocated
+ * Args: pointer returned by pool_alloc(), counter to charge (or NULL)
+ * Returns: Nothing
+ */
+void pool_account(void *ptr, size_t *acct)
+{
+    struct pool_hdr *hdr=((struct pool_hdr *) ptr)-1;
+
+    if (hdr->acct)
+        __atomic_sub_fetch(hdr->acct,hdr->size,__ATOMIC_RELAXED);
+    if ((hdr->acct=acct))
+        __atomic_add_fetch(acct,hdr->size,__ATOMIC_RELAXED);
+}
+
+/*
+ * Bytes charged for a pool allocation of a given size
+ * Args: size which would be requested from pool_alloc()
+ * Returns: bytes charged
+ */
+size_t pool_size(size_t size)
+{
+    size_t need,c;
+
+    need=size+sizeof(struct pool_hdr);
+    return(((c=class_of(need)) < NCLASSES)?classsize[c]:need);
+}
+
+/*
+ * Set the cap on memory charged to pooled objects
+ * Args: limit in bytes, 0 for none
+ * Returns: Nothing
+ */
+void pool_setlimit(size_t limit)
+{
+    __atomic_store_n(&pool_limit,limit,__ATOMIC_RELAXED);
+}
+
+/*
+ * Report pool usage
+ * Args: pointers to bytes charged to live objects, bytes held from the
+ * system and the limit (0 if none)
+ * Returns: Nothing
+ */
+void pool_usage(size_t *used, size_t *held, size_t *limit)
+{
+    *used=__atomic_load_n(&pool_used,__ATOMIC_RELAXED);
+    *held=__atomic_load_n(&pool_held,__ATOMIC_RELAXED);
+    *limit=__atomic_load_n(&pool_limit,__ATOMIC_RELAXED);
+}
@@ -0,0 +1,1272 @@
+/* queue.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Sentence pool and ioqueue functions
+ *
+ * Two queue implementations are provided.  The default protects a ring of
+ * senblk references with the queue mutex.  The lock-free implementation
+ * (qtype=lockfree) is a bounded ring in which each cell carries a sequence
+ * number, allowing any number of producers (inputs pushing to the engine)
+ * and consumers.  A queue's writer thread is its only real consumer, but a
+ * producer finding the queue full steals from the head, dropping the oldest
+ * entry, and so briefly acts as a second one.  In both cases the queue mutex
+ * is only used by consumers waiting for data, and producers only signal
+ * when a consumer is actually waiting
+ *
+ * What happens when an output queue is full is set per interface by the
+ * "overflow" option.  Dropping the oldest entry is the default.  Queues
+ * may instead drop the entry being added, drop the oldest entry which does
+ * not pass a "priority" filter, or grow (up to "qmax" entries) and shrink
+ * back once their consumer catches up.  The last two are only supported by
+ * the mutex protected ring
+ *
+ * Output queues with "qstore=compact" don't hold references.  Sentences are
+ * copied into a mutex protected byte ring as records of source id, (read
+ * time,) length and data, releasing the shared senblk at once, and copied
+ * back into pooled senblks as they are taken off.  The ring has room for
+ * "qsize" sentences of the maximum length but typical sentences are less
+ * than half that, so it holds more sentences in far less memory than
+ * referenced senblks would pin: useful for deep queues on slow links
+ *
+ * Queues may also be split into priority lanes ("lane1" etc.), each a mutex
+ * protected ring of its own with room for "qsize" entries.  Sentences go to
+ * the first lane whose filter they pass, or the last lane if none.  A full
+ * lane only drops its own entries, so a burst of bulk traffic can't push
+ * out or hold up sentences in a higher priority lane.  Consumers either
+ * always take from the highest priority lane with entries ("strict") or
+ * take from each lane in turn up to its weight ("weighted") so that bulk
+ * traffic is never starved
+ */
+
+#include "kplex.h"
+
+int lockfreeq=0;        /* Use lock-free queues if set */
+
+/* Bytes of a compact queue record before the sentence.  The length is
+ * last, in one byte */
+#ifdef KPLEX_LATENCY
+#define CRECHDR (sizeof(unsigned long)+sizeof(struct timespec)+1)
+#else
+#define CRECHDR (sizeof(unsigned long)+1)
+#endif
+
+/*
+ * Pool of senblks shared by all queues.  A sentence is copied into a pooled
+ * senblk once, when an input pushes it onto the engine's queue.  After that
+ * queues only hold references to it.  The pool grows in chunks as required
+ * and is never shrunk.  Lock ordering: a queue's q_mutex may be held when
+ * taking senpool_mutex, never the other way round
+ */
+#define SENPOOLCHUNK 64
+static pthread_mutex_t senpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static senblk_t *senpool = NULL;
+
+/*
+ * Take a senblk from the pool, growing it if empty
+ * Args: None
+ * Returns: Pointer to senblk with a single reference or NULL on failure
+ */
+static senblk_t *senblk_alloc(void)
+{
+    senblk_t *sptr;
+    int i;
+
+    pthread_mutex_lock(&senpool_mutex);
+    if (senpool == NULL) {
+        if ((sptr=(senblk_t *)calloc(SENPOOLCHUNK,sizeof(senblk_t))) == NULL) {
+            pthread_mutex_unlock(&senpool_mutex);
+            return(NULL);
+        }
+        for (i=0;i<SENPOOLCHUNK-1;i++)
+            sptr[i].next=&sptr[i+1];
+        sptr[i].next=NULL;
+        senpool=sptr;
+    }
+    sptr=senpool;
+    senpool=sptr->next;
+    pthread_mutex_unlock(&senpool_mutex);
+
+    sptr->next=NULL;
+    sptr->refs=1;
+    sptr->tagstate=TAGC_EMPTY;
+    return(sptr);
+}
+
+/*
+ * Drop a reference to a pooled senblk, returning it to the pool if it was
+ * the last
+ * Args: Pointer to senblk
+ * Returns: Nothing
+ */
+static void senblk_unref(senblk_t *sptr)
+{
+    if (__atomic_sub_fetch(&sptr->refs,1,__ATOMIC_ACQ_REL))
+        return;
+
+    pthread_mutex_lock(&senpool_mutex);
+    sptr->next=senpool;
+    senpool=sptr;
+    pthread_mutex_unlock(&senpool_mutex);
+}
+
+/*
+ * Add a reference to the tail of a lock-free queue
+ * Args: Pointer to queue and senblk
+ * Returns: 0 on success, -1 if the queue is full
+ */
+static int lf_enqueue(ioqueue_t *q, senblk_t *sptr)
+{
+    struct qcell *cell;
+    size_t pos,seq;
+    long dif;
+
+    pos=__atomic_load_n(&q->enqpos,__ATOMIC_RELAXED);
+    for (;;) {
+        cell=&q->cells[pos % q->size];
+        seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+        if ((dif=(long) seq - (long) pos) == 0) {
+            if (__atomic_compare_exchange_n(&q->enqpos,&pos,pos+1,1,
+                    __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return(-1);
+        else
+            pos=__atomic_load_n(&q->enqpos,__ATOMIC_RELAXED);
+    }
+    cell->sptr=sptr;
+    __atomic_store_n(&cell->seq,pos+1,__ATOMIC_RELEASE);
+    return(0);
+}
+
+/*
+ * Take a reference from the head of a lock-free queue
+ * Args: Pointer to queue
+ * Returns: Pointer to senblk or NULL if the queue is empty
+ */
+static senblk_t *lf_dequeue(ioqueue_t *q)
+{
+    struct qcell *cell;
+    senblk_t *sptr;
+    size_t pos,seq;
+    long dif;
+
+    pos=__atomic_load_n(&q->deqpos,__ATOMIC_RELAXED);
+    for (;;) {
+        cell=&q->cells[pos % q->size];
+        seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+        if ((dif=(long) seq - (long) (pos+1)) == 0) {
+            if (__atomic_compare_exchange_n(&q->deqpos,&pos,pos+1,1,
+                    __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return(NULL);
+        else
+            pos=__atomic_load_n(&q->deqpos,__ATOMIC_RELAXED);
+    }
+    sptr=cell->sptr;
+    __atomic_store_n(&cell->seq,pos+q->size,__ATOMIC_RELEASE);
+    return(sptr);
+}
+
+#ifdef KPLEX_LATENCY
+/*
+ * Record how long sentences taken from a queue have been in kplex against
+ * the queue's owner
+ * Args: Queue, array of senblks taken from it and number of them
+ * Returns: Nothing
+ */
+static void lat_dequeued(ioqueue_t *q, senblk_t **sptrs, size_t n)
+{
+    struct timespec now;
+    size_t i;
+
+    if (n == 0 || q->owner == NULL)
+        return;
+    stats_clock(&now);
+    for (i=0;i<n;i++)
+        lat_record(&q->owner->stats.residency,&sptrs[i]->ts,&now);
+}
+#else
+#define lat_dequeued(q,sptrs,n)
+#endif
+
+/*
+ * Wake a consumer polling a queue's wake descriptor.  The consumer re-arms
+ * it each time it finds the queue empty so only one write is made per wait
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void wake_fd(ioqueue_t *q)
+{
+    if (__atomic_exchange_n(&q->waiting,0,__ATOMIC_SEQ_CST) == 0)
+        return;
+    /* Non-blocking: if the pipe is full the consumer has been woken anyway */
+    if (write(q->wakefd,"",1) < 0)
+        DEBUG2(7,"Queue wakeup write failed");
+}
+
+/*
+ * Update a lock-free queue's high water mark after an enqueue
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void lf_hwm(ioqueue_t *q)
+{
+    size_t depth,hwm;
+
+    depth=__atomic_load_n(&q->enqpos,__ATOMIC_RELAXED)-
+            __atomic_load_n(&q->deqpos,__ATOMIC_RELAXED);
+    /* deqpos may have been read after a consumer overtook us */
+    if ((long) depth <= 0 || depth > q->size)
+        return;
+    hwm=__atomic_load_n(&q->hwm,__ATOMIC_RELAXED);
+    while (depth > hwm && !__atomic_compare_exchange_n(&q->hwm,&hwm,depth,1,
+            __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+/*
+ * Wake any consumer waiting on a queue.  Only takes the queue mutex if
+ * there is a waiting consumer
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void lf_wake(ioqueue_t *q)
+{
+    /* Order our enqueue before reading "waiting": pairs with the fence in
+     * the consumer's increment of it before re-checking the queue */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->waiting,__ATOMIC_RELAXED) == 0)
+        return;
+    if (q->wakefd >= 0) {
+        wake_fd(q);
+        return;
+    }
+    pthread_mutex_lock(&q->q_mutex);
+    pthread_cond_broadcast(&q->freshmeat);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Wake any consumer waiting on a mutex protected or compact queue.  Called
+ * with q_mutex held
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void q_signal(ioqueue_t *q)
+{
+    if (q->waiting) {
+        if (q->wakefd >= 0)
+            wake_fd(q);
+        else
+            pthread_cond_broadcast(&q->freshmeat);
+    }
+}
+
+/*
+ * Copy bytes into a compact queue's ring, wrapping at the end
+ * Args: Pointer to queue, pointer to offset to copy to (advanced past what
+ * is copied), data and its length
+ * Returns: Nothing
+ */
+static void cq_put(ioqueue_t *q, size_t *off, const void *src, size_t len)
+{
+    size_t n;
+
+    if ((n=q->bsize-*off) > len)
+        n=len;
+    memcpy(q->bytes+*off,src,n);
+    memcpy(q->bytes,(const char *) src+n,len-n);
+    if ((*off+=len) >= q->bsize)
+        *off-=q->bsize;
+}
+
+/*
+ * Copy bytes out of a compact queue's ring, wrapping at the end
+ * Args: Pointer to queue, pointer to offset to copy from (advanced past
+ * what is copied), destination and length
+ * Returns: Nothing
+ */
+static void cq_get(ioqueue_t *q, size_t *off, void *dst, size_t len)
+{
+    size_t n;
+
+    if ((n=q->bsize-*off) > len)
+        n=len;
+    memcpy(dst,q->bytes+*off,n);
+    memcpy((char *) dst+n,q->bytes,len-n);
+    if ((*off+=len) >= q->bsize)
+        *off-=q->bsize;
+}
+
+/*
+ * Discard the oldest record on a compact queue.  Called with q_mutex held.
+ * The caller adjusts count
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void cq_skip(ioqueue_t *q)
+{
+    size_t off,len;
+
+    if ((off=q->bhead+CRECHDR-1) >= q->bsize)
+        off-=q->bsize;
+    len=CRECHDR+(unsigned char) q->bytes[off];
+    if ((q->bhead+=len) >= q->bsize)
+        q->bhead-=q->bsize;
+    q->bused-=len;
+}
+
+/*
+ * Copy a sentence onto the tail of a compact queue, making room according
+ * to the queue's overflow policy
+ * Args: Pointer to senblk (not consumed) and queue
+ * Returns: Nothing
+ */
+static void cq_add(senblk_t *sptr, ioqueue_t *q)
+{
+    size_t need=CRECHDR+sptr->len,off;
+    unsigned char len=sptr->len;
+
+    pthread_mutex_lock(&q->q_mutex);
+    while (q->bused+need > q->bsize) {
+        q->drops++;
+        DEBUG(4,"Dropped senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
+        if (q->policy == Q_NEWEST) {
+            pthread_mutex_unlock(&q->q_mutex);
+            return;
+        }
+        cq_skip(q);
+        q->count--;
+    }
+
+    if ((off=q->bhead+q->bused) >= q->bsize)
+        off-=q->bsize;
+    cq_put(q,&off,&sptr->src,sizeof(unsigned long));
+#ifdef KPLEX_LATENCY
+    cq_put(q,&off,&sptr->ts,sizeof(struct timespec));
+#endif
+    cq_put(q,&off,&len,1);
+    cq_put(q,&off,sptr->data,len);
+    q->bused+=need;
+    if (++q->count > q->hwm)
+        q->hwm=q->count;
+
+    q_signal(q);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Copy sentences from the head of a compact queue into pooled senblks.
+ * Called with q_mutex held
+ * Args: Pointer to queue, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ * Sentences for which no senblk can be had are dropped
+ */
+static size_t cq_take(ioqueue_t *q, senblk_t **sptrs, size_t max)
+{
+    senblk_t *sptr;
+    unsigned char len;
+    size_t n,off;
+
+    for (n=0;n<max && q->count;q->count--) {
+        if ((sptr=senblk_alloc()) == NULL) {
+            q->drops++;
+            cq_skip(q);
+            continue;
+        }
+        off=q->bhead;
+        cq_get(q,&off,&sptr->src,sizeof(unsigned long));
+#ifdef KPLEX_LATENCY
+        cq_get(q,&off,&sptr->ts,sizeof(struct timespec));
+#endif
+        cq_get(q,&off,&len,1);
+        cq_get(q,&off,sptr->data,len);
+        sptr->len=len;
+        q->bhead=off;
+        q->bused-=CRECHDR+len;
+        sptrs[n++]=sptr;
+    }
+    return(n);
+}
+
+/*
+ * Add a reference to a queue with priority lanes, dropping from the head of
+ * its lane (or dropping the new entry with "overflow=newest") if the lane is
+ * full
+ * Args: Pointer to senblk and queue
+ * Returns: Nothing
+ */
+static void lane_add(senblk_t *sptr, ioqueue_t *q)
+{
+    struct qlane *lane;
+    senblk_t *dropped=NULL;
+    size_t tail;
+    int i;
+
+    /* Done outside the lock as for priority filters */
+    for (i=0;i<q->nlanes-1 && senfilter(sptr,q->lanes[i].match);i++);
+    lane=&q->lanes[i];
+
+    pthread_mutex_lock(&q->q_mutex);
+    if (lane->count == lane->size) {
+        q->drops++;
+        DEBUG(4,"Dropped senblk q=%s lane %d",
+                (q->owner->name)?q->owner->name:"(unknown)",i+1);
+        if (q->policy == Q_NEWEST)
+            dropped=sptr;
+        else {
+            dropped=lane->ring[lane->head];
+            if (++lane->head == lane->size)
+                lane->head=0;
+            lane->count--;
+            q->count--;
+        }
+    }
+
+    if (dropped != sptr) {
+        if ((tail=lane->head+lane->count) >= lane->size)
+            tail-=lane->size;
+        lane->ring[tail]=sptr;
+        lane->count++;
+        if (++q->count > q->hwm)
+            q->hwm=q->count;
+
+        q_signal(q);
+    }
+    pthread_mutex_unlock(&q->q_mutex);
+
+    if (dropped)
+        senblk_unref(dropped);
+}
+
+/*
+ * Take references from a queue with priority lanes.  Called with q_mutex
+ * held
+ * Args: Pointer to queue, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ */
+static size_t lane_take(ioqueue_t *q, senblk_t **sptrs, size_t max)
+{
+    struct qlane *lane;
+    size_t n;
+    int i;
+
+    for (n=0;n<max && q->count;n++,q->count--) {
+        if (q->lanemode == LANE_WEIGHTED) {
+            /* The highest priority lane with entries and credit left.  When
+             * there isn't one, start a new round */
+            for (i=0;i<q->nlanes && (q->lanes[i].count == 0 ||
+                    q->lanes[i].credit == 0);i++);
+            if (i == q->nlanes) {
+                for (i=0;i<q->nlanes;i++)
+                    q->lanes[i].credit=q->lanes[i].weight;
+                for (i=0;q->lanes[i].count == 0;i++);
+            }
+            q->lanes[i].credit--;
+        } else
+            for (i=0;q->lanes[i].count == 0;i++);
+
+        lane=&q->lanes[i];
+        sptrs[n]=lane->ring[lane->head];
+        if (++lane->head == lane->size)
+            lane->head=0;
+        lane->count--;
+    }
+    return(n);
+}
+
+/*
+ * Take references from the head of a mutex protected or compact queue.
+ * Called with q_mutex held
+ * Args: Pointer to queue, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ */
+static size_t q_take(ioqueue_t *q, senblk_t **sptrs, size_t max)
+{
+    size_t n;
+
+    if (q->nlanes)
+        return(lane_take(q,sptrs,max));
+    if (q->compact)
+        return(cq_take(q,sptrs,max));
+    for (n=0;n<max && q->count;n++,q->count--) {
+        sptrs[n]=q->ring[q->head];
+        if (++q->head == q->size)
+            q->head=0;
+    }
+    return(n);
+}
+
+/*
+ * Drop all but the newest entries on a mutex protected or compact queue.
+ * Queues with priority lanes drop from the lowest priority lanes first.
+ * Called with q_mutex held unless the queue can no longer be used
+ * Args: Pointer to queue, number of entries to keep
+ * Returns: Nothing
+ */
+static void q_discard(ioqueue_t *q, size_t keep)
+{
+    struct qlane *lane;
+    int i;
+
+    for (;q->count > keep;q->count--) {
+        if (q->nlanes) {
+            for (i=q->nlanes-1;q->lanes[i].count == 0;i--);
+            lane=&q->lanes[i];
+            senblk_unref(lane->ring[lane->head]);
+            if (++lane->head == lane->size)
+                lane->head=0;
+            lane->count--;
+            continue;
+        }
+        if (q->compact) {
+            cq_skip(q);
+            continue;
+        }
+        senblk_unref(q->ring[q->head]);
+        if (++q->head == q->size)
+            q->head=0;
+    }
+}
+
+/*
+ * Count the priority lanes an interface's options ask for, checking they
+ * make sense
+ * Args: interface
+ * Returns: number of lanes including the last (0 if none), -1 with errno set
+ * if the options are invalid
+ */
+static int lanes_count(iface_t *ifa)
+{
+    struct laneconf *lc=&ifa->qlanes;
+    int i,n;
+
+    for (n=0;n<MAXLANES-1 && lc->match[n];n++);
+    for (i=n;i<MAXLANES-1;i++)
+        if (lc->match[i]) {
+            logerr(0,"lane%d requires lane%d",i+1,n+1);
+            errno=EINVAL;
+            return(-1);
+        }
+    if (n)
+        n++;
+    if (lc->nweights && lc->nweights != n) {
+        logerr(0,"laneweights needs a weight for each lane and one for "
+                "other sentences");
+        errno=EINVAL;
+        return(-1);
+    }
+    if (n && ifa->qpolicy > Q_NEWEST) {
+        logerr(0,"Priority lanes may only be used with overflow=oldest or "
+                "overflow=newest");
+        errno=EINVAL;
+        return(-1);
+    }
+    return(n);
+}
+
+/*
+ * Allocate a queue's priority lanes
+ * Args: queue, interface whose options define them, number of lanes and
+ * size of each
+ * Returns: 0 on success, -1 on failure
+ */
+static int lanes_init(ioqueue_t *q, iface_t *ifa, int nlanes, size_t size)
+{
+    struct laneconf *lc=&ifa->qlanes;
+    struct qlane *lane;
+    int i;
+
+    if ((q->lanes=(struct qlane *) pool_alloc(nlanes*sizeof(struct qlane),
+            &ifa->mem)) == NULL)
+        return(-1);
+    for (i=0;i<nlanes;i++) {
+        lane=&q->lanes[i];
+        if ((lane->ring=(senblk_t **) pool_alloc(size*sizeof(senblk_t *),
+                &ifa->mem)) == NULL) {
+            while (i--)
+                pool_free(q->lanes[i].ring);
+            pool_free(q->lanes);
+            q->lanes=NULL;
+            return(-1);
+        }
+        lane->size=size;
+        lane->match=(i < nlanes-1)?lc->match[i]:NULL;
+        /* By default each lane gets twice the share of the one below */
+        lane->weight=(lc->nweights)?lc->weight[i]:1U << (nlanes-1-i);
+        lane->credit=lane->weight;
+    }
+    q->nlanes=nlanes;
+    q->lanemode=lc->mode;
+    return(0);
+}
+
+/*
+ *  Initialise an ioqueue
+ *  Args: iface_t to add queue to, size of queue (in senblk structures)
+ *  Returns: 0 on success, -1 on failure
+ *  The queue's overflow policy is taken from the interface.  Queues which
+ *  grow or keep priority sentences always use the mutex protected ring, as
+ *  do queues with priority lanes (each lane having room for size entries).
+ *  Otherwise the interface's qstore option may ask for a compact queue,
+ *  overriding qtype.  Queue memory is pooled and charged to the interface
+ */
+int init_q(iface_t *ifa, size_t size)
+{
+    ioqueue_t *newq;
+    int    i,nlanes;
+
+    if (ifa->qpolicy == Q_PRIORITY && ifa->qprio == NULL) {
+        logerr(0,"overflow=priority requires a priority filter");
+        errno=EINVAL;
+        return(-1);
+    }
+    if ((nlanes=lanes_count(ifa)) < 0)
+        return(-1);
+
+    if ((newq=(ioqueue_t *)pool_alloc(sizeof(ioqueue_t),&ifa->mem)) == NULL)
+        return(-1);
+    newq->policy=ifa->qpolicy;
+
+    if (nlanes) {
+        if (lanes_init(newq,ifa,nlanes,size) < 0) {
+            i=errno;
+            pool_free(newq);
+            errno=i;
+            return(-1);
+        }
+    } else if (ifa->qcompact && newq->policy <= Q_NEWEST) {
+        newq->bsize=size*(CRECHDR+SENBUFSZ);
+        if ((newq->bytes=(char *)pool_alloc(newq->bsize,&ifa->mem)) == NULL) {
+            i=errno;
+            pool_free(newq);
+            errno=i;
+            return(-1);
+        }
+        newq->compact=1;
+    } else if (lockfreeq && newq->policy <= Q_NEWEST) {
+        if ((newq->cells=(struct qcell *)pool_alloc(size*sizeof(struct qcell),
+                &ifa->mem)) == NULL) {
+            i=errno;
+            pool_free(newq);
+            errno=i;
+            return(-1);
+        }
+        for (i=0;i<size;i++)
+            newq->cells[i].seq=i;
+        newq->lockfree=1;
+    } else if ((newq->ring=(senblk_t **)pool_alloc(size*sizeof(senblk_t *),
+            &ifa->mem)) == NULL || (newq->policy == Q_PRIORITY &&
+            (newq->isprio=(unsigned char *) pool_alloc(size,&ifa->mem))
+            == NULL)) {
+        i=errno;
+        pool_free(newq->ring);
+        pool_free(newq);
+        errno=i;
+        return(-1);
+    }
+
+    if (newq->policy == Q_PRIORITY)
+        newq->prio=ifa->qprio;
+    else if (newq->policy == Q_GROW) {
+        newq->minsize=size;
+        if ((newq->maxsize=(ifa->qmax)?ifa->qmax:DEFQMAX) < size)
+            newq->maxsize=size;
+    }
+
+    newq->size=(nlanes)?size*nlanes:size;
+    newq->owner=ifa;
+    newq->wakefd=-1;
+
+    pthread_mutex_init(&newq->q_mutex,NULL);
+    if ((i=wait_cond_init(&newq->freshmeat))) {
+        free_q(newq);
+        errno=i;
+        return(-1);
+    }
+
+    newq->active=1;
+    ifa->q=newq;
+    return(0);
+}
+
+/*
+ *  Free an ioqueue, dropping references to anything still on it
+ *  Args: Queue to be freed
+ *  Returns: Nothing
+ *  The queue must no longer be reachable from the engine
+ */
+void free_q(ioqueue_t *q)
+{
+    senblk_t *sptr;
+    int i;
+
+    if (q == NULL)
+        return;
+
+    if (q->lockfree) {
+        while ((sptr=lf_dequeue(q)))
+            senblk_unref(sptr);
+        pool_free(q->cells);
+    } else {
+        q_discard(q,0);
+        for (i=0;i<q->nlanes;i++)
+            pool_free(q->lanes[i].ring);
+        pool_free(q->lanes);
+        pool_free(q->ring);
+        pool_free(q->isprio);
+        pool_free(q->bytes);
+    }
+    pool_free(q);
+}
+
+/*
+ *  Copy information in a senblk structure (data and len only)
+ *  Args: pointers to dest and source senblk structures
+ *  Returns: pointer to dest senblk
+ */
+senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
+{
+    dptr->len=sptr->len;
+    dptr->src=sptr->src;
+    dptr->next=NULL;
+#ifdef KPLEX_LATENCY
+    dptr->ts=sptr->ts;
+#endif
+    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
+            sptr->len);
+}
+
+/*
+ * Copy a mutex protected queue's ring into a new one of a different size.
+ * Called with q_mutex held
+ * Args: Pointer to queue, new size (no smaller than the number queued)
+ * Returns: 0 on success, -1 on failure (the queue is unchanged)
+ */
+static int q_resize(ioqueue_t *q, size_t size)
+{
+    senblk_t **ring;
+    size_t i,j;
+
+    /* Fails if this would exceed the memory limit: the queue then behaves
+     * as if at its maximum size */
+    if ((ring=(senblk_t **) pool_alloc(size*sizeof(senblk_t *),
+            &q->owner->mem)) == NULL)
+        return(-1);
+    for (i=0,j=q->head;i<q->count;i++) {
+        ring[i]=q->ring[j];
+        if (++j == q->size)
+            j=0;
+    }
+    pool_free(q->ring);
+    q->ring=ring;
+    q->head=0;
+    q->size=size;
+    DEBUG(5,"Queue for %s resized to %zu",
+            (q->owner->name)?q->owner->name:"(unknown)",size);
+    return(0);
+}
+
+/*
+ * Give back memory a grown queue no longer needs once its consumer has
+ * caught up.  Called by consumers with q_mutex held
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+static void q_shrink(ioqueue_t *q)
+{
+    size_t size;
+
+    if (q->policy != Q_GROW || q->size == q->minsize || q->count > q->size/4)
+        return;
+    if ((size=q->size/2) < q->minsize)
+        size=q->minsize;
+    (void) q_resize(q,size);
+}
+
+/*
+ * Make room in a full mutex protected queue according to its overflow
+ * policy.  Called with q_mutex held
+ * Args: Pointer to queue, pointer to the senblk being added and whether it
+ * passes the queue's priority filter
+ * Returns: Reference removed from the queue to be dropped, sptr if the new
+ * senblk should be dropped instead or NULL if the queue has grown
+ */
+static senblk_t *q_overflow(ioqueue_t *q, senblk_t *sptr, int prio)
+{
+    senblk_t *dropped;
+    size_t i,j,k,size;
+
+    switch (q->policy) {
+    case Q_NEWEST:
+        return(sptr);
+    case Q_GROW:
+        if (q->size < q->maxsize) {
+            if ((size=q->size*2) > q->maxsize)
+                size=q->maxsize;
+            if (q_resize(q,size) == 0)
+                return(NULL);
+        }
+        break;
+    case Q_PRIORITY:
+        /* Find the oldest entry we're allowed to drop */
+        for (i=0,j=q->head;i<q->count && q->isprio[j];i++)
+            if (++j == q->size)
+                j=0;
+        if (i == q->count) {
+            /* Everything queued is wanted: drop the new entry unless it is
+             * too, in which case fall back to dropping the oldest */
+            if (!prio)
+                return(sptr);
+            break;
+        }
+        /* Close the gap by moving the entries in front of it up one */
+        dropped=q->ring[j];
+        for (;i;i--,j=k) {
+            k=(j)?j-1:q->size-1;
+            q->ring[j]=q->ring[k];
+            q->isprio[j]=q->isprio[k];
+        }
+        if (++q->head == q->size)
+            q->head=0;
+        q->count--;
+        return(dropped);
+    default:
+        break;
+    }
+
+    /* Steal from the head of the queue, dropping previous contents */
+    dropped=q->ring[q->head];
+    if (++q->head == q->size)
+        q->head=0;
+    q->count--;
+    return(dropped);
+}
+
+/*
+ * Add a reference to a senblk to the tail of an ioqueue.  If the queue is
+ * full, what is dropped depends on its overflow policy
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+static void enqueue_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_t *dropped=NULL;
+    size_t tail;
+    int prio=0;
+
+    if (q->compact) {
+        cq_add(sptr,q);
+        senblk_unref(sptr);
+        return;
+    }
+
+    if (q->nlanes) {
+        lane_add(sptr,q);
+        return;
+    }
+
+    if (q->lockfree) {
+        while (lf_enqueue(q,sptr) < 0) {
+            if (q->policy == Q_NEWEST)
+                dropped=sptr;
+            /* Steal from the head of the queue, dropping previous contents */
+            else if ((dropped=lf_dequeue(q)) == NULL)
+                continue;
+            __atomic_add_fetch(&q->drops,1,__ATOMIC_RELAXED);
+            DEBUG(4,"Dropped senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
+            senblk_unref(dropped);
+            if (dropped == sptr)
+                return;
+        }
+        lf_hwm(q);
+        lf_wake(q);
+        return;
+    }
+
+    /* Done outside the lock: senfilter() is safe for several engine
+     * threads to call at once */
+    if (q->prio)
+        prio=(senfilter(sptr,q->prio) == 0);
+
+    pthread_mutex_lock(&q->q_mutex);
+
+    if (q->count == q->size && (dropped=q_overflow(q,sptr,prio))) {
+        q->drops++;
+        DEBUG(4,"Dropped senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
+    }
+
+    if (dropped != sptr) {
+        if ((tail=q->head+q->count) >= q->size)
+            tail-=q->size;
+        q->ring[tail]=sptr;
+        if (q->isprio)
+            q->isprio[tail]=prio;
+        if (++q->count > q->hwm)
+            q->hwm=q->count;
+
+        q_signal(q);
+    }
+    pthread_mutex_unlock(&q->q_mutex);
+
+    if (dropped)
+        senblk_unref(dropped);
+}
+
+/*
+ * Copy a senblk into the pool and add it to an ioqueue
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+void push_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    if (sptr == NULL) {
+        /* NULL senblk pointer is magic "off" switch for a queue */
+        pthread_mutex_lock(&q->q_mutex);
+        q->active = 0;
+        if (q->wakefd >= 0)
+            wake_fd(q);
+        pthread_cond_broadcast(&q->freshmeat);
+        pthread_mutex_unlock(&q->q_mutex);
+        return;
+    }
+
+    /* Compact queues copy the sentence anyway */
+    if (q->compact) {
+        cq_add(sptr,q);
+        return;
+    }
+
+    if ((tptr=senblk_alloc()) == NULL) {
+        DEBUG(4,"No memory for senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
+        return;
+    }
+    (void) senblk_copy(tptr,sptr);
+    enqueue_senblk(tptr,q);
+}
+
+/*
+ * Add a reference to an existing pooled senblk to an ioqueue without copying
+ * it.  Used by the engine to distribute sentences to outputs
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+void link_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    enqueue_senblk(senblk_ref(sptr),q);
+}
+
+/*
+ * Take an additional reference to a senblk, for example to hold it on a
+ * private list.  The reference is released with senblk_free()
+ * Args: Pointer to senblk
+ * Returns: Pointer to senblk
+ */
+senblk_t *senblk_ref(senblk_t *sptr)
+{
+    __atomic_add_fetch(&sptr->refs,1,__ATOMIC_RELAXED);
+    return(sptr);
+}
+
+/*
+ *  Cancellation cleanup handler releasing a queue's mutex
+ *  Args: Queue (cast to void *)
+ *  Returns: Nothing
+ */
+static void unlock_q(void *q)
+{
+    pthread_mutex_unlock(&((ioqueue_t *) q)->q_mutex);
+}
+
+/*
+ *  Wait on a queue's condition variable, optionally with a timeout
+ *  Args: Queue to wait on (with q_mutex held), absolute time to give up at
+ *  or NULL to wait indefinitely
+ *  Returns: 0 if woken, ETIMEDOUT if the timeout expired
+ */
+static int wait_q(ioqueue_t *q, const struct timespec *abstime)
+{
+    int ret=0;
+
+    /* The consumer may be cancelled here, in which case it must not exit
+     * holding the mutex the engine needs to add to the queue */
+    pthread_cleanup_push(unlock_q,q);
+    if (abstime == NULL)
+        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    else
+        ret=pthread_cond_timedwait(&q->freshmeat,&q->q_mutex,abstime);
+    pthread_cleanup_pop(0);
+    return(ret);
+}
+
+/*
+ *  Get the next senblk from the head of a lock-free queue
+ *  Args: Queue to retrieve from, absolute timeout or NULL to wait
+ *  indefinitely
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active or the timeout expired
+ *  Only blocks on the queue mutex if the queue is empty
+ */
+static senblk_t *lf_next_senblk(ioqueue_t *q, const struct timespec *abstime)
+{
+    senblk_t *tptr;
+    int timedout=0;
+
+    while ((tptr=lf_dequeue(q)) == NULL) {
+        pthread_mutex_lock(&q->q_mutex);
+        __atomic_add_fetch(&q->waiting,1,__ATOMIC_SEQ_CST);
+        /* Re-check now that producers can see we're waiting */
+        if ((tptr=lf_dequeue(q)) == NULL) {
+            if (!q->active || timedout) {
+                /* Return NULL if the queue has been shut down */
+                __atomic_sub_fetch(&q->waiting,1,__ATOMIC_RELAXED);
+                pthread_mutex_unlock(&q->q_mutex);
+                errno=(q->active)?ETIMEDOUT:0;
+                return ((senblk_t *)NULL);
+            }
+            timedout=(wait_q(q,abstime) == ETIMEDOUT);
+        }
+        __atomic_sub_fetch(&q->waiting,1,__ATOMIC_RELAXED);
+        pthread_mutex_unlock(&q->q_mutex);
+        if (tptr)
+            break;
+    }
+    return(tptr);
+}
+
+/*
+ *  Get the next senblk from the head of a queue, waiting at most until a
+ *  given time for one to arrive
+ *  Args: Queue to retrieve from, absolute timeout (see wait_abstime()) or
+ *  NULL to wait indefinitely
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active (errno 0) or the timeout expired (errno ETIMEDOUT)
+ *  The caller owns the returned reference and must release it with
+ *  senblk_free()
+ */
+senblk_t *next_senblk_timed(ioqueue_t *q, const struct timespec *abstime)
+{
+    senblk_t *tptr;
+    int timedout=0;
+
+    if (q->lockfree) {
+        if ((tptr=lf_next_senblk(q,abstime)))
+            lat_dequeued(q,&tptr,1);
+        return(tptr);
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    while (q_take(q,&tptr,1) == 0) {
+        /* No data available for reading */
+        if (!q->active || timedout) {
+            /* Return NULL if the queue has been shut down */
+            errno=(q->active)?ETIMEDOUT:0;
+            pthread_mutex_unlock(&q->q_mutex);
+            return ((senblk_t *)NULL);
+        }
+        /* Wait until something is available */
+        q->waiting++;
+        timedout=(wait_q(q,abstime) == ETIMEDOUT);
+        q->waiting--;
+    }
+    q_shrink(q);
+    pthread_mutex_unlock(&q->q_mutex);
+    lat_dequeued(q,&tptr,1);
+    return(tptr);
+}
+
+/*
+ *  Get the next senblk from the head of a queue
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ *  The caller owns the returned reference and must release it with
+ *  senblk_free()
+ */
+senblk_t *next_senblk(ioqueue_t *q)
+{
+    return(next_senblk_timed(q,NULL));
+}
+
+/*
+ *  Get up to max senblks from the head of a queue in one go, waiting at most
+ *  until a given time for the first
+ *  Args: Queue to retrieve from, array to return senblks in and its size,
+ *  absolute timeout (see wait_abstime()) or NULL to wait indefinitely
+ *  Returns: Number of senblks returned or 0 if the queue is no longer active
+ *  (errno 0) or the timeout expired (errno ETIMEDOUT)
+ *  The caller owns the returned references
+ */
+size_t next_senblk_batch_timed(ioqueue_t *q, senblk_t **sptrs, size_t max,
+        const struct timespec *abstime)
+{
+    size_t n;
+    int timedout=0;
+
+    if (q->lockfree) {
+        if ((sptrs[0]=lf_next_senblk(q,abstime)) == NULL)
+            return(0);
+        for (n=1;n<max && (sptrs[n]=lf_dequeue(q));n++);
+        lat_dequeued(q,sptrs,n);
+        return(n);
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    while ((n=q_take(q,sptrs,max)) == 0) {
+        if (!q->active || timedout) {
+            errno=(q->active)?ETIMEDOUT:0;
+            pthread_mutex_unlock(&q->q_mutex);
+            return(0);
+        }
+        q->waiting++;
+        timedout=(wait_q(q,abstime) == ETIMEDOUT);
+        q->waiting--;
+    }
+    q_shrink(q);
+    pthread_mutex_unlock(&q->q_mutex);
+    lat_dequeued(q,sptrs,n);
+    return(n);
+}
+
+/*
+ *  Get up to max senblks from the head of a queue in one go
+ *  Args: Queue to retrieve from, array to return senblks in and its size
+ *  Returns: Number of senblks returned or 0 if the queue is no longer active
+ *  This function blocks until at least one senblk is available or the queue
+ *  is shut down.  The caller owns the returned references
+ */
+size_t next_senblk_batch(ioqueue_t *q, senblk_t **sptrs, size_t max)
+{
+    return(next_senblk_batch_timed(q,sptrs,max,NULL));
+}
+
+/*
+ *  Get up to max senblks from the head of a queue without blocking
+ *  Args: Queue to retrieve from, array to return senblks in and its size
+ *  Returns: Number of senblks returned
+ *  For queues with a wake descriptor.  If the queue is empty the descriptor
+ *  is armed so that it is written to when data next arrive: callers must
+ *  only poll it after a call which returned 0.  The caller owns the returned
+ *  references
+ */
+size_t try_senblk_batch(ioqueue_t *q, senblk_t **sptrs, size_t max)
+{
+    size_t n;
+
+    if (q->lockfree) {
+        for (n=0;n<max && (sptrs[n]=lf_dequeue(q));n++);
+        if (n == 0) {
+            __atomic_store_n(&q->waiting,1,__ATOMIC_SEQ_CST);
+            /* Re-check now that producers can see we're waiting */
+            for (n=0;n<max && (sptrs[n]=lf_dequeue(q));n++);
+        }
+        lat_dequeued(q,sptrs,n);
+        return(n);
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    if ((n=q_take(q,sptrs,max)) == 0)
+        q->waiting=1;
+    else
+        q_shrink(q);
+    pthread_mutex_unlock(&q->q_mutex);
+    lat_dequeued(q,sptrs,n);
+    return(n);
+}
+
+/*
+ *  Get the last senblk from a queue, discarding all before it
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to last senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+senblk_t *last_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr,*nptr;
+
+    if (q->lockfree) {
+        for (tptr=NULL;(nptr=lf_dequeue(q));tptr=nptr)
+            if (tptr)
+                senblk_unref(tptr);
+        if (tptr == NULL && (tptr=lf_next_senblk(q,NULL)) == NULL)
+            return(NULL);
+        lat_dequeued(q,&tptr,1);
+        return(tptr);
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    /* Drop references to all but last senblk on the queue */
+    q_discard(q,1);
+    pthread_mutex_unlock(&q->q_mutex);
+
+    return(next_senblk(q));
+}
+
+/*
+ * Flush a queue, dropping references to anything on it
+ * Args: Queue to be flushed
+ * Returns: Nothing
+ * Side Effect: senblks no longer referenced by any queue are returned to the
+ * pool
+ */
+void flush_queue(ioqueue_t *q)
+{
+    senblk_t *sptr;
+
+    if (q->lockfree) {
+        while ((sptr=lf_dequeue(q)))
+            senblk_unref(sptr);
+        return;
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    q_discard(q,0);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Count sentences dropped on a queue's behalf by its consumer, e.g. by a tcp
+ * server reactor from its connections' rings
+ * Args: Queue and number of drops
+ * Returns: Nothing
+ * Producers update drops under q_mutex, or atomically for lock free queues,
+ * so this does both
+ */
+void q_dropped(ioqueue_t *q, unsigned long n)
+{
+    if (q->lockfree) {
+        __atomic_add_fetch(&q->drops,n,__ATOMIC_RELAXED);
+        return;
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    q->drops+=n;
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Release a senblk obtained from a queue
+ * Args: pointer to senblk, and pointer to the queue it was taken from
+ * Returns: Nothing
+ */
+void senblk_free(senblk_t *sptr, ioqueue_t *q)
+{
+#ifdef KPLEX_LATENCY
+    struct timespec now;
+
+    /* Outputs release senblks once they have been written */
+    if (q && q->owner) {
+        stats_clock(&now);
+        lat_record(&q->owner->stats.completion,&sptr->ts,&now);
+    }
+#else
+    (void) q;
+#endif
+    senblk_unref(sptr);
+}
@@ -0,0 +1,1004 @@
+/* reactor.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Event driven tcp server.  With "reactor=yes" a single thread accepts and
+ * services all connections to a tcp server interface using non-blocking
+ * I/O, rather than running one thread for each direction of each
+ * connection.  Each connection costs a small structure: a parser for input
+ * and a ring of sentences waiting to be written for output.
+ *
+ * The server interface has a single queue fed by the engine.  The reactor
+ * takes batches from it and gives each connection a reference to each
+ * sentence.  The queue's wake descriptor is a pipe polled alongside the
+ * sockets so the thread only ever blocks in epoll_wait() (or poll() where
+ * epoll is not available).
+ *
+ * With "reactor=uring" on a kplex built with "make IOURING=1" the thread
+ * instead waits in io_uring_enter().  The listening socket has a multishot
+ * accept and each connection a multishot receive into buffers provided to
+ * the kernel, so reading costs no system calls of its own.  Writes are still
+ * made directly by the reactor; a connection which can't take more output
+ * waits for a poll request to complete.  If io_uring can't be set up (e.g.
+ * on kernels before 6.0) epoll is used
+ */
+
+#include "kplex.h"
+#include "tcp.h"
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#else
+#include <poll.h>
+#endif
+#ifdef KPLEX_IOURING
+#include "uring.h"
+#include <poll.h>
+#endif
+
+#define RXEVENTS 64     /* Maximum events returned per epoll_wait() */
+#define RXBATCHES 4     /* Queue batches handled before checking sockets */
+#define OBUFSIZ (WRITEBATCH * (SENBUFSZ + TAGMAX))
+
+#ifdef KPLEX_IOURING
+#define RXURENTRIES 256 /* io_uring submission queue size */
+#define RXBUFS 64       /* Receive buffers provided to the kernel */
+#define RXBGID 0        /* Their buffer group */
+/* Kinds of request, encoded in the low bits of the request's user data */
+#define UD_ACCEPT 0
+#define UD_WAKE 1
+#define UD_RECV 2
+#define UD_POLLOUT 3
+#define UD_MASK 3
+#define UD(ptr,kind) ((unsigned long) (ptr) | (kind))
+#endif
+
+struct tcp_conn {
+    int fd;                 /* -1 once closed, until swept */
+    unsigned long id;
+    int blocked;            /* Waiting for socket to become writable */
+    senblk_t **ring;        /* Sentences waiting to be written */
+    unsigned char *isprio;  /* overflow=priority: which ring entries pass
+                               the priority filter */
+    size_t head;
+    size_t count;
+    char *obuf;             /* Unwritten remainder of a short write */
+    size_t ooff;
+    size_t olen;
+    size_t *mem;            /* Server's counter connection memory is
+                               charged to */
+#ifdef KPLEX_IOURING
+    int inflight;           /* io_uring requests outstanding */
+    int pollout;            /* A poll for writability is outstanding */
+#endif
+    struct nmea_parser parser;
+};
+
+struct tcp_reactor {
+    size_t qsize;
+    int wake[2];            /* Pipe written by producers to the queue */
+#ifdef HAVE_EPOLL
+    int epfd;
+#else
+    struct pollfd *pfds;
+    size_t npfds;
+#endif
+    size_t nconns;
+    size_t maxconns;
+    struct tcp_conn **conns;
+    char *tagbuf;
+#ifdef KPLEX_IOURING
+    int useuring;           /* reactor=uring was specified */
+    struct uring *ur;       /* Non-NULL once io_uring is in use */
+#endif
+};
+
+/*
+ * Set a descriptor non-blocking
+ * Args: file descriptor
+ * Returns: 0 on success, -1 on error
+ */
+static int set_nonblock(int fd)
+{
+    int fl;
+
+    if ((fl=fcntl(fd,F_GETFL)) < 0)
+        return(-1);
+    return(fcntl(fd,F_SETFL,fl|O_NONBLOCK));
+}
+
+#ifdef HAVE_EPOLL
+/*
+ * Register a descriptor with the reactor's epoll instance
+ * Args: reactor, descriptor, events and pointer to return with events
+ * Returns: 0 on success, -1 on error
+ */
+static int ev_ctl(struct tcp_reactor *rx, int op, int fd, unsigned events,
+        void *ptr)
+{
+    struct epoll_event ev;
+
+    memset(&ev,0,sizeof(ev));
+    ev.events=events;
+    ev.data.ptr=ptr;
+    return(epoll_ctl(rx->epfd,op,fd,&ev));
+}
+#endif
+
+/*
+ * Note whether a connection is waiting to be able to write
+ * Args: reactor, connection, 1 if blocked, 0 otherwise
+ * Returns: Nothing
+ */
+static void set_blocked(struct tcp_reactor *rx, struct tcp_conn *c, int on)
+{
+#ifdef KPLEX_IOURING
+    struct io_uring_sqe *sqe;
+
+#endif
+    if (c->blocked == on)
+        return;
+    c->blocked=on;
+#ifdef KPLEX_IOURING
+    if (rx->ur) {
+        if (on && !c->pollout) {
+            if ((sqe=uring_sqe(rx->ur)) == NULL) {
+                logerr(errno,"Failed to wait for connection %x to be writable",
+                        c->id);
+                return;
+            }
+            uring_prep_poll(sqe,c->fd,POLLOUT,0);
+            sqe->user_data=UD(c,UD_POLLOUT);
+            c->pollout=1;
+            c->inflight++;
+        }
+        return;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if (ev_ctl(rx,EPOLL_CTL_MOD,c->fd,EPOLLIN|(on?EPOLLOUT:0),c) < 0)
+        logerr(errno,"Failed to update events for connection %x",c->id);
+#endif
+}
+
+/*
+ * Close a connection.  The structure is freed later by sweep_conns() so
+ * that events already returned for it can safely be ignored
+ * Args: server interface, connection, reason for debug output
+ * Returns: Nothing
+ */
+static void conn_close(iface_t *ifa, struct tcp_conn *c, char *why)
+{
+    DEBUG(3,"%s: connection id %x closed: %s",ifa->name,c->id,why);
+#ifdef KPLEX_IOURING
+    /* io_uring holds its own reference to the socket: shutting it down
+     * makes outstanding requests complete */
+    if (c->inflight)
+        shutdown(c->fd,SHUT_RDWR);
+#endif
+    close(c->fd);
+    c->fd=-1;
+}
+
+/*
+ * Free a connection structure and anything waiting on it
+ * Args: connection, size of its ring
+ * Returns: Nothing
+ */
+static void conn_free(struct tcp_conn *c, size_t qsize)
+{
+    if (c->ring) {
+        for (;c->count;c->count--) {
+            senblk_free(c->ring[c->head],NULL);
+            if (++c->head == qsize)
+                c->head=0;
+        }
+        pool_free(c->ring);
+    }
+    pool_free(c->isprio);
+    parser_release(&c->parser);
+    pool_free(c->obuf);
+    pool_free(c);
+}
+
+/*
+ * Free closed connections
+ * Args: reactor
+ * Returns: Nothing
+ */
+static void sweep_conns(struct tcp_reactor *rx)
+{
+    size_t i;
+
+    for (i=0;i<rx->nconns;) {
+        if (rx->conns[i]->fd >= 0
+#ifdef KPLEX_IOURING
+                /* Wait for completions which refer to the connection */
+                || rx->conns[i]->inflight
+#endif
+                ) {
+            i++;
+            continue;
+        }
+        conn_free(rx->conns[i],rx->qsize);
+        rx->conns[i]=rx->conns[--rx->nconns];
+    }
+}
+
+#ifdef KPLEX_IOURING
+/*
+ * Start a multishot receive on a connection
+ * Args: reactor, connection
+ * Returns: 0 on success, -1 on failure
+ */
+static int arm_recv(struct tcp_reactor *rx, struct tcp_conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe=uring_sqe(rx->ur)) == NULL)
+        return(-1);
+    sqe->opcode=IORING_OP_RECV;
+    sqe->fd=c->fd;
+    sqe->ioprio=IORING_RECV_MULTISHOT;
+    sqe->flags=IOSQE_BUFFER_SELECT;
+    sqe->buf_group=RXBGID;
+    sqe->user_data=UD(c,UD_RECV);
+    c->inflight++;
+    return(0);
+}
+#endif
+
+/*
+ * Start waiting for input on a new connection
+ * Args: reactor, connection
+ * Returns: 0 on success, -1 on failure
+ */
+static int conn_watch(struct tcp_reactor *rx, struct tcp_conn *c)
+{
+#ifdef KPLEX_IOURING
+    if (rx->ur)
+        return(arm_recv(rx,c));
+#endif
+#ifdef HAVE_EPOLL
+    return(ev_ctl(rx,EPOLL_CTL_ADD,c->fd,EPOLLIN,c));
+#else
+    (void) rx;
+    (void) c;
+    return(0);
+#endif
+}
+
+/*
+ * Set up a new connection
+ * Args: server interface, reactor, descriptor of accepted socket
+ * Returns: 0 on success, -1 on failure
+ */
+static int conn_new(iface_t *ifa, struct tcp_reactor *rx, int fd)
+{
+    struct tcp_conn *c,**cp;
+    size_t newmax;
+    int on=1;
+
+    if (rx->nconns == rx->maxconns) {
+        newmax=(rx->maxconns)?rx->maxconns*2:16;
+        if ((cp=(struct tcp_conn **) realloc(rx->conns,
+                newmax*sizeof(struct tcp_conn *))) == NULL)
+            return(-1);
+        rx->conns=cp;
+        rx->maxconns=newmax;
+    }
+
+    if ((c=(struct tcp_conn *) pool_alloc(sizeof(struct tcp_conn),
+            &ifa->mem)) == NULL)
+        return(-1);
+    c->mem=&ifa->mem;
+
+    if (ifa->direction != IN) {
+        if ((c->ring=(senblk_t **) pool_alloc(rx->qsize*sizeof(senblk_t *),
+                &ifa->mem)) == NULL || (ifa->q->policy == Q_PRIORITY &&
+                (c->isprio=(unsigned char *) pool_alloc(rx->qsize,&ifa->mem))
+                == NULL)) {
+            pool_free(c->ring);
+            pool_free(c);
+            return(-1);
+        }
+        if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0)
+            logerr(errno,"Could not disable Nagle on new tcp connection");
+    }
+
+    c->fd=fd;
+    c->id=ifa->id+(fd&IDMINORMASK);
+    parser_init(&c->parser,ifa,engine_q(ifa->lists,c->id),c->id);
+
+    if (set_nonblock(fd) < 0 || conn_watch(rx,c) < 0) {
+        parser_release(&c->parser);
+        pool_free(c->ring);
+        pool_free(c->isprio);
+        pool_free(c);
+        return(-1);
+    }
+
+    rx->conns[rx->nconns++]=c;
+    return(0);
+}
+
+/*
+ * Accept all pending connections
+ * Args: server interface, reactor
+ * Returns: Nothing
+ */
+static void conn_accept(iface_t *ifa, struct tcp_reactor *rx)
+{
+    struct if_tcp *ift=(struct if_tcp *)ifa->info;
+    struct sockaddr_storage sad;
+    socklen_t slen;
+    char addrs[INET6_ADDRSTRLEN];
+    int afd,failed;
+
+    for (;;) {
+        slen = sizeof(struct sockaddr_storage);
+        if ((afd = accept(ift->fd,(struct sockaddr *) &sad,&slen)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logerr(errno,"accept failed for connection to %s",ifa->name);
+            return;
+        }
+
+        if ((failed=conn_new(ifa,rx,afd)) < 0) {
+            logerr(errno,"Failed to set up new connection");
+            close(afd);
+        }
+        DEBUG(3,"%s: New connection id %x %ssuccessfully received from %s",
+                ifa->name,ifa->id+(afd&IDMINORMASK),(failed)?"un":"",
+                inet_ntop(sad.ss_family,(sad.ss_family == AF_INET)?
+                (const void *) &((struct sockaddr_in *)&sad)->sin_addr:
+                (const void *) &((struct sockaddr_in6 *)&sad)->sin6_addr,
+                addrs,INET6_ADDRSTRLEN));
+    }
+}
+
+/*
+ * Read from a connection, parsing any sentences received
+ * Args: server interface, connection, buffer of BUFSIZ bytes
+ * Returns: Nothing
+ * Data are discarded for output-only servers but reading lets us notice
+ * clients disconnecting
+ */
+static void conn_read(iface_t *ifa, struct tcp_conn *c, char *buf)
+{
+    ssize_t nread;
+
+    if ((nread=read(c->fd,buf,BUFSIZ)) > 0) {
+        if (ifa->direction != OUT)
+            parse_nmea(&c->parser,buf,nread);
+    } else if (nread == 0)
+        conn_close(ifa,c,"EOF");
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        conn_close(ifa,c,strerror(errno));
+}
+
+/*
+ * Save what wasn't sent of a short write
+ * Args: connection, iovec written and number of entries in it, bytes sent
+ * Returns: 0 on success, -1 on failure
+ */
+static int save_unsent(struct tcp_conn *c, struct iovec *iov, int cnt,
+        size_t sent)
+{
+    int i;
+
+    if (c->obuf == NULL && (c->obuf=(char *) pool_alloc(OBUFSIZ,c->mem))
+            == NULL)
+        return(-1);
+
+    c->ooff=c->olen=0;
+    for (i=0;i<cnt;i++) {
+        if (sent >= iov[i].iov_len) {
+            sent-=iov[i].iov_len;
+            continue;
+        }
+        memcpy(c->obuf+c->olen,(char *)iov[i].iov_base+sent,
+                iov[i].iov_len-sent);
+        c->olen+=iov[i].iov_len-sent;
+        sent=0;
+    }
+    return(0);
+}
+
+/*
+ * Write as much waiting output as a connection will take without blocking
+ * Args: server interface, reactor, connection
+ * Returns: Nothing
+ */
+static void conn_flush(iface_t *ifa, struct tcp_reactor *rx,
+        struct tcp_conn *c)
+{
+    senblk_t *sptrs[WRITEBATCH];
+    struct iovec iov[WRITEBATCH*3];
+    struct timespec start;
+    size_t i,n,total;
+    ssize_t sent;
+    int cnt;
+
+    for (;;) {
+        if (c->olen) {
+            if ((sent=write(c->fd,c->obuf+c->ooff,c->olen)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    set_blocked(rx,c,1);
+                else
+                    conn_close(ifa,c,strerror(errno));
+                return;
+            }
+            STATADD(&ifa->stats,bytes_out,sent);
+            c->ooff+=sent;
+            if ((c->olen-=sent)) {
+                set_blocked(rx,c,1);
+                return;
+            }
+        }
+
+        if (c->count == 0) {
+            set_blocked(rx,c,0);
+            return;
+        }
+
+        for (n=0;n<WRITEBATCH && c->count;n++,c->count--) {
+            sptrs[n]=c->ring[c->head];
+            if (++c->head == rx->qsize)
+                c->head=0;
+        }
+
+        sent=0;
+        if ((cnt=batch_iov(ifa,sptrs,n,iov,rx->tagbuf,0))) {
+            for (i=0,total=0;i<cnt;i++)
+                total+=iov[i].iov_len;
+            stats_clock(&start);
+            if ((sent=writev(c->fd,iov,cnt)) < 0 &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                sent=0;
+            /* Sentences not fully written are counted now: the rest of
+             * them is counted in bytes as it is flushed */
+            if (sent >= 0)
+                stats_write(ifa,n,sent,&start);
+            if (sent >= 0 && sent < total &&
+                    save_unsent(c,iov,cnt,sent) < 0) {
+                errno=ENOMEM;
+                sent=-1;
+            }
+        }
+
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+
+        if (sent < 0) {
+            conn_close(ifa,c,strerror(errno));
+            return;
+        }
+    }
+}
+
+/*
+ * Make room in a full connection ring according to the server's overflow
+ * policy, as q_overflow() does for an interface queue
+ * Args: reactor, connection, overflow policy and whether the sentence being
+ * added passes the priority filter
+ * Returns: 0 if room has been made, -1 if the new sentence should be dropped
+ */
+static int conn_overflow(struct tcp_reactor *rx, struct tcp_conn *c,
+        int policy, int prio)
+{
+    size_t i,j,k;
+
+    if (policy == Q_NEWEST)
+        return(-1);
+
+    if (policy == Q_PRIORITY) {
+        /* Find the oldest entry we're allowed to drop */
+        for (i=0,j=c->head;i<c->count && c->isprio[j];i++)
+            if (++j == rx->qsize)
+                j=0;
+        if (i < c->count) {
+            /* Drop it, moving the entries in front of it up one */
+            senblk_free(c->ring[j],NULL);
+            for (;i;i--,j=k) {
+                k=(j)?j-1:rx->qsize-1;
+                c->ring[j]=c->ring[k];
+                c->isprio[j]=c->isprio[k];
+            }
+            if (++c->head == rx->qsize)
+                c->head=0;
+            c->count--;
+            return(0);
+        }
+        /* Everything queued is wanted: drop the new entry unless it is
+         * too, in which case fall back to dropping the oldest */
+        if (!prio)
+            return(-1);
+    }
+
+    senblk_free(c->ring[c->head],NULL);
+    if (++c->head == rx->qsize)
+        c->head=0;
+    c->count--;
+    return(0);
+}
+
+/*
+ * Give each connection a reference to a batch of sentences from the server
+ * interface's queue and write what can be written
+ * Args: server interface, reactor, senblks and number of them
+ * Returns: Nothing
+ */
+static void fanout(iface_t *ifa, struct tcp_reactor *rx, senblk_t **sptrs,
+        size_t n)
+{
+    struct tcp_conn *c;
+    size_t i,j,tail;
+    unsigned long drops=0;
+    unsigned char prio[WRITEBATCH];
+    int policy=ifa->q->policy;
+
+    /* Checked once for all connections, as filters may have rate limits */
+    if (policy == Q_PRIORITY)
+        for (j=0;j<n;j++)
+            prio[j]=(senfilter(sptrs[j],ifa->q->prio) == 0);
+
+    for (i=0;i<rx->nconns;i++) {
+        if ((c=rx->conns[i])->fd < 0)
+            continue;
+        for (j=0;j<n;j++) {
+            /* Don't send sentences back where they came from */
+            if (sptrs[j]->src == c->id && !flag_test(ifa,F_LOOPBACK))
+                continue;
+            if (c->count == rx->qsize) {
+                drops++;
+                DEBUG(4,"Dropped senblk for connection %x",c->id);
+                if (conn_overflow(rx,c,policy,
+                        (policy == Q_PRIORITY)?prio[j]:0) < 0)
+                    continue;
+            }
+            if ((tail=c->head+c->count) >= rx->qsize)
+                tail-=rx->qsize;
+            c->ring[tail]=senblk_ref(sptrs[j]);
+            if (c->isprio)
+                c->isprio[tail]=prio[j];
+            c->count++;
+        }
+        if (!c->blocked)
+            conn_flush(ifa,rx,c);
+    }
+
+    for (j=0;j<n;j++)
+        senblk_free(sptrs[j],NULL);
+    if (drops)
+        q_dropped(ifa->q,drops);
+}
+
+/*
+ * Discard wakeup bytes written to the reactor's pipe
+ * Args: reactor
+ * Returns: Nothing
+ */
+static void drain_wake(struct tcp_reactor *rx)
+{
+    char buf[64];
+
+    while (read(rx->wake[0],buf,sizeof(buf)) > 0);
+}
+
+/*
+ * Free reactor state, closing all connections
+ * Args: reactor
+ * Returns: Nothing
+ * Called from the interface cleanup routine
+ */
+void reactor_free(struct tcp_reactor *rx)
+{
+    size_t i;
+
+    if (rx == NULL)
+        return;
+
+#ifdef KPLEX_IOURING
+    /* Closing the ring cancels requests referring to connections */
+    if (rx->ur) {
+        uring_free(rx->ur);
+        free(rx->ur);
+    }
+#endif
+    for (i=0;i<rx->nconns;i++) {
+        if (rx->conns[i]->fd >= 0)
+            close(rx->conns[i]->fd);
+        conn_free(rx->conns[i],rx->qsize);
+    }
+    free(rx->conns);
+
+    if (rx->wake[0] >= 0)
+        close(rx->wake[0]);
+    if (rx->wake[1] >= 0)
+        close(rx->wake[1]);
+#ifdef HAVE_EPOLL
+    if (rx->epfd >= 0)
+        close(rx->epfd);
+#else
+    free(rx->pfds);
+#endif
+    if (rx->tagbuf)
+        free(rx->tagbuf);
+    free(rx);
+}
+
+/*
+ * Allocate reactor state for a tcp server interface
+ * Args: Number of sentences which may wait to be written to each connection
+ * and flag indicating whether io_uring should be used
+ * Returns: Pointer to reactor or NULL on failure
+ * io_uring is set up by the reactor thread itself, which is the only one
+ * allowed to submit to it
+ */
+struct tcp_reactor *reactor_init(size_t qsize, int uring)
+{
+    struct tcp_reactor *rx;
+
+    if ((rx=(struct tcp_reactor *) malloc(sizeof(struct tcp_reactor)))
+            == NULL)
+        return(NULL);
+    memset(rx,0,sizeof(struct tcp_reactor));
+    rx->qsize=qsize;
+    rx->wake[0]=rx->wake[1]=-1;
+#ifdef KPLEX_IOURING
+    rx->useuring=uring;
+#else
+    if (uring)
+        logwarn("kplex was not built with io_uring support: using %s",
+#ifdef HAVE_EPOLL
+                "epoll"
+#else
+                "poll"
+#endif
+                );
+#endif
+#ifdef HAVE_EPOLL
+    if ((rx->epfd=epoll_create(RXEVENTS)) < 0) {
+        reactor_free(rx);
+        return(NULL);
+    }
+#endif
+    if (pipe(rx->wake) < 0 || set_nonblock(rx->wake[0]) < 0 ||
+            set_nonblock(rx->wake[1]) < 0) {
+        reactor_free(rx);
+        return(NULL);
+    }
+    return(rx);
+}
+
+/*
+ * Wait for and handle socket events
+ * Args: server interface, reactor, timeout (ms, -1 for indefinitely)
+ * and read buffer
+ * Returns: 0 on success, -1 on error
+ */
+static int handle_events(iface_t *ifa, struct tcp_reactor *rx, int timeout,
+        char *buf)
+{
+    struct tcp_conn *c;
+    int i,n,listening=0;
+#ifdef HAVE_EPOLL
+    struct epoll_event events[RXEVENTS];
+
+    if ((n=epoll_wait(rx->epfd,events,RXEVENTS,timeout)) < 0)
+        return((errno == EINTR)?0:-1);
+
+    for (i=0;i<n;i++) {
+        if (events[i].data.ptr == rx->wake)
+            drain_wake(rx);
+        else if (events[i].data.ptr == rx)
+            listening=1;
+        else {
+            if ((c=(struct tcp_conn *) events[i].data.ptr)->fd < 0)
+                continue;
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+                conn_read(ifa,c,buf);
+            if (c->fd >= 0 && (events[i].events & EPOLLOUT))
+                conn_flush(ifa,rx,c);
+        }
+    }
+#else
+    struct if_tcp *ift=(struct if_tcp *)ifa->info;
+    struct pollfd *pfd;
+    size_t need=rx->nconns+2;
+
+    if (need > rx->npfds) {
+        if ((pfd=(struct pollfd *) realloc(rx->pfds,
+                need*2*sizeof(struct pollfd))) == NULL)
+            return(-1);
+        rx->pfds=pfd;
+        rx->npfds=need*2;
+    }
+
+    rx->pfds[0].fd=rx->wake[0];
+    rx->pfds[1].fd=ift->fd;
+    rx->pfds[0].events=rx->pfds[1].events=POLLIN;
+    for (i=0;i<rx->nconns;i++) {
+        rx->pfds[i+2].fd=rx->conns[i]->fd;
+        rx->pfds[i+2].events=POLLIN|((rx->conns[i]->blocked)?POLLOUT:0);
+    }
+
+    if ((n=poll(rx->pfds,need,timeout)) < 0)
+        return((errno == EINTR)?0:-1);
+
+    if (rx->pfds[0].revents)
+        drain_wake(rx);
+    listening=rx->pfds[1].revents;
+    for (i=0;i<need-2;i++) {
+        if ((pfd=&rx->pfds[i+2])->revents == 0)
+            continue;
+        c=rx->conns[i];
+        if (pfd->revents & (POLLIN|POLLHUP|POLLERR))
+            conn_read(ifa,c,buf);
+        if (c->fd >= 0 && (pfd->revents & POLLOUT))
+            conn_flush(ifa,rx,c);
+    }
+#endif
+
+    /* Accept after handling connections: accepting may grow rx->conns */
+    if (listening)
+        conn_accept(ifa,rx);
+    return(0);
+}
+
+#ifdef KPLEX_IOURING
+/*
+ * Set up io_uring for a reactor: a multishot accept on the listening socket
+ * and a multishot poll on the wake pipe
+ * Args: server interface, reactor
+ * Returns: 0 on success, -1 on failure
+ */
+static int uring_start(iface_t *ifa, struct tcp_reactor *rx)
+{
+    struct if_tcp *ift=(struct if_tcp *)ifa->info;
+    struct io_uring_sqe *sqe;
+    int err;
+
+    if ((rx->ur=(struct uring *) malloc(sizeof(struct uring))) == NULL)
+        return(-1);
+    if (uring_init(rx->ur,RXURENTRIES,
+            IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN) < 0) {
+        err=errno;
+        free(rx->ur);
+        rx->ur=NULL;
+        errno=err;
+        return(-1);
+    }
+    if (uring_bufs_init(rx->ur,RXBGID,RXBUFS,BUFSIZ) < 0 ||
+            (sqe=uring_sqe(rx->ur)) == NULL)
+        goto fail;
+    sqe->opcode=IORING_OP_ACCEPT;
+    sqe->fd=ift->fd;
+    sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+    sqe->user_data=UD(rx,UD_ACCEPT);
+    if ((sqe=uring_sqe(rx->ur)) == NULL)
+        goto fail;
+    uring_prep_poll(sqe,rx->wake[0],POLLIN,1);
+    sqe->user_data=UD(rx,UD_WAKE);
+    if (uring_enter(rx->ur,0) < 0)
+        goto fail;
+    return(0);
+
+fail:
+    err=errno;
+    uring_free(rx->ur);
+    free(rx->ur);
+    rx->ur=NULL;
+    errno=err;
+    return(-1);
+}
+
+/*
+ * Re-arm a multishot request which has terminated
+ * Args: server interface, reactor, kind of request
+ * Returns: 0 on success, -1 on failure
+ */
+static int uring_rearm(iface_t *ifa, struct tcp_reactor *rx, int kind)
+{
+    struct if_tcp *ift=(struct if_tcp *)ifa->info;
+    struct io_uring_sqe *sqe;
+
+    if ((sqe=uring_sqe(rx->ur)) == NULL)
+        return(-1);
+    if (kind == UD_ACCEPT) {
+        sqe->opcode=IORING_OP_ACCEPT;
+        sqe->fd=ift->fd;
+        sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+    } else
+        uring_prep_poll(sqe,rx->wake[0],POLLIN,1);
+    sqe->user_data=UD(rx,kind);
+    return(0);
+}
+
+/*
+ * Handle a receive completing on a connection
+ * Args: server interface, reactor, connection, cqe result and flags
+ * Returns: Nothing
+ */
+static void uring_recv(iface_t *ifa, struct tcp_reactor *rx,
+        struct tcp_conn *c, int res, unsigned flags)
+{
+    unsigned bid;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid=flags>>IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && c->fd >= 0 && ifa->direction != OUT)
+            parse_nmea(&c->parser,uring_buf(rx->ur,bid),res);
+        uring_buf_return(rx->ur,bid);
+    }
+    if (flags & IORING_CQE_F_MORE)
+        return;
+
+    c->inflight--;
+    if (c->fd < 0)
+        return;
+    if (res == 0)
+        conn_close(ifa,c,"EOF");
+    else if (res < 0 && res != -ENOBUFS && res != -EINTR)
+        conn_close(ifa,c,strerror(-res));
+    /* Otherwise the receive stopped because we ran out of buffers or the
+     * kernel ended it: those used have been returned so start another */
+    else if (arm_recv(rx,c) < 0)
+        conn_close(ifa,c,strerror(errno));
+}
+
+/*
+ * Wait for and handle io_uring completions
+ * Args: server interface, reactor, flag indicating whether to wait
+ * Returns: 0 on success, -1 on error
+ */
+static int uring_events(iface_t *ifa, struct tcp_reactor *rx, int wait)
+{
+    struct io_uring_cqe *cqe;
+    struct tcp_conn *c;
+    unsigned long ud;
+    unsigned flags;
+    int res,afd,failed;
+
+    if (uring_enter(rx->ur,(wait)?1:0) < 0)
+        return((errno == EINTR)?0:-1);
+
+    while ((cqe=uring_cqe(rx->ur))) {
+        ud=cqe->user_data;
+        res=cqe->res;
+        flags=cqe->flags;
+        uring_cqe_seen(rx->ur);
+
+        c=(struct tcp_conn *) (ud&~(unsigned long) UD_MASK);
+        switch (ud&UD_MASK) {
+        case UD_ACCEPT:
+            if ((afd=res) >= 0) {
+                if ((failed=conn_new(ifa,rx,afd)) < 0) {
+                    logerr(errno,"Failed to set up new connection");
+                    close(afd);
+                }
+                DEBUG(3,"%s: New connection id %x %ssuccessfully received",
+                        ifa->name,ifa->id+(afd&IDMINORMASK),
+                        (failed)?"un":"");
+            } else if (res != -EINTR && res != -ECONNABORTED)
+                logerr(-res,"accept failed for connection to %s",ifa->name);
+            if (!(flags & IORING_CQE_F_MORE) &&
+                    uring_rearm(ifa,rx,UD_ACCEPT) < 0)
+                return(-1);
+            break;
+        case UD_WAKE:
+            drain_wake(rx);
+            if (!(flags & IORING_CQE_F_MORE) &&
+                    uring_rearm(ifa,rx,UD_WAKE) < 0)
+                return(-1);
+            break;
+        case UD_RECV:
+            uring_recv(ifa,rx,c,res,flags);
+            break;
+        case UD_POLLOUT:
+            c->inflight--;
+            c->pollout=0;
+            if (c->fd >= 0 && c->blocked) {
+                /* Let conn_flush() ask for another poll if need be */
+                c->blocked=0;
+                conn_flush(ifa,rx,c);
+            }
+            break;
+        }
+    }
+    return(0);
+}
+#endif
+
+/*
+ * Reactor loop for a tcp server interface
+ * Args: Pointer to server interface
+ * Returns: Does not return
+ */
+void tcp_reactor(iface_t *ifa)
+{
+    struct if_tcp *ift=(struct if_tcp *)ifa->info;
+    struct tcp_reactor *rx=ift->reactor;
+    senblk_t *sptrs[WRITEBATCH];
+    char buf[BUFSIZ];
+    /* An input interface's queue is the engine's */
+    ioqueue_t *q=(ifa->direction == IN)?NULL:ifa->q;
+    size_t n;
+    int i,armed;
+
+    if (ifa->tagflags &&
+            (rx->tagbuf=(char *) malloc(TAGMAX*WRITEBATCH)) == NULL) {
+        logerr(errno,"Disabing tag output on interface id %x (%s)",
+                ifa->id,ifa->name);
+        ifa->tagflags=0;
+    }
+
+    if (listen(ift->fd,SOMAXCONN) < 0 || set_nonblock(ift->fd) < 0) {
+        logerr(errno,"%s: Could not start tcp server",ifa->name);
+        iface_thread_exit(errno);
+    }
+
+#ifdef KPLEX_IOURING
+    if (rx->useuring) {
+        if (uring_start(ifa,rx) < 0)
+            logwarn("%s: Could not set up io_uring (%s): using epoll",
+                    ifa->name,strerror(errno));
+        else
+            DEBUG(3,"%s: using io_uring",ifa->name);
+    }
+    if (rx->ur == NULL)
+#endif
+#ifdef HAVE_EPOLL
+    if (ev_ctl(rx,EPOLL_CTL_ADD,ift->fd,EPOLLIN,rx) < 0 ||
+            ev_ctl(rx,EPOLL_CTL_ADD,rx->wake[0],EPOLLIN,rx->wake) < 0) {
+        logerr(errno,"%s: Could not start tcp server",ifa->name);
+        iface_thread_exit(errno);
+    }
+#endif
+
+    if (q)
+        q->wakefd=rx->wake[1];
+    /* io_uring_enter() isn't a cancellation point so we need waking */
+    __atomic_store_n(&ifa->cancelfd,rx->wake[1],__ATOMIC_RELEASE);
+
+    for (;;) {
+        pthread_testcancel();
+        armed=1;
+        if (q) {
+            /* Only sleep if the queue has been found empty, which arms the
+             * wake descriptor.  Otherwise just check the sockets */
+            for (i=0,armed=0;i<RXBATCHES;i++) {
+                if ((n=try_senblk_batch(q,sptrs,WRITEBATCH)) == 0) {
+                    armed=1;
+                    break;
+                }
+                fanout(ifa,rx,sptrs,n);
+            }
+            if (armed && !q->active)
+                break;
+        }
+
+#ifdef KPLEX_IOURING
+        if (rx->ur) {
+            if (uring_events(ifa,rx,armed) < 0) {
+                logerr(errno,"%s: Failed waiting for events",ifa->name);
+                break;
+            }
+        } else
+#endif
+        if (handle_events(ifa,rx,(armed)?-1:0,buf) < 0) {
+            logerr(errno,"%s: Failed waiting for events",ifa->name);
+            break;
+        }
+        sweep_conns(rx);
+    }
+
+    iface_thread_exit(errno);
+}
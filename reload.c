@@ -0,0 +1,409 @@
+/* reload.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Configuration reload
+ *
+ * On SIGHUP the config file is read again and compared with the interfaces
+ * started from it, which are matched by name (or, for those not given one,
+ * by type and options).  Only what has changed is touched:
+ *  - Interfaces no longer configured are stopped
+ *  - New interfaces are started
+ *  - Interfaces whose options have changed are stopped and started again
+ *    with the same id so that filters naming them still match
+ *  - Interfaces whose only changes are to their input or output filters are
+ *    left running and given the new filters (see iface_refilter())
+ * Serial lines, tcp connections etc. belonging to unchanged interfaces are
+ * never disturbed.  Interfaces specified on the command line are left alone
+ * as are global options, changes to which need a restart.  A config file
+ * which can't be parsed or refers to unknown interfaces changes nothing
+ */
+
+#include "kplex.h"
+
+/* What a reload is to do with a configured interface */
+enum reload_action {
+    R_KEEP,
+    R_STOP,
+    R_RESTART,
+    R_REFILTER
+};
+
+/* How an interface was configured */
+struct ifconf {
+    unsigned long id;
+    char *name;
+    enum itype type;
+    int autoname;               /* Name was made up by mkname() */
+    char *conf;                 /* Options text, NULL if the interface was
+                                   specified on the command line */
+    sfilter_t *ifilter;         /* Filters as configured */
+    sfilter_t *ofilter;
+    enum reload_action action;
+    iface_t *update;            /* New configuration during a reload */
+    struct ifconf *next;
+};
+
+/* Only used by the main thread */
+static struct ifconf *confs;
+
+/*
+ * Record how an interface was configured so that it can be compared with
+ * the config file when that is reloaded
+ * Args: interface (after initialisation), whether its name was made up
+ * Returns: 0 on success, -1 on failure
+ * The interface's options text is taken over by the record
+ */
+int reload_add(iface_t *ifa, int autoname)
+{
+    struct ifconf *c;
+
+    if ((c=(struct ifconf *) calloc(1,sizeof(struct ifconf))) == NULL)
+        return(-1);
+    if ((c->name=strdup(ifa->name)) == NULL) {
+        free(c);
+        return(-1);
+    }
+    c->id=ifa->id;
+    c->type=ifa->type;
+    c->autoname=autoname;
+    c->conf=ifa->conf;
+    ifa->conf=NULL;
+    c->ifilter=addfilter(ifa->ifilter);
+    c->ofilter=addfilter(ifa->ofilter);
+    c->action=R_KEEP;
+    c->next=confs;
+    confs=c;
+    return(0);
+}
+
+/*
+ * Remove the record of an interface's configuration
+ * Args: address of the pointer to the record
+ * Returns: Nothing
+ */
+static void conf_remove(struct ifconf **cp)
+{
+    struct ifconf *c=*cp;
+
+    *cp=c->next;
+    free(c->name);
+    if (c->conf)
+        free(c->conf);
+    free_filter(c->ifilter);
+    free_filter(c->ofilter);
+    free(c);
+}
+
+/*
+ * Compare filters by the option values they were made from
+ * Args: two filters (either may be NULL)
+ * Returns: 1 if they are the same, 0 otherwise
+ */
+static int same_filter(sfilter_t *a, sfilter_t *b)
+{
+    if (a == NULL || b == NULL)
+        return(a == b);
+    return(a->spec && b->spec && !strcmp(a->spec,b->spec));
+}
+
+/*
+ * Find the running interface a newly read one corresponds to
+ * Args: interface read from the config file
+ * Returns: record of the running interface's configuration, or NULL if there
+ * is none
+ */
+static struct ifconf *conf_match(iface_t *ifa)
+{
+    struct ifconf *c;
+
+    for (c=confs;c;c=c->next) {
+        /* Only file interfaces not already matched are candidates */
+        if (c->conf == NULL || c->update)
+            continue;
+        if (ifa->name) {
+            if (!c->autoname && !strcasecmp(c->name,ifa->name))
+                return(c);
+        } else if (c->autoname && c->type == ifa->type &&
+                !strcmp(c->conf,ifa->conf))
+            return(c);
+    }
+    return(NULL);
+}
+
+/*
+ * Cancel the running interfaces (including any pairs and connections) to be
+ * stopped by a reload.  Called with io_mutex held
+ * Args: iolists structure
+ * Returns: number of those interfaces which have yet to exit
+ * This is called again each time an interface exits: a tcp server may have
+ * accepted a connection after being cancelled
+ */
+static int stop_confs(struct iolists *lists)
+{
+    iface_t *lptrs[3] = { lists->initialized, lists->inputs, lists->outputs };
+    iface_t *ifa;
+    struct ifconf *c;
+    int i,n=0;
+
+    for (i=0;i<3;i++)
+        for (ifa=lptrs[i];ifa;ifa=ifa->next)
+            for (c=confs;c;c=c->next) {
+                if ((c->action != R_STOP && c->action != R_RESTART) ||
+                        (ifa->id & ~IDMINORMASK) != c->id)
+                    continue;
+                if (ifa->tid)
+                    iface_cancel(ifa);
+                else
+                    /* Not started yet.  start_interface() will see this */
+                    ifa->direction = NONE;
+                n++;
+                break;
+            }
+    return(n);
+}
+
+/*
+ * Give the running interfaces for a configuration the filters just read.
+ * Called with io_mutex held
+ * Args: iolists structure, configuration record
+ * Returns: Nothing
+ * A tcp connection accepted while this is being done may keep the old
+ * filters
+ */
+static void refilter_conf(struct iolists *lists, struct ifconf *c)
+{
+    iface_t *lptrs[3] = { lists->initialized, lists->inputs, lists->outputs };
+    iface_t *ifa,*new=c->update;
+    int ichange,ochange,i;
+
+    ichange=!same_filter(c->ifilter,new->ifilter);
+    ochange=!same_filter(c->ofilter,new->ofilter);
+
+    for (i=0;i<3;i++)
+        for (ifa=lptrs[i];ifa;ifa=ifa->next) {
+            if ((ifa->id & ~IDMINORMASK) != c->id)
+                continue;
+            if (ichange)
+                iface_refilter(ifa,&ifa->ifilter,new->ifilter);
+            if (ochange)
+                iface_refilter(ifa,&ifa->ofilter,new->ofilter);
+        }
+
+    if (ichange) {
+        free_filter(c->ifilter);
+        c->ifilter=addfilter(new->ifilter);
+    }
+    if (ochange) {
+        free_filter(c->ofilter);
+        c->ofilter=addfilter(new->ofilter);
+    }
+}
+
+/*
+ * Check a newly read interface configuration and give new interfaces ids
+ * Args: list of interfaces read (after the global section)
+ * Returns: 0 if the new configuration may be applied, -1 otherwise
+ */
+static int check_config(iface_t *list)
+{
+    iface_t *ifa,*ifptr;
+    struct ifconf *c;
+    unsigned long id;
+
+    for (ifa=list;ifa;ifa=ifa->next) {
+        if (ifa->name) {
+            for (ifptr=list;ifptr != ifa;ifptr=ifptr->next)
+                if (ifptr->name && !strcasecmp(ifptr->name,ifa->name)) {
+                    logerr(0,"%s used as name for more than one interface",
+                            ifa->name);
+                    return(-1);
+                }
+        }
+
+        if ((c=conf_match(ifa)) != NULL) {
+            c->update=ifa;
+            ifa->id=c->id;
+            if (c->type != ifa->type || strcmp(c->conf,ifa->conf))
+                c->action=R_RESTART;
+            else if (!same_filter(c->ifilter,ifa->ifilter) ||
+                    !same_filter(c->ofilter,ifa->ofilter))
+                c->action=R_REFILTER;
+            else
+                c->action=R_KEEP;
+            continue;
+        }
+
+        /* New interfaces without names are given them when started */
+        if (!ifa->name)
+            continue;
+
+        /* A name used before keeps its id, so long as whatever had it is
+         * going */
+        if ((id=namelookup(ifa->name))) {
+            for (c=confs;c;c=c->next)
+                if (c->id == id && (c->conf == NULL || c->update)) {
+                    logerr(0,"%s used as name for more than one interface",
+                            ifa->name);
+                    return(-1);
+                }
+            ifa->id=id;
+        } else if (iface_assign(ifa) < 0)
+            return(-1);
+    }
+
+    /* Now all names are known, check the filters which refer to them */
+    for (ifa=list;ifa;ifa=ifa->next) {
+        if (ifa->direction == IN)
+            continue;
+        if (name2id(ifa->ofilter) || name2id(ifa->qprio) ||
+                lanes_name2id(&ifa->qlanes)) {
+            logerr(0,"Name to interface translation failed for %s",
+                    (ifa->name)?ifa->name:iftypes[ifa->type].name);
+            return(-1);
+        }
+        if (ifa->qpolicy == Q_PRIORITY && ifa->qprio == NULL) {
+            logerr(0,"overflow=priority requires a priority filter");
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/*
+ * Re-read the config file and apply the differences to the running
+ * configuration.  Called by the main thread with io_mutex held, which is
+ * released while the file is read and interfaces are initialised
+ * Args: iolists structure, path to config file (NULL if none is being used)
+ * Returns: Nothing
+ */
+void reload_config(struct iolists *lists, char *fname)
+{
+    iface_t *list,*ifa,*next,*started=NULL;
+    iface_t **tail=&started;
+    struct ifconf *c,**cp;
+    const char *oconf,*nconf;
+    int nstart=0,nstop=0,nrestart=0,nrefilter=0;
+    int autoname;
+
+    if (fname == NULL) {
+        logwarn("Not using a config file: nothing to reload");
+        return;
+    }
+
+    pthread_mutex_unlock(&lists->io_mutex);
+    DEBUG(1,"Reloading config file %s",fname);
+
+    if ((list=parse_file(fname)) == NULL) {
+        logerr(0,"Reload failed: configuration unchanged");
+        pthread_mutex_lock(&lists->io_mutex);
+        return;
+    }
+
+    oconf=(lists->engine->conf)?lists->engine->conf:"";
+    nconf=(list->conf)?list->conf:"";
+    if (strcmp(oconf,nconf))
+        logwarn("Global options have changed: restart kplex to apply them");
+
+    for (c=confs;c;c=c->next)
+        if (c->conf)
+            c->action=R_STOP;
+
+    if (check_config(list->next) < 0) {
+        logerr(0,"Reload failed: configuration unchanged");
+        for (c=confs;c;c=c->next) {
+            c->action=R_KEEP;
+            c->update=NULL;
+        }
+        free_config(list);
+        pthread_mutex_lock(&lists->io_mutex);
+        return;
+    }
+
+    /* Stop what has gone or changed and refilter what can be kept.  Don't
+     * shut down for lack of inputs while they are being replaced */
+    pthread_mutex_lock(&lists->io_mutex);
+    lists->reloading=1;
+    for (c=confs;c;c=c->next)
+        if (c->action == R_REFILTER) {
+            DEBUG(2,"Reload: New filters for %s",c->name);
+            refilter_conf(lists,c);
+            nrefilter++;
+        }
+    while (stop_confs(lists) && timetodie == 0) {
+        pthread_cond_wait(&lists->dead_cond,&lists->io_mutex);
+        reap_dead(lists);
+    }
+    pthread_mutex_unlock(&lists->io_mutex);
+
+    for (cp=&confs;*cp;) {
+        if ((*cp)->action == R_STOP) {
+            DEBUG(2,"Reload: Stopped %s",(*cp)->name);
+            conf_remove(cp);
+            nstop++;
+        } else
+            cp=&(*cp)->next;
+    }
+
+    /* Start what is new or changed.  Initialisation may be slow (e.g.
+     * serial lines) so is done without holding io_mutex */
+    ifa=list->next;
+    list->next=NULL;
+    free_config(list);
+    for (;ifa;ifa=next) {
+        next=ifa->next;
+        ifa->next=NULL;
+
+        for (cp=&confs;*cp && (*cp)->update != ifa;cp=&(*cp)->next);
+        if ((c=*cp) != NULL) {
+            c->update=NULL;
+            if (c->action != R_RESTART) {
+                c->action=R_KEEP;
+                free_config(ifa);
+                continue;
+            }
+            /* The replacement gets a new record */
+            autoname=c->autoname;
+            conf_remove(cp);
+        } else
+            autoname=(ifa->name == NULL);
+
+        if (timetodie || (ifa->id == 0 && iface_assign(ifa) < 0)) {
+            free_config(ifa);
+            continue;
+        }
+
+        if (init_iface(ifa,lists) == NULL) {
+            /* As at startup, what the interface had is not all freed */
+            pool_free(ifa);
+            continue;
+        }
+        if (reload_add(ifa,autoname) < 0)
+            logerr(errno,"Failed to record configuration of %s: it won't be "
+                    "changed by later reloads",ifa->name);
+        if (c) {
+            DEBUG(2,"Reload: Restarted %s",ifa->name);
+            nrestart++;
+        } else {
+            DEBUG(2,"Reload: Started %s",ifa->name);
+            nstart++;
+        }
+        for (*tail=ifa;*tail;tail=&(*tail)->next);
+    }
+
+    pthread_mutex_lock(&lists->io_mutex);
+    if (started) {
+        for (tail=&lists->initialized;*tail;tail=&(*tail)->next);
+        *tail=started;
+        for (ifa=started;ifa;ifa=ifa->next)
+            (void) iface_thread(ifa);
+        while (lists->initialized)
+            pthread_cond_wait(&lists->init_cond,&lists->io_mutex);
+    }
+    lists->reloading=0;
+    check_inputs(lists);
+
+    loginfo("Reloaded %s: %d started, %d stopped, %d restarted, %d refiltered",
+            fname,nstart,nstop,nrestart,nrefilter);
+}
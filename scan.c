@@ -0,0 +1,266 @@
+/* scan.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Bulk byte scanning used by the sentence parser: finding the next framing
+ * delimiter in a buffer and XORing spans of bytes for checksums.  Vector
+ * implementations (SSE2 and AVX2 on x86, NEON on 64 bit ARM) are selected at
+ * run time by scan_init() according to what the CPU supports, with portable
+ * scalar versions used otherwise
+ */
+
+#include "kplex.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+/* Framing delimiters recognised by parse_nmea() */
+#define ISDELIM(c) ((c) == '$' || (c) == '!' || (c) == '\\' || (c) == '\r' || \
+        (c) == '\n' || (c) == '\0')
+
+/*
+ * Scalar delimiter scan
+ * Args: Buffer and its length
+ * Returns: Offset of first delimiter or len if there is none
+ */
+static size_t scan_delim_scalar(const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i=0;i<len;i++)
+        if (ISDELIM(buf[i]))
+            break;
+    return(i);
+}
+
+/*
+ * Scalar XOR of a span of bytes
+ * Args: Buffer and its length
+ * Returns: XOR of all bytes
+ */
+static unsigned char xorsum_scalar(const char *buf, size_t len)
+{
+    unsigned char c=0;
+
+    for (;len;len--)
+        c^=(unsigned char) *buf++;
+    return(c);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t scan_delim_sse2(const char *buf, size_t len)
+{
+    const __m128i dollar=_mm_set1_epi8('$');
+    const __m128i bang=_mm_set1_epi8('!');
+    const __m128i bslash=_mm_set1_epi8('\\');
+    const __m128i cr=_mm_set1_epi8('\r');
+    const __m128i lf=_mm_set1_epi8('\n');
+    const __m128i nul=_mm_setzero_si128();
+    __m128i v,m;
+    unsigned int mask;
+    size_t i;
+
+    for (i=0;i+16<=len;i+=16) {
+        v=_mm_loadu_si128((const __m128i *)(buf+i));
+        m=_mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v,dollar),_mm_cmpeq_epi8(v,bang)),
+                _mm_or_si128(_mm_cmpeq_epi8(v,bslash),
+                _mm_or_si128(_mm_cmpeq_epi8(v,cr),
+                _mm_or_si128(_mm_cmpeq_epi8(v,lf),_mm_cmpeq_epi8(v,nul)))));
+        if ((mask=_mm_movemask_epi8(m)))
+            return(i+__builtin_ctz(mask));
+    }
+    return(i+scan_delim_scalar(buf+i,len-i));
+}
+
+__attribute__((target("sse2")))
+static unsigned char xorsum_sse2(const char *buf, size_t len)
+{
+    __m128i acc=_mm_setzero_si128();
+    size_t i;
+
+    for (i=0;i+16<=len;i+=16)
+        acc=_mm_xor_si128(acc,_mm_loadu_si128((const __m128i *)(buf+i)));
+
+    acc=_mm_xor_si128(acc,_mm_srli_si128(acc,8));
+    acc=_mm_xor_si128(acc,_mm_srli_si128(acc,4));
+    acc=_mm_xor_si128(acc,_mm_srli_si128(acc,2));
+    acc=_mm_xor_si128(acc,_mm_srli_si128(acc,1));
+    return((unsigned char) _mm_cvtsi128_si32(acc) ^
+            xorsum_scalar(buf+i,len-i));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_delim_avx2(const char *buf, size_t len)
+{
+    const __m256i dollar=_mm256_set1_epi8('$');
+    const __m256i bang=_mm256_set1_epi8('!');
+    const __m256i bslash=_mm256_set1_epi8('\\');
+    const __m256i cr=_mm256_set1_epi8('\r');
+    const __m256i lf=_mm256_set1_epi8('\n');
+    const __m256i nul=_mm256_setzero_si256();
+    __m256i v,m;
+    unsigned int mask;
+    size_t i;
+
+    for (i=0;i+32<=len;i+=32) {
+        v=_mm256_loadu_si256((const __m256i *)(buf+i));
+        m=_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,dollar),
+                _mm256_cmpeq_epi8(v,bang)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,bslash),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,cr),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,lf),
+                _mm256_cmpeq_epi8(v,nul)))));
+        if ((mask=(unsigned int) _mm256_movemask_epi8(m)))
+            return(i+__builtin_ctz(mask));
+    }
+    /* The tail is done here rather than by scan_delim_sse2() so that no
+     * legacy SSE code runs with the upper halves of the ymm registers
+     * dirty: the transition penalty costs more than the whole scan */
+    if (i+16 <= len) {
+        v=_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(buf+i)));
+        m=_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,dollar),
+                _mm256_cmpeq_epi8(v,bang)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,bslash),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,cr),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,lf),
+                _mm256_cmpeq_epi8(v,nul)))));
+        if ((mask=(unsigned int) _mm256_movemask_epi8(m) & 0xffff))
+            return(i+__builtin_ctz(mask));
+        i+=16;
+    }
+    _mm256_zeroupper();
+    for (;i<len && !ISDELIM(buf[i]);i++);
+    return(i);
+}
+
+__attribute__((target("avx2")))
+static unsigned char xorsum_avx2(const char *buf, size_t len)
+{
+    __m256i acc=_mm256_setzero_si256();
+    __m128i x;
+    size_t i;
+    unsigned char c;
+
+    for (i=0;i+32<=len;i+=32)
+        acc=_mm256_xor_si256(acc,_mm256_loadu_si256((const __m256i *)(buf+i)));
+
+    /* VEX encoded 128 bit operations for the tail: see scan_delim_avx2() */
+    x=_mm_xor_si128(_mm256_castsi256_si128(acc),
+            _mm256_extracti128_si256(acc,1));
+    if (i+16 <= len) {
+        x=_mm_xor_si128(x,_mm_loadu_si128((const __m128i *)(buf+i)));
+        i+=16;
+    }
+    x=_mm_xor_si128(x,_mm_srli_si128(x,8));
+    x=_mm_xor_si128(x,_mm_srli_si128(x,4));
+    x=_mm_xor_si128(x,_mm_srli_si128(x,2));
+    x=_mm_xor_si128(x,_mm_srli_si128(x,1));
+    c=(unsigned char) _mm_cvtsi128_si32(x);
+    _mm256_zeroupper();
+    for (;i<len;i++)
+        c^=(unsigned char) buf[i];
+    return(c);
+}
+#endif
+
+#ifdef HAVE_NEON
+static size_t scan_delim_neon(const char *buf, size_t len)
+{
+    const uint8x16_t dollar=vdupq_n_u8('$');
+    const uint8x16_t bang=vdupq_n_u8('!');
+    const uint8x16_t bslash=vdupq_n_u8('\\');
+    const uint8x16_t cr=vdupq_n_u8('\r');
+    const uint8x16_t lf=vdupq_n_u8('\n');
+    uint8x16_t v,m;
+    size_t i;
+
+    for (i=0;i+16<=len;i+=16) {
+        v=vld1q_u8((const uint8_t *)(buf+i));
+        m=vorrq_u8(vorrq_u8(vceqq_u8(v,dollar),vceqq_u8(v,bang)),
+                vorrq_u8(vceqq_u8(v,bslash),
+                vorrq_u8(vorrq_u8(vceqq_u8(v,cr),vceqq_u8(v,lf)),
+                vceqzq_u8(v))));
+        if (vmaxvq_u8(m))
+            return(i+scan_delim_scalar(buf+i,16));
+    }
+    return(i+scan_delim_scalar(buf+i,len-i));
+}
+
+static unsigned char xorsum_neon(const char *buf, size_t len)
+{
+    uint8x16_t acc=vdupq_n_u8(0);
+    uint8x8_t x;
+    size_t i;
+
+    for (i=0;i+16<=len;i+=16)
+        acc=veorq_u8(acc,vld1q_u8((const uint8_t *)(buf+i)));
+
+    x=veor_u8(vget_low_u8(acc),vget_high_u8(acc));
+    x=veor_u8(x,vreinterpret_u8_u64(vshr_n_u64(vreinterpret_u64_u8(x),32)));
+    x=veor_u8(x,vreinterpret_u8_u64(vshr_n_u64(vreinterpret_u64_u8(x),16)));
+    x=veor_u8(x,vreinterpret_u8_u64(vshr_n_u64(vreinterpret_u64_u8(x),8)));
+    return(vget_lane_u8(x,0) ^ xorsum_scalar(buf+i,len-i));
+}
+#endif
+
+static size_t (*scan_delim_fn)(const char *, size_t) = scan_delim_scalar;
+static unsigned char (*xorsum_fn)(const char *, size_t) = xorsum_scalar;
+static char *scan_impl = "scalar";
+
+/*
+ * Select the fastest scanning functions the CPU supports
+ * Args: None
+ * Returns: Nothing
+ * Must be called before any interface threads are started.  Until it is,
+ * the scalar versions are used
+ */
+void scan_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_delim_fn=scan_delim_avx2;
+        xorsum_fn=xorsum_avx2;
+        scan_impl="avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_delim_fn=scan_delim_sse2;
+        xorsum_fn=xorsum_sse2;
+        scan_impl="sse2";
+    }
+#elif defined(HAVE_NEON)
+    scan_delim_fn=scan_delim_neon;
+    xorsum_fn=xorsum_neon;
+    scan_impl="neon";
+#endif
+    DEBUG(3,"Using %s sentence scanning",scan_impl);
+}
+
+/*
+ * Find the next sentence framing delimiter ($ ! \ CR LF or NUL) in a buffer
+ * Args: Buffer and its length
+ * Returns: Offset of first delimiter or len if there is none
+ */
+size_t scan_delim(const char *buf, size_t len)
+{
+    return((*scan_delim_fn)(buf,len));
+}
+
+/*
+ * XOR a span of bytes, as for an NMEA checksum
+ * Args: Buffer and its length
+ * Returns: XOR of all bytes
+ */
+unsigned char xorsum(const char *buf, size_t len)
+{
+    return((*xorsum_fn)(buf,len));
+}
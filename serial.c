@@ -31,6 +31,7 @@ struct if_serial {
     int saved;                  /* Are stored terminal settins valid? */
     struct termios otermios;    /* To restore previous interface settings
                                  *  on exit */
+    struct ifring ring;         /* io_uring reads for inputs */
 };
 
 /*
@@ -57,6 +58,8 @@ void *ifdup_serial(void *ifs)
     newif->slavename=oldif->slavename;
     newif->saved=oldif->saved;
     memcpy(&newif->otermios,&oldif->otermios,sizeof(struct termios));
+    newif->ring.want=oldif->ring.want;
+    newif->ring.rd=NULL;
     return((void *)newif);
 }
 
@@ -69,6 +72,7 @@ void cleanup_serial(iface_t *ifa)
 {
     struct if_serial *ifs = (struct if_serial *)ifa->info;
 
+    ring_free(ifa,&ifs->ring);
     if (!ifa->pair) {
         if (ifs->saved) {
             if (tcsetattr(ifs->fd,TCSAFLUSH,&ifs->otermios) < 0) {
@@ -201,7 +205,7 @@ int ttysetup(int dev,struct termios *otermios_p, int baud, int st)
 ssize_t read_serial(struct iface *ifa, char *buf)
 {
     struct if_serial *ifs = (struct if_serial *) ifa->info;
-    return(read(ifs->fd,buf,BUFSIZ));
+    return(ring_read(ifa,&ifs->ring,ifs->fd,buf));
 }
 
 /*
@@ -212,65 +216,38 @@ ssize_t read_serial(struct iface *ifa, char *buf)
 void write_serial(struct iface *ifa)
 {
     struct if_serial *ifs = (struct if_serial *) ifa->info;
-    senblk_t *senblk_p;
+    senblk_t *sptrs[WRITEBATCH];
+    struct iovec iov[WRITEBATCH*3];
     int fd=ifs->fd;
-    int n=0,tlen=0;
-    char *ptr;
-    char *tbuf;
+    size_t i,n;
+    int cnt;
+    char *tbuf=NULL;
 
     if (ifa->tagflags) {
-        if ((tbuf=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WRITEBATCH)) == NULL) {
             logerr(errno,"Disabing tag output on interface id %u (%s)",
                 ifa->id,(ifa->name)?ifa->name:"unlabelled");
             ifa->tagflags=0;
         }
     }
 
-    while(n >= 0) {
-        /* NULL return from next_senblk means the queue has been shut
+    for (;;) {
+        /* 0 return from next_senblk_batch means the queue has been shut
          * down. Time to die */
-        if ((senblk_p = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,sptrs,WRITEBATCH)) == 0)
             break;
 
-        if (senfilter(senblk_p,ifa->ofilter)) {
-            senblk_free(senblk_p,ifa->q);
-            continue;
-        }
-
-        if (ifa->tagflags) {
-            if ((tlen = gettag(ifa,tbuf,senblk_p)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                    ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                free(tbuf);
-            }
-            ptr=tbuf;
-            while(tlen) {
-                if ((n=write(fd,ptr,tlen)) < 0)
-                    break;
-                tlen-=n;
-                ptr+=n;
-            }
-            if (tlen) {
-                senblk_free(senblk_p,ifa->q);
-                break;
-            }
-        }
+        cnt=batch_iov(ifa,sptrs,n,iov,tbuf,0);
+        if (cnt && writev_batch(ifa,fd,iov,cnt,n) < 0)
+            cnt=-1;
 
-        ptr=senblk_p->data;
-        tlen=senblk_p->len;
-        while(tlen) {
-            if ((n=write(fd,ptr,tlen)) < 0)
-                break;
-            tlen-=n;
-            ptr+=n;
-        }
-        senblk_free(senblk_p,ifa->q);
-        if (tlen)
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+        if (cnt < 0)
             break;
     }
 
-    if (ifa->tagflags)
+    if (tbuf)
         free(tbuf);
 
     iface_thread_exit(errno);
@@ -290,6 +267,7 @@ struct iface *init_serial (struct iface *ifa)
     int ret;
     struct kopts *opt;
     int qsize=DEFSERIALQSIZE;
+    struct ifring ring = {0,NULL};
     
     for(opt=ifa->options;opt;opt=opt->next) {
         if (!strcasecmp(opt->var,"filename"))
@@ -324,17 +302,26 @@ struct iface *init_serial (struct iface *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"uring")) {
+            if (ring_opt(ifa,&ring,opt->val) < 0)
+                return(NULL);
         } else  {
             logerr(0,"unknown interface option %s",opt->var);
             return(NULL);
         }
     }
 
+    if (ring.want && ifa->direction == OUT) {
+        logerr(0,"uring option only valid for serial inputs");
+        return(NULL);
+    }
+
     /* Allocate serial specific data storage */
     if ((ifs = malloc(sizeof(struct if_serial))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
+    ifs->ring=ring;
 
     /* Open interface or die */
     if ((ifs->fd=ttyopen(devname,ifa->direction)) < 0) {
@@ -410,6 +397,7 @@ struct iface *init_pty (struct iface *ifa)
     gid_t gid=-1;
     struct stat statbuf;
     char slave[PATH_MAX];
+    struct ifring ring = {0,NULL};
 
     for(opt=ifa->options;opt;opt=opt->next) {
         if (!strcasecmp(opt->var,"mode")) {
@@ -472,17 +460,26 @@ struct iface *init_pty (struct iface *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"uring")) {
+            if (ring_opt(ifa,&ring,opt->val) < 0)
+                return(NULL);
         } else {
             logerr(0,"Unknown interface option %s",opt->var);
             return(NULL);
         }
     }
 
+    if (ring.want && ifa->direction == OUT) {
+        logerr(0,"uring option only valid for pty inputs");
+        return(NULL);
+    }
+
     if ((ifs = malloc(sizeof(struct if_serial))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
 
+    ifs->ring=ring;
     ifs->saved=0;
     ifs->slavename=NULL;
 
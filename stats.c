@@ -0,0 +1,788 @@
+/* stats.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Runtime statistics.  Interfaces keep counters in their iface_t and queues
+ * record drops and high water marks.  Memory use is that charged to each
+ * interface by the pools (see pool.c).  These can be queried with a
+ * $PKPXQ,S sentence or read from an optional stats socket which reports all
+ * interfaces in JSON or Prometheus text format
+ */
+
+#include "kplex.h"
+#include "version.h"
+#include <stdarg.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stddef.h>
+
+/* How long to wait for an (optional) request from a stats client */
+#define STATSREQWAIT 200
+
+/* Growable output buffer for stats reports */
+struct sbuf {
+    char *buf;
+    size_t len;
+    size_t size;
+    int err;
+};
+
+/*
+ * Record a write by an output interface
+ * Args: Interface, number of sentences and bytes written, and the time the
+ * write started (from stats_clock())
+ * Returns: Nothing
+ */
+void stats_write(iface_t *ifa, size_t nsen, size_t bytes,
+        const struct timespec *start)
+{
+    struct timespec now;
+    long us;
+    int b;
+
+    stats_clock(&now);
+    us=(now.tv_sec-start->tv_sec)*1000000L+(now.tv_nsec-start->tv_nsec)/1000;
+    for (b=0;b<LATBUCKETS-1 && us >= (1L<<(2*b));b++);
+    STATADD(&ifa->stats,wlat[b],1);
+    STATADD(&ifa->stats,sen_out,nsen);
+    STATADD(&ifa->stats,bytes_out,bytes);
+}
+
+#ifdef KPLEX_LATENCY
+/*
+ * Record a sentence's latency in a histogram
+ * Args: Histogram, time the sentence was read and current time
+ * Returns: Nothing
+ * Each histogram has a single writer, as for the other counters.  Sentences
+ * with no read time (e.g. generated by kplex itself) are ignored
+ */
+void lat_record(struct lathist *h, const struct timespec *ts,
+        const struct timespec *now)
+{
+    unsigned long us;
+    long d;
+    int e,b;
+
+    if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+        return;
+    d=(now->tv_sec-ts->tv_sec)*1000000L+(now->tv_nsec-ts->tv_nsec)/1000;
+    us=(d < 0)?0:(unsigned long) d;
+    if (us < 4)
+        b=us;
+    else {
+        e=63-__builtin_clzl(us);
+        b=4*(e-1)+((us>>(e-2))&3);
+        if (b >= LATHBUCKETS)
+            b=LATHBUCKETS-1;
+    }
+    STATADD(h,b[b],1);
+    STATADD(h,count,1);
+    if (us > __atomic_load_n(&h->max,__ATOMIC_RELAXED))
+        __atomic_store_n(&h->max,us,__ATOMIC_RELAXED);
+}
+
+/*
+ * Estimate a percentile from a latency histogram
+ * Args: Histogram, percentile
+ * Returns: Upper bound in microseconds of the bucket containing the
+ * percentile, or 0 if the histogram is empty
+ */
+static unsigned long lat_percentile(struct lathist *h, int pct)
+{
+    unsigned long count,target,cum,bound,max;
+    int b;
+
+    if ((count=__atomic_load_n(&h->count,__ATOMIC_RELAXED)) == 0)
+        return(0);
+    target=(count*pct+99)/100;
+    for (b=0,cum=0;b<LATHBUCKETS-1;b++)
+        if ((cum+=__atomic_load_n(&h->b[b],__ATOMIC_RELAXED)) >= target)
+            break;
+    /* Upper bound of bucket b is the lower bound of the next, but nothing
+     * is above the maximum seen */
+    b++;
+    bound=(b < 4)?(unsigned long) b:(unsigned long) (4+b%4)<<(b/4-1);
+    max=__atomic_load_n(&h->max,__ATOMIC_RELAXED);
+    return((bound < max)?bound:max);
+}
+#endif
+
+/*
+ * Read a counter
+ * Args: pointer to counter
+ * Returns: Counter value
+ */
+static unsigned long statval(unsigned long *ctr)
+{
+    return(__atomic_load_n(ctr,__ATOMIC_RELAXED));
+}
+
+/*
+ * Number of references currently on a queue.  Approximate as the queue is
+ * not locked
+ * Args: queue
+ * Returns: queue depth
+ */
+static size_t q_depth(ioqueue_t *q)
+{
+    size_t enq,deq;
+
+    if (!q->lockfree)
+        return(__atomic_load_n(&q->count,__ATOMIC_RELAXED));
+    deq=__atomic_load_n(&q->deqpos,__ATOMIC_RELAXED);
+    enq=__atomic_load_n(&q->enqpos,__ATOMIC_RELAXED);
+    return((enq > deq)?enq-deq:0);
+}
+
+/*
+ * Answer a $PKPXQ,S statistics query
+ * Args: senblk containing the query, engine interface
+ * Returns: 0 if the senblk now contains the response (without checksum),
+ * -1 if the query was invalid or the response wouldn't fit a sentence
+ * The query may name an interface; counters from all interfaces with that
+ * name (e.g. connections to a tcp server) are summed.  With no name all
+ * interfaces are summed
+ */
+int stats_query(senblk_t *sptr, iface_t *eptr)
+{
+    char name[SENMAX];
+    char *cptr,*nptr;
+    iface_t *ifa,*list[2];
+    unsigned long in=0,out=0,cks=0,filt=0,drops=0;
+    size_t hwm=0;
+    int i,found=0,len;
+
+    /* $PKPXQ,S[,<name>] */
+    cptr=sptr->data+8;
+    if (*cptr == ',')
+        cptr++;
+    else if (*cptr != '*' && *cptr != '\r' && *cptr != '\n')
+        return(-1);
+    for (nptr=name;*cptr != '*' && *cptr != '\r' && *cptr != '\n';cptr++) {
+        if (*cptr == ',' || nptr-name >= SENMAX-1 ||
+                cptr >= sptr->data+sptr->len)
+            return(-1);
+        *nptr++=*cptr;
+    }
+    *nptr='\0';
+
+    pthread_mutex_lock(&eptr->lists->io_mutex);
+    list[0]=eptr->lists->inputs;
+    list[1]=eptr->lists->outputs;
+    for (i=0;i<2;i++)
+        for (ifa=list[i];ifa;ifa=ifa->next) {
+            if (*name && (ifa->name == NULL || strcmp(ifa->name,name)))
+                continue;
+            found++;
+            in+=statval(&ifa->stats.sen_in);
+            out+=statval(&ifa->stats.sen_out);
+            cks+=statval(&ifa->stats.cksum_fail);
+            filt+=statval(&ifa->stats.filtered);
+            if (ifa->direction != IN && ifa->q) {
+                drops+=__atomic_load_n(&ifa->q->drops,__ATOMIC_RELAXED);
+                if (__atomic_load_n(&ifa->q->hwm,__ATOMIC_RELAXED) > hwm)
+                    hwm=__atomic_load_n(&ifa->q->hwm,__ATOMIC_RELAXED);
+            }
+        }
+    pthread_mutex_unlock(&eptr->lists->io_mutex);
+
+    if (!found)
+        return(-1);
+
+    /* Leave room for the checksum and line termination */
+    len=snprintf(sptr->data,SENMAX-4,"$PKPXR,S,%s,%lu,%lu,%lu,%lu,%lu,%lu",
+            name,in,out,drops,(unsigned long) hwm,cks,filt);
+    if (len < 0 || len >= SENMAX-4)
+        return(-1);
+    sptr->len=len;
+    return(0);
+}
+
+/*
+ * Append formatted output to a stats buffer
+ * Args: buffer, format and arguments as for printf
+ * Returns: Nothing.  On failure the buffer's err flag is set
+ */
+static void sbuf_printf(struct sbuf *sb, const char *fmt, ...)
+{
+    va_list ap;
+    char *nbuf;
+    int n;
+
+    for (;!sb->err;) {
+        va_start(ap,fmt);
+        n=vsnprintf(sb->buf+sb->len,sb->size-sb->len,fmt,ap);
+        va_end(ap);
+        if (n < 0) {
+            sb->err++;
+            return;
+        }
+        if ((size_t) n < sb->size-sb->len) {
+            sb->len+=n;
+            return;
+        }
+        if ((nbuf=(char *) realloc(sb->buf,sb->size*2+n)) == NULL) {
+            sb->err++;
+            return;
+        }
+        sb->buf=nbuf;
+        sb->size=sb->size*2+n;
+    }
+}
+
+/*
+ * Append an interface name escaped for use in a JSON string or Prometheus
+ * label value
+ * Args: buffer, name (may be NULL)
+ * Returns: Nothing
+ */
+static void sbuf_name(struct sbuf *sb, const char *name)
+{
+    if (name == NULL)
+        return;
+    for (;*name;name++)
+        if (*name == '"' || *name == '\\')
+            sbuf_printf(sb,"\\%c",*name);
+        else if (*name == '\n')
+            sbuf_printf(sb,"\\n");
+        else
+            sbuf_printf(sb,"%c",*name);
+}
+
+static const char *dirnames[] = { "none", "in", "out", "both" };
+
+/*
+ * Name of an interface type
+ * Args: Interface
+ * Returns: Pointer to type name
+ */
+static const char *typename(iface_t *ifa)
+{
+    struct iftypedef *t;
+
+    for (t=iftypes;t->name;t++)
+        if (t->index == ifa->type)
+            return(t->name);
+    return("unknown");
+}
+
+/*
+ * Upper bound in microseconds of a latency histogram bucket
+ * Args: bucket number (less than LATBUCKETS-1)
+ * Returns: bound
+ */
+static unsigned long bucketmax(int b)
+{
+    return(1UL<<(2*b));
+}
+
+#ifdef KPLEX_LATENCY
+/*
+ * Report a latency histogram in JSON
+ * Args: buffer, name of the histogram and the histogram
+ * Returns: Nothing
+ */
+static void json_lat(struct sbuf *sb, const char *name, struct lathist *h)
+{
+    sbuf_printf(sb,"\"%s\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,"
+            "\"max\":%lu}",name,statval(&h->count),lat_percentile(h,50),
+            lat_percentile(h,99),statval(&h->max));
+}
+#endif
+
+/*
+ * Report one interface in JSON
+ * Args: buffer, interface, flag indicating whether its queue is its own
+ * Returns: Nothing
+ */
+static void json_iface(struct sbuf *sb, iface_t *ifa, int ownq)
+{
+    struct ifstats *st=&ifa->stats;
+    int b;
+
+    sbuf_printf(sb,"{\"name\":\"");
+    sbuf_name(sb,ifa->name);
+    sbuf_printf(sb,"\",\"id\":\"%lx\",\"type\":\"%s\",\"direction\":\"%s\","
+            "\"sentences_in\":%lu,\"bytes_in\":%lu,"
+            "\"sentences_out\":%lu,\"bytes_out\":%lu,"
+            "\"checksum_errors\":%lu,\"filtered\":%lu,\"reconnects\":%lu,"
+            "\"memory\":%lu",
+            ifa->id,typename(ifa),dirnames[ifa->direction],
+            statval(&st->sen_in),statval(&st->bytes_in),
+            statval(&st->sen_out),statval(&st->bytes_out),
+            statval(&st->cksum_fail),statval(&st->filtered),
+            statval(&st->reconnects),
+            (unsigned long) __atomic_load_n(&ifa->mem,__ATOMIC_RELAXED));
+    if (ownq && ifa->q) {
+        sbuf_printf(sb,",\"queue\":{\"size\":%lu,\"depth\":%lu,"
+                "\"high_water\":%lu,\"drops\":%lu",
+                (unsigned long) ifa->q->size,(unsigned long) q_depth(ifa->q),
+                (unsigned long) ifa->q->hwm,
+                __atomic_load_n(&ifa->q->drops,__ATOMIC_RELAXED));
+        /* Compact queues may hold more than "size" sentences */
+        if (ifa->q->compact)
+            sbuf_printf(sb,",\"bytes\":%lu,\"bytes_used\":%lu",
+                    (unsigned long) ifa->q->bsize,(unsigned long)
+                    __atomic_load_n(&ifa->q->bused,__ATOMIC_RELAXED));
+        sbuf_printf(sb,"}");
+    }
+    if (ifa->direction != IN && ifa->type != GLOBAL) {
+        sbuf_printf(sb,",\"write_latency_us\":{");
+        for (b=0;b<LATBUCKETS;b++) {
+            if (b < LATBUCKETS-1)
+                sbuf_printf(sb,"\"%lu\":",bucketmax(b));
+            else
+                sbuf_printf(sb,"\"+Inf\":");
+            sbuf_printf(sb,"%lu%s",statval(&st->wlat[b]),
+                    (b < LATBUCKETS-1)?",":"}");
+        }
+    }
+#ifdef KPLEX_LATENCY
+    if (ownq) {
+        sbuf_printf(sb,",\"latency_us\":{");
+        json_lat(sb,"residency",&st->residency);
+        sbuf_printf(sb,",");
+        json_lat(sb,"completion",&st->completion);
+        sbuf_printf(sb,"}");
+    }
+#endif
+    sbuf_printf(sb,"}");
+}
+
+/*
+ * Append the labels identifying an interface in Prometheus output
+ * Args: buffer, interface
+ * Returns: Nothing
+ */
+static void prom_labels(struct sbuf *sb, iface_t *ifa)
+{
+    sbuf_printf(sb,"name=\"");
+    sbuf_name(sb,ifa->name);
+    sbuf_printf(sb,"\",id=\"%lx\",type=\"%s\",direction=\"%s\"",
+            ifa->id,typename(ifa),dirnames[ifa->direction]);
+}
+
+/* Counters reported in Prometheus format */
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} promctrs[] = {
+    { "sentences_in", "Sentences accepted from input",
+            offsetof(struct ifstats,sen_in) },
+    { "bytes_in", "Bytes of sentences accepted from input",
+            offsetof(struct ifstats,bytes_in) },
+    { "sentences_out", "Sentences written",
+            offsetof(struct ifstats,sen_out) },
+    { "bytes_out", "Bytes of sentences written",
+            offsetof(struct ifstats,bytes_out) },
+    { "checksum_errors", "Sentences failing checksum verification",
+            offsetof(struct ifstats,cksum_fail) },
+    { "filtered", "Sentences rejected by filters",
+            offsetof(struct ifstats,filtered) },
+    { "reconnects", "Connections re-established",
+            offsetof(struct ifstats,reconnects) },
+    { NULL, NULL, 0 }
+};
+
+#ifdef KPLEX_LATENCY
+/*
+ * Report a latency histogram as a Prometheus summary
+ * Args: buffer, interface, stage the histogram measures and the histogram
+ * Returns: Nothing
+ */
+static void prom_lat(struct sbuf *sb, iface_t *ifa, const char *stage,
+        struct lathist *h)
+{
+    static const int pcts[] = { 50, 99 };
+    size_t i;
+
+    for (i=0;i<sizeof(pcts)/sizeof(pcts[0]);i++) {
+        sbuf_printf(sb,"kplex_latency_seconds{");
+        prom_labels(sb,ifa);
+        sbuf_printf(sb,",stage=\"%s\",quantile=\"%g\"} %g\n",stage,
+                pcts[i]/100.0,lat_percentile(h,pcts[i])/1e6);
+    }
+    sbuf_printf(sb,"kplex_latency_seconds_count{");
+    prom_labels(sb,ifa);
+    sbuf_printf(sb,",stage=\"%s\"} %lu\n",stage,statval(&h->count));
+}
+#endif
+
+/*
+ * Report all interfaces in Prometheus text format
+ * Args: buffer, array of interfaces, flags showing which have their own
+ * queue, number of interfaces
+ * Returns: Nothing
+ */
+static void prom_report(struct sbuf *sb, iface_t **ifs, int *ownq, int n)
+{
+    unsigned long cum;
+    size_t used,held,limit;
+    int i,j,b;
+
+    for (j=0;promctrs[j].name;j++) {
+        sbuf_printf(sb,"# HELP kplex_%s_total %s\n# TYPE kplex_%s_total counter\n",
+                promctrs[j].name,promctrs[j].help,promctrs[j].name);
+        for (i=0;i<n;i++) {
+            sbuf_printf(sb,"kplex_%s_total{",promctrs[j].name);
+            prom_labels(sb,ifs[i]);
+            sbuf_printf(sb,"} %lu\n",statval((unsigned long *)
+                    ((char *) &ifs[i]->stats+promctrs[j].offset)));
+        }
+    }
+
+    sbuf_printf(sb,"# HELP kplex_queue_drops_total Sentences dropped from full queues\n# TYPE kplex_queue_drops_total counter\n");
+    for (i=0;i<n;i++)
+        if (ownq[i]) {
+            sbuf_printf(sb,"kplex_queue_drops_total{");
+            prom_labels(sb,ifs[i]);
+            sbuf_printf(sb,"} %lu\n",
+                    __atomic_load_n(&ifs[i]->q->drops,__ATOMIC_RELAXED));
+        }
+    sbuf_printf(sb,"# HELP kplex_queue_depth Sentences queued\n# TYPE kplex_queue_depth gauge\n");
+    for (i=0;i<n;i++)
+        if (ownq[i]) {
+            sbuf_printf(sb,"kplex_queue_depth{");
+            prom_labels(sb,ifs[i]);
+            sbuf_printf(sb,"} %lu\n",(unsigned long) q_depth(ifs[i]->q));
+        }
+    sbuf_printf(sb,"# HELP kplex_queue_high_water Most sentences queued\n# TYPE kplex_queue_high_water gauge\n");
+    for (i=0;i<n;i++)
+        if (ownq[i]) {
+            sbuf_printf(sb,"kplex_queue_high_water{");
+            prom_labels(sb,ifs[i]);
+            sbuf_printf(sb,"} %lu\n",(unsigned long) ifs[i]->q->hwm);
+        }
+    sbuf_printf(sb,"# HELP kplex_queue_size Queue capacity\n# TYPE kplex_queue_size gauge\n");
+    for (i=0;i<n;i++)
+        if (ownq[i]) {
+            sbuf_printf(sb,"kplex_queue_size{");
+            prom_labels(sb,ifs[i]);
+            sbuf_printf(sb,"} %lu\n",(unsigned long) ifs[i]->q->size);
+        }
+
+    sbuf_printf(sb,"# HELP kplex_memory_bytes Pooled memory used by interface\n# TYPE kplex_memory_bytes gauge\n");
+    for (i=0;i<n;i++) {
+        sbuf_printf(sb,"kplex_memory_bytes{");
+        prom_labels(sb,ifs[i]);
+        sbuf_printf(sb,"} %lu\n",(unsigned long)
+                __atomic_load_n(&ifs[i]->mem,__ATOMIC_RELAXED));
+    }
+    pool_usage(&used,&held,&limit);
+    sbuf_printf(sb,"# HELP kplex_pool_used_bytes Pooled memory in use\n# TYPE kplex_pool_used_bytes gauge\nkplex_pool_used_bytes %lu\n",
+            (unsigned long) used);
+    sbuf_printf(sb,"# HELP kplex_pool_held_bytes Memory held by pools\n# TYPE kplex_pool_held_bytes gauge\nkplex_pool_held_bytes %lu\n",
+            (unsigned long) held);
+    if (limit)
+        sbuf_printf(sb,"# HELP kplex_pool_limit_bytes Limit on pooled memory in use\n# TYPE kplex_pool_limit_bytes gauge\nkplex_pool_limit_bytes %lu\n",
+                (unsigned long) limit);
+
+    sbuf_printf(sb,"# HELP kplex_write_seconds Time taken by output writes\n# TYPE kplex_write_seconds histogram\n");
+    for (i=0;i<n;i++) {
+        if (ifs[i]->direction == IN || ifs[i]->type == GLOBAL)
+            continue;
+        for (b=0,cum=0;b<LATBUCKETS;b++) {
+            cum+=statval(&ifs[i]->stats.wlat[b]);
+            sbuf_printf(sb,"kplex_write_seconds_bucket{");
+            prom_labels(sb,ifs[i]);
+            if (b < LATBUCKETS-1)
+                sbuf_printf(sb,",le=\"%g\"} %lu\n",bucketmax(b)/1e6,cum);
+            else
+                sbuf_printf(sb,",le=\"+Inf\"} %lu\n",cum);
+        }
+        sbuf_printf(sb,"kplex_write_seconds_count{");
+        prom_labels(sb,ifs[i]);
+        sbuf_printf(sb,"} %lu\n",cum);
+    }
+
+#ifdef KPLEX_LATENCY
+    sbuf_printf(sb,"# HELP kplex_latency_seconds Time since sentences were read\n# TYPE kplex_latency_seconds summary\n");
+    for (i=0;i<n;i++)
+        if (ownq[i]) {
+            prom_lat(sb,ifs[i],"residency",&ifs[i]->stats.residency);
+            prom_lat(sb,ifs[i],"completion",&ifs[i]->stats.completion);
+        }
+    sbuf_printf(sb,"# HELP kplex_latency_max_seconds Longest time since a sentence was read\n# TYPE kplex_latency_max_seconds gauge\n");
+    for (i=0;i<n;i++)
+        if (ownq[i])
+            for (j=0;j<2;j++) {
+                sbuf_printf(sb,"kplex_latency_max_seconds{");
+                prom_labels(sb,ifs[i]);
+                sbuf_printf(sb,",stage=\"%s\"} %g\n",
+                        (j)?"completion":"residency",
+                        statval((j)?&ifs[i]->stats.completion.max:
+                        &ifs[i]->stats.residency.max)/1e6);
+            }
+#endif
+}
+
+/*
+ * Make a copy of the engine interface whose queue figures are the totals
+ * for all engine threads' queues (the largest high water mark)
+ * Args: engine interface, interface and queue structures to fill in
+ * Returns: Nothing
+ */
+static void engine_totals(iface_t *eptr, iface_t *eng, ioqueue_t *engq)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    ioqueue_t *q;
+    size_t hwm;
+    unsigned int i;
+
+    *eng=*eptr;
+    memset(engq,0,sizeof(ioqueue_t));
+    for (i=0;i<ifg->shards;i++) {
+        q=ifg->shard[i].q;
+        engq->size+=q->size;
+        engq->count+=q_depth(q);
+        engq->drops+=__atomic_load_n(&q->drops,__ATOMIC_RELAXED);
+        if ((hwm=__atomic_load_n(&q->hwm,__ATOMIC_RELAXED)) > engq->hwm)
+            engq->hwm=hwm;
+    }
+    eng->q=engq;
+}
+
+/*
+ * Build a report on the engine and all running interfaces
+ * Args: buffer, engine interface, report format
+ * Returns: Nothing
+ */
+static void stats_report(struct sbuf *sb, iface_t *eptr, int fmt)
+{
+    iface_t *ifa,**ifs,*list[2];
+    iface_t eng;
+    ioqueue_t engq;
+    size_t used,held,limit;
+    int *ownq;
+    int i,j,n;
+
+    engine_totals(eptr,&eng,&engq);
+
+    pthread_mutex_lock(&eptr->lists->io_mutex);
+    list[0]=eptr->lists->inputs;
+    list[1]=eptr->lists->outputs;
+    for (n=1,j=0;j<2;j++)
+        for (ifa=list[j];ifa;ifa=ifa->next)
+            n++;
+
+    ifs=(iface_t **) malloc(n*sizeof(iface_t *));
+    ownq=(int *) malloc(n*sizeof(int));
+    if (ifs == NULL || ownq == NULL)
+        sb->err++;
+    else {
+        ifs[0]=&eng;
+        ownq[0]=1;
+        for (i=1,j=0;j<2;j++)
+            for (ifa=list[j];ifa;ifa=ifa->next,i++) {
+                ifs[i]=ifa;
+                /* Inputs share the engine's queue */
+                ownq[i]=(ifa->direction != IN && ifa->q)?1:0;
+            }
+    }
+
+    if (!sb->err) {
+        if (fmt == STATS_JSON) {
+            pool_usage(&used,&held,&limit);
+            sbuf_printf(sb,"{\"version\":\"%s\",\"memory\":{\"used\":%lu,"
+                    "\"held\":%lu,\"limit\":%lu},\"interfaces\":[",VERSION,
+                    (unsigned long) used,(unsigned long) held,
+                    (unsigned long) limit);
+            for (i=0;i<n;i++) {
+                json_iface(sb,ifs[i],ownq[i]);
+                if (i < n-1)
+                    sbuf_printf(sb,",");
+            }
+            sbuf_printf(sb,"]}\n");
+        } else
+            prom_report(sb,ifs,ownq,n);
+    }
+    pthread_mutex_unlock(&eptr->lists->io_mutex);
+    free(ifs);
+    free(ownq);
+}
+
+/*
+ * Write a whole buffer to a socket
+ * Args: socket, buffer, length
+ * Returns: Nothing
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n=write(fd,buf,len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            DEBUG(3,"Stats client write failed: %s",strerror(errno));
+            return;
+        }
+        buf+=n;
+        len-=n;
+    }
+}
+
+struct stats_srv {
+    int fd;
+    int fmt;
+    iface_t *engine;
+};
+
+/*
+ * Thread serving stats clients.  Each connection is sent a report and closed.
+ * If the client sends an HTTP GET the report is given an HTTP header so
+ * the socket can be scraped by Prometheus or read with a browser
+ * Args: server details (cast to void *)
+ * Returns: Nothing
+ */
+static void *run_stats(void *arg)
+{
+    struct stats_srv *srv = (struct stats_srv *) arg;
+    struct sbuf sb;
+    struct pollfd pfd;
+    char req[4];
+    char hdr[128];
+    ssize_t n;
+    int fd,http,hlen;
+
+    (void) pthread_detach(pthread_self());
+
+    for (;;) {
+        if ((fd=accept(srv->fd,NULL,NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            logerr(errno,"Stats socket accept failed");
+            break;
+        }
+
+        /* Don't wait long for a request: plain clients needn't send one */
+        pfd.fd=fd;
+        pfd.events=POLLIN;
+        http=0;
+        if (poll(&pfd,1,STATSREQWAIT) > 0 &&
+                (n=recv(fd,req,sizeof(req),MSG_PEEK)) == sizeof(req) &&
+                !memcmp(req,"GET ",4))
+            http=1;
+
+        sb.len=sb.err=0;
+        sb.size=BUFSIZ;
+        if ((sb.buf=(char *) malloc(sb.size)) == NULL)
+            sb.err++;
+        else
+            stats_report(&sb,srv->engine,srv->fmt);
+
+        if (sb.err) {
+            logerr(errno,"Failed to produce statistics report");
+        } else {
+            if (http) {
+                hlen=snprintf(hdr,sizeof(hdr),"HTTP/1.0 200 OK\r\n"
+                        "Content-Type: %s\r\nContent-Length: %lu\r\n\r\n",
+                        (srv->fmt == STATS_JSON)?"application/json":
+                        "text/plain; version=0.0.4",(unsigned long) sb.len);
+                write_all(fd,hdr,hlen);
+            }
+            write_all(fd,sb.buf,sb.len);
+        }
+        free(sb.buf);
+        close(fd);
+    }
+    return(NULL);
+}
+
+/*
+ * Start serving statistics if configured to
+ * Args: engine interface
+ * Returns: 0 on success or if no stats socket is configured, -1 on error
+ * The stats= engine option is either the path of a unix domain socket or
+ * [<address>:]<port> for tcp.  A tcp socket with no address given listens on
+ * the loopback interface only
+ */
+int init_stats(iface_t *eptr)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    struct stats_srv *srv;
+    struct sockaddr_un sun;
+    struct addrinfo hints,*abase,*aptr;
+    char *host,*port,*spec;
+    pthread_t tid;
+    int fd=-1,on=1,err;
+
+    if ((spec=ifg->stats) == NULL)
+        return(0);
+
+    if (*spec == '/') {
+        if (strlen(spec) >= sizeof(sun.sun_path)) {
+            logerr(0,"Stats socket path %s too long",spec);
+            return(-1);
+        }
+        memset(&sun,0,sizeof(sun));
+        sun.sun_family=AF_UNIX;
+        strcpy(sun.sun_path,spec);
+        (void) unlink(spec);
+        if ((fd=socket(AF_UNIX,SOCK_STREAM,0)) < 0 ||
+                bind(fd,(struct sockaddr *) &sun,sizeof(sun)) < 0) {
+            logerr(errno,"Failed to create stats socket %s",spec);
+            if (fd >= 0)
+                close(fd);
+            return(-1);
+        }
+    } else {
+        if ((port=strrchr(spec,':'))) {
+            host=spec;
+            *port++='\0';
+        } else {
+            host="localhost";
+            port=spec;
+        }
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family=AF_UNSPEC;
+        hints.ai_socktype=SOCK_STREAM;
+        hints.ai_flags=AI_PASSIVE;
+        if ((err=getaddrinfo((*host)?host:NULL,port,&hints,&abase))) {
+            logerr(0,"Lookup failed for stats address %s:%s: %s",host,port,
+                    gai_strerror(err));
+            return(-1);
+        }
+        for (aptr=abase;aptr;aptr=aptr->ai_next) {
+            if ((fd=socket(aptr->ai_family,aptr->ai_socktype,
+                    aptr->ai_protocol)) < 0)
+                continue;
+            (void) setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+            if (bind(fd,aptr->ai_addr,aptr->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd=-1;
+        }
+        freeaddrinfo(abase);
+        if (fd < 0) {
+            logerr(errno,"Failed to create stats socket on %s:%s",host,port);
+            return(-1);
+        }
+    }
+
+    if (listen(fd,5) < 0) {
+        logerr(errno,"Failed to listen on stats socket");
+        close(fd);
+        return(-1);
+    }
+
+    if ((srv=(struct stats_srv *) malloc(sizeof(struct stats_srv))) == NULL) {
+        close(fd);
+        return(-1);
+    }
+    srv->fd=fd;
+    srv->fmt=ifg->statsfmt;
+    srv->engine=eptr;
+
+    if ((err=pthread_create(&tid,NULL,run_stats,(void *) srv))) {
+        logerr(err,"Failed to start stats thread");
+        close(fd);
+        free(srv);
+        return(-1);
+    }
+    DEBUG(3,"Serving statistics on %s",spec);
+    return(0);
+}
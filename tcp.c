@@ -8,6 +8,7 @@
 #include "tcp.h"
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/uio.h>
@@ -22,7 +23,7 @@ void *ifdup_tcp(void *ift)
 {
     struct if_tcp *oldif,*newif;
 
-    if ((newif = (struct if_tcp *) malloc(sizeof(struct if_tcp)))
+    if ((newif = (struct if_tcp *) pool_alloc(sizeof(struct if_tcp),NULL))
         == (struct if_tcp *) NULL)
         return(NULL);
     oldif = (struct if_tcp *) ift;
@@ -44,12 +45,17 @@ void *ifdup_tcp(void *ift)
 void cleanup_tcp(iface_t *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *)ifa->info;
+
+    ring_free(ifa,&ift->ring);
+    /* if_tcp structures are pooled so are freed here, not by free_if_data() */
+    ifa->info=NULL;
     if (ift->shared) {
         /* io_mutex is held in cleanup routines to serialize this */
         /* unlock shared mutex in case we were interupted whilst holding it */
         (void)  pthread_mutex_unlock(&ift->shared->t_mutex);
         if (!(ift->shared->donewith)) {
             ift->shared->donewith++;
+            pool_free(ift);
             return;
         }
         if (ift->shared->port)
@@ -65,7 +71,10 @@ void cleanup_tcp(iface_t *ifa)
         free(ift->shared);
     }
 
+    ifa->cancelfd=-1;
+    reactor_free(ift->reactor);
     close(ift->fd);
+    pool_free(ift);
 }
 
 /*
@@ -150,6 +159,248 @@ int establish_keepalive(struct if_tcp *ift)
     return(err);
 }
 
+/*
+ * Connect to whichever of a list of addresses answers first.  Addresses are
+ * tried alternating between families, a further attempt being started each
+ * CONNSTAGGER ms or as soon as an earlier one fails, so that an unreachable
+ * address (typically an IPv6 one on an IPv4 only network) doesn't hold up
+ * the rest
+ * Args: List of addresses from getaddrinfo(), pointer to return the address
+ *       connected to
+ * Returns: Connected (blocking) socket, -1 on failure with errno set
+ */
+static int race_connect(struct addrinfo *abase, struct addrinfo **winner)
+{
+    struct addrinfo *cand[MAXCONNADDRS],*aptr;
+    struct pollfd pfd[MAXCONNADDRS];
+    size_t which[MAXCONNADDRS];
+    struct timespec start,now;
+    size_t n,i,j,next,npend;
+    int fd=-1,err=EHOSTUNREACH,soerr,flags,wait,stagger,ready;
+    long remaining;
+    socklen_t len;
+
+    for (n=0,aptr=abase;aptr && n < MAXCONNADDRS;aptr=aptr->ai_next)
+        cand[n++]=aptr;
+
+    for (i=1;i<n;i++) {
+        if (cand[i]->ai_family != cand[i-1]->ai_family)
+            continue;
+        for (j=i+1;j<n && cand[j]->ai_family == cand[i-1]->ai_family;j++);
+        if (j == n)
+            break;
+        aptr=cand[j];
+        memmove(&cand[i+1],&cand[i],(j-i)*sizeof(cand[0]));
+        cand[i]=aptr;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (next=npend=0,stagger=1;fd < 0;) {
+        if (next < n && stagger) {
+            stagger=0;
+            aptr=cand[next];
+            if ((pfd[npend].fd=socket(aptr->ai_family,aptr->ai_socktype,
+                    aptr->ai_protocol)) < 0) {
+                err=errno;
+                break;
+            }
+            if ((flags=fcntl(pfd[npend].fd,F_GETFL)) < 0 ||
+                    fcntl(pfd[npend].fd,F_SETFL,flags|O_NONBLOCK) < 0) {
+                err=errno;
+                close(pfd[npend].fd);
+                break;
+            }
+            if (connect(pfd[npend].fd,aptr->ai_addr,aptr->ai_addrlen) == 0) {
+                fd=pfd[npend].fd;
+                *winner=aptr;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                err=errno;
+                close(pfd[npend].fd);
+                stagger=1;
+            } else {
+                pfd[npend].events=POLLOUT;
+                which[npend++]=next;
+            }
+            next++;
+            continue;
+        }
+
+        if (npend == 0)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        if ((remaining=CONNTIMEOUT*1000-((now.tv_sec-start.tv_sec)*1000+
+                (now.tv_nsec-start.tv_nsec)/1000000)) <= 0) {
+            err=ETIMEDOUT;
+            break;
+        }
+        wait=(next < n && remaining > CONNSTAGGER)?CONNSTAGGER:remaining;
+
+        if ((ready=poll(pfd,npend,wait)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err=errno;
+            break;
+        }
+        if (ready == 0) {
+            stagger=1;
+            continue;
+        }
+
+        for (i=0;i<npend;i++) {
+            if (pfd[i].revents == 0)
+                continue;
+            len=sizeof(soerr);
+            if (getsockopt(pfd[i].fd,SOL_SOCKET,SO_ERROR,&soerr,&len) < 0)
+                soerr=errno;
+            if (soerr == 0) {
+                fd=pfd[i].fd;
+                *winner=cand[which[i]];
+            } else {
+                err=soerr;
+                close(pfd[i].fd);
+                stagger=1;
+            }
+            pfd[i]=pfd[--npend];
+            which[i--]=which[npend];
+            if (fd >= 0)
+                break;
+        }
+    }
+
+    for (i=0;i<npend;i++)
+        close(pfd[i].fd);
+
+    if (fd < 0) {
+        errno=err;
+        return(-1);
+    }
+
+    if ((flags=fcntl(fd,F_GETFL)) < 0 ||
+            fcntl(fd,F_SETFL,flags & ~O_NONBLOCK) < 0) {
+        err=errno;
+        close(fd);
+        errno=err;
+        return(-1);
+    }
+    return(fd);
+}
+
+/*
+ * Make a connection for a persistent client.  The host is looked up afresh
+ * each time in case its address has changed, falling back to the address
+ * last connected to if the lookup fails
+ * Args: Pointer to if_tcp_shared structure
+ * Returns: Connected socket, -1 on failure with errno set.  EINVAL means
+ * the host can never be looked up
+ * Side effects: Address connected to and time of connection are saved
+ */
+static int persist_connect(struct if_tcp_shared *sh)
+{
+    struct addrinfo hints,*abase,*aptr,last;
+    int fd,err;
+
+    memset((void *)&hints,0,sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+
+    if ((err=getaddrinfo(sh->host,sh->port,&hints,&abase))) {
+        if (sh->sa_len == 0) {
+            if (err != EAI_AGAIN && err != EAI_FAIL) {
+                logerr(0,"Lookup failed for host %s/service %s: %s",sh->host,
+                        sh->port,gai_strerror(err));
+                errno=EINVAL;
+            } else
+                errno=EAGAIN;
+            return(-1);
+        }
+        DEBUG(4,"Lookup failed for host %s: %s (using previous address)",
+                sh->host,gai_strerror(err));
+        memset((void *)&last,0,sizeof(last));
+        last.ai_family=sh->sa.ss_family;
+        last.ai_socktype=SOCK_STREAM;
+        last.ai_protocol=sh->protocol;
+        last.ai_addr=(struct sockaddr *) &sh->sa;
+        last.ai_addrlen=sh->sa_len;
+        abase=NULL;
+    }
+
+    if ((fd=race_connect(abase?abase:&last,&aptr)) >= 0) {
+        if (abase) {
+            sh->sa_len=aptr->ai_addrlen;
+            (void) memcpy(&sh->sa,aptr->ai_addr,aptr->ai_addrlen);
+            sh->protocol=aptr->ai_protocol;
+        }
+        sh->connected=mono_ms();
+    }
+
+    if (abase) {
+        err=errno;
+        freeaddrinfo(abase);
+        errno=err;
+    }
+    return(fd);
+}
+
+/*
+ * Wait before retrying a connection.  The delay doubles with each failure
+ * from RETRYMIN ms up to the "retry" value, and is randomised so clients
+ * which lost the same server don't all return to it together
+ * Args: Pointer to if_tcp_shared structure
+ * Returns: Nothing
+ */
+static void backoff(struct if_tcp_shared *sh)
+{
+    long max=sh->retry*1000;
+
+    if (sh->backoff == 0)
+        sh->backoff=(RETRYMIN < max)?RETRYMIN:max;
+    else if ((sh->backoff*=2) > max)
+        sh->backoff=max;
+
+    (void) mysleep_ms(sh->backoff/2+rand_r(&sh->seed)%(sh->backoff/2+1));
+}
+
+/*
+ * Decide how soon to replace a lost connection.  One which lasted at least
+ * the "retry" time is replaced at once and the delay reset.  One which was
+ * only just made counts as another failure, so a server which accepts and
+ * at once closes connections is retried less and less often
+ * Args: Pointer to if_tcp_shared structure
+ * Returns: Nothing
+ */
+static void lost_connection(struct if_tcp_shared *sh)
+{
+    if (mono_ms()-sh->connected < sh->retry*1000)
+        backoff(sh);
+    else
+        sh->backoff=0;
+}
+
+/*
+ * Check whether a failed connection attempt is worth retrying
+ * Args: errno from the attempt
+ * Returns: non-zero if the error is likely to be transient
+ */
+static int transient(int err)
+{
+    switch (err) {
+    case EAGAIN:
+    case ECONNREFUSED:
+    case ECONNRESET:
+    case EHOSTUNREACH:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case ETIMEDOUT:
+    case EADDRNOTAVAIL:
+        return(1);
+    default:
+        return(0);
+    }
+}
+
 /*
  * Reconnect a lost connection in persist mode
  * Args: Pointer to interface and error raised by onnection failure
@@ -167,46 +418,29 @@ int reconnect(iface_t *ifa, int err)
 
     /* ift->shared_t_mutex should be locked by the calling routine */
 
-    /* If the write timed out, we don't need to sleep before retrying */
-    switch (err) {
-    case EAGAIN:
-        break;
-    default:
-        mysleep(ift->shared->retry);
-    }
+    /* Retry at once unless the connection we've lost was only just made, and
+     * loop until we reconnect or encounter an error which doesn't look like
+     * one we are going to recover from */
+    if (err == EAGAIN)
+        ift->shared->backoff=0;
+    else
+        lost_connection(ift->shared);
 
-    /* Loop retrying until we reconnect or encounter an error which doesn't
-     * look like one we are going to recover from */
     for(retval=0;retval == 0;) {
-        /* For most re-connections, closing and re-opening the socket is 
-         * unnecessary, but we do it here for consistency */
         close(ift->fd);
-        if ((ift->fd=socket(ift->shared->sa.ss_family,SOCK_STREAM,
-                ift->shared->protocol)) < 0) {
-            logerr(errno,"Failed to create socket");
-            retval=-1;
-            break;
-        }
         DEBUG(6,"%s: Reconnecting...",ifa->name);
-        if (connect(ift->fd,(const struct sockaddr *)
-                &ift->shared->sa,ift->shared->sa_len) == 0) {
+        if ((ift->fd=persist_connect(ift->shared)) >= 0)
+            break;
+        if (!transient(errno)) {
+            logerr(errno,"Failed to reconnect");
+            retval=-1;
             break;
         }
-
-        switch (errno) {
-        case ECONNREFUSED:
-        case EHOSTUNREACH:
-        case ENETDOWN:
-        case ENETUNREACH:
-            mysleep(ift->shared->retry);
-        case ETIMEDOUT:
-            continue;
-        default:
-            retval = -1;
-        }
+        backoff(ift->shared);
     }
     DEBUG(3,"%s: Reconnected (write) interface",ifa->name);
     if (retval == 0) {
+        STATADD(&ifa->stats,reconnects,1);
         if (ifa->pair) {
                 iftp = (struct if_tcp *) ifa->pair->info;
                 iftp->fd = ift->fd;
@@ -221,8 +455,10 @@ int reconnect(iface_t *ifa, int err)
         }
     }
 
-    DEBUG(7,"Flushing queue interface %s",ifa->name);
-    flush_queue(ifa->q);
+    if (!ift->shared->replay) {
+        DEBUG(7,"Flushing queue interface %s",ifa->name);
+        flush_queue(ifa->q);
+    }
 
     return(retval);
 }
@@ -260,22 +496,19 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
     if ((nread=read(ift->fd,buf,bsize)) <= 0) {
         if (nread == 0 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
             /* An actual error as opposed to success but would block */
+            lost_connection(ift->shared);
             for (nread=-1;nread!=0;) {
                 close(ift->fd);
-                if ((ift->fd=socket(ift->shared->sa.ss_family,SOCK_STREAM,
-                        ift->shared->protocol)) < 0) {
-                    logerr(errno,"Failed to create socket");
-                    nread=-1;
-                    break;
-                }
-
-                mysleep(ift->shared->retry);
                 DEBUG(7,"%s: Retrying connection...",ifa->name);
-                if ((nread=connect(ift->fd,
-                        (const struct sockaddr *)&ift->shared->sa,
-                        ift->shared->sa_len)) == 0)
+                if ((ift->fd=persist_connect(ift->shared)) >= 0) {
+                    nread=0;
+                    STATADD(&ifa->stats,reconnects,1);
                     DEBUG(3,"%s: Reconnected (read) interface",ifa->name);
-
+                } else if (!transient(errno)) {
+                    logerr(errno,"Failed to reconnect");
+                    break;
+                } else
+                    backoff(ift->shared);
             }
         } else {
             nread=0;
@@ -350,7 +583,7 @@ ssize_t read_tcp(struct iface *ifa, char *buf)
          * to a process reading from socket which times out due to unreplied to
          * keepalives.  Instead the read exits with ETIMEDOUT
          */
-        nread=read(ift->fd,buf,BUFSIZ);
+        nread=ring_read(ifa,&ift->ring,ift->fd,buf);
         if (nread <= 0) {
             if (nread) {
                 DEBUG(3,"%s: %s",ifa->name,"Read Failed");
@@ -396,103 +629,97 @@ ssize_t read_tcp(struct iface *ifa, char *buf)
 void write_tcp(struct iface *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
-    senblk_t *sptr;
+    senblk_t *sptrs[WRITEBATCH];
+    struct iovec iov[WRITEBATCH*3];
+    char *tagbuf=NULL;
+    size_t i,n;
     int status=0;
     int err=0;
-    int data=0;
-    int cnt=1;
+    int cnt;
+    int resend;
     int done = 0;
-    struct iovec iov[2];
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tagbuf=malloc(TAGMAX*WRITEBATCH)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %x (%s)",
                         ifa->id,ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
     for(;(!done);) {
 
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,sptrs,WRITEBATCH)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %x (%s)",
-                        ifa->id,ifa->name);
-                ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
-        /* SIGPIPE is blocked here so we can avoid using the (non-portable)
-         * MSG_NOSIGNAL
-         */
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-        if (flag_test(ifa,F_PERSIST)) {
-            pthread_mutex_lock(&ift->shared->t_mutex);
-            if (ift->fd == -1)
-                done++;
-            else
-                ift->shared->critical++;
-            pthread_mutex_unlock(&ift->shared->t_mutex);
-            if (done) {
-                senblk_free(sptr,ifa->q);
-                break;
-            }
-        }
-        if (writev(ift->fd,iov,cnt) <0) {
-            DEBUG2(3,"%s id %x: write failed",ifa->name,ifa->id);
-            err=errno;
-            if (!flag_test(ifa,F_PERSIST)) {
-                senblk_free(sptr,ifa->q);
+        /* In persist mode with "replay" set, a batch whose write failed is
+         * sent again once the connection has been re-established.  The
+         * iovec is rebuilt as a partial write will have modified it */
+        for (resend=1;resend && (!done);) {
+            resend=0;
+            if ((cnt=batch_iov(ifa,sptrs,n,iov,tagbuf,0)) == 0)
                 break;
+
+            /* SIGPIPE is blocked here so we can avoid using the (non-portable)
+             * MSG_NOSIGNAL
+             */
+            if (flag_test(ifa,F_PERSIST)) {
+                pthread_mutex_lock(&ift->shared->t_mutex);
+                if (ift->fd == -1)
+                    done++;
+                else
+                    ift->shared->critical++;
+                pthread_mutex_unlock(&ift->shared->t_mutex);
+                if (done)
+                    break;
             }
-            pthread_mutex_lock(&ift->shared->t_mutex);
-            if (ift->shared->fixing) {
-                pthread_cond_signal(&ift->shared->fv);
-                pthread_cond_wait(&ift->shared->fv,&ift->shared->t_mutex);
-            } else {
-                if (ift->shared->critical == 2) {
-                    ift->shared->fixing++;
-                    (void) shutdown(ift->fd,SHUT_RDWR);
-                    pthread_cond_wait(&ift->shared->fv,&ift->shared->t_mutex);
-                }
-                if ((status=reconnect(ifa,err)) <  0) {
-                    if (ifa->pair)
-                        ((struct if_tcp *) ifa->pair->info)->fd=-1;
-                    logerr(errno,"failed to reconnect tcp connection");
+            if (writev_batch(ifa,ift->fd,iov,cnt,n) <0) {
+                DEBUG2(3,"%s id %x: write failed",ifa->name,ifa->id);
+                err=errno;
+                if (!flag_test(ifa,F_PERSIST)) {
                     done++;
+                    break;
                 }
+                pthread_mutex_lock(&ift->shared->t_mutex);
                 if (ift->shared->fixing) {
-                    ift->shared->fixing=0;
                     pthread_cond_signal(&ift->shared->fv);
+                    pthread_cond_wait(&ift->shared->fv,&ift->shared->t_mutex);
+                    resend=ift->shared->replay && ift->fd != -1;
+                } else {
+                    if (ift->shared->critical == 2) {
+                        ift->shared->fixing++;
+                        (void) shutdown(ift->fd,SHUT_RDWR);
+                        pthread_cond_wait(&ift->shared->fv,
+                                &ift->shared->t_mutex);
+                    }
+                    if ((status=reconnect(ifa,err)) <  0) {
+                        if (ifa->pair)
+                            ((struct if_tcp *) ifa->pair->info)->fd=-1;
+                        logerr(errno,"failed to reconnect tcp connection");
+                        done++;
+                    } else
+                        resend=ift->shared->replay;
+                    if (ift->shared->fixing) {
+                        ift->shared->fixing=0;
+                        pthread_cond_signal(&ift->shared->fv);
+                    }
                 }
+                ift->shared->critical--;
+                pthread_mutex_unlock(&ift->shared->t_mutex);
+            } else if (flag_test(ifa,F_PERSIST)) {
+                pthread_mutex_lock(&ift->shared->t_mutex);
+                ift->shared->critical--;
+                if (ift->shared->fixing)
+                    pthread_cond_signal(&ift->shared->fv);
+                pthread_mutex_unlock(&ift->shared->t_mutex);
             }
-            ift->shared->critical--;
-            pthread_mutex_unlock(&ift->shared->t_mutex);
-        } else if (flag_test(ifa,F_PERSIST)) {
-            pthread_mutex_lock(&ift->shared->t_mutex);
-            ift->shared->critical--;
-            if (ift->shared->fixing)
-                pthread_cond_signal(&ift->shared->fv);
-            pthread_mutex_unlock(&ift->shared->t_mutex);
         }
-        senblk_free(sptr,ifa->q);
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    if (tagbuf)
+        free(tagbuf);
 
     iface_thread_exit(errno);
 }
@@ -501,41 +728,13 @@ void delayed_connect(iface_t *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
     struct if_tcp *iftp;
-    struct addrinfo hints,*abase,*aptr;
-    int err;
     int on=1;
 
-    memset((void *)&hints,0,sizeof(hints));
-
-    hints.ai_family=AF_UNSPEC;
-    hints.ai_socktype=SOCK_STREAM;
-
     pthread_mutex_lock(&ift->shared->t_mutex);
 
-    while (ift->shared->host) {
-        if ((err=getaddrinfo(ift->shared->host,ift->shared->port,&hints,&abase))) {
-            if ((err != EAI_AGAIN && err != EAI_FAIL)) {
-                logerr(0,"Lookup failed for host %s/service %s: %s",ift->shared->host,ift->shared->port,gai_strerror(err));
-                iface_thread_exit(errno);
-            }
-            abase=NULL;
-        }
-
-        for (aptr=abase;aptr;aptr=aptr->ai_next) {
-            if ((ift->fd=socket(aptr->ai_family,aptr->ai_socktype,aptr->ai_protocol)) < 0)
-                continue;
-            if (connect(ift->fd,aptr->ai_addr,aptr->ai_addrlen) == 0)
-                break;
-            close(ift->fd);
-        }
-        if (aptr) {
-            ift->shared->sa_len=aptr->ai_addrlen;
-            (void) memcpy(&ift->shared->sa,aptr->ai_addr,aptr->ai_addrlen);
-            ift->shared->protocol=aptr->ai_protocol;
-            freeaddrinfo(abase);
-            free(ift->shared->host);
-            free(ift->shared->port);
-            ift->shared->host=ift->shared->port=NULL;
+    while (ift->shared->pending) {
+        if ((ift->fd=persist_connect(ift->shared)) >= 0) {
+            ift->shared->pending=0;
             if (ift->shared->nodelay &&
                     (setsockopt(ift->fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on))
                         < 0))
@@ -553,8 +752,10 @@ void delayed_connect(iface_t *ifa)
             DEBUG(3,"%s: Completed delayed connect",ifa->name);
 
         } else {
+            if (errno == EINVAL)
+                iface_thread_exit(errno);
             DEBUG(4,"%s: Delayed connect failed (sleeping)",ifa->name);
-            mysleep(ift->shared->retry);
+            backoff(ift->shared);
         }
     }
 
@@ -572,32 +773,49 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     iface_t *newifa;
     struct if_tcp *oldift=(struct if_tcp *) ifa->info;
     struct if_tcp *newift=NULL;
-    pthread_t tid;
+    size_t qsize;
     int on=1;
-    sigset_t set,saved;
 
-    if ((newifa = malloc(sizeof(iface_t))) == NULL) {
-        logerr(errno,"malloc failed for %s",ifa->name);
+    if ((newifa = iface_alloc()) == NULL) {
+        logerr(errno,"Failed to allocate new connection to %s",ifa->name);
         return(NULL);
     }
 
-    memset(newifa,0,sizeof(iface_t));
+    newifa->qpolicy=ifa->qpolicy;
+    newifa->qmax=ifa->qmax;
+    newifa->qprio=addfilter(ifa->qprio);
+    lanes_copy(&newifa->qlanes,&ifa->qlanes);
+    newifa->qcompact=ifa->qcompact;
 
-    if (((newift = (struct if_tcp *) malloc(sizeof(struct if_tcp))) == NULL) ||
-            ((ifa->direction != IN) &&
-            (init_q(newifa, oldift->qsize) < 0))) {
+    if ((newift = (struct if_tcp *) pool_alloc(sizeof(struct if_tcp),
+            &newifa->mem)) == NULL) {
         logerr(errno,"Failed to set up new connection");
-        if (newifa && newifa->q)
-            free(newifa->q);
-        if (newift)
-            free(newift);
-        free(newifa);
+        free_filter(newifa->qprio);
+        lanes_free(&newifa->qlanes);
+        pool_free(newifa);
         return(NULL);
     }
-    memset(newift,0,sizeof(struct if_tcp));
+
+    /* Short of memory (see "memlimit"), give the client a shorter queue
+     * rather than turning it away */
+    for (qsize=oldift->qsize;(ifa->direction != IN) &&
+            (init_q(newifa,qsize) < 0);qsize/=2)
+        if (errno != ENOMEM || qsize/2 < MINCONNQSIZE) {
+            logerr(errno,"Failed to set up new connection");
+            free_filter(newifa->qprio);
+            lanes_free(&newifa->qlanes);
+            pool_free(newift);
+            pool_free(newifa);
+            return(NULL);
+        }
+    if (qsize < oldift->qsize)
+        logwarn("%s: Queue for new connection reduced to %zu by memory limit",
+                ifa->name,qsize);
 
     newift->fd=fd;
     newift->shared=NULL;
+    newift->ring.want=0;
+    newift->ring.rd=NULL;
     newifa->id=ifa->id+(fd&IDMINORMASK);
     newifa->direction=ifa->direction;
     newifa->type=TCP;
@@ -610,12 +828,13 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     newifa->flags=ifa->flags;
     newifa->readbuf=read_tcp;
     newifa->lists=ifa->lists;
-    newifa->ifilter=addfilter(ifa->ifilter);
-    newifa->ofilter=addfilter(ifa->ofilter);
+    newifa->ifilter=filter_get(&ifa->ifilter);
+    newifa->ofilter=filter_get(&ifa->ofilter);
     newifa->checksum=ifa->checksum;
     newifa->strict=ifa->strict;
+    newifa->tattr=ifa->tattr;
     if (ifa->direction == IN)
-        newifa->q=ifa->lists->engine->q;
+        newifa->q=engine_q(ifa->lists,newifa->id);
     else {
         if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0)
             logerr(errno,"Could not disable Nagle on new tcp connection");
@@ -623,28 +842,21 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
         if (ifa->direction == BOTH) {
             if ((newifa->next=ifdup(newifa)) == NULL) {
                 logwarn("Interface duplication failed");
-                free(newifa->q);
-                free(newift);
-                free(newifa);
+                free_q(newifa->q);
+                pool_free(newift);
+                pool_free(newifa);
                 return(NULL);
             }
+            pool_account(newifa->pair->info,&newifa->pair->mem);
             newifa->direction=OUT;
             newifa->pair->direction=IN;
-            newifa->pair->q=ifa->lists->engine->q;
-            sigemptyset(&set);
-            sigaddset(&set, SIGUSR1);
-            pthread_sigmask(SIG_BLOCK, &set, &saved);
+            newifa->pair->q=engine_q(ifa->lists,newifa->id);
             link_to_initialized(newifa->pair);
-            pthread_create(&tid,NULL,(void *)start_interface,(void *) newifa->pair);
-            pthread_sigmask(SIG_SETMASK,&saved,NULL);
+            (void) iface_thread(newifa->pair);
         }
     }
-    sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
-    pthread_sigmask(SIG_BLOCK, &set, &saved);
     link_to_initialized(newifa);
-    pthread_create(&tid,NULL,(void *)start_interface,(void *) newifa);
-    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    (void) iface_thread(newifa);
     return(newifa);
 }
 
@@ -672,7 +884,7 @@ void tcp_server(iface_t *ifa)
                 afd=-1;
             }
             DEBUG(3,"%s: New connection id %x %ssuccessfully received from %s",
-                    ifa->name,newifa->id,(afd<0)?"un":"",
+                    ifa->name,(newifa)?newifa->id:0,(afd<0)?"un":"",
                     inet_ntop(sad.ss_family,(sad.ss_family == AF_INET)?
                     (const void *) &((struct sockaddr_in *)&sad)->sin_addr:
                     (const void *) &((struct sockaddr_in6 *)&sad)->sin6_addr,
@@ -809,18 +1021,24 @@ iface_t *init_tcp(iface_t *ifa)
     unsigned keepcnt=0;
     unsigned sndbuf=DEFSNDBUF;
     int nodelay=1;
+    int replay=0;
     long timeout=-1;
     int gpsd=0;
+    int reactor=0;
 
     host=port=NULL;
 
-    if ((ift = malloc(sizeof(struct if_tcp))) == NULL) {
+    if ((ift = (struct if_tcp *) pool_alloc(sizeof(struct if_tcp),
+            &ifa->mem)) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
 
     ift->qsize=DEFQSIZE;
     ift->shared=NULL;
+    ift->reactor=NULL;
+    ift->ring.want=0;
+    ift->ring.rd=NULL;
     preamble=NULL;
 
     for(opt=ifa->options;opt;opt=opt->next) {
@@ -927,6 +1145,20 @@ iface_t *init_tcp(iface_t *ifa)
                 logerr(0,"Could not parse preamble %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"reactor")) {
+            if (!strcasecmp(opt->val,"yes")) {
+                reactor=1;
+            } else if (!strcasecmp(opt->val,"uring")) {
+                reactor=2;
+            } else if (!strcasecmp(opt->val,"no")) {
+                reactor=0;
+            } else {
+                logerr(0,"Invalid option \"reactor=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"uring")) {
+            if (ring_opt(ifa,&ift->ring,opt->val) < 0)
+                return(NULL);
         } else if (!strcasecmp(opt->var,"nodelay")) {
             if (!strcasecmp(opt->val,"no")) {
                 nodelay=0;
@@ -936,6 +1168,19 @@ iface_t *init_tcp(iface_t *ifa)
                 logerr(0,"Invalid option \"nodelay=%s\"",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"replay")) {
+            if (!flag_test(ifa,F_PERSIST)) {
+                logerr(0,"replay valid only valid with persist option");
+                return(NULL);
+            }
+            if (!strcasecmp(opt->val,"yes"))
+                replay=1;
+            else if (!strcasecmp(opt->val,"no"))
+                replay=0;
+            else {
+                logerr(0,"replay must be \"yes\" or \"no\"");
+                return(NULL);
+            }
         } else  {
             logerr(0,"unknown interface option %s\n",opt->var);
             return(NULL);
@@ -970,6 +1215,10 @@ iface_t *init_tcp(iface_t *ifa)
             }
             preamble=parse_preamble("?WATCH={\"enable\":true,\"nmea\":true}");
         }
+        if (reactor) {
+            logerr(0,"reactor option only valid for tcp servers");
+            return(NULL);
+        }
     } else {
         if (flag_test(ifa,F_PERSIST)) {
             logerr(0,"persist option not valid for tcp servers");
@@ -987,6 +1236,11 @@ iface_t *init_tcp(iface_t *ifa)
             logerr(0,"proto=gpsd not valid for servers");
             return(NULL);
         }
+
+        if (ift->ring.want) {
+            logerr(0,"uring option only valid for tcp clients: use reactor=uring");
+            return(NULL);
+        }
     }
 
     if (!port) {
@@ -1011,29 +1265,29 @@ iface_t *init_tcp(iface_t *ifa)
         }
     }
 
-    for (connection=abase;connection;connection=connection->ai_next) {
+    if (*conntype == 'c') {
+        if ((ift->fd=race_connect(abase,&connection)) < 0) {
+            err=errno;
+            connection=NULL;
+        }
+    } else for (connection=abase;connection;connection=connection->ai_next) {
         if ((ift->fd=socket(connection->ai_family,connection->ai_socktype,connection->ai_protocol)) < 0)
             continue;
-        if (*conntype == 'c') {
-            if (connect(ift->fd,connection->ai_addr,connection->ai_addrlen) == 0)
-                break;
-        } else {
-            setsockopt(ift->fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
-            if (connection->ai_family == AF_INET6) {
-                for (ptr=((struct sockaddr_in6 *)connection->ai_addr)->sin6_addr.s6_addr,i=0;i<16;i++,ptr++)
-                    if (*ptr)
-                        break;
-                if (i == sizeof(struct in6_addr)) {
-                    if (setsockopt(ift->fd,IPPROTO_IPV6,IPV6_V6ONLY,
-                            (void *)&off,sizeof(off)) <0) {
-                        logerr(errno,"Failed to set ipv6 mapped ipv4 addresses on socket");
-                    }
+        setsockopt(ift->fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        if (connection->ai_family == AF_INET6) {
+            for (ptr=((struct sockaddr_in6 *)connection->ai_addr)->sin6_addr.s6_addr,i=0;i<16;i++,ptr++)
+                if (*ptr)
+                    break;
+            if (i == sizeof(struct in6_addr)) {
+                if (setsockopt(ift->fd,IPPROTO_IPV6,IPV6_V6ONLY,
+                        (void *)&off,sizeof(off)) <0) {
+                    logerr(errno,"Failed to set ipv6 mapped ipv4 addresses on socket");
                 }
             }
-            if (bind(ift->fd,connection->ai_addr,connection->ai_addrlen) == 0)
-                break;
-            err=errno;
         }
+        if (bind(ift->fd,connection->ai_addr,connection->ai_addrlen) == 0)
+            break;
+        err=errno;
         close(ift->fd);
      }
 
@@ -1045,7 +1299,7 @@ iface_t *init_tcp(iface_t *ifa)
     if (flag_test(ifa,F_PERSIST)) {
         if ((ift->shared = malloc(sizeof(struct if_tcp_shared))) == NULL) {
             logerr(errno,"Could not allocate memory");
-            free(ift);
+            pool_free(ift);
             return(NULL);
         }
 
@@ -1064,17 +1318,27 @@ iface_t *init_tcp(iface_t *ifa)
             logerr(0,"retry value out of range");
             return(NULL);
         }
+        /* host and port are kept so the address can be looked up again
+         * on reconnection */
+        ift->shared->host=strdup(host);
+        ift->shared->port=strdup(port);
+        ift->shared->backoff=0;
+        ift->shared->seed=(unsigned) time(NULL) ^ (unsigned) getpid() ^
+                (unsigned) (uintptr_t) ift->shared;
         if (connection) {
             ift->shared->sa_len=connection->ai_addrlen;
             (void) memcpy(&ift->shared->sa,connection->ai_addr,connection->ai_addrlen);
             ift->shared->protocol=connection->ai_protocol;
-            ift->shared->host=ift->shared->port=NULL;
+            ift->shared->connected=mono_ms();
+            ift->shared->pending=0;
         } else {
-            ift->shared->host=strdup(host);
-            ift->shared->port=strdup(port);
+            ift->shared->sa_len=0;
+            ift->shared->connected=0;
+            ift->shared->pending=1;
             DEBUG(3,"%s: Initial connection to %s port %s failed",ifa->name,
                     host,port);
         }
+        ift->shared->replay=replay;
         ift->shared->donewith=1;
         ift->shared->critical=0;
         ift->shared->fixing=0;
@@ -1134,6 +1398,24 @@ iface_t *init_tcp(iface_t *ifa)
             ifa->direction=OUT;
             ifa->pair->direction=IN;
         }
+    } else if (reactor) {
+        /* Connections' rings are fixed size and not divided into lanes */
+        if (ifa->direction != IN && (ifa->qpolicy == Q_GROW ||
+                ifa->qlanes.match[0])) {
+            logerr(0,"%s can't be used with reactor",
+                    (ifa->qpolicy == Q_GROW)?"overflow=grow":"lane1");
+            return(NULL);
+        }
+        if ((ifa->direction != IN) && (init_q(ifa, ift->qsize) < 0)) {
+            logerr(errno,"Could not create queue");
+            return(NULL);
+        }
+        if ((ift->reactor=reactor_init(ift->qsize,reactor == 2)) == NULL) {
+            logerr(errno,"Could not initialise tcp server");
+            return(NULL);
+        }
+        ifa->write=tcp_reactor;
+        ifa->read=tcp_reactor;
     } else {
         ifa->write=tcp_server;
         ifa->read=tcp_server;
@@ -10,22 +10,38 @@
 #define DEFKEEPINTVL 10
 #define DEFKEEPCNT 3
 #define MAXPREAMBLE 1024
+/* Smallest queue a new connection may be given under a memory limit */
+#define MINCONNQSIZE 4
+/* Client connection establishment */
+#define CONNTIMEOUT 10      /* Seconds to wait for a connection to complete */
+#define CONNSTAGGER 250     /* ms before also trying the next address */
+#define MAXCONNADDRS 8      /* Addresses tried per connection attempt */
+#define RETRYMIN 100        /* First reconnection delay (ms) */
 
 struct tcp_preamble {
     unsigned char * string;
     size_t len;
 };
 
+struct tcp_reactor;
+
 struct if_tcp {
     int fd;
     size_t qsize;
     struct if_tcp_shared *shared;
+    struct tcp_reactor *reactor;    /* Event driven server state */
+    struct ifring ring;             /* io_uring reads for client inputs */
 };
 
 struct if_tcp_shared {
     char *host;
     char *port;
-    time_t retry;
+    time_t retry;       /* Maximum delay between connection attempts */
+    long backoff;       /* Current delay between connection attempts (ms) */
+    long long connected;    /* mono_ms() of last successful connection */
+    unsigned seed;      /* For randomising retry delays */
+    int pending;        /* Initial connection not yet made */
+    int replay;         /* Re-send batch interrupted by reconnection */
     socklen_t sa_len;
     struct sockaddr_storage sa;
     int donewith;
@@ -47,5 +63,8 @@ struct if_tcp_shared {
 void cleanup_tcp(iface_t *ifa);
 void write_tcp(struct iface *ifa);
 ssize_t read_tcp(struct iface *ifa, char *buf);
+struct tcp_reactor *reactor_init(size_t qsize, int uring);
+void reactor_free(struct tcp_reactor *rx);
+void tcp_reactor(iface_t *ifa);
 
 
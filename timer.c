@@ -0,0 +1,221 @@
+/* timer.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Monotonic time and a timer wheel
+ *
+ * Limits, failover and flush deadlines are measured on the monotonic clock so
+ * that they are unaffected by changes to the system time.  Timed waits on
+ * condition variables initialised with wait_cond_init() take deadlines from
+ * wait_abstime().
+ *
+ * Timers are kept on a hashed wheel of TIMERSLOTS slots each TIMERTICK ms
+ * wide, serviced by a thread which is started when the first timer is added
+ * and which only wakes each tick while timers are pending.  Timer callbacks
+ * run in that thread so must not block for long.
+ */
+
+#include "kplex.h"
+
+#define TIMERTICK 10        /* ms covered by each slot */
+#define TIMERSLOTS 256      /* slots on the wheel */
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tw_mutex;
+static pthread_cond_t tw_cond;          /* Timer added or callback completed */
+static struct ktimer *wheel[TIMERSLOTS];
+static struct ktimer *running;          /* Timer whose callback is running */
+static pthread_t tw_tid;
+static long long tw_tick;               /* Next tick to be processed */
+static size_t ntimers;
+static int tw_err;
+
+/*
+ * Read the monotonic clock
+ * Args: None
+ * Returns: milliseconds since an arbitrary starting point
+ */
+long long mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((long long) ts.tv_sec*1000+ts.tv_nsec/1000000);
+}
+
+/*
+ * Calculate an absolute deadline for a timed wait on a condition variable
+ * initialised with wait_cond_init()
+ * Args: timespec to fill in, milliseconds from now
+ * Returns: Nothing
+ */
+void wait_abstime(struct timespec *ts, long ms)
+{
+    clock_gettime(WAITCLOCK,ts);
+    ts->tv_sec+=ms/1000;
+    if ((ts->tv_nsec+=(ms%1000)*1000000) >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec-=1000000000;
+    }
+}
+
+/*
+ * Initialise a condition variable whose timed waits use WAITCLOCK
+ * Args: condition variable
+ * Returns: 0 on success, error number otherwise
+ */
+int wait_cond_init(pthread_cond_t *cond)
+{
+#ifdef __APPLE__
+    return(pthread_cond_init(cond,NULL));
+#else
+    pthread_condattr_t attr;
+    int err;
+
+    if ((err=pthread_condattr_init(&attr)))
+        return(err);
+    if ((err=pthread_condattr_setclock(&attr,WAITCLOCK)) == 0)
+        err=pthread_cond_init(cond,&attr);
+    pthread_condattr_destroy(&attr);
+    return(err);
+#endif
+}
+
+/*
+ * Service the timer wheel, running callbacks for timers which have expired
+ * Args: unused
+ * Returns: Nothing (doesn't)
+ */
+static void *timer_run(void *arg)
+{
+    struct ktimer *t;
+    struct timespec ts;
+    long long now,ms;
+
+    (void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+    pthread_mutex_lock(&tw_mutex);
+    for (;;) {
+        while (ntimers == 0)
+            pthread_cond_wait(&tw_cond,&tw_mutex);
+
+        now=mono_ms();
+        /* Each slot need be visited only once however long we overslept */
+        if (now/TIMERTICK-tw_tick >= TIMERSLOTS)
+            tw_tick=now/TIMERTICK-TIMERSLOTS+1;
+
+        for (;tw_tick <= now/TIMERTICK;tw_tick++) {
+            for (t=wheel[tw_tick%TIMERSLOTS];t;) {
+                /* Timers due on a later turn of the wheel stay put */
+                if (t->when > now) {
+                    t=t->next;
+                    continue;
+                }
+                if ((*t->prev=t->next))
+                    t->next->prev=t->prev;
+                t->prev=NULL;
+                ntimers--;
+                running=t;
+                pthread_mutex_unlock(&tw_mutex);
+                t->fn(t->arg);
+                pthread_mutex_lock(&tw_mutex);
+                running=NULL;
+                pthread_cond_broadcast(&tw_cond);
+                /* The slot may have changed while unlocked */
+                t=wheel[tw_tick%TIMERSLOTS];
+            }
+        }
+
+        if (ntimers && (ms=tw_tick*TIMERTICK-mono_ms()) > 0) {
+            wait_abstime(&ts,ms);
+            (void) pthread_cond_timedwait(&tw_cond,&tw_mutex,&ts);
+        }
+    }
+    return(NULL);
+}
+
+/*
+ * Initialise the timer wheel and start its thread.  Run once
+ * Args: None
+ * Returns: Nothing.  tw_err is set on failure
+ */
+static void timer_init(void)
+{
+    pthread_attr_t attr;
+
+    pthread_mutex_init(&tw_mutex,NULL);
+    if ((tw_err=wait_cond_init(&tw_cond)))
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    tw_err=pthread_create(&tw_tid,&attr,timer_run,NULL);
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Arrange for a function to be called after a delay
+ * Args: timer (zeroed before first use and not already pending), delay in
+ * ms, function to call and argument to pass to it
+ * Returns: 0 on success, -1 with errno set if the timer thread could not be
+ * started
+ */
+int timer_add(struct ktimer *t, long ms, void (*fn)(void *), void *arg)
+{
+    struct ktimer **slot;
+    long long tick;
+
+    (void) pthread_once(&timer_once,timer_init);
+    if (tw_err) {
+        errno=tw_err;
+        return(-1);
+    }
+
+    t->fn=fn;
+    t->arg=arg;
+    t->when=mono_ms()+ms;
+
+    pthread_mutex_lock(&tw_mutex);
+    if (ntimers++ == 0)
+        tw_tick=mono_ms()/TIMERTICK;
+    /* The first tick at or after expiry, so that the timer is due whenever
+     * its slot is visited on the right turn of the wheel.  A timer already
+     * due goes in the next slot to be processed */
+    if ((tick=(t->when+TIMERTICK-1)/TIMERTICK) < tw_tick)
+        tick=tw_tick;
+    slot=&wheel[tick%TIMERSLOTS];
+    if ((t->next=*slot))
+        t->next->prev=&t->next;
+    t->prev=slot;
+    *slot=t;
+    pthread_cond_signal(&tw_cond);
+    pthread_mutex_unlock(&tw_mutex);
+    return(0);
+}
+
+/*
+ * Cancel a timer.  If its callback is running in another thread, wait for
+ * it to finish
+ * Args: timer
+ * Returns: 1 if the timer was pending, 0 if it had already fired (or was
+ * never added)
+ */
+int timer_cancel(struct ktimer *t)
+{
+    int pending=0;
+
+    if (pthread_once(&timer_once,timer_init) || tw_err)
+        return(0);
+
+    pthread_mutex_lock(&tw_mutex);
+    if (t->prev) {
+        if ((*t->prev=t->next))
+            t->next->prev=t->prev;
+        t->prev=NULL;
+        ntimers--;
+        pending=1;
+    } else if (!pthread_equal(pthread_self(),tw_tid))
+        while (running == t)
+            pthread_cond_wait(&tw_cond,&tw_mutex);
+    pthread_mutex_unlock(&tw_mutex);
+    return(pending);
+}
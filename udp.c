@@ -11,8 +11,13 @@
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
 
 #define CBUFSIZ 128
+#define DEFMTU 1472             /* Ethernet MTU less IPv4 and UDP headers */
+#define MINMTU (SENBUFSZ+TAGMAX)
+#define MAXMTU 65507
+#define DEFMAXHOLD 5            /* milliseconds */
 
 static struct ignore_addr {
     struct sockaddr_in iaddr;
@@ -39,6 +44,13 @@ struct if_udp {
     } mr;
     struct ignore_addr *ignore;
     struct coalesce *coalesce;
+    size_t batch;               /* Datagrams per system call */
+    int uring;                  /* Receive with io_uring.  See dgram.c */
+    size_t mtu;                 /* Maximum packed datagram payload */
+    long maxhold;               /* Max time (ms) to hold a packed datagram */
+    char *pbuf;                 /* Packing buffer if packing sentences */
+    struct dgram_tx *tx;
+    struct dgram_rx *rx;
 };
 
 /*
@@ -60,6 +72,10 @@ void *ifdup_udp(void *ifa)
 
     /* In-bound connections don't need pointer to coalesce buffer */
     newif->coalesce = NULL;
+    newif->pbuf = NULL;
+    /* Batch buffers are allocated by the thread using them */
+    newif->tx = NULL;
+    newif->rx = NULL;
 
     /* Whole new file descriptor to bind() to.  Not an issue for Linux but
      * for some other platforms (e.g. OS X) we can't send with a multicast /
@@ -107,6 +123,12 @@ void cleanup_udp(iface_t *ifa)
     if (ifu->coalesce)
         free(ifu->coalesce);
 
+    if (ifu->pbuf)
+        free(ifu->pbuf);
+
+    dgram_tx_free(ifu->tx);
+    dgram_rx_free(ifu->rx);
+
     /* iomutex should be locked in the cleanup routine */
     close(ifu->fd);
 }
@@ -147,13 +169,32 @@ int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
     return(1);
 }
 
+/*
+ * Check whether a sentence would be taken by coalesce()
+ * Args: udp interface info, sentence data and length
+ * Returns: 1 if the sentence is to be coalesced, 0 otherwise
+ */
+static int coalescing(struct if_udp *ifu, char *data, size_t len)
+{
+    size_t nfrags,frag;
+    unsigned int seqid;
+
+    if (!(is_ais(data,len,&nfrags,&frag,&seqid)))
+        return(0);
+
+    if (nfrags == 1 && ifu->coalesce->offset == 0)
+        return(0);
+
+    return(1);
+}
+
 int coalesce(struct if_udp *ifu, struct msghdr * mh)
 {
     size_t nfrags,frag;
     unsigned int seqid;
     struct iovec *ioptr = mh->msg_iov;
     int data = mh->msg_iovlen-1;
-    size_t len;
+    size_t len=0;
     int i;
     struct coalesce *cp = ifu->coalesce;
 
@@ -165,7 +206,7 @@ int coalesce(struct if_udp *ifu, struct msghdr * mh)
         return(0);
 
     for (i=0;i<mh->msg_iovlen;i++)
-        len=ioptr[i].iov_len;
+        len+=ioptr[i].iov_len;
 
     if ((cp->offset + len) > CBUFSIZ || ((cp->offset) && (cp->seqid != seqid) &&
             frag < nfrags)) {
@@ -193,6 +234,160 @@ int coalesce(struct if_udp *ifu, struct msghdr * mh)
 }
 
 
+/*
+ * Write to a coalescing udp interface using sendmmsg() to send up to
+ * ifu->batch datagrams per system call
+ * Args: Pointer to interface
+ * Returns: Does not return
+ */
+static void write_udp_batch(struct iface *ifa)
+{
+    struct if_udp *ifu = (struct if_udp *) ifa->info;
+    senblk_t *sptrs[MAXDGRAMBATCH];
+    senblk_t *pass[MAXDGRAMBATCH];
+    char tagbuf[TAGMAX];
+    struct msghdr msgh;
+    struct iovec iov[2];
+    size_t i,m,n;
+    int err=0;
+
+    msgh.msg_name=(void *)&ifu->addr;
+    msgh.msg_namelen=ifu->asize;
+    msgh.msg_control=NULL;
+    msgh.msg_controllen=msgh.msg_flags=0;
+    msgh.msg_iov=iov;
+    iov[0].iov_base=tagbuf;
+
+    while (!err) {
+        if ((n = next_senblk_batch(ifa->q,sptrs,ifu->batch)) == 0)
+            break;
+
+        for (i=0,m=0;i<n && !err;i++) {
+            if (!(ifu->coalesce &&
+                    coalescing(ifu,sptrs[i]->data,sptrs[i]->len))) {
+                pass[m++]=sptrs[i];
+                continue;
+            }
+
+            /* coalesce() may send immediately, so send what we have already
+             * to keep sentences in order */
+            if (m && dgram_send(ifa,ifu->tx,ifu->fd,pass,m,
+                    (struct sockaddr *)&ifu->addr,ifu->asize) < 0) {
+                err++;
+                break;
+            }
+            m=0;
+
+            msgh.msg_iovlen=1;
+            if (ifa->tagflags) {
+                if ((iov[0].iov_len = gettag(ifa,tagbuf,sptrs[i])) == 0) {
+                    logerr(errno,"%s: Disabing tag output",ifa->name);
+                    ifa->tagflags=0;
+                } else
+                    msgh.msg_iovlen=2;
+            }
+            iov[msgh.msg_iovlen-1].iov_base=sptrs[i]->data;
+            iov[msgh.msg_iovlen-1].iov_len=sptrs[i]->len;
+            (void) coalesce(ifu,&msgh);
+            /* Coalesced sentences are counted as they are buffered */
+            STATADD(&ifa->stats,sen_out,1);
+            STATADD(&ifa->stats,bytes_out,sptrs[i]->len);
+        }
+
+        if (m && !err && dgram_send(ifa,ifu->tx,ifu->fd,pass,m,
+                (struct sockaddr *)&ifu->addr,ifu->asize) < 0)
+            err++;
+
+        for (i=0;i<n;i++)
+            senblk_free(sptrs[i],ifa->q);
+    }
+
+    iface_thread_exit(errno);
+}
+
+/*
+ * Send a packed datagram
+ * Args: Interface, length of data in its pack buffer and number of sentences
+ * in it
+ * Returns: Number of bytes sent or -1 on error
+ */
+static ssize_t send_pack(struct iface *ifa, size_t len, size_t nsen)
+{
+    struct if_udp *ifu = (struct if_udp *) ifa->info;
+    struct timespec start;
+    ssize_t sent;
+
+    stats_clock(&start);
+    if ((sent=sendto(ifu->fd,ifu->pbuf,len,0,(struct sockaddr *)&ifu->addr,
+            ifu->asize)) >= 0)
+        stats_write(ifa,nsen,sent,&start);
+    return(sent);
+}
+
+/*
+ * Write to a udp interface packing as many sentences as will fit into each
+ * datagram.  A partly filled datagram is sent when no more sentences have
+ * arrived within ifu->maxhold milliseconds of the first being added
+ * Args: Pointer to interface
+ * Returns: Does not return
+ */
+static void write_udp_pack(struct iface *ifa)
+{
+    struct if_udp *ifu = (struct if_udp *) ifa->info;
+    senblk_t *sptr;
+    struct timespec deadline;
+    size_t offset=0,len,nsen=0;
+    int timedout;
+
+    for (;;) {
+        if (offset == 0)
+            sptr = next_senblk(ifa->q);
+        else
+            sptr = next_senblk_timed(ifa->q,&deadline);
+
+        if (sptr == NULL) {
+            timedout=(errno == ETIMEDOUT);
+            /* Timed out or shutting down: send what we have */
+            if (offset && send_pack(ifa,offset,nsen) < 0)
+                break;
+            offset=nsen=0;
+            if (timedout)
+                continue;
+            errno=0;
+            break;
+        }
+
+        /* MINMTU guarantees a tag and sentence always fit an empty buffer */
+        len=sptr->len;
+        if (ifa->tagflags)
+            len+=TAGMAX;
+        if (offset + len > ifu->mtu) {
+            if (send_pack(ifa,offset,nsen) < 0) {
+                senblk_free(sptr,ifa->q);
+                break;
+            }
+            offset=nsen=0;
+        }
+
+        if (offset == 0)
+            wait_abstime(&deadline,ifu->maxhold);
+
+        if (ifa->tagflags) {
+            if ((len = gettag(ifa,ifu->pbuf+offset,sptr)) == 0) {
+                logerr(errno,"%s: Disabing tag output",ifa->name);
+                ifa->tagflags=0;
+            }
+            offset+=len;
+        }
+        memcpy(ifu->pbuf+offset,sptr->data,sptr->len);
+        offset+=sptr->len;
+        nsen++;
+        senblk_free(sptr,ifa->q);
+    }
+
+    iface_thread_exit(errno);
+}
+
 void write_udp(struct iface *ifa)
 {
     struct if_udp *ifu;
@@ -200,8 +395,29 @@ void write_udp(struct iface *ifa)
     int data=0;
     struct msghdr msgh;
     struct iovec iov[2];
+    struct timespec start;
+    ssize_t sent;
 
     ifu = (struct if_udp *) ifa->info;
+
+    if (ifu->pbuf)
+        write_udp_pack(ifa);
+
+    if (ifu->batch > 1) {
+        if ((ifu->tx=dgram_tx_init(ifu->batch))) {
+            if (ifu->coalesce)
+                write_udp_batch(ifa);
+            else {
+                dgram_write(ifa,ifu->tx,ifu->fd,(struct sockaddr *)&ifu->addr,
+                        ifu->asize);
+                iface_thread_exit(errno);
+            }
+        }
+        /* Only get here if we couldn't allocate buffers */
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+    }
+
     msgh.msg_name=(void *)&ifu->addr;
     msgh.msg_namelen=ifu->asize;
     msgh.msg_control=NULL;
@@ -222,11 +438,6 @@ void write_udp(struct iface *ifa)
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
         if (ifa->tagflags)
             if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
@@ -246,8 +457,10 @@ void write_udp(struct iface *ifa)
             }
         }
 
-        if (sendmsg(ifu->fd,&msgh,0) < 0)
+        stats_clock(&start);
+        if ((sent=sendmsg(ifu->fd,&msgh,0)) < 0)
             break;
+        stats_write(ifa,1,sent,&start);
         senblk_free(sptr,ifa->q);
     }
 
@@ -276,8 +489,34 @@ ssize_t read_udp(iface_t *ifa, char *buf)
     mh.msg_controllen = 0;
     mh.msg_flags = 0;
 
+#ifdef KPLEX_IOURING
+    if (ifu->uring && !ifu->rx) {
+        if ((ifu->rx=dgram_rx_uring(ifu->fd)) == NULL) {
+            logwarn("%s: Could not set up io_uring (%s): not using it",
+                    ifa->name,strerror(errno));
+            ifu->uring=0;
+        } else {
+            DEBUG(3,"%s: receiving with io_uring",ifa->name);
+            /* io_uring_enter() isn't a cancellation point */
+            __atomic_store_n(&ifa->cancelfd,dgram_rx_wakefd(ifu->rx),
+                    __ATOMIC_RELEASE);
+        }
+    }
+#endif
+    if (ifu->batch > 1 && !ifu->rx &&
+            (ifu->rx=dgram_rx_init(ifu->batch)) == NULL) {
+        logerr(errno,"%s: Could not allocate batch buffers: not batching",
+                ifa->name);
+        ifu->batch=1;
+    }
+
     do {
-        nread = recvmsg(ifu->fd,&mh,0);
+        if (ifu->rx) {
+            mh.msg_namelen = (socklen_t) sizeof(src);
+            nread = dgram_recv(ifu->rx,ifu->fd,buf,(struct sockaddr *)&src,
+                    &mh.msg_namelen);
+        } else
+            nread = recvmsg(ifu->fd,&mh,0);
 
         if (ifu->ignore && ifu->ignore->writers) {
         /* Broadcast Interface: IPv4 */
@@ -332,6 +571,11 @@ struct iface *init_udp(struct iface *ifa)
     size_t qsize = DEFQSIZE;
     struct kopts *opt;
     int coalesce=0;
+    int batch=1;
+    int uring=0;
+    int pack=0;
+    long mtu=DEFMTU;
+    long maxhold=DEFMAXHOLD;
     int ifindex,iffound=0;
     int linklocal=0;
     int on=1,off=0;
@@ -368,6 +612,42 @@ struct iface *init_udp(struct iface *ifa)
                 coalesce=0;
             else
                 logerr(0,"Unrecognized value for coalesce: %s",opt->val);
+        } else if (!strcasecmp(opt->var,"batch")) {
+            if (((batch=atoi(opt->val)) <= 0) || batch > MAXDGRAMBATCH) {
+                logerr(0,"Invalid batch size specified: %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"uring")) {
+            if (!strcasecmp(opt->val,"yes"))
+                uring=1;
+            else if (!strcasecmp(opt->val,"no"))
+                uring=0;
+            else {
+                logerr(0,"Unrecognized value for uring: %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"pack")) {
+            if (!strcasecmp(opt->val,"yes"))
+                pack=1;
+            else if (!strcasecmp(opt->val,"no"))
+                pack=0;
+            else {
+                logerr(0,"Unrecognized value for pack: %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"mtu")) {
+            if ((mtu=strtol(opt->val,&eptr,0)) < MINMTU || mtu > MAXMTU ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid mtu %s: must be between %d and %d",
+                        opt->val,MINMTU,MAXMTU);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"maxhold")) {
+            if ((maxhold=strtol(opt->val,&eptr,0)) < 0 || maxhold > 10000 ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid maxhold specified: %s",opt->val);
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"qsize")) {
             if (!(qsize=atoi(opt->val))) {
                 logerr(0,"Invalid queue size specified: %s",opt->val);
@@ -390,6 +670,26 @@ struct iface *init_udp(struct iface *ifa)
         }
     }
 
+    if (pack && (coalesce || batch > 1)) {
+        logerr(0,"%s: pack may not be used with coalesce or batch",ifa->name);
+        return(NULL);
+    }
+    ifu->mtu=mtu;
+    ifu->maxhold=maxhold;
+
+    if (batch > 1 && !dgram_batch_supported()) {
+        logwarn("%s: batch option not supported on this platform",ifa->name);
+        batch=1;
+    }
+    ifu->batch=batch;
+#ifndef KPLEX_IOURING
+    if (uring && ifa->direction != OUT)
+        logwarn("%s: kplex was not built with io_uring support: not using it",
+                ifa->name);
+    uring=0;
+#endif
+    ifu->uring=uring;
+
     if (!service) {
         if ((svent = getservbyname("nmea-0183","udp")) != NULL) {
             service=svent->s_name;
@@ -749,6 +1049,10 @@ struct iface *init_udp(struct iface *ifa)
             }
             ifu->coalesce->offset=ifu->coalesce->seqid=0;
         }
+        if (pack && (ifu->pbuf=(char *)malloc(ifu->mtu)) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            return(NULL);
+        }
     }
 
     /* Set interface.  This is platform specific and is generally a privileged
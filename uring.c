@@ -0,0 +1,433 @@
+/* uring.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Minimal io_uring wrapper.  A ring belongs to a single thread, which is the
+ * only one to submit to it or reap its completions.  Receives are done into
+ * a ring of buffers provided to the kernel (IORING_REGISTER_PBUF_RING) so
+ * multishot receives need no buffer set up per read.  Features used need
+ * Linux 6.0 or later: uring_init() fails on older kernels so that callers
+ * can fall back to epoll
+ *
+ * uring_rd_*() give file, serial and tcp client input threads a ring of
+ * their own to read through in place of read(): a multishot recv for a
+ * socket, so one request delivers everything until EOF, or a buffer selecting
+ * read re-armed as each completes for anything else
+ */
+
+#include "kplex.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <fcntl.h>
+
+/*
+ * Set up an io_uring instance
+ * Args: ring structure to initialise, number of submission queue entries
+ * and io_uring_setup() flags
+ * Returns: 0 on success, -1 on failure with errno set
+ */
+int uring_init(struct uring *ur, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p;
+    char *sq,*cq;
+    int err;
+
+    memset(ur,0,sizeof(struct uring));
+    memset(&p,0,sizeof(p));
+    p.flags=flags;
+    if ((ur->fd=syscall(__NR_io_uring_setup,entries,&p)) < 0)
+        return(-1);
+
+    ur->sq_ring_sz=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    ur->cq_ring_sz=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_ring_sz > ur->sq_ring_sz)
+            ur->sq_ring_sz=ur->cq_ring_sz;
+        ur->cq_ring_sz=ur->sq_ring_sz;
+    }
+    if ((ur->sq_ring=mmap(NULL,ur->sq_ring_sz,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,ur->fd,IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ur->cq_ring=ur->sq_ring;
+    else if ((ur->cq_ring=mmap(NULL,ur->cq_ring_sz,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,ur->fd,IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        ur->cq_ring=NULL;
+        goto fail;
+    }
+    ur->sqes_sz=p.sq_entries*sizeof(struct io_uring_sqe);
+    if ((ur->sqes=mmap(NULL,ur->sqes_sz,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,ur->fd,IORING_OFF_SQES)) == MAP_FAILED) {
+        ur->sqes=NULL;
+        goto fail;
+    }
+
+    sq=(char *) ur->sq_ring;
+    ur->sq_head=(unsigned *)(sq+p.sq_off.head);
+    ur->sq_tail=(unsigned *)(sq+p.sq_off.tail);
+    ur->sq_mask=*(unsigned *)(sq+p.sq_off.ring_mask);
+    ur->sq_array=(unsigned *)(sq+p.sq_off.array);
+    ur->sq_local=*ur->sq_tail;
+    cq=(char *) ur->cq_ring;
+    ur->cq_head=(unsigned *)(cq+p.cq_off.head);
+    ur->cq_tail=(unsigned *)(cq+p.cq_off.tail);
+    ur->cq_mask=*(unsigned *)(cq+p.cq_off.ring_mask);
+    ur->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+    return(0);
+
+fail:
+    err=errno;
+    if (ur->sq_ring == MAP_FAILED)
+        ur->sq_ring=NULL;
+    uring_free(ur);
+    errno=err;
+    return(-1);
+}
+
+/*
+ * Tear down an io_uring instance, cancelling anything outstanding
+ * Args: ring
+ * Returns: Nothing
+ */
+void uring_free(struct uring *ur)
+{
+    if (ur->fd >= 0)
+        close(ur->fd);
+    ur->fd=-1;
+    if (ur->sqes)
+        munmap(ur->sqes,ur->sqes_sz);
+    if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+        munmap(ur->cq_ring,ur->cq_ring_sz);
+    if (ur->sq_ring)
+        munmap(ur->sq_ring,ur->sq_ring_sz);
+    if (ur->br)
+        munmap(ur->br,ur->br_sz);
+    if (ur->bufs)
+        free(ur->bufs);
+    ur->sqes=NULL;
+    ur->sq_ring=ur->cq_ring=NULL;
+    ur->br=NULL;
+    ur->bufs=NULL;
+}
+
+/*
+ * Get a submission queue entry to fill in, submitting what has been queued
+ * if the submission queue is full
+ * Args: ring
+ * Returns: Pointer to zeroed sqe or NULL on failure
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (ur->sq_local-__atomic_load_n(ur->sq_head,__ATOMIC_ACQUIRE) >
+            ur->sq_mask && uring_enter(ur,0) < 0)
+        return(NULL);
+
+    idx=ur->sq_local++&ur->sq_mask;
+    ur->sq_array[idx]=idx;
+    sqe=&ur->sqes[idx];
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    return(sqe);
+}
+
+/*
+ * Submit queued sqes and optionally wait for completions
+ * Args: ring, number of completions to wait for (0 not to wait)
+ * Returns: 0 on success, -1 on failure with errno set
+ */
+int uring_enter(struct uring *ur, unsigned wait)
+{
+    unsigned submit;
+    int n;
+
+    __atomic_store_n(ur->sq_tail,ur->sq_local,__ATOMIC_RELEASE);
+    submit=ur->sq_local-__atomic_load_n(ur->sq_head,__ATOMIC_ACQUIRE);
+    if (submit == 0 && wait == 0)
+        return(0);
+    /* Don't sleep if there are completions waiting to be reaped */
+    if (wait && __atomic_load_n(ur->cq_tail,__ATOMIC_ACQUIRE) != *ur->cq_head)
+        wait=0;
+    if ((n=syscall(__NR_io_uring_enter,ur->fd,submit,wait,
+            (wait)?IORING_ENTER_GETEVENTS:0,NULL,0)) < 0)
+        return(-1);
+    return(0);
+}
+
+/*
+ * Look at the next completion, if there is one
+ * Args: ring
+ * Returns: Pointer to cqe or NULL if there is none.  uring_cqe_seen()
+ * must be called when it has been dealt with
+ */
+struct io_uring_cqe *uring_cqe(struct uring *ur)
+{
+    unsigned head=*ur->cq_head;
+
+    if (head == __atomic_load_n(ur->cq_tail,__ATOMIC_ACQUIRE))
+        return(NULL);
+    return(&ur->cqes[head&ur->cq_mask]);
+}
+
+/*
+ * Release the completion returned by uring_cqe()
+ * Args: ring
+ * Returns: Nothing
+ */
+void uring_cqe_seen(struct uring *ur)
+{
+    __atomic_store_n(ur->cq_head,*ur->cq_head+1,__ATOMIC_RELEASE);
+}
+
+/*
+ * Provide the kernel with a ring of receive buffers
+ * Args: ring, buffer group id, number of buffers (a power of 2) and size
+ * of each
+ * Returns: 0 on success, -1 on failure with errno set
+ */
+int uring_bufs_init(struct uring *ur, unsigned short bgid, unsigned n,
+        size_t size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    int err;
+
+    ur->br_sz=n*sizeof(struct io_uring_buf);
+    /* The ring must be page aligned */
+    if ((ur->br=(struct io_uring_buf_ring *) mmap(NULL,ur->br_sz,
+            PROT_READ|PROT_WRITE,MAP_ANONYMOUS|MAP_PRIVATE,-1,0))
+            == MAP_FAILED) {
+        ur->br=NULL;
+        return(-1);
+    }
+    if ((ur->bufs=(char *) malloc(n*size)) == NULL) {
+        err=errno;
+        munmap(ur->br,ur->br_sz);
+        ur->br=NULL;
+        errno=err;
+        return(-1);
+    }
+    ur->nbufs=n;
+    ur->bufsize=size;
+    ur->bgid=bgid;
+
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr=(unsigned long) ur->br;
+    reg.ring_entries=n;
+    reg.bgid=bgid;
+    if (syscall(__NR_io_uring_register,ur->fd,IORING_REGISTER_PBUF_RING,
+            &reg,1) < 0)
+        return(-1);
+
+    ur->br_tail=0;
+    for (i=0;i<n;i++)
+        uring_buf_return(ur,i);
+    return(0);
+}
+
+/*
+ * Get a provided buffer given its id
+ * Args: ring, buffer id
+ * Returns: pointer to buffer
+ */
+char *uring_buf(struct uring *ur, unsigned bid)
+{
+    return(ur->bufs+bid*ur->bufsize);
+}
+
+/*
+ * Give a provided buffer back to the kernel once its data have been used
+ * Args: ring, buffer id
+ * Returns: Nothing
+ */
+void uring_buf_return(struct uring *ur, unsigned bid)
+{
+    struct io_uring_buf *buf=&ur->br->bufs[ur->br_tail&(ur->nbufs-1)];
+
+    buf->addr=(unsigned long) uring_buf(ur,bid);
+    buf->len=ur->bufsize;
+    buf->bid=bid;
+    __atomic_store_n(&ur->br->tail,++ur->br_tail,__ATOMIC_RELEASE);
+}
+
+/*
+ * Prepare a poll request
+ * Args: sqe, descriptor, poll events and flag to request a multishot poll
+ * Returns: Nothing
+ */
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events,
+        int multi)
+{
+    sqe->opcode=IORING_OP_POLL_ADD;
+    sqe->fd=fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events=(events<<16)|(events>>16);
+#endif
+    sqe->poll32_events=events;
+    if (multi)
+        sqe->len=IORING_POLL_ADD_MULTI;
+}
+
+#define RDENTRIES 16        /* Submission queue size for an input's ring */
+#define RDBUFS 32           /* Receive buffers provided to the kernel */
+#define RDBGID 0
+#define RD_READ 0
+#define RD_WAKE 1
+#define RD_UD(rd,kind) ((unsigned long) (rd)->gen << 1 | (kind))
+
+/*
+ * Start a read (or recv) on an input's ring, or re-arm its wake poll
+ * Args: reader, which request
+ * Returns: 0 on success, -1 on failure
+ */
+static int rd_arm(struct uring_rd *rd, int kind)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe=uring_sqe(&rd->ur)) == NULL)
+        return(-1);
+    if (kind == RD_WAKE)
+        uring_prep_poll(sqe,rd->wake[0],POLLIN,1);
+    else {
+        sqe->opcode=(rd->stream)?IORING_OP_RECV:IORING_OP_READ;
+        sqe->fd=rd->fd;
+        sqe->flags=IOSQE_BUFFER_SELECT;
+        sqe->buf_group=RDBGID;
+        if (rd->stream)
+            sqe->ioprio=IORING_RECV_MULTISHOT;
+        else
+            /* Read from the current file position */
+            sqe->off=(unsigned long long) -1;
+        rd->armed=1;
+    }
+    sqe->user_data=RD_UD(rd,kind);
+    return(0);
+}
+
+/*
+ * Set up a ring for an input thread to read through.  The ring belongs to
+ * the calling thread, which must be the only one to use it
+ * Args: descriptor to be read (which may later be replaced by another of the
+ * same kind: see uring_rd_read())
+ * Returns: Pointer to reader or NULL on failure.  io_uring_enter() is not a
+ * cancellation point: the thread should be woken by writing to rd->wake[1]
+ * after being cancelled
+ */
+struct uring_rd *uring_rd_init(int fd)
+{
+    struct uring_rd *rd;
+    struct stat sbuf;
+    int err;
+
+    if ((rd=(struct uring_rd *) calloc(1,sizeof(struct uring_rd))) == NULL)
+        return(NULL);
+    rd->wake[0]=rd->wake[1]=-1;
+    if (uring_init(&rd->ur,RDENTRIES,
+            IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN) < 0) {
+        err=errno;
+        free(rd);
+        errno=err;
+        return(NULL);
+    }
+    rd->fd=fd;
+    rd->stream=(fstat(fd,&sbuf) == 0 && S_ISSOCK(sbuf.st_mode));
+    if (pipe(rd->wake) < 0 || fcntl(rd->wake[0],F_SETFL,O_NONBLOCK) < 0 ||
+            uring_bufs_init(&rd->ur,RDBGID,RDBUFS,BUFSIZ) < 0 ||
+            rd_arm(rd,RD_WAKE) < 0 || uring_enter(&rd->ur,0) < 0) {
+        err=errno;
+        uring_rd_free(rd);
+        errno=err;
+        return(NULL);
+    }
+    return(rd);
+}
+
+/*
+ * Free an input's ring, cancelling anything outstanding
+ * Args: reader (may be NULL)
+ * Returns: Nothing
+ */
+void uring_rd_free(struct uring_rd *rd)
+{
+    if (rd == NULL)
+        return;
+    uring_free(&rd->ur);
+    if (rd->wake[0] >= 0)
+        close(rd->wake[0]);
+    if (rd->wake[1] >= 0)
+        close(rd->wake[1]);
+    free(rd);
+}
+
+/*
+ * Read from an input through its ring, waiting for data if need be
+ * Args: reader, descriptor to read (if this isn't the one last read, e.g.
+ * after a reconnection, completions for the old one are discarded), buffer
+ * and its size
+ * Returns: as for read()
+ */
+ssize_t uring_rd_read(struct uring_rd *rd, int fd, char *buf, size_t len)
+{
+    struct io_uring_cqe *cqe;
+    char dbuf[64];
+    unsigned long ud;
+    unsigned flags,bid;
+    int res;
+
+    if (fd != rd->fd) {
+        rd->fd=fd;
+        rd->gen++;
+        rd->armed=0;
+    }
+
+    for (;;) {
+        if (!rd->armed && rd_arm(rd,RD_READ) < 0)
+            return(-1);
+        if ((cqe=uring_cqe(&rd->ur)) == NULL) {
+            if (uring_enter(&rd->ur,1) < 0 && errno != EINTR)
+                return(-1);
+            continue;
+        }
+        ud=cqe->user_data;
+        res=cqe->res;
+        flags=cqe->flags;
+        uring_cqe_seen(&rd->ur);
+
+        if ((ud&1) == RD_WAKE) {
+            while (read(rd->wake[0],dbuf,sizeof(dbuf)) > 0);
+            pthread_testcancel();
+            if (!(flags & IORING_CQE_F_MORE) && rd_arm(rd,RD_WAKE) < 0)
+                return(-1);
+            continue;
+        }
+
+        if (flags & IORING_CQE_F_BUFFER) {
+            bid=flags>>IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && ud == RD_UD(rd,RD_READ)) {
+                if ((size_t) res > len)
+                    res=len;
+                memcpy(buf,uring_buf(&rd->ur,bid),res);
+            }
+            uring_buf_return(&rd->ur,bid);
+        }
+        if (ud != RD_UD(rd,RD_READ))
+            /* For a descriptor we've finished with */
+            continue;
+        if (!(flags & IORING_CQE_F_MORE))
+            rd->armed=0;
+        /* Out of buffers (those used have now been returned) or interrupted:
+         * try again */
+        if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN)
+            continue;
+        if (res < 0) {
+            errno=-res;
+            return(-1);
+        }
+        return(res);
+    }
+}
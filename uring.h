@@ -0,0 +1,64 @@
+/* uring.h
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2017
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Minimal io_uring support for event driven interfaces, using the raw
+ * system calls so there is no dependency on liburing.  Only built on Linux
+ * with "make IOURING=1"
+ */
+
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local;          /* Tail of sqes prepared but not submitted */
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+    /* Provided receive buffers */
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    char *bufs;
+    size_t bufsize;
+    unsigned nbufs;
+    unsigned short bgid;
+    unsigned short br_tail;
+};
+
+/* A ring reading a single input descriptor.  See uring_rd_init() */
+struct uring_rd {
+    struct uring ur;
+    int fd;                     /* Descriptor being read */
+    int stream;                 /* A socket: use multishot recv */
+    int armed;                  /* A read or recv is outstanding on fd */
+    unsigned gen;               /* Changed with fd to spot stale completions */
+    int wake[2];                /* Written to to wake a cancelled reader */
+};
+
+int uring_init(struct uring *, unsigned, unsigned);
+void uring_free(struct uring *);
+struct io_uring_sqe *uring_sqe(struct uring *);
+int uring_enter(struct uring *, unsigned);
+struct io_uring_cqe *uring_cqe(struct uring *);
+void uring_cqe_seen(struct uring *);
+int uring_bufs_init(struct uring *, unsigned short, unsigned, size_t);
+char *uring_buf(struct uring *, unsigned);
+void uring_buf_return(struct uring *, unsigned);
+void uring_prep_poll(struct io_uring_sqe *, int, unsigned, int);
+struct uring_rd *uring_rd_init(int);
+void uring_rd_free(struct uring_rd *);
+ssize_t uring_rd_read(struct uring_rd *, int, char *, size_t);